@@ -0,0 +1,36 @@
+#!/usr/bin/python
+
+import struct
+import sys
+import time
+
+# Keep the same as struct accessRecord in src/protocol/http/proto_http.c
+RECORD_HEAD = struct.Struct("=HHII6H")
+
+def read_records(f):
+    data = f.read()
+    pos = 0
+    while pos + RECORD_HEAD.size <= len(data):
+        head = RECORD_HEAD.unpack_from(data, pos)
+        length, status, timestamp, response_length = head[:4]
+        fields = []
+        off = pos + RECORD_HEAD.size
+        for field_len in head[4:]:
+            fields.append(data[off:off+field_len])
+            off += field_len
+        yield status, timestamp, response_length, fields
+        pos += length
+
+def format_record(status, timestamp, response_length, fields):
+    remote_addr, method, path, protocol, refer, user_agent = fields
+    datetime = time.strftime("%d/%m/%Y:%H:%M:%S +0000", time.gmtime(timestamp))
+    return '%s - - [%s] %s %s %s %d "%d" %s %s' % (remote_addr, datetime,
+            method, path, protocol, status, response_length, refer, user_agent)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print "Convert binary access log to text. Usage: ./access_log.py file"
+        sys.exit(1)
+    with open(sys.argv[1], "rb") as f:
+        for record in read_records(f):
+            print format_record(*record)
@@ -20,6 +20,29 @@ def application(environ, start_response):
 
     return [ret]
 
+def path_info(environ, start_response):
+    """Reply request path, used to check apps mounted by `http-route`"""
+    ret = environ['PATH_INFO']
+    start_response('200 OK', [('Content-type', 'text/plain'),
+                              ('Content-Length', str(len(ret)))])
+    return [ret]
+
+CALLS = [0]
+
+def counter(environ, start_response):
+    """Reply times of being called, used to check `http-cache-size`"""
+    CALLS[0] += 1
+    ret = str(CALLS[0])
+    headers = [('Content-type', 'text/plain'), ('Content-Length', str(len(ret)))]
+    if environ['QUERY_STRING'] == 'nostore':
+        headers.append(('Cache-Control', 'no-store'))
+    start_response('200 OK', headers)
+    return [ret]
+
+def websocket(path, message):
+    """Echo WebSocket messages, see `app-websocket-name`"""
+    return [message]
+
 if __name__ == '__main__':
     from gevent.pywsgi import WSGIServer
     print 'Serving on 8088...'
@@ -1,4 +1,5 @@
-WSGI_APP_MODULE = app/wsgi/app_wsgi.c app/wsgi/wsgiwrapper.c app/wsgi/wsgiinput.c
+WSGI_APP_MODULE = app/wsgi/app_wsgi.c app/wsgi/wsgiwrapper.c app/wsgi/wsgiinput.c \
+				  app/wsgi/wsgiprofile.c
 PYTHON_VERSION = $(shell python -c "import distutils.sysconfig;print distutils.sysconfig.get_python_version()")
 MODULE_ATTRS += AppWsgiAttr
 
@@ -7,24 +8,44 @@ LIBS += -lpython$(PYTHON_VERSION)
 MODULE_SOURCES += $(WSGI_APP_MODULE)
 
 ################################ Module Separtor ###############################
-STATIC_APP_MODULE = app/static/app_static_file.c
+STATIC_APP_MODULE = app/static/app_static_file.c app/static/file_cache.c
 
 MODULE_SOURCES += $(STATIC_APP_MODULE)
 MODULE_ATTRS += AppStaticAttr
 
 ################################ Module Separtor ###############################
 REDIS_APP_MODULE = app/wheatredis/redis.c app/wheatredis/hashkit.c \
-				   app/wheatredis/md5.c app/wheatredis/redis_config.c
+				   app/wheatredis/md5.c app/wheatredis/redis_config.c \
+				   app/wheatredis/keyhash.c
 
 MODULE_SOURCES += $(REDIS_APP_MODULE)
 MODULE_ATTRS += AppRedisAttr
 
 ################################ Module Separtor ###############################
-HTTP_PROTOCOL_MODULE = protocol/http/http_parser.c protocol/http/proto_http.c
+PROXY_APP_MODULE = app/proxy/app_proxy.c
+
+MODULE_SOURCES += $(PROXY_APP_MODULE)
+MODULE_ATTRS += AppProxyAttr
+
+################################ Module Separtor ###############################
+HTTP_PROTOCOL_MODULE = protocol/http/http_parser.c protocol/http/proto_http.c \
+					   protocol/http/http_cache.c protocol/http/http_ratelimit.c
 
 MODULE_SOURCES += $(HTTP_PROTOCOL_MODULE)
 MODULE_ATTRS += ProtocolHttpAttr
 
+################################ Module Separtor ###############################
+HTTP2_PROTOCOL_MODULE = protocol/http2/hpack.c protocol/http2/proto_http2.c
+
+MODULE_SOURCES += $(HTTP2_PROTOCOL_MODULE)
+MODULE_ATTRS += ProtocolHttp2Attr
+
+################################ Module Separtor ###############################
+WEBSOCKET_PROTOCOL_MODULE = protocol/websocket/proto_websocket.c
+
+MODULE_SOURCES += $(WEBSOCKET_PROTOCOL_MODULE)
+MODULE_ATTRS += ProtocolWebSocketAttr
+
 ################################ Module Separtor ###############################
 REDIS_PROTOCOL_MODULE = protocol/redis/proto_redis.c
 
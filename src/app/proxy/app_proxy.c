@@ -0,0 +1,899 @@
+// Http reverse proxy module
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "../application.h"
+#include "../../protocol/http/proto_http.h"
+#include "app_proxy.h"
+
+#define WHEAT_PROXY_KEEPALIVE       16
+#define WHEAT_PROXY_TIMEOUT         30
+// Seconds server is skipped after connecting to it failed
+#define WHEAT_PROXY_RETRY_TIME      5
+#define WHEAT_PROXY_HEADER_LEN      512
+
+int proxyCall(struct conn *, void *);
+int initProxy(struct protocol *);
+void deallocProxy();
+void proxyCron();
+
+static struct configuration ProxyConf[] = {
+    {"proxy-upstream",    WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
+        NULL,                   LIST_FORMAT},
+    {"proxy-keepalive",   2, unsignedIntValidator, {.val=WHEAT_PROXY_KEEPALIVE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"proxy-timeout",     2, unsignedIntValidator, {.val=WHEAT_PROXY_TIMEOUT},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+};
+
+static struct statItem ProxyStats[] = {
+    {"Total proxy request", SUM_STAT, RAW, 0, 0},
+    {"Total proxy upstream connection", SUM_STAT, RAW, 0, 0},
+    {"Total proxy upstream failure", SUM_STAT, RAW, 0, 0},
+};
+
+static struct app AppProxy = {
+    "Http", proxyCron, proxyCall, initProxy, deallocProxy,
+        NULL, NULL, 0
+};
+
+struct moduleAttr AppProxyAttr = {
+    "http-proxy", APP, {.app=&AppProxy},
+    ProxyStats, sizeof(ProxyStats)/sizeof(struct statItem),
+    ProxyConf, sizeof(ProxyConf)/sizeof(struct configuration),
+    NULL, 0
+};
+
+// Upstream connections are built by `buildConn` and answer one request at
+// a time. Response is parsed into a conn of upstream client, its headers
+// are copied to client response and body is sent as slices of upstream
+// request buffer, so upstream conn is kept until client conn is freed.
+//
+// `idle`: keep-alive connections, the last one is reused first
+// `outstanding`: requests sent and not answered, new request goes to server
+// with the least outstanding requests
+struct upstreamServer {
+    wstr ip;
+    int port;
+    int outstanding;
+    time_t down_until;
+    struct list *idle;
+};
+
+struct upstreamPool {
+    wstr name;
+    struct upstreamServer *servers;
+    size_t nserver;
+    size_t next;
+};
+
+// `request`: request waiting for response
+// `held`: requests whose response is still sending to client
+struct upstreamConn {
+    struct client *client;
+    struct upstreamServer *server;
+    struct proxyRequest *request;
+    struct list *held;
+    struct listNode *node;
+    struct listNode *idle_node;
+    time_t idle_since;
+    unsigned started:1;
+    unsigned keep_alive:1;
+};
+
+// Request buffer of closed upstream client, it's kept until all responses
+// in it are sent
+struct heldBuffer {
+    struct msghdr *buf;
+    int refs;
+};
+
+struct proxyRequest {
+    struct conn *outer;
+    struct upstreamPool *pool;
+    struct upstreamConn *upstream;
+    struct conn *response;
+    struct listNode *held_node;
+    struct heldBuffer *held_buf;
+    wstr header;
+    time_t start;
+    unsigned retried:1;
+};
+
+struct headerPair {
+    wstr field;
+    wstr value;
+};
+
+// Protocol data of upstream conn
+struct upstreamResponse {
+    http_parser parser;
+    struct array *headers;
+    wstr field;
+    wstr value;
+    struct slice *body;
+    size_t nbody;
+    size_t body_cap;
+    size_t body_len;
+    unsigned complete:1;
+    unsigned keep_alive:1;
+    unsigned skip_body:1;
+};
+
+static struct upstreamPool *Pools = NULL;
+static size_t NPools = 0;
+static struct list *UpstreamConns = NULL;
+static size_t KeepAlive = WHEAT_PROXY_KEEPALIVE;
+static time_t ProxyTimeout = WHEAT_PROXY_TIMEOUT;
+static time_t LastCheck = 0;
+static struct http_parser_settings ResponseParserSettings;
+static long long *TotalRequest = NULL;
+static long long *TotalConnection = NULL;
+static long long *TotalFailure = NULL;
+
+static int upstreamSpot(struct conn *);
+static int parseUpstream(struct conn *, struct slice *, size_t *);
+static void *initUpstreamData();
+static void freeUpstreamData(void *);
+
+// Upstream clients speak Http response, it isn't a module because it's
+// only used by upstream clients built here
+static struct protocol UpstreamProtocol = {
+    upstreamSpot, parseUpstream, initUpstreamData, freeUpstreamData,
+        NULL, NULL, NULL
+};
+
+// Hop-by-hop headers(RFC 7230 6.1) and headers rebuilt by proxy
+static const char *SkipRequestHeaders[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Content-Length", "Expect",
+    "X-Forwarded-For", NULL
+};
+
+// Server and Date are written by Http protocol itself
+static const char *SkipResponseHeaders[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Server", "Date", NULL
+};
+
+static int isSkipHeader(const char **headers, const char *field)
+{
+    for (; *headers; headers++) {
+        if (!strcasecmp(*headers, field))
+            return 1;
+    }
+    return 0;
+}
+
+// ========== Upstream response parser ==========
+
+static int commitHeader(struct upstreamResponse *resp)
+{
+    struct headerPair pair, *p;
+    size_t i;
+
+    if (!resp->field)
+        return 0;
+    if (!resp->value)
+        resp->value = wstrEmpty();
+    // Repeated fields are combined as RFC 7230 3.2.2
+    for (i = 0; i < narray(resp->headers); i++) {
+        p = arrayIndex(resp->headers, i);
+        if (!strcasecmp(p->field, resp->field)) {
+            p->value = wstrCatLen(p->value, ", ", 2);
+            p->value = wstrCat(p->value, resp->value);
+            wstrFree(resp->field);
+            wstrFree(resp->value);
+            resp->field = resp->value = NULL;
+            return 0;
+        }
+    }
+    pair.field = resp->field;
+    pair.value = resp->value;
+    arrayPush(resp->headers, &pair);
+    resp->field = resp->value = NULL;
+    return 0;
+}
+
+static int onResponseHeaderField(http_parser *parser, const char *at, size_t len)
+{
+    struct upstreamResponse *resp = parser->data;
+
+    if (resp->value)
+        commitHeader(resp);
+    if (resp->field)
+        resp->field = wstrCatLen(resp->field, at, len);
+    else
+        resp->field = wstrNewLen(at, (int)len);
+    return resp->field == NULL;
+}
+
+static int onResponseHeaderValue(http_parser *parser, const char *at, size_t len)
+{
+    struct upstreamResponse *resp = parser->data;
+
+    if (resp->value)
+        resp->value = wstrCatLen(resp->value, at, len);
+    else
+        resp->value = wstrNewLen(at, (int)len);
+    return resp->value == NULL;
+}
+
+// Return 1 to tell parser response to HEAD has no body
+static int onResponseHeadersComplete(http_parser *parser)
+{
+    struct upstreamResponse *resp = parser->data;
+
+    commitHeader(resp);
+    resp->keep_alive = http_should_keep_alive(parser) ? 1 : 0;
+    return resp->skip_body;
+}
+
+static int onResponseBody(http_parser *parser, const char *at, size_t len)
+{
+    struct upstreamResponse *resp = parser->data;
+
+    if (resp->nbody == resp->body_cap) {
+        resp->body_cap = resp->body_cap ? resp->body_cap * 2 : 8;
+        resp->body = wrealloc(resp->body, sizeof(struct slice)*resp->body_cap);
+        if (!resp->body)
+            return 1;
+    }
+    sliceTo(&resp->body[resp->nbody++], (uint8_t *)at, len);
+    resp->body_len += len;
+    return 0;
+}
+
+// Stop at the end of response, data left belongs to nothing because only
+// one request is sent at a time
+static int onResponseComplete(http_parser *parser)
+{
+    struct upstreamResponse *resp = parser->data;
+
+    resp->complete = 1;
+    http_parser_pause(parser, 1);
+    return 0;
+}
+
+static void *initUpstreamData()
+{
+    struct upstreamResponse *resp = wmalloc(sizeof(*resp));
+    if (!resp)
+        return NULL;
+    memset(resp, 0, sizeof(*resp));
+    http_parser_init(&resp->parser, HTTP_RESPONSE);
+    resp->parser.data = resp;
+    resp->headers = arrayCreate(sizeof(struct headerPair), 16);
+    return resp;
+}
+
+static void freeUpstreamData(void *data)
+{
+    struct upstreamResponse *resp = data;
+    struct headerPair *pair;
+    size_t i;
+
+    for (i = 0; i < narray(resp->headers); i++) {
+        pair = arrayIndex(resp->headers, i);
+        wstrFree(pair->field);
+        wstrFree(pair->value);
+    }
+    arrayDealloc(resp->headers);
+    wstrFree(resp->field);
+    wstrFree(resp->value);
+    wfree(resp->body);
+    wfree(resp);
+}
+
+static int parseUpstream(struct conn *c, struct slice *slice, size_t *out)
+{
+    struct upstreamResponse *resp = c->protocol_data;
+    struct upstreamConn *upstream = c->client->client_data;
+    size_t nparsed;
+
+    if (upstream->request)
+        resp->skip_body = !strcasecmp(httpGetMethod(upstream->request->outer), "HEAD");
+    nparsed = http_parser_execute(&resp->parser, &ResponseParserSettings,
+            (const char *)slice->data, slice->len);
+    if (nparsed)
+        upstream->started = 1;
+    if (out) *out = nparsed;
+    if (resp->complete)
+        return WHEAT_OK;
+    if (nparsed != slice->len || HTTP_PARSER_ERRNO(&resp->parser) != HPE_OK) {
+        wheatLog(WHEAT_WARNING, "parse response from %s failed: %s",
+                c->client->name,
+                http_errno_description(HTTP_PARSER_ERRNO(&resp->parser)));
+        return WHEAT_WRONG;
+    }
+    return 1;
+}
+
+// ========== Upstream connection pool ==========
+
+static void upstreamClosed(struct client *client);
+
+static struct upstreamPool *spotPool(const char *name)
+{
+    size_t i;
+
+    if (!name)
+        return NPools ? &Pools[0] : NULL;
+    for (i = 0; i < NPools; i++) {
+        if (!strcmp(Pools[i].name, name))
+            return &Pools[i];
+    }
+    return NULL;
+}
+
+static struct upstreamConn *connectUpstream(struct upstreamServer *server)
+{
+    struct upstreamConn *upstream;
+    struct client *client;
+    char name[255];
+
+    client = buildConn(server->ip, server->port, &UpstreamProtocol);
+    if (!client)
+        return NULL;
+    upstream = wmalloc(sizeof(*upstream));
+    memset(upstream, 0, sizeof(*upstream));
+    upstream->client = client;
+    upstream->server = server;
+    upstream->held = createList();
+    upstream->node = appendToListTail(UpstreamConns, upstream);
+    client->client_data = upstream;
+    snprintf(name, sizeof(name), "Upstream %s:%d", server->ip, server->port);
+    setClientName(client, name);
+    setClientFreeNotify(client, upstreamClosed);
+    (*TotalConnection)++;
+    return upstream;
+}
+
+// Choose the server with the least outstanding requests, start from
+// different servers in turn so servers equally busy share requests.
+static struct upstreamConn *getUpstreamConn(struct upstreamPool *pool)
+{
+    struct upstreamServer *server, *best;
+    struct upstreamConn *upstream;
+    struct listNode *node;
+    size_t i, tried;
+
+    for (tried = 0; tried < pool->nserver; tried++) {
+        best = NULL;
+        for (i = 0; i < pool->nserver; i++) {
+            server = &pool->servers[(pool->next + i) % pool->nserver];
+            if (server->down_until > Server.cron_time.tv_sec)
+                continue;
+            if (!best || server->outstanding < best->outstanding)
+                best = server;
+        }
+        if (!best)
+            return NULL;
+        pool->next = (pool->next + 1) % pool->nserver;
+
+        node = listLast(best->idle);
+        if (node) {
+            upstream = listNodeValue(node);
+            removeListNode(best->idle, node);
+            upstream->idle_node = NULL;
+            return upstream;
+        }
+        upstream = connectUpstream(best);
+        if (upstream)
+            return upstream;
+        best->down_until = Server.cron_time.tv_sec + WHEAT_PROXY_RETRY_TIME;
+    }
+    return NULL;
+}
+
+// Only called if upstream client isn't in its handleRequest, otherwise
+// keep it out of idle list and let cron close it
+static void closeUpstream(struct upstreamConn *upstream)
+{
+    freeClient(upstream->client);
+}
+
+// No request refers to `upstream` any more
+static void releaseUpstream(struct upstreamConn *upstream)
+{
+    struct upstreamServer *server = upstream->server;
+
+    if (upstream->request || listLength(upstream->held))
+        return ;
+    if (!upstream->keep_alive || !isClientValid(upstream->client))
+        return ;
+    upstream->idle_since = Server.cron_time.tv_sec;
+    upstream->idle_node = appendToListTail(server->idle, upstream);
+}
+
+// ========== Request forwarding ==========
+
+static wstr buildRequestHeader(struct conn *c)
+{
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+    wstr header, field, value, forwarded = NULL, query;
+    const char *method;
+    char buf[64];
+    int ret;
+
+    method = httpGetMethod(c);
+    query = httpGetQueryString(c);
+    header = wstrNewLen(NULL, WHEAT_PROXY_HEADER_LEN);
+    header = wstrCat(header, method);
+    header = wstrCatLen(header, " ", 1);
+    header = wstrCat(header, httpGetPath(c));
+    if (query && wstrlen(query)) {
+        header = wstrCatLen(header, "?", 1);
+        header = wstrCat(header, query);
+    }
+    header = wstrCat(header, " HTTP/1.1\r\n");
+
+    iter = dictGetIterator(httpGetReqHeaders(c));
+    while ((entry = dictNext(iter)) != NULL) {
+        field = dictGetKey(entry);
+        value = dictGetVal(entry);
+        if (!strcasecmp(field, "X-Forwarded-For"))
+            forwarded = value;
+        if (isSkipHeader(SkipRequestHeaders, field))
+            continue;
+        header = wstrCat(header, field);
+        header = wstrCatLen(header, ": ", 2);
+        header = wstrCat(header, value);
+        header = wstrCatLen(header, "\r\n", 2);
+    }
+    dictReleaseIterator(iter);
+
+    header = wstrCat(header, "X-Forwarded-For: ");
+    if (forwarded) {
+        header = wstrCat(header, forwarded);
+        header = wstrCatLen(header, ", ", 2);
+    }
+    header = wstrCat(header, getConnIP(c));
+    header = wstrCatLen(header, "\r\n", 2);
+    if (httpBodyGetSize(c) || (strcmp(method, "GET") && strcmp(method, "HEAD"))) {
+        ret = snprintf(buf, sizeof(buf), "%s: %d\r\n", CONTENT_LENGTH,
+                httpBodyGetSize(c));
+        header = wstrCatLen(header, buf, ret);
+    }
+    header = wstrCat(header, "Connection: keep-alive\r\n\r\n");
+    return header;
+}
+
+static int sendRequest(struct proxyRequest *request,
+        struct upstreamConn *upstream)
+{
+    struct conn *send_conn, *outer = request->outer;
+    const struct slice *body;
+    struct slice slice;
+    int fd;
+
+    send_conn = connGet(upstream->client);
+    sliceTo(&slice, (uint8_t *)request->header, wstrlen(request->header));
+    if (sendClientData(send_conn, &slice) == WHEAT_WRONG)
+        goto err;
+    fd = httpGetBodyFile(outer);
+    if (fd != -1) {
+        if (httpBodyGetSize(outer) && sendClientFileRange(send_conn, fd, 0,
+                    httpBodyGetSize(outer)) == WHEAT_WRONG)
+            goto err;
+    } else {
+        while ((body = httpGetBodyNext(outer)) != NULL) {
+            if (sendClientData(send_conn, (struct slice *)body) == WHEAT_WRONG)
+                goto err;
+        }
+    }
+    finishConn(send_conn);
+    if (!isClientValid(upstream->client))
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+
+err:
+    finishConn(send_conn);
+    return WHEAT_WRONG;
+}
+
+// Body is sent from where it's stored without copying, so request buffer
+// of client must live until upstream answers. Idle connection may be
+// closed by server at any time, so request is sent again by a new one if
+// writing to it failed.
+static int forwardRequest(struct proxyRequest *request)
+{
+    struct upstreamConn *upstream;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        upstream = getUpstreamConn(request->pool);
+        if (!upstream)
+            return WHEAT_WRONG;
+        if (sendRequest(request, upstream) == WHEAT_OK) {
+            upstream->request = request;
+            upstream->started = 0;
+            upstream->server->outstanding++;
+            request->upstream = upstream;
+            request->start = Server.cron_time.tv_sec;
+            return WHEAT_OK;
+        }
+        closeUpstream(upstream);
+        if (httpGetBodyFile(request->outer) == -1 && httpBodyGetSize(request->outer))
+            return WHEAT_WRONG;
+    }
+    return WHEAT_WRONG;
+}
+
+static void sendUpstreamError(struct conn *c, int status)
+{
+    const char *msg = status == 504 ? "Gateway Timeout" : "Bad Gateway";
+    char body[128];
+    int len;
+
+    (*TotalFailure)++;
+    len = snprintf(body, sizeof(body), "<html><body><h1>%d %s</h1></body></html>\n",
+            status, msg);
+    fillResInfo(c, status, msg);
+    if (!httpSendHeaders(c))
+        httpSendBody(c, body, len);
+}
+
+// Response not sent yet is answered with error and completed
+static void failRequest(struct proxyRequest *request, int status)
+{
+    struct upstreamConn *upstream = request->upstream;
+
+    if (upstream) {
+        upstream->request = NULL;
+        upstream->server->outstanding--;
+        request->upstream = NULL;
+    }
+    sendUpstreamError(request->outer, status);
+    httpCompleteResponse(request->outer);
+}
+
+static const char *reasonPhrase(int status)
+{
+    switch (status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Request Entity Too Large";
+        case 416: return "Requested Range Not Satisfiable";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Unknown";
+    }
+}
+
+static void sendResponse(struct conn *outer, struct upstreamResponse *resp)
+{
+    struct headerPair *pair;
+    int status, has_body;
+    char buf[32];
+    size_t i;
+
+    status = resp->parser.status_code;
+    has_body = !(status >= 100 && status < 200) && status != 204 &&
+        status != 304 && !resp->skip_body;
+    fillResInfo(outer, status, reasonPhrase(status));
+    for (i = 0; i < narray(resp->headers); i++) {
+        pair = arrayIndex(resp->headers, i);
+        if (isSkipHeader(SkipResponseHeaders, pair->field))
+            continue;
+        // Chunked body is sent with length because the whole body is here
+        if (has_body && !strcasecmp(pair->field, CONTENT_LENGTH))
+            continue;
+        appendToResHeaders(outer, pair->field, pair->value);
+    }
+    if (has_body) {
+        snprintf(buf, sizeof(buf), "%zu", resp->body_len);
+        appendToResHeaders(outer, CONTENT_LENGTH, buf);
+    }
+    if (httpSendHeaders(outer) == -1)
+        return ;
+    for (i = 0; i < resp->nbody; i++) {
+        if (httpSendBody(outer, (const char *)resp->body[i].data,
+                    resp->body[i].len) == -1)
+            return ;
+    }
+}
+
+static int upstreamSpot(struct conn *c)
+{
+    struct upstreamConn *upstream = c->client->client_data;
+    struct upstreamResponse *resp = c->protocol_data;
+    struct proxyRequest *request = upstream->request;
+
+    upstream->keep_alive = resp->keep_alive;
+    if (!request) {
+        wheatLog(WHEAT_NOTICE, "unexpected response from %s", c->client->name);
+        setClientUnvalid(c->client);
+        return WHEAT_OK;
+    }
+    upstream->request = NULL;
+    upstream->server->outstanding--;
+
+    // Response body refers to this conn, keep it until client conn is freed
+    request->response = c;
+    request->held_node = appendToListTail(upstream->held, request);
+    sendResponse(request->outer, resp);
+    httpCompleteResponse(request->outer);
+    return WHEAT_OK;
+}
+
+static void freeHeldBuffer(struct heldBuffer *held)
+{
+    if (--held->refs == 0) {
+        msgFree(held->buf);
+        wfree(held);
+    }
+}
+
+// Called when client conn is freed, either response is sent or client
+// is closed before upstream answers
+static void proxyRequestDone(void *data)
+{
+    struct proxyRequest *request = data;
+    struct upstreamConn *upstream = request->upstream;
+
+    if (upstream && !request->response) {
+        // Client is gone, upstream still refers to request body
+        upstream->request = NULL;
+        upstream->server->outstanding--;
+        closeUpstream(upstream);
+    } else if (upstream) {
+        removeListNode(upstream->held, request->held_node);
+        finishConn(request->response);
+        releaseUpstream(upstream);
+    }
+    if (request->held_buf)
+        freeHeldBuffer(request->held_buf);
+    wstrFree(request->header);
+    wfree(request);
+}
+
+static void upstreamClosed(struct client *client)
+{
+    struct upstreamConn *upstream = client->client_data;
+    struct proxyRequest *request;
+    struct listIterator *iter;
+    struct listNode *node;
+    struct heldBuffer *held;
+
+    if (upstream->idle_node)
+        removeListNode(upstream->server->idle, upstream->idle_node);
+    removeListNode(UpstreamConns, upstream->node);
+
+    // Responses still sending refer to request buffer of this client
+    if (listLength(upstream->held)) {
+        held = wmalloc(sizeof(*held));
+        held->buf = client->req_buf;
+        held->refs = listLength(upstream->held);
+        client->req_buf = msgCreate(Server.mbuf_size);
+        iter = listGetIterator(upstream->held, START_HEAD);
+        while ((node = listNext(iter)) != NULL) {
+            request = listNodeValue(node);
+            request->upstream = NULL;
+            request->response = NULL;
+            request->held_buf = held;
+        }
+        freeListIterator(iter);
+    }
+    freeList(upstream->held);
+
+    request = upstream->request;
+    if (request) {
+        upstream->request = NULL;
+        upstream->server->outstanding--;
+        request->upstream = NULL;
+        // Connection closed before answering, retry idempotent request
+        // without body once
+        if (!upstream->started && !request->retried &&
+                !httpBodyGetSize(request->outer) &&
+                (!strcmp(httpGetMethod(request->outer), "GET") ||
+                 !strcmp(httpGetMethod(request->outer), "HEAD"))) {
+            request->retried = 1;
+            if (forwardRequest(request) == WHEAT_OK)
+                request = NULL;
+        }
+        if (request)
+            failRequest(request, 502);
+    }
+    wfree(upstream);
+}
+
+int proxyCall(struct conn *c, void *arg)
+{
+    struct proxyRequest *request;
+    struct upstreamPool *pool;
+
+    (*TotalRequest)++;
+    pool = spotPool(arg);
+    if (!pool) {
+        wheatLog(WHEAT_WARNING, "upstream %s not found", arg ? (char *)arg : "");
+        sendUpstreamError(c, 502);
+        return WHEAT_OK;
+    }
+    request = wmalloc(sizeof(*request));
+    memset(request, 0, sizeof(*request));
+    request->outer = c;
+    request->pool = pool;
+    request->header = buildRequestHeader(c);
+    registerConnFree(c, proxyRequestDone, request);
+    if (forwardRequest(request) == WHEAT_WRONG) {
+        sendUpstreamError(c, 502);
+        return WHEAT_OK;
+    }
+    httpDeferResponse(c);
+    return WHEAT_OK;
+}
+
+// Close idle connections more than `proxy-keepalive` and those not
+// reusable, answer requests waiting longer than `proxy-timeout` with 504
+void proxyCron()
+{
+    struct listIterator *iter;
+    struct listNode *node;
+    struct upstreamConn *upstream;
+    struct upstreamServer *server;
+    size_t i, j;
+
+    if (!UpstreamConns || LastCheck == Server.cron_time.tv_sec)
+        return ;
+    LastCheck = Server.cron_time.tv_sec;
+
+    iter = listGetIterator(UpstreamConns, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        upstream = listNodeValue(node);
+        if (upstream->request &&
+                Server.cron_time.tv_sec - upstream->request->start >= ProxyTimeout) {
+            wheatLog(WHEAT_NOTICE, "%s timeout", upstream->client->name);
+            failRequest(upstream->request, 504);
+            closeUpstream(upstream);
+        } else if (!upstream->request && !listLength(upstream->held) &&
+                !upstream->idle_node) {
+            closeUpstream(upstream);
+        }
+    }
+    freeListIterator(iter);
+
+    for (i = 0; i < NPools; i++) {
+        for (j = 0; j < Pools[i].nserver; j++) {
+            server = &Pools[i].servers[j];
+            while (listLength(server->idle) > KeepAlive) {
+                upstream = listNodeValue(listFirst(server->idle));
+                closeUpstream(upstream);
+            }
+        }
+    }
+}
+
+// `proxy-upstream` item: NAME HOST:PORT [HOST:PORT ...]
+static int initPool(struct upstreamPool *pool, wstr line)
+{
+    wstr *frags, *addr;
+    int count, n, i;
+    struct upstreamServer *server;
+
+    frags = wstrNewSplit(line, " ", 1, &count);
+    if (!frags)
+        return WHEAT_WRONG;
+    pool->servers = wmalloc(sizeof(struct upstreamServer) * count);
+    pool->nserver = 0;
+    pool->next = 0;
+    pool->name = NULL;
+    for (i = 0; i < count; i++) {
+        if (!wstrlen(frags[i]))
+            continue;
+        if (!pool->name) {
+            pool->name = wstrDup(frags[i]);
+            continue;
+        }
+        addr = wstrNewSplit(frags[i], ":", 1, &n);
+        if (!addr || n != 2 || atoi(addr[1]) <= 0) {
+            wheatLog(WHEAT_WARNING, "proxy-upstream %s is unvalid", frags[i]);
+            if (addr)
+                wstrFreeSplit(addr, n);
+            wstrFreeSplit(frags, count);
+            return WHEAT_WRONG;
+        }
+        server = &pool->servers[pool->nserver++];
+        memset(server, 0, sizeof(*server));
+        server->ip = wstrDup(addr[0]);
+        server->port = atoi(addr[1]);
+        server->idle = createList();
+        wstrFreeSplit(addr, n);
+    }
+    wstrFreeSplit(frags, count);
+    if (!pool->nserver) {
+        wheatLog(WHEAT_WARNING, "proxy-upstream %s has no server", line);
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+int initProxy(struct protocol *p)
+{
+    struct configuration *conf;
+    struct listIterator *iter;
+    struct listNode *node;
+    struct list *upstreams;
+
+    TotalRequest = &getStatValByName("Total proxy request");
+    TotalConnection = &getStatValByName("Total proxy upstream connection");
+    TotalFailure = &getStatValByName("Total proxy upstream failure");
+    conf = getConfiguration("proxy-upstream");
+    upstreams = conf->target.ptr;
+    if (!upstreams || !listLength(upstreams))
+        return WHEAT_OK;
+    // Waiting for upstream would block SyncWorker
+    if (!strcasecmp(Server.worker_type, "SyncWorker")) {
+        wheatLog(WHEAT_WARNING, "http-proxy needs AsyncWorker");
+        return WHEAT_WRONG;
+    }
+    KeepAlive = getConfiguration("proxy-keepalive")->target.val;
+    ProxyTimeout = getConfiguration("proxy-timeout")->target.val;
+
+    memset(&ResponseParserSettings, 0, sizeof(ResponseParserSettings));
+    ResponseParserSettings.on_header_field = onResponseHeaderField;
+    ResponseParserSettings.on_header_value = onResponseHeaderValue;
+    ResponseParserSettings.on_headers_complete = onResponseHeadersComplete;
+    ResponseParserSettings.on_body = onResponseBody;
+    ResponseParserSettings.on_message_complete = onResponseComplete;
+
+    Pools = wmalloc(sizeof(struct upstreamPool) * listLength(upstreams));
+    memset(Pools, 0, sizeof(struct upstreamPool) * listLength(upstreams));
+    NPools = 0;
+    iter = listGetIterator(upstreams, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        if (initPool(&Pools[NPools], listNodeValue(node)) == WHEAT_WRONG) {
+            freeListIterator(iter);
+            return WHEAT_WRONG;
+        }
+        NPools++;
+    }
+    freeListIterator(iter);
+    UpstreamConns = createList();
+    return WHEAT_OK;
+}
+
+void deallocProxy()
+{
+    struct upstreamConn *upstream;
+    size_t i, j;
+
+    if (UpstreamConns) {
+        while (listLength(UpstreamConns)) {
+            upstream = listNodeValue(listFirst(UpstreamConns));
+            closeUpstream(upstream);
+        }
+        freeList(UpstreamConns);
+        UpstreamConns = NULL;
+    }
+    for (i = 0; i < NPools; i++) {
+        for (j = 0; j < Pools[i].nserver; j++) {
+            wstrFree(Pools[i].servers[j].ip);
+            freeList(Pools[i].servers[j].idle);
+        }
+        wfree(Pools[i].servers);
+        wstrFree(Pools[i].name);
+    }
+    wfree(Pools);
+    Pools = NULL;
+    NPools = 0;
+}
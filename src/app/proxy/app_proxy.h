@@ -0,0 +1,8 @@
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_APP_PROXY_H
+#define WHEATSERVER_APP_PROXY_H
+
+#endif
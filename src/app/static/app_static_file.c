@@ -13,6 +13,12 @@
 
 #include "../application.h"
 #include "../../protocol/http/proto_http.h"
+#include "file_cache.h"
+
+#define WHEAT_FILE_CACHE_SIZE 128
+#define WHEAT_FILE_CACHE_VALID 5
+#define WHEAT_FILE_MEMORY_SIZE (4*1024*1024)
+#define WHEAT_FILE_MEMORY_MAX_FILE 16384
 
 int staticFileCall(struct conn *, void *);
 int initStaticFile(struct protocol *);
@@ -30,6 +36,23 @@ static struct configuration StaticConf[] = {
         (void *)WHEAT_NOTFREE,  STRING_FORMAT},
     {"directory-index",   2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"static-file-cache-size", 2, unsignedIntValidator, {.val=WHEAT_FILE_CACHE_SIZE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"static-file-cache-valid", 2, unsignedIntValidator, {.val=WHEAT_FILE_CACHE_VALID},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"static-file-memory-size", 2, unsignedIntValidator, {.val=WHEAT_FILE_MEMORY_SIZE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"static-file-memory-max-file", 2, unsignedIntValidator, {.val=WHEAT_FILE_MEMORY_MAX_FILE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"static-file-precompressed", 2, boolValidator, {.val=0},
+        NULL,                   BOOL_FORMAT},
+    {"static-file-max-age", WHEAT_ARGS_NO_LIMIT, listValidator, {.ptr=NULL},
+        NULL,                   LIST_FORMAT},
+};
+
+static struct statItem StaticStats[] = {
+    {"Total static file cache hit", SUM_STAT, RAW, 0, 0},
+    {"Total static file cache miss", SUM_STAT, RAW, 0, 0},
 };
 
 static struct app AppStatic = {
@@ -38,15 +61,39 @@ static struct app AppStatic = {
 };
 
 struct moduleAttr AppStaticAttr = {
-    "static-file", APP, {.app=&AppStatic}, NULL, 0,
+    "static-file", APP, {.app=&AppStatic},
+    StaticStats, sizeof(StaticStats)/sizeof(struct statItem),
     StaticConf, sizeof(StaticConf)/sizeof(struct configuration),
     NULL, 0
 };
 
+// Requests asking for more ranges than it are served as a whole
+#define WHEAT_MAX_RANGES 16
+
 static unsigned int MaxFileSize = WHEAT_MAX_BUFFER_SIZE;
 static struct dict *AllowExtensions = NULL;
 static wstr IfModifiedSince = NULL;
+static wstr RangeKey = NULL;
+static wstr IfRangeKey = NULL;
+static wstr IfNoneMatchKey = NULL;
+// Extension to "Cache-Control" value, `DefaultMaxAge` is used by others
+static struct dict *MaxAges = NULL;
+static wstr DefaultMaxAge = NULL;
 static struct list *DirectoryIndex = NULL;
+static int PrecompressedEnabled = 0;
+static wstr AcceptEncodingKey = NULL;
+static wstr VariantKey = NULL;
+
+// Sidecar files compressed ahead, tried in order of preference
+struct precompressed {
+    const char *encoding;
+    const char *suffix;
+};
+
+static struct precompressed Precompressed[] = {
+    {"br", ".br"},
+    {"gzip", ".gz"},
+};
 
 struct contenttype {
     const char *extension;
@@ -56,7 +103,8 @@ struct contenttype {
 struct staticFileData {
     wstr filename;
     wstr extension;
-    int fd;
+    struct cachedFile *file;
+    struct cachedFile *variant;
 };
 
 static struct contenttype ContentTypes[] = {
@@ -192,131 +240,442 @@ static struct contenttype ContentTypes[] = {
     {"zip", "application/zip"},
 };
 
-static int fillResHeaders(struct conn *c, off_t rep_len, time_t m_time)
+static const char *getContentType(struct staticFileData *static_data)
+{
+    int i, size;
+
+    if (!static_data->extension || !static_data->filename)
+        return NULL;
+    size = sizeof(ContentTypes)/sizeof(struct contenttype);
+    for (i = 0; i < size; ++i) {
+        if (!strcmp(static_data->extension, ContentTypes[i].extension))
+            return ContentTypes[i].mime_type;
+    }
+    return "application/octet-stream";
+}
+
+static int fillResHeaders(struct conn *c, off_t rep_len,
+        const char *last_modified, const char *content_type)
 {
     int ret = 0;
-    struct staticFileData *static_data = c->app_private_data;
-    int i;
     char buf[50];
 
     if (rep_len != 0) {
-        ret = snprintf(buf, sizeof(buf), "%lld", rep_len);
+        ret = snprintf(buf, sizeof(buf), "%lld", (long long)rep_len);
         if (ret < 0 || ret > sizeof(buf))
             return -1;
         appendToResHeaders(c, CONTENT_LENGTH, buf);
     }
 
-    if (m_time != 0) {
-        ret = convertHttpDate(m_time, buf, sizeof(buf));
-        if (ret < 0)
-            return -1;
-        appendToResHeaders(c, LAST_MODIFIED, buf);
-    }
+    if (last_modified && *last_modified)
+        appendToResHeaders(c, LAST_MODIFIED, last_modified);
 
-    if (static_data->extension && static_data->filename) {
-        int size = sizeof(ContentTypes)/sizeof(struct contenttype);
-        for (i = 0; i < size; ++i) {
-            if (!strcmp(static_data->extension, ContentTypes[i].extension)) {
-                break;
-            }
-        }
-        if (i != size) {
-            appendToResHeaders(c, CONTENT_TYPE, ContentTypes[i].mime_type);
-        } else {
-            appendToResHeaders(c, CONTENT_TYPE, "application/octet-stream");
-        }
-    }
+    if (content_type)
+        appendToResHeaders(c, CONTENT_TYPE, content_type);
     return ret;
 }
 
-int staticFileCall(struct conn *c, void *arg)
+// Range is only honored if "If-Range" is absent or matches Last-Modified
+// exactly, otherwise file has changed and whole file is sent
+static int isRangeFresh(struct conn *c, struct cachedFile *file)
 {
-    wstr path = arg;
-    struct staticFileData *static_data;
-    off_t len;
-    time_t m_time;
-    int ret;
-    struct stat stat;
+    wstr if_range = dictFetchValue(httpGetReqHeaders(c), IfRangeKey);
 
-    static_data = c->app_private_data;
-    static_data->fd = open(path, O_RDONLY);
+    if (!if_range)
+        return 1;
+    if (*if_range == '"')
+        return !strcmp(if_range, file->etag);
+    return *file->last_modified && !strcmp(if_range, file->last_modified);
+}
 
-    if (static_data->fd  == -1) {
-        wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
-        goto failed404;
+// Strong ETag changes whenever file is replaced or modified
+static void fillFileHeaders(struct conn *c, struct cachedFile *file)
+{
+    struct staticFileData *static_data = c->app_private_data;
+    wstr max_age = NULL;
+
+    file->content_type = getContentType(static_data);
+    if (convertHttpDate(file->mtime, file->last_modified,
+                sizeof(file->last_modified)) < 0)
+        file->last_modified[0] = '\0';
+    snprintf(file->etag, sizeof(file->etag), "\"%lx-%llx-%lx\"",
+            (unsigned long)file->ino, (unsigned long long)file->size,
+            (unsigned long)file->mtime);
+    if (MaxAges && static_data->extension)
+        max_age = dictFetchValue(MaxAges, static_data->extension);
+    file->cache_control = max_age ? max_age : DefaultMaxAge;
+}
+
+// Weak comparison(RFC 7232 2.3.2) against each tag of "If-None-Match"
+static int isNoneMatch(const char *tags, const char *etag)
+{
+    size_t len = strlen(etag);
+    const char *p = tags;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (*p == '*')
+            return 0;
+        if (p[0] == 'W' && p[1] == '/')
+            p += 2;
+        if (!strncmp(p, etag, len))
+            return 0;
+        while (*p && *p != ',')
+            p++;
     }
+    return 1;
+}
 
-    ret = lstat(path, &stat);
-    if (ret == -1)
-        goto failed404;
+static int sendNotModified(struct conn *c, struct cachedFile *file)
+{
+    fillResInfo(c, 304, "Not Modified");
+    appendToResHeaders(c, ETAG, file->etag);
+    if (file->cache_control)
+        appendToResHeaders(c, CACHE_CONTROL, file->cache_control);
+    if (fillResHeaders(c, 0, NULL, file->content_type) == -1)
+        return -1;
+    return httpSendHeaders(c);
+}
+
+static int sendRangeNotSatisfiable(struct conn *c, off_t size)
+{
+    char buf[50];
+
+    fillResInfo(c, 416, "Requested Range Not Satisfiable");
+    snprintf(buf, sizeof(buf), "bytes */%lld", (long long)size);
+    appendToResHeaders(c, CONTENT_RANGE, buf);
+    appendToResHeaders(c, CONTENT_LENGTH, "0");
+    return httpSendHeaders(c);
+}
+
+static int sendSingleRange(struct conn *c, struct cachedFile *file,
+        struct httpRange *range)
+{
+    char buf[100];
+    off_t size = file->size;
+
+    fillResInfo(c, 206, "Partial Content");
+    if (fillResHeaders(c, range->len, file->last_modified, file->content_type) == -1)
+        return -1;
+    snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld", (long long)range->start,
+            (long long)(range->start + range->len - 1), (long long)size);
+    appendToResHeaders(c, CONTENT_RANGE, buf);
+    appendToResHeaders(c, ACCEPT_RANGES, "bytes");
+    if (httpSendHeaders(c) == -1)
+        return -1;
+    return httpSendFileRange(c, file->fd, range->start, range->len);
+}
 
-    if (!S_ISREG(stat.st_mode)) {
-        close(static_data->fd);
-        static_data->fd = -1;
-        if (S_ISDIR(stat.st_mode) && DirectoryIndex) {
+// Send "multipart/byteranges" body, part headers are built into one buffer
+// living with conn and each part is sent from file directly
+static int sendMultiRanges(struct conn *c, struct cachedFile *file,
+        struct httpRange *ranges, int count)
+{
+    const char *content_type = file->content_type;
+    off_t size = file->size;
+    size_t offsets[WHEAT_MAX_RANGES+1];
+    char boundary[20], buf[256];
+    off_t total = 0;
+    wstr parts;
+    int i, ret;
+
+    if (!content_type)
+        content_type = "application/octet-stream";
+    snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+            (unsigned long)random(), (unsigned long)random());
+    parts = wstrEmpty();
+    for (i = 0; i < count && parts; i++) {
+        offsets[i] = wstrlen(parts);
+        ret = snprintf(buf, sizeof(buf), "\r\n--%s\r\n%s: %s\r\n"
+                "%s: bytes %lld-%lld/%lld\r\n\r\n", boundary, CONTENT_TYPE,
+                content_type, CONTENT_RANGE, (long long)ranges[i].start,
+                (long long)(ranges[i].start + ranges[i].len - 1),
+                (long long)size);
+        parts = wstrCatLen(parts, buf, ret);
+        total += ranges[i].len;
+    }
+    if (!parts)
+        return -1;
+    offsets[count] = wstrlen(parts);
+    ret = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n", boundary);
+    parts = wstrCatLen(parts, buf, ret);
+    if (!parts)
+        return -1;
+    registerConnFree(c, (void (*)(void *))wstrFree, parts);
+    total += wstrlen(parts);
+
+    fillResInfo(c, 206, "Partial Content");
+    snprintf(buf, sizeof(buf), "multipart/byteranges; boundary=%s", boundary);
+    if (fillResHeaders(c, total, file->last_modified, buf) == -1)
+        return -1;
+    appendToResHeaders(c, ACCEPT_RANGES, "bytes");
+    if (httpSendHeaders(c) == -1)
+        return -1;
+    for (i = 0; i < count; i++) {
+        if (httpSendBody(c, parts + offsets[i], offsets[i+1] - offsets[i]) == -1)
+            return -1;
+        ret = httpSendFileRange(c, file->fd, ranges[i].start,
+                ranges[i].len);
+        if (ret == WHEAT_WRONG)
+            return -1;
+    }
+    return httpSendBody(c, parts + offsets[count],
+            wstrlen(parts) - offsets[count]);
+}
+
+// Return fd of file or index file of directory, `real_path` is set to the
+// file opened
+static int openStaticFile(wstr path, char *real_path, size_t size,
+        struct stat *st)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
+        return -1;
+    }
+    if (lstat(path, st) == -1) {
+        close(fd);
+        return -1;
+    }
+    snprintf(real_path, size, "%s", path);
+
+    if (!S_ISREG(st->st_mode)) {
+        close(fd);
+        fd = -1;
+        if (S_ISDIR(st->st_mode) && DirectoryIndex) {
             struct listNode *node;
             struct listIterator *iter;
             wstr last;
-            char append_path[255];
             iter = listGetIterator(DirectoryIndex, START_HEAD);
             while ((node = listNext(iter)) != NULL) {
                 last = listNodeValue(node);
-                snprintf(append_path, 255, "%s/%s", path, last);
-                static_data->fd = open(append_path, O_RDONLY);
+                snprintf(real_path, size, "%s/%s", path, last);
+                fd = open(real_path, O_RDONLY);
 
-                if (static_data->fd  != -1) {
+                if (fd != -1) {
                     break;
                 }
             }
+            freeListIterator(iter);
         }
-        if (static_data->fd == -1) {
+        if (fd == -1) {
             wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
-            goto failed404;
+            return -1;
+        }
+    }
+    if (fstat(fd, st) == -1) {
+        wheatLog(WHEAT_VERBOSE, "stat file failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Coding is acceptable if it or "*" is listed without "q=0"
+static int acceptsEncoding(const char *accept, const char *coding)
+{
+    size_t len = strlen(coding);
+    const char *p = accept, *end;
+    int any = 0, listed = 0, zero;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',')
+            p++;
+        end = p;
+        while (*end && *end != ',' && *end != ';' && *end != ' ')
+            end++;
+        zero = 0;
+        while (*end && *end != ',') {
+            if (*end == 'q' && end[1] == '=' && atof(end+2) == 0)
+                zero = 1;
+            end++;
+        }
+        if (!zero && end != p) {
+            if (!strncasecmp(p, coding, len) && (p[len] == ',' ||
+                        p[len] == ';' || p[len] == ' ' || !p[len]))
+                listed = 1;
+            else if (*p == '*')
+                any = 1;
+        }
+        p = end;
+    }
+    return listed || any;
+}
+
+// Return referenced sidecar variant of `file` acceptable to client and set
+// `*encoding`, NULL if none. Sidecar older than `file` is ignored.
+static struct cachedFile *spotPrecompressed(struct conn *c,
+        struct cachedFile *file, time_t now, const char **encoding)
+{
+    wstr accept = dictFetchValue(httpGetReqHeaders(c), AcceptEncodingKey);
+    struct cachedFile *variant;
+    char real_path[255];
+    struct stat st;
+    int i, fd;
+
+    if (!accept)
+        return NULL;
+    for (i = 0; i < sizeof(Precompressed)/sizeof(struct precompressed); i++) {
+        if ((file->variants_missing & (1 << i)) ||
+                !acceptsEncoding(accept, Precompressed[i].encoding))
+            continue;
+        wstrClear(VariantKey);
+        VariantKey = wstrCat(wstrCat(VariantKey, file->path),
+                Precompressed[i].suffix);
+        variant = fileCacheGet(VariantKey, now);
+        if (!variant) {
+            snprintf(real_path, sizeof(real_path), "%s%s", file->real_path,
+                    Precompressed[i].suffix);
+            fd = open(real_path, O_RDONLY);
+            if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+                if (fd != -1)
+                    close(fd);
+                file->variants_missing |= 1 << i;
+                continue;
+            }
+            variant = fileCacheAdd(VariantKey, real_path, fd, &st, now);
+            if (!variant)
+                continue;
+            fillFileHeaders(c, variant);
+            memcpy(variant->last_modified, file->last_modified,
+                    sizeof(variant->last_modified));
         }
+        if (variant->mtime < file->mtime) {
+            fileCacheRelease(variant);
+            file->variants_missing |= 1 << i;
+            continue;
+        }
+        *encoding = Precompressed[i].encoding;
+        return variant;
     }
+    return NULL;
+}
+
+int staticFileCall(struct conn *c, void *arg)
+{
+    wstr path = arg;
+    struct staticFileData *static_data;
+    struct cachedFile *file, *variant;
+    const char *encoding;
+    time_t mtime, now = Server.cron_time.tv_sec;
+    int fd, ret, nranges;
+    struct stat stat;
+    struct httpRange ranges[WHEAT_MAX_RANGES];
+    char real_path[255];
+    wstr range;
+
+    static_data = c->app_private_data;
     if (AllowExtensions && static_data->extension &&
             !dictFetchValue(AllowExtensions, static_data->extension)) {
         goto failed404;
     }
-    ret = getFileSizeAndMtime(static_data->fd , &len, &m_time);
-    if (ret == WHEAT_WRONG) {
-        wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
-        goto failed404;
+
+    file = fileCacheGet(path, now);
+    if (file) {
+        getStatItemByName("Total static file cache hit")->val++;
+    } else {
+        getStatItemByName("Total static file cache miss")->val++;
+        fd = openStaticFile(path, real_path, sizeof(real_path), &stat);
+        if (fd == -1)
+            goto failed404;
+        file = fileCacheAdd(path, real_path, fd, &stat, now);
+        if (!file)
+            goto failed404;
+        // Header values are computed once for each opened file
+        fillFileHeaders(c, file);
     }
-    if (len > MaxFileSize) {
-        wheatLog(WHEAT_NOTICE, "file exceed max limit %d", len);
-        wheatLog(WHEAT_VERBOSE, "open file failed: %s", strerror(errno));
+    static_data->file = file;
+
+    if (file->size > MaxFileSize) {
+        wheatLog(WHEAT_NOTICE, "file exceed max limit %lld", (long long)file->size);
         goto failed404;
     }
 
+    // Ranges always refer to the original file
+    range = dictFetchValue(httpGetReqHeaders(c), RangeKey);
+    variant = NULL;
+    if (PrecompressedEnabled) {
+        appendToResHeaders(c, VARY, ACCEPT_ENCODING);
+        if (!range)
+            variant = spotPrecompressed(c, file, now, &encoding);
+        static_data->variant = variant;
+    }
+
+    // Last-Modified of variant is the same as original file
+    mtime = file->mtime;
+    if (variant) {
+        appendToResHeaders(c, CONTENT_ENCODING, encoding);
+        file = variant;
+    }
+
+    // "If-Modified-Since" is ignored if "If-None-Match" is present
+    // (RFC 7232 6)
+    wstr none_match = dictFetchValue(httpGetReqHeaders(c), IfNoneMatchKey);
     wstr modified = dictFetchValue(httpGetReqHeaders(c), IfModifiedSince);
-    if (modified != NULL) {
-        char buf[wstrlen(modified)];
-        memcpy(buf, modified, wstrlen(modified));
+    if (none_match) {
+        if (!isNoneMatch(none_match, file->etag)) {
+            if (sendNotModified(c, file) == -1)
+                goto failed;
+            return WHEAT_OK;
+        }
+    } else if (modified != NULL) {
+        char buf[wstrlen(modified)+1];
+        memcpy(buf, modified, wstrlen(modified)+1);
         time_t client_m_time = fromHttpDate(buf);
-        if (m_time <= client_m_time) {
-            fillResInfo(c, 304, "Not Modified");
-            ret = fillResHeaders(c, 0, 0);
-            if (ret == -1)
+        if (mtime <= client_m_time) {
+            if (sendNotModified(c, file) == -1)
                 goto failed;
-            ret = httpSendHeaders(c);
-            if (ret == -1)
+            return WHEAT_OK;
+        }
+    }
+    appendToResHeaders(c, ETAG, file->etag);
+    if (file->cache_control)
+        appendToResHeaders(c, CACHE_CONTROL, file->cache_control);
+
+    if (range && !strcmp(httpGetMethod(c), "GET") && isRangeFresh(c, file)) {
+        // 0 means range is ignored and whole file is sent
+        nranges = httpParseRange(range, file->size, ranges, WHEAT_MAX_RANGES);
+        if (nranges != 0) {
+            if (nranges == -1)
+                ret = sendRangeNotSatisfiable(c, file->size);
+            else if (nranges == 1)
+                ret = sendSingleRange(c, file, &ranges[0]);
+            else
+                ret = sendMultiRanges(c, file, ranges, nranges);
+            if (ret == -1) {
+                wheatLog(WHEAT_WARNING, "send file range failed: %s",
+                        strerror(errno));
                 goto failed;
+            }
             return WHEAT_OK;
         }
     }
+
     fillResInfo(c, 200, "OK");
-    ret = fillResHeaders(c, len, m_time);
+    ret = fillResHeaders(c, file->size, file->last_modified, file->content_type);
     if (ret == -1) {
         wheatLog(WHEAT_WARNING, "fill Res Headers failes: %s", strerror(errno));
         goto failed;
     }
+    appendToResHeaders(c, ACCEPT_RANGES, "bytes");
+    // Content in memory is sent with headers together
+    if (file->data) {
+        ret = httpSendResponse(c, file->data, file->size);
+        if (ret == -1) {
+            wheatLog(WHEAT_WARNING, "send static file failed: %s", strerror(errno));
+            goto failed;
+        }
+        return WHEAT_OK;
+    }
     ret = httpSendHeaders(c);
     if (ret == -1) {
         wheatLog(WHEAT_WARNING, "static file send headers failed: %s", strerror(errno));
         goto failed;
     }
-    ret = sendClientFile(c, static_data->fd , len);
+    ret = httpSendFile(c, file->fd, file->size);
     if (ret == WHEAT_WRONG) {
         wheatLog(WHEAT_WARNING, "send static file failed: %s", strerror(errno));
         goto failed;
@@ -333,6 +692,57 @@ failed:
     return WHEAT_OK;
 }
 
+// Each item is "EXTENSIONS SECONDS", EXTENSIONS is separated by ',' and "*"
+// means extensions not listed
+static int initMaxAges()
+{
+    struct configuration *conf = getConfiguration("static-file-max-age");
+    struct listIterator *iter;
+    struct listNode *node;
+    wstr *frags, *exts, args[2], key, value;
+    int count, nexts, nargs, replaced, i, ret = WHEAT_OK;
+    char buf[32];
+
+    if (!conf->target.ptr)
+        return WHEAT_OK;
+    MaxAges = dictCreate(&wstrDictType);
+    iter = listGetIterator(conf->target.ptr, START_HEAD);
+    while (ret == WHEAT_OK && (node = listNext(iter)) != NULL) {
+        frags = wstrNewSplit(listNodeValue(node), " ", 1, &count);
+        for (i = nargs = 0; frags && i < count; i++) {
+            if (wstrlen(frags[i]) && nargs++ < 2)
+                args[nargs-1] = frags[i];
+        }
+        if (!frags || nargs != 2 || !isdigit(*args[1])) {
+            wheatLog(WHEAT_WARNING, "static-file-max-age invalid: %s",
+                    (char *)listNodeValue(node));
+            ret = WHEAT_WRONG;
+        } else {
+            snprintf(buf, sizeof(buf), "max-age=%ld", atol(args[1]));
+            exts = wstrNewSplit(args[0], ",", 1, &nexts);
+            for (i = 0; exts && i < nexts; i++) {
+                value = wstrNew(buf);
+                if (!strcmp(exts[i], WHEAT_ASTERISK)) {
+                    wstrFree(DefaultMaxAge);
+                    DefaultMaxAge = value;
+                } else {
+                    key = wstrNew(exts[i]);
+                    if (dictReplace(MaxAges, key, value, &replaced) == DICT_WRONG)
+                        ret = WHEAT_WRONG;
+                    else if (replaced)
+                        wstrFree(key);
+                }
+            }
+            if (exts)
+                wstrFreeSplit(exts, nexts);
+        }
+        if (frags)
+            wstrFreeSplit(frags, count);
+    }
+    freeListIterator(iter);
+    return ret;
+}
+
 int initStaticFile(struct protocol *p)
 {
     int args, i, ret;
@@ -376,8 +786,6 @@ int initStaticFile(struct protocol *p)
 
         for (i = 0; i < args; ++i) {
             appendToListTail(DirectoryIndex, wstrNew(argvs[i]));
-            if (ret == DICT_WRONG)
-                break;
         }
 
         wstrFreeSplit(argvs, args);
@@ -385,7 +793,23 @@ int initStaticFile(struct protocol *p)
         DirectoryIndex = NULL;
     }
 
+    if (fileCacheInit(getConfiguration("static-file-cache-size")->target.val,
+                getConfiguration("static-file-cache-valid")->target.val,
+                getConfiguration("static-file-memory-max-file")->target.val,
+                getConfiguration("static-file-memory-size")->target.val) == -1) {
+        wheatLog(WHEAT_WARNING, "init static file cache failed");
+        return WHEAT_WRONG;
+    }
+
+    if (initMaxAges() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    PrecompressedEnabled = getConfiguration("static-file-precompressed")->target.val;
+    AcceptEncodingKey = wstrNew(ACCEPT_ENCODING);
+    VariantKey = wstrEmpty();
     IfModifiedSince = wstrNew(IF_MODIFIED_SINCE);
+    RangeKey = wstrNew(RANGE);
+    IfRangeKey = wstrNew(IF_RANGE);
+    IfNoneMatchKey = wstrNew(IF_NONE_MATCH);
     return WHEAT_OK;
 }
 
@@ -396,7 +820,18 @@ void deallocStaticFile()
     if (DirectoryIndex)
         freeList(DirectoryIndex);
     MaxFileSize = 0;
+    fileCacheDealloc();
+    wstrFree(AcceptEncodingKey);
+    wstrFree(VariantKey);
     wstrFree(IfModifiedSince);
+    wstrFree(RangeKey);
+    wstrFree(IfRangeKey);
+    wstrFree(IfNoneMatchKey);
+    if (MaxAges)
+        dictRelease(MaxAges);
+    MaxAges = NULL;
+    wstrFree(DefaultMaxAge);
+    DefaultMaxAge = NULL;
 }
 
 void *initStaticFileData(struct conn *c)
@@ -414,7 +849,8 @@ void *initStaticFileData(struct conn *c)
             data->filename = wstrNewLen(base_name, (int)(point-base_name));
         }
     }
-    data->fd = 0;
+    data->file = NULL;
+    data->variant = NULL;
     return data;
 }
 
@@ -423,7 +859,9 @@ void freeStaticFileData(void *app_data)
     struct staticFileData *data = app_data;
     wstrFree(data->extension);
     wstrFree(data->filename);
-    if (data->fd > 0)
-        close(data->fd);
+    if (data->file)
+        fileCacheRelease(data->file);
+    if (data->variant)
+        fileCacheRelease(data->variant);
     wfree(data);
 }
@@ -0,0 +1,329 @@
+// Open file cache of static file app
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <string.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "../../dict.h"
+#include "../../list.h"
+#include "../../memalloc.h"
+
+static unsigned int fileCacheHash(const void *key)
+{
+    return dictGenHashFunction(key, wstrlen((wstr)key));
+}
+
+static int fileCacheKeyCompare(const void *key1, const void *key2)
+{
+    return wstrlen((wstr)key1) == wstrlen((wstr)key2) &&
+        !memcmp(key1, key2, wstrlen((wstr)key1));
+}
+
+// Key is owned by entry
+static struct dictType FileCacheDictType = {
+    fileCacheHash, NULL, NULL, fileCacheKeyCompare, NULL, NULL
+};
+
+static struct dict *Files = NULL;
+// Most recently used entry is at head
+static struct list *Lru = NULL;
+static size_t MaxFiles = 0;
+static time_t Valid = 0;
+static size_t MemFileSize = 0;
+static size_t MemSize = 0;
+static size_t MemUsed = 0;
+
+int fileCacheInit(size_t max, time_t valid, size_t mem_file_size,
+        size_t mem_size)
+{
+    MaxFiles = max;
+    Valid = valid;
+    MemFileSize = mem_file_size;
+    MemSize = mem_size;
+    MemUsed = 0;
+    if (!max)
+        return 0;
+    Files = dictCreate(&FileCacheDictType);
+    Lru = createList();
+    if (!Files || !Lru)
+        return -1;
+    return 0;
+}
+
+static void fileFree(struct cachedFile *file)
+{
+    if (file->data) {
+        MemUsed -= file->size;
+        wfree(file->data);
+    }
+    close(file->fd);
+    wstrFree(file->path);
+    wstrFree(file->real_path);
+    wfree(file);
+}
+
+static void fileRemove(struct cachedFile *file)
+{
+    dictDelete(Files, file->path);
+    removeListNode(Lru, file->lru);
+    file->lru = NULL;
+    file->removed = 1;
+    if (!file->refcount)
+        fileFree(file);
+}
+
+void fileCacheDealloc()
+{
+    if (!Files)
+        return ;
+    while (listLength(Lru))
+        fileRemove(listNodeValue(listFirst(Lru)));
+    dictRelease(Files);
+    freeList(Lru);
+    Files = NULL;
+    Lru = NULL;
+}
+
+struct cachedFile *fileCacheGet(wstr path, time_t now)
+{
+    struct cachedFile *file;
+    struct stat st;
+
+    if (!Files)
+        return NULL;
+    file = dictFetchValue(Files, path);
+    if (!file)
+        return NULL;
+    if (now >= file->valid_until) {
+        if (stat(file->real_path, &st) == -1 || !S_ISREG(st.st_mode) ||
+                st.st_dev != file->dev || st.st_ino != file->ino ||
+                st.st_size != file->size || st.st_mtime != file->mtime) {
+            fileRemove(file);
+            return NULL;
+        }
+        file->valid_until = now + Valid;
+    }
+    if (listFirst(Lru) != file->lru) {
+        removeListNode(Lru, file->lru);
+        file->lru = insertToListHead(Lru, file);
+    }
+    file->refcount++;
+    return file;
+}
+
+// Free content of entries not used by any request from the least recently
+// used one until `size` bytes is available
+static int fileReserveMemory(size_t size)
+{
+    struct listNode *node = listLast(Lru);
+    struct cachedFile *file;
+
+    while (MemUsed + size > MemSize && node) {
+        file = listNodeValue(node);
+        node = node->prev;
+        if (file->data && !file->refcount) {
+            MemUsed -= file->size;
+            wfree(file->data);
+            file->data = NULL;
+        }
+    }
+    return MemUsed + size <= MemSize;
+}
+
+static void fileLoad(struct cachedFile *file)
+{
+    ssize_t nread;
+    off_t off = 0;
+
+    if (file->size > MemFileSize || !fileReserveMemory(file->size))
+        return ;
+    file->data = wmalloc(file->size);
+    if (!file->data)
+        return ;
+    while (off < file->size) {
+        nread = pread(file->fd, file->data + off, file->size - off, off);
+        if (nread <= 0) {
+            wfree(file->data);
+            file->data = NULL;
+            return ;
+        }
+        off += nread;
+    }
+    MemUsed += file->size;
+}
+
+struct cachedFile *fileCacheAdd(wstr path, const char *real_path, int fd,
+        struct stat *st, time_t now)
+{
+    struct cachedFile *file, *old;
+
+    file = wmalloc(sizeof(*file));
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+    memset(file, 0, sizeof(*file));
+    file->path = wstrDup(path);
+    file->real_path = wstrNew(real_path);
+    file->fd = fd;
+    file->size = st->st_size;
+    file->mtime = st->st_mtime;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->valid_until = now + Valid;
+    file->refcount = 1;
+    file->removed = 1;
+    if (!Files)
+        return file;
+
+    old = dictFetchValue(Files, path);
+    if (old)
+        fileRemove(old);
+    if (listLength(Lru) >= MaxFiles)
+        fileRemove(listNodeValue(listLast(Lru)));
+    if (dictAdd(Files, file->path, file) == DICT_WRONG)
+        return file;
+    file->lru = insertToListHead(Lru, file);
+    file->removed = 0;
+    if (file->size)
+        fileLoad(file);
+    return file;
+}
+
+void fileCacheRelease(struct cachedFile *file)
+{
+    if (!--file->refcount && file->removed)
+        fileFree(file);
+}
+
+size_t fileCacheCount()
+{
+    return Lru ? listLength(Lru) : 0;
+}
+
+size_t fileCacheMemory()
+{
+    return MemUsed;
+}
+
+#ifdef FILE_CACHE_TEST_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include "../../test_help.h"
+
+static struct cachedFile *openAndAdd(wstr path, time_t now)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    fstat(fd, &st);
+    return fileCacheAdd(path, path, fd, &st, now);
+}
+
+int main(int argc, const char *argv[])
+{
+    char template[] = "/tmp/wheat_file_cacheXXXXXX";
+    wstr a, b, c;
+    struct cachedFile *fa, *fb, *file;
+    int fd;
+
+    mkdtemp(template);
+    a = wstrCat(wstrNew(template), "/a");
+    b = wstrCat(wstrNew(template), "/b");
+    c = wstrCat(wstrNew(template), "/c");
+    close(open(a, O_CREAT|O_WRONLY, 0644));
+    close(open(b, O_CREAT|O_WRONLY, 0644));
+    close(open(c, O_CREAT|O_WRONLY, 0644));
+
+    fileCacheInit(0, 10, 0, 0);
+    fa = openAndAdd(a, 100);
+    fd = fa->fd;
+    fileCacheRelease(fa);
+    test_cond("fileCacheInit disabled", fileCacheCount() == 0 &&
+            fcntl(fd, F_GETFD) == -1 && !fileCacheGet(a, 100));
+
+    fileCacheInit(2, 10, 0, 0);
+    test_cond("fileCacheGet miss", fileCacheGet(a, 100) == NULL);
+    fa = openAndAdd(a, 100);
+    fileCacheRelease(fa);
+    file = fileCacheGet(a, 105);
+    test_cond("fileCacheGet hit", file == fa && file->refcount == 1);
+    fileCacheRelease(file);
+
+    // "a" is used recently, "b" is dropped when "c" comes
+    fb = openAndAdd(b, 105);
+    fileCacheRelease(fb);
+    fileCacheRelease(fileCacheGet(a, 106));
+    fileCacheRelease(openAndAdd(c, 106));
+    test_cond("fileCacheAdd evict least recently used",
+            fileCacheCount() == 2 && !fileCacheGet(b, 106));
+
+    // Dropped entry keeps fd until released
+    file = fileCacheGet(a, 106);
+    fd = file->fd;
+    fileCacheRelease(openAndAdd(b, 106));
+    fileCacheRelease(openAndAdd(c, 106));
+    test_cond("fileCacheAdd evict referenced",
+            !fileCacheGet(a, 106) && fcntl(fd, F_GETFD) != -1);
+    fileCacheRelease(file);
+    test_cond("fileCacheRelease close evicted", fcntl(fd, F_GETFD) == -1);
+
+    fd = open(b, O_WRONLY);
+    write(fd, "changed", 7);
+    close(fd);
+    file = fileCacheGet(b, 110);
+    test_cond("fileCacheGet changed file still valid", file != NULL);
+    fileCacheRelease(file);
+    test_cond("fileCacheGet changed file revalidated", !fileCacheGet(b, 116));
+    unlink(c);
+    test_cond("fileCacheGet removed file revalidated",
+            !fileCacheGet(c, 116) && fileCacheCount() == 0);
+
+    fileCacheRelease(openAndAdd(a, 120));
+    fileCacheDealloc();
+    test_cond("fileCacheDealloc", fileCacheCount() == 0);
+
+    // Only 10 bytes of content are kept and files larger than 8 aren't
+    fileCacheInit(3, 10, 8, 10);
+    fd = open(a, O_WRONLY);
+    write(fd, "aaaaaa", 6);
+    close(fd);
+    close(open(c, O_CREAT|O_WRONLY, 0644));
+    fd = open(c, O_WRONLY);
+    write(fd, "cccccc", 6);
+    close(fd);
+    fa = openAndAdd(a, 130);
+    fb = openAndAdd(b, 130);
+    test_cond("fileCacheAdd load content", fa->data &&
+            !memcmp(fa->data, "aaaaaa", 6) && fileCacheMemory() == 6);
+    test_cond("fileCacheAdd skip large content", fb->data == NULL);
+    file = openAndAdd(c, 130);
+    test_cond("fileCacheAdd keep referenced content", file->data == NULL &&
+            fa->data != NULL);
+    fileCacheRelease(file);
+    fileCacheRelease(fb);
+    fileCacheRelease(fa);
+    fileCacheRelease(fileCacheGet(c, 131));
+    fileCacheRelease(openAndAdd(c, 131));
+    test_cond("fileCacheAdd free least recently used content",
+            fa->data == NULL && fileCacheMemory() == 6);
+    fileCacheDealloc();
+    test_cond("fileCacheDealloc free content", fileCacheMemory() == 0);
+    unlink(c);
+
+    unlink(a);
+    unlink(b);
+    rmdir(template);
+    wstrFree(a);
+    wstrFree(b);
+    wstrFree(c);
+    test_report();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,66 @@
+// Open file cache of static file app
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_APP_STATIC_FILE_CACHE_H
+#define WHEATSERVER_APP_STATIC_FILE_CACHE_H
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "../../wstr.h"
+
+// Each worker keeps opened files keyed by request path, so hot files are
+// served without open and stat. Entry is trusted for `valid` seconds, then
+// file is stat again and entry is dropped if it changed. Least recently
+// used entries are dropped when cache is full.
+//
+// Content of files not larger than `mem_file_size` is also kept in `data`,
+// total size of them is limited by `mem_size` and content of least recently
+// used entries is freed first.
+//
+// Entry is referenced by each request using its fd, and fd is closed when
+// entry is dropped and the last request is released.
+//
+// `real_path`: file opened, it differs from key when directory index is used
+// `content_type`, `last_modified`, `etag` and `cache_control`: header values
+// filled by caller
+// `variants_missing`: bits of sidecar variants known not existing, used by
+// caller
+struct cachedFile {
+    wstr path;
+    wstr real_path;
+    int fd;
+    off_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t ino;
+    time_t valid_until;
+    const char *content_type;
+    char last_modified[40];
+    char etag[48];
+    const char *cache_control;
+    char *data;
+    unsigned variants_missing;
+
+    int refcount;
+    struct listNode *lru;
+    unsigned removed:1;
+};
+
+// `max` is 0 means nothing is kept and each entry is dropped when released
+int fileCacheInit(size_t max, time_t valid, size_t mem_file_size,
+        size_t mem_size);
+void fileCacheDealloc();
+// Return referenced entry, NULL if not cached or file changed
+struct cachedFile *fileCacheGet(wstr path, time_t now);
+// Entry takes `fd`, return referenced entry or NULL if no memory
+struct cachedFile *fileCacheAdd(wstr path, const char *real_path, int fd,
+        struct stat *st, time_t now);
+void fileCacheRelease(struct cachedFile *file);
+size_t fileCacheCount();
+size_t fileCacheMemory();
+
+#endif
@@ -8,20 +8,6 @@
 
 #include "redis.h"
 
-extern void md5_signature(const unsigned char *key, unsigned int length, unsigned char *result);
-
-static uint32_t ketamaHash(const char *key, size_t key_length, uint32_t alignment)
-{
-    unsigned char results[16];
-
-    md5_signature((unsigned char*)key, (int)key_length, results);
-
-    return ((uint32_t) (results[3 + alignment * 4] & 0xFF) << 24)
-        | ((uint32_t) (results[2 + alignment * 4] & 0xFF) << 16)
-        | ((uint32_t) (results[1 + alignment * 4] & 0xFF) << 8)
-        | (results[0 + alignment * 4] & 0xFF);
-}
-
 // hashAdd is used when a new redis server add to rebalance tokens
 int hashAdd(struct redisServer *server, wstr ip, int port, int id)
 {
@@ -133,7 +119,7 @@ int hashInit(struct redisServer *server)
 
 struct token *hashDispatch(struct redisServer *server, struct slice *key)
 {
-    uint32_t hash = ketamaHash((const char *)key->data, key->len, 0);
+    uint32_t hash = server->key_hash((const char *)key->data, key->len);
 
     return &server->tokens[hash%WHEAT_KEYSPACE];
 }
@@ -0,0 +1,445 @@
+// Key hash functions of WheatRedis
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <string.h>
+
+#include "keyhash.h"
+
+extern void md5_signature(const unsigned char *key, unsigned int length, unsigned char *result);
+
+static inline uint32_t readLE32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t readLE64(const uint8_t *p)
+{
+    return (uint64_t)readLE32(p) | ((uint64_t)readLE32(p + 4) << 32);
+}
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// ========================== Ketama(MD5) ==========================
+
+uint32_t keyHashKetama(const char *key, size_t len)
+{
+    unsigned char results[16];
+
+    md5_signature((const unsigned char *)key, (unsigned int)len, results);
+    return readLE32(results);
+}
+
+// ========================== MurmurHash3 ==========================
+
+uint32_t murmur3Hash32(const void *data, size_t len, uint32_t seed)
+{
+    const uint8_t *p = data, *tail;
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    uint32_t h = seed, k;
+    size_t i, nblocks = len / 4;
+
+    for (i = 0; i < nblocks; i++) {
+        k = readLE32(p + i*4);
+        k *= c1;
+        k = rotl32(k, 15);
+        k *= c2;
+        h ^= k;
+        h = rotl32(h, 13);
+        h = h*5 + 0xe6546b64;
+    }
+    tail = p + nblocks*4;
+    k = 0;
+    switch (len & 3) {
+        case 3: k ^= (uint32_t)tail[2] << 16;
+        case 2: k ^= (uint32_t)tail[1] << 8;
+        case 1: k ^= tail[0];
+                k *= c1;
+                k = rotl32(k, 15);
+                k *= c2;
+                h ^= k;
+    }
+    h ^= (uint32_t)len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t keyHashMurmur3(const char *key, size_t len)
+{
+    return murmur3Hash32(key, len, 0);
+}
+
+// ============================= XXH3 ==============================
+// XXH3_64bits with seed 0, scalar code path of xxHash 0.8
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH3_SECRET_SIZE  192
+#define XXH3_STRIPE_LEN   64
+#define XXH3_ACC_NB       8
+
+static const uint8_t Xxh3Secret[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint64_t mul128Fold64(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh64Avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t xxh3Avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t xxh3Rrmxmx(uint64_t h, uint64_t len)
+{
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static inline uint64_t xxh3Mix16B(const uint8_t *p, const uint8_t *secret)
+{
+    return mul128Fold64(readLE64(p) ^ readLE64(secret),
+            readLE64(p + 8) ^ readLE64(secret + 8));
+}
+
+static uint64_t xxh3Len0To16(const uint8_t *p, size_t len)
+{
+    const uint8_t *s = Xxh3Secret;
+    uint64_t lo, hi;
+
+    if (len > 8) {
+        lo = readLE64(p) ^ (readLE64(s + 24) ^ readLE64(s + 32));
+        hi = readLE64(p + len - 8) ^ (readLE64(s + 40) ^ readLE64(s + 48));
+        return xxh3Avalanche(len + __builtin_bswap64(lo) + hi +
+                mul128Fold64(lo, hi));
+    }
+    if (len >= 4) {
+        lo = readLE32(p + len - 4) + ((uint64_t)readLE32(p) << 32);
+        return xxh3Rrmxmx(lo ^ (readLE64(s + 8) ^ readLE64(s + 16)), len);
+    }
+    if (len) {
+        lo = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) |
+            p[len - 1] | ((uint32_t)len << 8);
+        return xxh64Avalanche(lo ^ (readLE32(s) ^ readLE32(s + 4)));
+    }
+    return xxh64Avalanche(readLE64(s + 56) ^ readLE64(s + 64));
+}
+
+static uint64_t xxh3Len17To240(const uint8_t *p, size_t len)
+{
+    const uint8_t *s = Xxh3Secret;
+    uint64_t acc = len * PRIME64_1, acc_end;
+    size_t i, nrounds;
+
+    if (len <= 128) {
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    acc += xxh3Mix16B(p + 48, s + 96);
+                    acc += xxh3Mix16B(p + len - 64, s + 112);
+                }
+                acc += xxh3Mix16B(p + 32, s + 64);
+                acc += xxh3Mix16B(p + len - 48, s + 80);
+            }
+            acc += xxh3Mix16B(p + 16, s + 32);
+            acc += xxh3Mix16B(p + len - 32, s + 48);
+        }
+        acc += xxh3Mix16B(p, s);
+        acc += xxh3Mix16B(p + len - 16, s + 16);
+        return xxh3Avalanche(acc);
+    }
+    nrounds = len / 16;
+    for (i = 0; i < 8; i++)
+        acc += xxh3Mix16B(p + 16*i, s + 16*i);
+    acc_end = xxh3Mix16B(p + len - 16, s + 136 - 17);
+    acc = xxh3Avalanche(acc);
+    for (i = 8; i < nrounds; i++)
+        acc_end += xxh3Mix16B(p + 16*i, s + 16*(i-8) + 3);
+    return xxh3Avalanche(acc + acc_end);
+}
+
+static inline void xxh3Accumulate512(uint64_t *acc, const uint8_t *p,
+        const uint8_t *secret)
+{
+    uint64_t value, key;
+    int i;
+
+    for (i = 0; i < XXH3_ACC_NB; i++) {
+        value = readLE64(p + 8*i);
+        key = value ^ readLE64(secret + 8*i);
+        acc[i ^ 1] += value;
+        acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static inline void xxh3Scramble(uint64_t *acc, const uint8_t *secret)
+{
+    int i;
+
+    for (i = 0; i < XXH3_ACC_NB; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= readLE64(secret + 8*i);
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static uint64_t xxh3Long(const uint8_t *p, size_t len)
+{
+    uint64_t acc[XXH3_ACC_NB] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};
+    const uint8_t *s = Xxh3Secret;
+    size_t stripes_per_block = (XXH3_SECRET_SIZE - XXH3_STRIPE_LEN) / 8;
+    size_t block_len = XXH3_STRIPE_LEN * stripes_per_block;
+    size_t nblocks = (len - 1) / block_len, nstripes, n, i;
+    uint64_t result;
+
+    for (n = 0; n < nblocks; n++) {
+        for (i = 0; i < stripes_per_block; i++)
+            xxh3Accumulate512(acc, p + n*block_len + i*XXH3_STRIPE_LEN, s + i*8);
+        xxh3Scramble(acc, s + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN);
+    }
+    nstripes = ((len - 1) - block_len*nblocks) / XXH3_STRIPE_LEN;
+    for (i = 0; i < nstripes; i++)
+        xxh3Accumulate512(acc, p + nblocks*block_len + i*XXH3_STRIPE_LEN, s + i*8);
+    xxh3Accumulate512(acc, p + len - XXH3_STRIPE_LEN,
+            s + XXH3_SECRET_SIZE - XXH3_STRIPE_LEN - 7);
+
+    result = len * PRIME64_1;
+    for (i = 0; i < 4; i++)
+        result += mul128Fold64(acc[2*i] ^ readLE64(s + 11 + 16*i),
+                acc[2*i+1] ^ readLE64(s + 11 + 16*i + 8));
+    return xxh3Avalanche(result);
+}
+
+uint64_t xxh3Hash64(const void *data, size_t len)
+{
+    if (len <= 16)
+        return xxh3Len0To16(data, len);
+    if (len <= 240)
+        return xxh3Len17To240(data, len);
+    return xxh3Long(data, len);
+}
+
+uint32_t keyHashXxh3(const char *key, size_t len)
+{
+    return (uint32_t)xxh3Hash64(key, len);
+}
+
+// ============================= CRC16 =============================
+
+static const uint16_t Crc16Table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+uint16_t crc16Hash(const char *data, size_t len)
+{
+    uint16_t crc = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        crc = (crc << 8) ^ Crc16Table[((crc >> 8) ^ (uint8_t)data[i]) & 0xff];
+    return crc;
+}
+
+// Only the part between the first "{" and next "}" is hashed if it isn't
+// empty, same as Redis Cluster
+uint32_t keyHashCrc16(const char *key, size_t len)
+{
+    const char *start, *end;
+
+    start = memchr(key, '{', len);
+    if (start) {
+        end = memchr(start + 1, '}', len - (start + 1 - key));
+        if (end && end != start + 1)
+            return crc16Hash(start + 1, end - start - 1) & 16383;
+    }
+    return crc16Hash(key, len) & 16383;
+}
+
+#ifdef KEYHASH_TEST_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../test_help.h"
+
+// Sanity buffer of xxHash tests
+static void fillSanityBuffer(uint8_t *buf, size_t len)
+{
+    uint64_t gen = 2654435761U;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(gen >> 56);
+        gen *= 11400714785074694797ULL;
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    uint8_t buf[2048];
+
+    fillSanityBuffer(buf, sizeof(buf));
+    test_cond("xxh3Hash64 empty", xxh3Hash64(buf, 0) == 0x2D06800538D394C2ULL);
+    test_cond("xxh3Hash64 1 byte", xxh3Hash64(buf, 1) == 0xC44BDFF4074EECDBULL);
+    test_cond("xxh3Hash64 6 bytes", xxh3Hash64(buf, 6) == 0x27B56A84CD2D7325ULL);
+    test_cond("xxh3Hash64 12 bytes", xxh3Hash64(buf, 12) == 0xA713DAF0DFBB77E7ULL);
+    test_cond("xxh3Hash64 24 bytes", xxh3Hash64(buf, 24) == 0xA3FE70BF9D3510EBULL);
+    test_cond("xxh3Hash64 48 bytes", xxh3Hash64(buf, 48) == 0x397DA259ECBA1F11ULL);
+    test_cond("xxh3Hash64 80 bytes", xxh3Hash64(buf, 80) == 0xBCDEFBBB2C47C90AULL);
+    test_cond("xxh3Hash64 195 bytes", xxh3Hash64(buf, 195) == 0xCD94217EE362EC3AULL);
+    test_cond("xxh3Hash64 403 bytes", xxh3Hash64(buf, 403) == 0xCDEB804D65C6DEA4ULL);
+    test_cond("xxh3Hash64 240 bytes", xxh3Hash64(buf, 240) == 0x81C3C2B67F568CCFULL);
+    test_cond("xxh3Hash64 1025 bytes", xxh3Hash64(buf, 1025) == 0xD870C0FA13211C6AULL);
+    test_cond("xxh3Hash64 2048 bytes", xxh3Hash64(buf, 2048) == 0xDD59E2C3A5F038E0ULL);
+
+    test_cond("murmur3Hash32 empty", murmur3Hash32("", 0, 0) == 0 &&
+            murmur3Hash32("", 0, 1) == 0x514E28B7);
+    test_cond("murmur3Hash32 zeros", murmur3Hash32("\0\0\0\0", 4, 0) == 0x2362F9DE);
+    test_cond("murmur3Hash32 tail", murmur3Hash32("abc", 3, 0) == 0xB3DD93FA);
+    test_cond("murmur3Hash32 seed",
+            murmur3Hash32("Hello, world!", 13, 0x9747b28c) == 0x24884CBA);
+
+    test_cond("crc16Hash", crc16Hash("123456789", 9) == 0x31C3);
+    test_cond("keyHashCrc16 tag", keyHashCrc16("{user1000}.following", 20) ==
+            keyHashCrc16("user1000", 8));
+    test_cond("keyHashCrc16 empty tag", keyHashCrc16("foo{}{bar}", 10) ==
+            (crc16Hash("foo{}{bar}", 10) & 16383));
+    test_cond("keyHashCrc16 unclosed tag", keyHashCrc16("foo{bar", 7) ==
+            (crc16Hash("foo{bar", 7) & 16383));
+    test_report();
+    return 0;
+}
+#endif
+
+#ifdef KEYHASH_BENCH_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_KEYS      4096
+#define BENCH_ROUNDS    512
+#define BENCH_KEYSPACE  1024
+
+// Dispatch throughput(hash % keyspace) of each hash over generated keys
+static void bench(const char *name, keyHashFunc hash, char keys[][64],
+        size_t *lens)
+{
+    struct timespec start, end;
+    unsigned tokens = 0;
+    size_t i, r;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r = 0; r < BENCH_ROUNDS; r++)
+        for (i = 0; i < BENCH_KEYS; i++)
+            tokens += hash(keys[i], lens[i]) % BENCH_KEYSPACE;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-8s %8.1f ns/key %8.2f Mkeys/s (%u)\n", name,
+            elapsed * 1e9 / (BENCH_KEYS * BENCH_ROUNDS),
+            BENCH_KEYS * BENCH_ROUNDS / elapsed / 1e6, tokens);
+}
+
+int main(int argc, const char *argv[])
+{
+    static char keys[BENCH_KEYS][64];
+    static size_t lens[BENCH_KEYS];
+    const char *formats[] = {"user:%d", "session:%08d:cart", "cache:page:/articles/%d/comments?page=2"};
+    size_t f, i;
+
+    for (f = 0; f < sizeof(formats)/sizeof(formats[0]); f++) {
+        for (i = 0; i < BENCH_KEYS; i++)
+            lens[i] = snprintf(keys[i], sizeof(keys[i]), formats[f], rand());
+        printf("keys like \"%s\"(%zu bytes)\n", keys[0], lens[0]);
+        bench("ketama", keyHashKetama, keys, lens);
+        bench("murmur3", keyHashMurmur3, keys, lens);
+        bench("xxh3", keyHashXxh3, keys, lens);
+        bench("crc16", keyHashCrc16, keys, lens);
+    }
+    return 0;
+}
+#endif
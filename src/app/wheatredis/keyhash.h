@@ -0,0 +1,33 @@
+// Key hash functions of WheatRedis
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_APP_REDIS_KEYHASH_H
+#define WHEATSERVER_APP_REDIS_KEYHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request key is dispatched to token `hash % WHEAT_KEYSPACE`, hash is
+// chosen by `redis-key-hash`. Ketama(MD5) is the original one and keeps
+// keys where tokens assigned before put them. Others are much cheaper for
+// short keys but move keys, so all proxies sharing tokens must agree.
+//
+// Crc16 is the Redis Cluster key slot(hash tag "{...}" respected), and
+// WHEAT_KEYSPACE divides 16384 slots, so keys of a slot go to one token.
+typedef uint32_t (*keyHashFunc)(const char *key, size_t len);
+
+uint32_t keyHashKetama(const char *key, size_t len);
+uint32_t keyHashMurmur3(const char *key, size_t len);
+uint32_t keyHashXxh3(const char *key, size_t len);
+uint32_t keyHashCrc16(const char *key, size_t len);
+
+// Underlying hashes as published(MurmurHash3_x86_32, XXH3_64bits with
+// default secret and CRC16-CCITT(XMODEM))
+uint32_t murmur3Hash32(const void *data, size_t len, uint32_t seed);
+uint64_t xxh3Hash64(const void *data, size_t len);
+uint16_t crc16Hash(const char *data, size_t len);
+
+#endif
@@ -28,6 +28,15 @@ static struct enumIdName RedisSources[] = {
     {0, "UseFile"}, {1, "UseRedis"}, {2, "RedisThenFile"},
 };
 
+// Index is the same as RedisKeyHashes id
+static keyHashFunc KeyHashFuncs[] = {
+    keyHashKetama, keyHashMurmur3, keyHashXxh3, keyHashCrc16,
+};
+
+static struct enumIdName RedisKeyHashes[] = {
+    {0, "Ketama"}, {1, "Murmur3"}, {2, "Xxh3"}, {3, "Crc16"}, {-1, NULL},
+};
+
 static struct configuration RedisConf[] = {
     {"redis-servers",     WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
         NULL,                   LIST_FORMAT},
@@ -39,6 +48,8 @@ static struct configuration RedisConf[] = {
         NULL,                   STRING_FORMAT},
     {"config-source",     2, enumValidator,        {.enum_ptr=&RedisSources[2]},
         &RedisSources[0],       ENUM_FORMAT},
+    {"redis-key-hash",    2, enumValidator,        {.enum_ptr=&RedisKeyHashes[0]},
+        &RedisKeyHashes[0],     ENUM_FORMAT},
 };
 
 static struct statItem RedisStats[] = {
@@ -567,6 +578,8 @@ int redisAppInit(struct protocol *ptocol)
     server->tokens = wmalloc(sizeof(struct token)*WHEAT_KEYSPACE);
     server->ntoken = WHEAT_KEYSPACE;
     server->is_serve = 0;
+    conf = getConfiguration("redis-key-hash");
+    server->key_hash = KeyHashFuncs[conf->target.enum_ptr->id];
 
     config_source = getConfiguration("config-source");
     use_redis_only = config_source->target.enum_ptr->id == WHEAT_REDIS_USEREDIS;
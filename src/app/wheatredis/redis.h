@@ -9,6 +9,7 @@
 
 #include "../application.h"
 #include "../../protocol/redis/proto_redis.h"
+#include "keyhash.h"
 
 #define WHEAT_KEYSPACE                1024
 #define WHEAT_SERVE_WAIT_MILLISECONDS 100
@@ -48,6 +49,8 @@ struct redisServer {
     // Now must be WHEAT_KEYSPACE
     size_t ntoken;
     int is_serve;
+    // Selected by `redis-key-hash`
+    keyHashFunc key_hash;
 };
 
 struct redisInstance {
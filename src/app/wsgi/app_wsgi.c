@@ -5,10 +5,13 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include "../application.h"
+#include "../../protocol/websocket/proto_websocket.h"
 #include "app_wsgi.h"
+#include "../../worker/thread_pool.h"
 
 int wsgiCall(struct conn *, void *);
 int initWsgi(struct protocol *);
+int initWsgiMaster();
 void deallocWsgi();
 void *initWsgiAppData(struct conn *);
 void freeWsgiAppData(void *app_data);
@@ -21,6 +24,33 @@ static struct configuration WsgiConf[] = {
         NULL,                   STRING_FORMAT},
     {"app-name",          2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"app-websocket-name", 2, stringValidator,     {.ptr=NULL},
+        NULL,                   STRING_FORMAT},
+    {"preload-app",       2, boolValidator,        {.val=0},
+        NULL,                   BOOL_FORMAT},
+    {"app-send-buffer-size", 2, unsignedIntValidator, {.val=WHEAT_WSGI_SEND_BUFFER},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"app-threads",       2, unsignedIntValidator, {.val=0},
+        (void *)64,             INT_FORMAT},
+    {"app-profile-sample", 2, unsignedIntValidator, {.val=0},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"app-profile-interval", 2, unsignedIntValidator, {.val=WHEAT_PROFILE_INTERVAL},
+        (void *)1000000,        INT_FORMAT},
+    {"app-profile-slots", 2, unsignedIntValidator, {.val=0},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+};
+
+static struct statItem WsgiStats[] = {
+    {"Total wsgi object created", SUM_STAT, RAW, 0, 0},
+    {"Total wsgi object reused", SUM_STAT, RAW, 0, 0},
+    {"Total wsgi profiled request", SUM_STAT, RAW, 0, 0},
+};
+
+static struct command WsgiCommands[] = {
+    {"profile",   1, profileCommand,
+        "profile\nOutput sampled python stacks of wsgi app in folded format"},
+    {"profile",   2, profileCommand,
+        "profile [start|stop|reset]\nProfile all requests until stop, or clear samples"},
 };
 
 static struct app AppWsgi = {
@@ -29,35 +59,248 @@ static struct app AppWsgi = {
 };
 
 struct moduleAttr AppWsgiAttr = {
-    "wsgi", APP, {.app=&AppWsgi}, NULL, 0, WsgiConf,
-    sizeof(WsgiConf)/sizeof(struct configuration),
-    NULL, 0
+    "wsgi", APP, {.app=&AppWsgi},
+    WsgiStats, sizeof(WsgiStats)/sizeof(struct statItem),
+    WsgiConf, sizeof(WsgiConf)/sizeof(struct configuration),
+    WsgiCommands, sizeof(WsgiCommands)/sizeof(struct command),
+    initWsgiMaster
 };
 
 static PyObject *pApp = NULL;
+static PyObject *pWebSocketApp = NULL;
 static PyObject *WsgiStderr = NULL;
 static PyObject *DefaultEnv = NULL;
+// App is imported by master and inherited by workers
+static int Preloaded = 0;
+// Body items are queued until this many bytes and sent together
+static size_t SendBufferSize = 0;
+// Apps are called by threads of `AppPool` with GIL, event loop only takes
+// GIL to release objects
+static struct threadPool *AppPool = NULL;
+static PyThreadState *MainThreadState = NULL;
+static long long *WsgiProfiled = NULL;
+
+struct wsgiJob {
+    struct conn *conn;
+    void *arg;
+    int failed;
+};
+
+long long *WsgiObjectCreated = NULL;
+long long *WsgiObjectReused = NULL;
+
+// Environ keys are interned once per worker
+enum envKeyIndex {
+    ENV_URL_SCHEME,
+    ENV_REQUEST_METHOD,
+    ENV_SERVER_PROTOCOL,
+    ENV_QUERY_STRING,
+    ENV_INPUT,
+    ENV_REMOTE_ADDR,
+    ENV_REMOTE_PORT,
+    ENV_SERVER_PORT,
+    ENV_SERVER_NAME,
+    ENV_PATH_INFO,
+    ENV_KEY_MAX
+};
+
+static const char *EnvKeyNames[ENV_KEY_MAX] = {
+    "wsgi.url_scheme", "REQUEST_METHOD", "SERVER_PROTOCOL", "QUERY_STRING",
+    "wsgi.input", "REMOTE_ADDR", "REMOTE_PORT", "SERVER_PORT", "SERVER_NAME",
+    "PATH_INFO"
+};
+static PyObject *EnvKeys[ENV_KEY_MAX];
+
+// Request header names whose environ key needs extra work
+enum headerKind {
+    HEADER_PLAIN,
+    HEADER_FORWARDED_FOR,
+    HEADER_HOST,
+};
+
+struct headerKey {
+    PyObject *key;
+    enum headerKind kind;
+};
+
+// Header name(case insensitive) -> struct headerKey, so "HTTP_*" key of
+// each header name is converted and interned once
+static struct dict *HeaderKeys = NULL;
+// Value string -> PyObject, for values of few kinds like method and
+// protocol shared by requests
+static struct dict *EnvValues = NULL;
+
+// Deallocated Request objects are kept and reused by next requests
+static struct response *ResponsePool[WHEAT_WSGI_POOL_SIZE];
+static int ResponsePoolCount = 0;
+
+// Apps mounted by `http-route` with "module[:callable]" argument are
+// imported at the first request. Route argument lives as long as worker,
+// so it's looked up by pointer.
+struct wsgiMount {
+    const char *spec;
+    PyObject *app;
+};
+static struct array *Mounts = NULL;
 
 static int wsgiSendResponse(struct conn *c, PyObject *result);
 
-int wsgiCall(struct conn *c, void *arg)
+static PyObject *loadMountedApp(const char *spec)
+{
+    PyObject *module, *app;
+    const char *sep, *name;
+    wstr module_name;
+
+    sep = strchr(spec, ':');
+    if (sep) {
+        module_name = wstrNewLen(spec, (int)(sep - spec));
+        name = sep + 1;
+    } else {
+        module_name = wstrNew(spec);
+        name = getConfiguration("app-name")->target.ptr;
+    }
+    module = PyImport_ImportModule(module_name);
+    wstrFree(module_name);
+    if (module == NULL)
+        return NULL;
+    app = name ? PyObject_GetAttrString(module, name) : NULL;
+    Py_DECREF(module);
+    if (app && !PyCallable_Check(app)) {
+        Py_DECREF(app);
+        app = NULL;
+    }
+    if (!app && !PyErr_Occurred())
+        PyErr_Format(PyExc_TypeError, "%s isn't callable", spec);
+    return app;
+}
+
+static PyObject *spotMountedApp(const char *spec)
+{
+    struct wsgiMount mount, *m;
+    size_t i;
+
+    for (i = 0; i < narray(Mounts); i++) {
+        m = arrayIndex(Mounts, i);
+        if (m->spec == spec)
+            return m->app;
+    }
+    mount.spec = spec;
+    mount.app = loadMountedApp(spec);
+    if (!mount.app) {
+        wheatLog(WHEAT_WARNING, "load wsgi app %s failed", spec);
+        return NULL;
+    }
+    arrayPush(Mounts, &mount);
+    return mount.app;
+}
+
+// Send each string of `result` as a message, unicode is sent as text
+// message in UTF-8 and str as binary message
+static int wsgiSendMessages(struct conn *c, PyObject *result)
+{
+    PyObject *iter, *item, *encoded;
+    int ret = 0;
+
+    iter = PyObject_GetIter(result);
+    if (iter == NULL)
+        return -1;
+    while (!ret && (item = PyIter_Next(iter))) {
+        if (PyUnicode_Check(item)) {
+            encoded = PyUnicode_AsUTF8String(item);
+            if (!encoded)
+                ret = -1;
+            else if (wsSendMessage(c, WS_OPCODE_TEXT, PyString_AS_STRING(encoded),
+                        PyString_GET_SIZE(encoded)) == WHEAT_WRONG)
+                ret = -1;
+            Py_XDECREF(encoded);
+        } else if (PyString_Check(item)) {
+            if (wsSendMessage(c, WS_OPCODE_BINARY, PyString_AS_STRING(item),
+                        PyString_GET_SIZE(item)) == WHEAT_WRONG)
+                ret = -1;
+        } else {
+            PyErr_SetString(PyExc_TypeError, "websocket message must be str or unicode");
+            ret = -1;
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : ret;
+}
+
+// WebSocket message is handed to `app-websocket-name` callable as
+// handler(path, message), text message is unicode and binary message is
+// str. Returned iterable is sent back as messages, None sends nothing.
+static int wsgiWebSocketCall(struct conn *c)
 {
-    /* Create Request object, passing it the context as a CObject */
-    int is_ok = 1;
-    PyObject *start_resp, *result, *args, *env;
+    const struct slice *msg = wsGetMessage(c);
+    wstr path = wsGetPath(c);
+    PyObject *message, *result;
+
+    if (!pWebSocketApp) {
+        wsClose(c, WS_CLOSE_UNEXPECTED, "no app-websocket-name");
+        return WHEAT_OK;
+    }
+    if (wsGetOpcode(c) == WS_OPCODE_TEXT) {
+        message = PyUnicode_DecodeUTF8((const char *)msg->data, msg->len, NULL);
+        if (!message) {
+            PyErr_Clear();
+            wsClose(c, WS_CLOSE_INVALID_DATA, NULL);
+            return WHEAT_OK;
+        }
+    } else {
+        message = PyString_FromStringAndSize((const char *)msg->data, msg->len);
+        if (!message)
+            goto out;
+    }
+
+    result = PyObject_CallFunction(pWebSocketApp, "s#O", path,
+            (int)wstrlen(path), message);
+    Py_DECREF(message);
+    if (result != NULL) {
+        if (result != Py_None)
+            wsgiSendMessages(c, result);
+        Py_DECREF(result);
+    }
+
+out:
+    if (PyErr_Occurred()) {
+        PyErr_Print();
+        wsClose(c, WS_CLOSE_UNEXPECTED, NULL);
+    }
+    return WHEAT_OK;
+}
+
+static struct response *newResponse(struct conn *c)
+{
+    struct response *self;
+
+    if (ResponsePoolCount) {
+        self = ResponsePool[--ResponsePoolCount];
+        Py_TYPE(self) = &responseType;
+        _Py_NewReference((PyObject *)self);
+        (*WsgiObjectReused)++;
+    } else {
+        self = PyObject_New(struct response, &responseType);
+        if (self == NULL)
+            return NULL;
+        (*WsgiObjectCreated)++;
+    }
+    self->c = c;
+    return self;
+}
+
+// Call app with environ of `c` and hand result to `respond`.
+// Return 0 if ok, -1 if error occurred and printed
+static int wsgiRun(struct conn *c, void *arg,
+        int (*respond)(struct conn *, PyObject *))
+{
+    int failed = 0, profiled;
+    PyObject *start_resp, *result, *args, *env, *app = pApp;
     struct response *req_obj = NULL;
-    PyObject *res = PyCObject_FromVoidPtr(c, NULL);
-    if (res == NULL)
-        goto out;
 
-    args = Py_BuildValue("(O)", res);
-    Py_DECREF(res);
-    if (args == NULL)
+    if (arg && (app = spotMountedApp(arg)) == NULL)
         goto out;
-
-    /* env now owned by req_obj */
-    req_obj = (struct response *)PyObject_CallObject((PyObject *)&responseType, args);
-    Py_DECREF(args);
+    req_obj = newResponse(c);
     if (req_obj == NULL)
         goto out;
 
@@ -77,22 +320,22 @@ int wsgiCall(struct conn *c, void *arg)
     if (args == NULL)
         goto out;
 
-    result = PyObject_CallObject(pApp, args);
+    profiled = wsgiProfileBegin();
+    result = PyObject_CallObject(app, args);
     Py_DECREF(args);
     if (result != NULL) {
         /* Handle the application response */
-        wsgiSendResponse(c, result); /* ignore return */
+        respond(c, result); /* ignore return */
         wsgiCallClose(result);
     }
+    wsgiProfileEnd(profiled);
+    if (profiled)
+        (*WsgiProfiled)++;
 
 out:
     if (PyErr_Occurred()) {
         PyErr_Print();
-
-        /* Display HTTP 500 error, if possible */
-        if (req_obj == NULL || !ishttpHeaderSended(c))
-            sendResponse500(c);
-        is_ok = 0;
+        failed = -1;
     }
 
     if (req_obj != NULL) {
@@ -100,6 +343,147 @@ out:
         Py_DECREF(req_obj);
     }
 
+    return failed;
+}
+
+// Keep strings of `result` in body_items, they're sent by event loop
+static int wsgiCollectResponse(struct conn *c, PyObject *result)
+{
+    struct wsgiData *wsgi_data = c->app_private_data;
+    PyObject *iter, *item;
+
+    iter = PyObject_GetIter(result);
+    if (iter == NULL)
+        return -1;
+    while ((item = PyIter_Next(iter))) {
+        if (!PyString_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, "response body must be str");
+            Py_DECREF(item);
+            break;
+        }
+        arrayPush(wsgi_data->body_items, &item);
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+// Send headers and body items collected by app thread, strings are only
+// read without GIL while body_items refers to them
+static int wsgiSendCollected(struct conn *c)
+{
+    struct wsgiData *wsgi_data = c->app_private_data;
+    PyObject *item;
+    size_t i;
+    int ret;
+
+    corkConn(c, SendBufferSize);
+    ret = httpSendHeaders(c);
+    for (i = 0; !ret && i < narray(wsgi_data->body_items); i++) {
+        item = *(PyObject **)arrayIndex(wsgi_data->body_items, i);
+        ret = httpSendBody(c, PyString_AS_STRING(item), PyString_GET_SIZE(item));
+    }
+    if (uncorkConn(c) == WHEAT_WRONG)
+        ret = -1;
+    return ret;
+}
+
+static void runWsgiJob(void *data)
+{
+    struct wsgiJob *job = data;
+    PyGILState_STATE gil;
+
+    gil = PyGILState_Ensure();
+    job->failed = wsgiRun(job->conn, job->arg, wsgiCollectResponse);
+    PyGILState_Release(gil);
+    // Client is still held, so unread streamed body is received here
+    httpDiscardBody(job->conn);
+}
+
+static void finishWsgiJob(void *data)
+{
+    struct wsgiJob *job = data;
+    struct conn *c = job->conn;
+    struct client *client = c->client;
+
+    // Nothing is sent if client is closed while app runs
+    if (isClientValid(client)) {
+        if (job->failed)
+            sendResponse500(c);
+        else if (wsgiSendCollected(c))
+            setClientClose(c);
+        httpCompleteResponse(c);
+    }
+    unholdClient(client);
+    wfree(job);
+}
+
+static void wsgiJobsDone(struct evcenter *center, int fd, void *data, int mask)
+{
+    threadPoolComplete(data);
+}
+
+// Interim response is sent by event loop before app is called, client's send
+// queue isn't touched by app threads
+static void sendContinue(struct conn *c)
+{
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+    struct slice s;
+
+    iter = dictGetIterator(httpGetReqHeaders(c));
+    while ((entry = dictNext(iter)) != NULL) {
+        if (!strcasecmp(dictGetKey(entry), "Expect") &&
+                !strcasecmp(dictGetVal(entry), "100-continue")) {
+            sliceTo(&s, (uint8_t *)HTTP_CONTINUE, sizeof(HTTP_CONTINUE)-1);
+            sendClientData(c, &s);
+            break;
+        }
+    }
+    dictReleaseIterator(iter);
+}
+
+// Client is held until app returns in thread, so request isn't changed and
+// pipelined requests wait for it
+static int wsgiCallInThread(struct conn *c, void *arg)
+{
+    struct wsgiJob *job = wmalloc(sizeof(*job));
+
+    if (!job) {
+        sendResponse500(c);
+        return WHEAT_OK;
+    }
+    job->conn = c;
+    job->arg = arg;
+    job->failed = 0;
+    if (threadPoolSubmit(AppPool, runWsgiJob, finishWsgiJob, job)) {
+        wfree(job);
+        sendResponse500(c);
+        return WHEAT_OK;
+    }
+    holdClient(c->client);
+    httpDeferResponse(c);
+    return WHEAT_OK;
+}
+
+int wsgiCall(struct conn *c, void *arg)
+{
+    PyGILState_STATE gil;
+    int ret;
+
+    if (isWebSocket(c)) {
+        if (!AppPool)
+            return wsgiWebSocketCall(c);
+        gil = PyGILState_Ensure();
+        ret = wsgiWebSocketCall(c);
+        PyGILState_Release(gil);
+        return ret;
+    }
+    sendContinue(c);
+    if (AppPool)
+        return wsgiCallInThread(c, arg);
+    /* Display HTTP 500 error, if possible */
+    if (wsgiRun(c, arg, wsgiSendResponse) && !ishttpHeaderSended(c))
+        sendResponse500(c);
     return WHEAT_OK;
 }
 
@@ -121,11 +505,16 @@ void freeWsgiAppData(void *data)
     struct wsgiData *d = data;
     int i = 0;
     PyObject *tmp;
+    PyGILState_STATE gil = PyGILState_UNLOCKED;
 
+    if (AppPool)
+        gil = PyGILState_Ensure();
     for (; i < narray(d->body_items); ++i) {
-        tmp = arrayIndex(d->body_items, i);
+        tmp = *(PyObject **)arrayIndex(d->body_items, i);
         Py_XDECREF(tmp);
     }
+    if (AppPool)
+        PyGILState_Release(gil);
     arrayDealloc(d->body_items);
     wfree(d);
 }
@@ -145,10 +534,20 @@ static PyObject *defaultEnviron()
     Py_DECREF(val);
     if (PyDict_SetItemString(env, "wsgi.multiprocess", Server.worker_number > 1 ? Py_True: Py_False) != 0)
         goto cleanup;
+    // Set by startAppThreads() if apps run in threads
     if (PyDict_SetItemString(env, "wsgi.multithread", Py_False) != 0)
         goto cleanup;
     if (PyDict_SetItemString(env, "wsgi.run_once", Py_False) != 0)
         goto cleanup;
+    if (PyDict_SetItemString(env, "wsgi.file_wrapper",
+                (PyObject *)&FileWrapper_Type) != 0)
+        goto cleanup;
+    // Replaced by "Script-Name" header
+    if ((val = PyString_FromString("")) == NULL)
+        goto cleanup;
+    if (PyDict_SetItemString(env, "SCRIPT_NAME", val) != 0)
+        goto cleanup;
+    Py_DECREF(val);
 
     return env;
 cleanup:
@@ -156,12 +555,90 @@ cleanup:
     return NULL;
 }
 
-int initWsgi(struct protocol *p)
+static unsigned int headerKeyHash(const void *key)
+{
+    return dictGenCaseHashFunction(key, wstrlen((wstr)key));
+}
+
+static int headerKeyCompare(const void *key1, const void *key2)
+{
+    return wstrlen((wstr)key1) == wstrlen((wstr)key2) &&
+        !strcasecmp(key1, key2);
+}
+
+static void keyDestructor(void *key)
+{
+    wstrFree(key);
+}
+
+static void headerKeyDestructor(void *val)
+{
+    struct headerKey *key = val;
+    Py_DECREF(key->key);
+    wfree(key);
+}
+
+static struct dictType HeaderKeyDictType = {
+    headerKeyHash, NULL, NULL, headerKeyCompare, keyDestructor,
+    headerKeyDestructor
+};
+
+// Looked up by C string, but keys are wstr
+static unsigned int envValueHash(const void *key)
+{
+    return dictGenHashFunction(key, (int)strlen(key));
+}
+
+static int envValueCompare(const void *key1, const void *key2)
+{
+    return !strcmp(key1, key2);
+}
+
+static void envValueDestructor(void *val)
+{
+    Py_DECREF((PyObject *)val);
+}
+
+static struct dictType EnvValueDictType = {
+    envValueHash, NULL, NULL, envValueCompare, keyDestructor,
+    envValueDestructor
+};
+
+static int initEnvCache()
+{
+    int i;
+
+    for (i = 0; i < ENV_KEY_MAX; i++) {
+        EnvKeys[i] = PyString_InternFromString(EnvKeyNames[i]);
+        if (!EnvKeys[i])
+            return WHEAT_WRONG;
+    }
+    HeaderKeys = dictCreate(&HeaderKeyDictType);
+    EnvValues = dictCreate(&EnvValueDictType);
+    if (!HeaderKeys || !EnvValues)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+static void deallocEnvCache()
+{
+    int i;
+
+    for (i = 0; i < ENV_KEY_MAX; i++)
+        Py_XDECREF(EnvKeys[i]);
+    if (HeaderKeys)
+        dictRelease(HeaderKeys);
+    if (EnvValues)
+        dictRelease(EnvValues);
+    HeaderKeys = EnvValues = NULL;
+}
+
+static int loadWsgi(int install_sigs)
 {
     char *app_t;
     char buf[WHEATSERVER_PATH_LEN];
     struct configuration *conf;
-    Py_Initialize();
+    Py_InitializeEx(install_sigs);
 
     conf = getConfiguration("app-project-path");
     snprintf(buf, WHEATSERVER_PATH_LEN, "import sys, os\n"
@@ -189,12 +666,25 @@ int initWsgi(struct protocol *p)
     if (!app_t)
         goto err;
     pApp = PyObject_GetAttrString(pModule, app_t);
-    Py_DECREF(pModule);
     if (pApp == NULL || !PyCallable_Check(pApp)) {
+        Py_DECREF(pModule);
         Py_XDECREF(pApp);
         goto err;
     }
 
+    conf = getConfiguration("app-websocket-name");
+    app_t = conf->target.ptr;
+    if (app_t) {
+        pWebSocketApp = PyObject_GetAttrString(pModule, app_t);
+        if (pWebSocketApp == NULL || !PyCallable_Check(pWebSocketApp)) {
+            Py_DECREF(pModule);
+            Py_XDECREF(pWebSocketApp);
+            pWebSocketApp = NULL;
+            goto err;
+        }
+    }
+    Py_DECREF(pModule);
+
     pName = PyString_FromString("sys");
     if (pName == NULL)
         goto err;
@@ -209,6 +699,13 @@ int initWsgi(struct protocol *p)
     DefaultEnv = defaultEnviron();
     if (!DefaultEnv)
         goto err;
+    if (initEnvCache() == WHEAT_WRONG)
+        goto err;
+    WsgiObjectCreated = &getStatValByName("Total wsgi object created");
+    WsgiObjectReused = &getStatValByName("Total wsgi object reused");
+    WsgiProfiled = &getStatValByName("Total wsgi profiled request");
+    Mounts = arrayCreate(sizeof(struct wsgiMount), 4);
+    SendBufferSize = getConfiguration("app-send-buffer-size")->target.val;
 
     return WHEAT_OK;
 err:
@@ -217,26 +714,123 @@ err:
     return WHEAT_WRONG;
 }
 
+// Worker keeps serving other clients while apps run in `app-threads`
+// threads, main thread releases GIL after this
+static int startAppThreads()
+{
+    int nthreads = getConfiguration("app-threads")->target.val;
+
+    if (!nthreads)
+        return WHEAT_OK;
+    if (strcmp(Server.worker_type, "AsyncWorker")) {
+        wheatLog(WHEAT_WARNING, "app-threads needs AsyncWorker, call app inline");
+        return WHEAT_OK;
+    }
+    if (PyDict_SetItemString(DefaultEnv, "wsgi.multithread", Py_True) != 0)
+        return WHEAT_WRONG;
+    AppPool = threadPoolCreate(nthreads);
+    if (!AppPool)
+        return WHEAT_WRONG;
+    if (createEvent(WorkerProcess->center, threadPoolFd(AppPool),
+                EVENT_READABLE, wsgiJobsDone, AppPool) == WHEAT_WRONG) {
+        threadPoolDestroy(AppPool);
+        AppPool = NULL;
+        return WHEAT_WRONG;
+    }
+    PyEval_InitThreads();
+    MainThreadState = PyEval_SaveThread();
+    return WHEAT_OK;
+}
+
+int initWsgi(struct protocol *p)
+{
+    if (Preloaded)
+        PyOS_AfterFork();
+    else if (loadWsgi(1) == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    if (startAppThreads() == WHEAT_WRONG) {
+        wheatLog(WHEAT_WARNING, "start app threads failed");
+        return WHEAT_WRONG;
+    }
+    return wsgiProfileInit(getConfiguration("app-profile-interval")->target.val,
+            getConfiguration("app-profile-sample")->target.val);
+}
+
+// Objects alive now are moved out of collected generations(gc.freeze()), so
+// collections in workers don't write to their headers and pages stay shared.
+// Python without gc.freeze() only collects garbage before fork.
+static int freezeGc()
+{
+    PyObject *gc, *ret;
+
+    gc = PyImport_ImportModule("gc");
+    if (gc == NULL)
+        return WHEAT_WRONG;
+    ret = PyObject_CallMethod(gc, "collect", NULL);
+    Py_XDECREF(ret);
+    if (ret && PyObject_HasAttrString(gc, "freeze")) {
+        ret = PyObject_CallMethod(gc, "freeze", NULL);
+        Py_XDECREF(ret);
+    }
+    Py_DECREF(gc);
+    return ret ? WHEAT_OK : WHEAT_WRONG;
+}
+
+// With `preload-app`, app is imported once by master before workers are
+// forked. Master doesn't run Python code later, so Python's signal handlers
+// aren't installed to keep master's.
+int initWsgiMaster()
+{
+    size_t slots = getConfiguration("app-profile-slots")->target.val;
+
+    if (strcasecmp(getConfiguration("protocol")->target.ptr, "Http"))
+        return WHEAT_OK;
+    // Stacks sampled by workers are counted in table shared with master
+    if (slots && wsgiProfileCreate(slots) == -1) {
+        wheatLog(WHEAT_WARNING, "create wsgi profiler failed: %s", strerror(errno));
+        return WHEAT_WRONG;
+    }
+    if (!getConfiguration("preload-app")->target.val)
+        return WHEAT_OK;
+    if (loadWsgi(0) == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    if (freezeGc() == WHEAT_WRONG) {
+        PyErr_Print();
+        return WHEAT_WRONG;
+    }
+    Preloaded = 1;
+    wheatLog(WHEAT_NOTICE, "wsgi app %s preloaded",
+            getConfiguration("app-module-name")->target.ptr);
+    return WHEAT_OK;
+}
+
 void deallocWsgi()
 {
+    size_t i;
+
+    if (AppPool) {
+        deleteEvent(WorkerProcess->center, threadPoolFd(AppPool), EVENT_READABLE);
+        threadPoolDestroy(AppPool);
+        AppPool = NULL;
+        PyEval_RestoreThread(MainThreadState);
+    }
+    wsgiProfileDealloc();
+
+    for (i = 0; i < narray(Mounts); i++)
+        Py_DECREF(((struct wsgiMount *)arrayIndex(Mounts, i))->app);
+    arrayDealloc(Mounts);
+    Mounts = NULL;
     Py_DECREF(pApp);
+    Py_XDECREF(pWebSocketApp);
+    pWebSocketApp = NULL;
     Py_DECREF(WsgiStderr);
     Py_DECREF(DefaultEnv);
+    deallocEnvCache();
+    while (ResponsePoolCount)
+        PyObject_Del(ResponsePool[--ResponsePoolCount]);
+    clearInputStreamPool();
     Py_Finalize();
-}
-
-int envPutString(PyObject *dict, const void *key, const void *value)
-{
-    PyObject *val;
-    int ret;
-
-    if ((val = PyString_FromString(value)) == NULL)
-        return -1;
-    ret = PyDict_SetItemString(dict, key, val);
-    Py_DECREF(val);
-    if (ret)
-        return -1;
-    return 0;
+    Preloaded = 0;
 }
 
 /* Assumes c is a valid hex digit */
@@ -278,132 +872,212 @@ const char *wsgiUnquote(const char *s)
     return result;
 }
 
+// Convert header name to environ key like "HTTP_USER_AGENT"
+static PyObject *buildHeaderKey(wstr header, enum headerKind *kind)
+{
+    PyObject *key;
+    char *buf;
+    int j, len = wstrlen(header);
+
+    key = PyString_FromStringAndSize(NULL, len + 5);
+    if (!key)
+        return NULL;
+    buf = PyString_AS_STRING(key);
+    memcpy(buf, "HTTP_", 5);
+    for (j = 0; j < len; j++) {
+        if (header[j] == '-')
+            buf[5 + j] = '_';
+        else
+            buf[5 + j] = toupper(header[j]);
+    }
+
+    *kind = HEADER_PLAIN;
+    if (!strcmp(buf, "HTTP_CONTENT_TYPE") ||
+            !strcmp(buf, "HTTP_CONTENT_LENGTH") ||
+            !strcmp(buf, "HTTP_SCRIPT_NAME")) {
+        // Strip HTTP_
+        Py_DECREF(key);
+        key = PyString_FromString(&buf[5]);
+        if (!key)
+            return NULL;
+    } else if (!strcmp(buf, "HTTP_X_FORWARDED_FOR")) {
+        *kind = HEADER_FORWARDED_FOR;
+    } else if (!strcmp(buf, "HTTP_HOST")) {
+        *kind = HEADER_HOST;
+    }
+    PyString_InternInPlace(&key);
+    return key;
+}
+
+// Return new reference of environ key of `header`, it's cached unless too
+// many distinct header names are seen
+static PyObject *spotHeaderKey(wstr header, enum headerKind *kind)
+{
+    struct headerKey *cached;
+    PyObject *key;
+
+    cached = dictFetchValue(HeaderKeys, header);
+    if (cached) {
+        (*WsgiObjectReused)++;
+        *kind = cached->kind;
+        Py_INCREF(cached->key);
+        return cached->key;
+    }
+    key = buildHeaderKey(header, kind);
+    if (!key)
+        return NULL;
+    (*WsgiObjectCreated)++;
+    if (dictSize(HeaderKeys) >= WHEAT_WSGI_ENV_CACHE)
+        return key;
+    cached = wmalloc(sizeof(*cached));
+    if (!cached)
+        return key;
+    cached->key = key;
+    cached->kind = *kind;
+    Py_INCREF(key);
+    if (dictAdd(HeaderKeys, wstrDup(header), cached) == DICT_WRONG)
+        ASSERT(0);
+    return key;
+}
+
+static int envPut(PyObject *environ, PyObject *key, const char *value)
+{
+    PyObject *val;
+    int ret;
+
+    if ((val = PyString_FromString(value)) == NULL)
+        return -1;
+    (*WsgiObjectCreated)++;
+    ret = PyDict_SetItem(environ, key, val);
+    Py_DECREF(val);
+    return ret ? -1 : 0;
+}
+
+// Put value of few kinds(e.g. method, protocol, server name), the string
+// object is kept and shared by requests
+static int envPutShared(PyObject *environ, PyObject *key, const char *value)
+{
+    PyObject *val;
+
+    val = dictFetchValue(EnvValues, value);
+    if (val) {
+        (*WsgiObjectReused)++;
+        return PyDict_SetItem(environ, key, val) ? -1 : 0;
+    }
+    if (dictSize(EnvValues) >= WHEAT_WSGI_ENV_CACHE)
+        return envPut(environ, key, value);
+    if ((val = PyString_FromString(value)) == NULL)
+        return -1;
+    (*WsgiObjectCreated)++;
+    if (dictAdd(EnvValues, wstrNew(value), val) == DICT_WRONG)
+        ASSERT(0);
+    return PyDict_SetItem(environ, key, val) ? -1 : 0;
+}
+
+// Environ is copied from template holding values constant for worker, then
+// keys interned once and shared values are put
 PyObject *createEnviron(struct conn *c)
 {
     const char *req_uri = NULL;
     PyObject *environ;
-    char buf[256];
+    char buf[32];
     int result = 1;
     wstr host = NULL, port = NULL, server = NULL;
-    PyObject *args, *input;
-    PyObject *c_obj = PyCObject_FromVoidPtr(c, NULL);
+    PyObject *input, *key;
+    enum headerKind kind;
+    struct dictIterator *iter = NULL;
+    struct dictEntry *entry;
+    const char *query;
 
     environ = PyDict_Copy(DefaultEnv);
     if (environ == NULL) {
         return NULL;
     }
 
-    if (envPutString(environ, "wsgi.url_scheme", httpGetUrlScheme(c)))
+    if (envPutShared(environ, EnvKeys[ENV_URL_SCHEME], httpGetUrlScheme(c)))
         goto cleanup;
 
-    if (envPutString(environ, "REQUEST_METHOD", httpGetMethod(c)))
+    if (envPutShared(environ, EnvKeys[ENV_REQUEST_METHOD], httpGetMethod(c)))
         goto cleanup;
 
-    if (envPutString(environ, "SERVER_PROTOCOL", httpGetProtocolVersion(c)))
+    if (envPutShared(environ, EnvKeys[ENV_SERVER_PROTOCOL],
+                httpGetProtocolVersion(c)))
         goto cleanup;
 
-    if (envPutString(environ, "QUERY_STRING", httpGetQueryString(c)))
+    query = httpGetQueryString(c);
+    if (*query ? envPut(environ, EnvKeys[ENV_QUERY_STRING], query) :
+            envPutShared(environ, EnvKeys[ENV_QUERY_STRING], query))
         goto cleanup;
 
     // Add http body stream as wsgi.input
-    if ((args = Py_BuildValue("(O)", c_obj)) == NULL)
-        goto cleanup;
-    input = PyObject_CallObject((PyObject *)&InputStream_Type, args);
-    Py_DECREF(args);
-    Py_DECREF(c_obj);
+    input = newInputStream(c);
     if (input == NULL)
         goto cleanup;
-    if (PyDict_SetItemString(environ, "wsgi.input", input) != 0)
+    result = PyDict_SetItem(environ, EnvKeys[ENV_INPUT], input);
+    Py_DECREF(input);
+    if (result != 0)
         goto cleanup;
+    result = 1;
 
     /* HTTP headers */
-    struct dictIterator *iter = dictGetIterator(httpGetReqHeaders(c));
-    struct dictEntry *entry;
+    iter = dictGetIterator(httpGetReqHeaders(c));
     while ((entry = dictNext(iter)) != NULL) {
-        int k, j;
         wstr header = dictGetKey(entry);
         wstr value = dictGetVal(entry);
 
-        /* Copy/convert header name */
-        strcpy(buf, "HTTP_");
-
-        k = wstrlen(header);
-        /* The length of header field should less than 250 */
-        if (k > (sizeof(buf) - 6))
-            k = sizeof(buf) - 6;
-
-        for (j = 0; j < k; j++) {
-            if (header[j] == '-')
-                buf[5 + j] = '_';
-            else
-                buf[5 + j] = toupper(header[j]);
+        key = spotHeaderKey(header, &kind);
+        if (key == NULL)
+            goto cleanup;
+        if (envPut(environ, key, value)) {
+            Py_DECREF(key);
+            goto cleanup;
         }
-        buf[5 + j] = '\0';
-
-        if (!strcmp(buf, "HTTP_CONTENT_TYPE") ||
-                !strcmp(buf, "HTTP_CONTENT_LENGTH")) {
-            /* Strip HTTP_ */
-            if (envPutString(environ, &buf[5], value))
-                goto cleanup;
-        } else if (!strcmp(buf, "HTTP_X_FORWARDED_FOR")) {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
+        Py_DECREF(key);
+
+        if (kind == HEADER_FORWARDED_FOR) {
             parserForward(value, &host, &port);
-        } else if (!strcmp(buf, "HTTP_EXPECT")) {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
-            wstrLower(value);
-            if (!strcmp(value, "100-continue")) {
-                // No need to free `h`
-                struct slice s;
-                sliceTo(&s, (uint8_t *)HTTP_CONTINUE, sizeof(HTTP_CONTINUE));
-                sendClientData(c, &s);
-            }
-        } else if (!strcmp(buf, "HTTP_HOST")) {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
+        } else if (kind == HEADER_HOST) {
             server = wstrDup(value);
-        } else if (!strcmp(buf, "HTTP_SCRIPT_NAME")) {
-            if (envPutString(environ, "SCRIPT_NAME", value))
-                goto cleanup;
-        } else {
-            if (envPutString(environ, buf, value))
-                goto cleanup;
         }
     }
-    dictReleaseIterator(iter);
     if (!host) {
         host = wstrNew(getConnIP(c));
-        snprintf(buf, 255, "%d", getConnPort(c));
+        snprintf(buf, sizeof(buf), "%d", getConnPort(c));
         port = wstrNew(buf);
     }
-    if (envPutString(environ, "REMOTE_ADDR", host))
+    if (envPut(environ, EnvKeys[ENV_REMOTE_ADDR], host))
         goto cleanup;
-    if (envPutString(environ, "REMOTE_PORT", port))
+    if (envPut(environ, EnvKeys[ENV_REMOTE_PORT], port))
         goto cleanup;
+    // Host is optional in HTTP/1.0 and Http2(:authority)
+    if (!server)
+        server = wstrNew(Server.bind_addr ? Server.bind_addr : "localhost");
     char *sep = strchr(server, ':');
     if (sep) {
-        if (envPutString(environ, "SERVER_PORT", sep+1))
+        if (envPutShared(environ, EnvKeys[ENV_SERVER_PORT], sep+1))
             goto cleanup;
-        server = wstrRange(server, (int)(sep-server+1), 0);
-    } else if (!strcmp(httpGetUrlScheme(c), "HTTP")) {
-        if (envPutString(environ, "SERVER_PORT", "80"))
+        *sep = '\0';
+        wstrupdatelen(server, (int)(sep-server));
+    } else if (!strcasecmp(httpGetUrlScheme(c), "HTTP")) {
+        if (envPutShared(environ, EnvKeys[ENV_SERVER_PORT], "80"))
             goto cleanup;
-    } else if (!strcmp(httpGetUrlScheme(c), "HTTPS")) {
-        if (envPutString(environ, "SERVER_PORT", "443"))
+    } else if (!strcasecmp(httpGetUrlScheme(c), "HTTPS")) {
+        if (envPutShared(environ, EnvKeys[ENV_SERVER_PORT], "443"))
             goto cleanup;
     }
-    if (envPutString(environ, "SERVER_NAME", server))
+    if (envPutShared(environ, EnvKeys[ENV_SERVER_NAME], server))
         goto cleanup;
 
     if ((req_uri = wsgiUnquote(httpGetPath(c))) == NULL) {
         goto cleanup;
     }
-    if (envPutString(environ, "PATH_INFO", req_uri))
+    if (envPut(environ, EnvKeys[ENV_PATH_INFO], req_uri))
         goto cleanup;
     result = 0;
 
 cleanup:
+    if (iter)
+        dictReleaseIterator(iter);
     if (req_uri)
         wfree((void *)req_uri);
     wstrFree(host);
@@ -445,6 +1119,10 @@ void wsgiCallClose(PyObject *result)
 
 static void responseDealloc(struct response *self)
 {
+    if (ResponsePoolCount < WHEAT_WSGI_POOL_SIZE) {
+        ResponsePool[ResponsePoolCount++] = self;
+        return ;
+    }
     self->ob_type->tp_free((PyObject *)self);
 }
 
@@ -545,14 +1223,25 @@ static PyObject *responseWrite(struct response *self, PyObject *args)
     const char *data;
     int datalen;
 
-    if (httpGetResStatus(c) != 0) {
+    if (httpGetResStatus(c) == 0) {
         wsgi_data->err = "write() before start_response()";
+        PyErr_SetString(PyExc_RuntimeError, wsgi_data->err);
         return NULL;
     }
 
     if (!PyArg_ParseTuple(args, "s#:write", &data, &datalen))
         return NULL;
 
+    // Event loop sends it with returned iterable
+    if (AppPool) {
+        PyObject *item = PyString_FromStringAndSize(data, datalen);
+        if (item == NULL)
+            return NULL;
+        arrayPush(wsgi_data->body_items, &item);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
     /* Send headers if necessary */
     if (!ishttpHeaderSended(c)) {
         if (httpSendHeaders(c))
@@ -650,45 +1339,81 @@ init_wsgisup(void)
     PyModule_AddObject(m, "InputStream", (PyObject *)&InputStream_Type);
 }
 
-/* Send a file as the HTTP response body. */
-int wsgiSendFile(struct conn *c, int fd)
+static void closeFd(void *fd)
 {
-    int ret = 0;
+    close((int)(intptr_t)fd);
+}
 
-    ret = sendClientFile(c, fd, 0);
+// Call method `name` of `obj` without arguments, return NULL with error
+// cleared if it's missing or failed
+static PyObject *callMethod(PyObject *obj, const char *name)
+{
+    PyObject *ret;
 
+    if (!PyObject_HasAttrString(obj, name))
+        return NULL;
+    ret = PyObject_CallMethod(obj, (char *)name, NULL);
+    if (ret == NULL)
+        PyErr_Clear();
     return ret;
 }
 
-/* Send a wrapped file using wsgiSendFile */
-static int wsgiSendFileWrapper(struct conn *c, FileWrapper *wrapper)
+// Send memory of `obj` supporting buffer protocol from `pos`, `obj` is
+// referenced until response is sent
+static int wsgiSendBuffer(struct conn *c, PyObject *obj, Py_ssize_t pos)
 {
-    PyObject *pFileno, *args, *pFD;
-    int fd;
-
-    /* file-like must have fileno */
-    if (!PyObject_HasAttrString((PyObject *)wrapper->filelike, "fileno"))
-        return 1;
+    struct wsgiData *wsgi_data = c->app_private_data;
+    const void *data;
+    Py_ssize_t len;
 
-    if ((pFileno = PyObject_GetAttrString((PyObject *)wrapper->filelike,
-                    "fileno")) == NULL)
+    if (PyObject_AsReadBuffer(obj, &data, &len))
         return -1;
+    if (pos < 0 || pos > len)
+        pos = len;
+    Py_INCREF(obj);
+    arrayPush(wsgi_data->body_items, &obj);
+    return httpSendBody(c, (const char *)data + pos, len - pos) ? -1 : 0;
+}
 
-    if ((args = PyTuple_New(0)) == NULL) {
-        Py_DECREF(pFileno);
-        return -1;
-    }
+// Send regular file from current position of file-like by sendfile(2), fd
+// is duplicated since app may close file-like before it's sent
+static int wsgiSendRegularFile(struct conn *c, PyObject *filelike, int fd,
+        struct stat *st)
+{
+    PyObject *pos;
+    off_t off = -1;
 
-    pFD = PyObject_CallObject(pFileno, args);
-    Py_DECREF(args);
-    Py_DECREF(pFileno);
-    if (pFD == NULL)
-        return -1;
+    pos = callMethod(filelike, "tell");
+    if (pos != NULL) {
+        off = PyLong_AsLongLong(pos);
+        Py_DECREF(pos);
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+            off = -1;
+        }
+    }
+    if (off < 0)
+        off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0)
+        off = 0;
+    if (off >= st->st_size)
+        return 0;
+    if ((fd = dup(fd)) == -1)
+        return 1;
+    registerConnFree(c, closeFd, (void *)(intptr_t)fd);
+    return httpSendFileRange(c, fd, off, st->st_size - off) == WHEAT_OK ? 0 : -1;
+}
 
-    fd = (int)PyInt_AsLong(pFD);
-    Py_DECREF(pFD);
-    if (PyErr_Occurred())
-        return -1;
+/* Send a wrapped file-like without copying its content to Python strings:
+   buffer objects are sent from their memory, regular files by sendfile(2),
+   pipes by splice(2) and objects with getvalue()(e.g. BytesIO) from the
+   returned value. Return 1 if it should be iterated instead */
+static int wsgiSendFileWrapper(struct conn *c, FileWrapper *wrapper)
+{
+    PyObject *filelike = wrapper->filelike, *ret, *tell;
+    Py_ssize_t pos = 0;
+    struct stat st;
+    int fd, sent;
 
     /* Send headers if necessary */
     if (!ishttpHeaderSended(c)) {
@@ -696,14 +1421,43 @@ static int wsgiSendFileWrapper(struct conn *c, FileWrapper *wrapper)
             return -1;
     }
 
-    if (wsgiSendFile(c, fd))
-        return -1;
+    if (PyObject_CheckReadBuffer(filelike))
+        return wsgiSendBuffer(c, filelike, 0);
 
-    return 0;
+    if ((ret = callMethod(filelike, "fileno")) != NULL) {
+        fd = (int)PyInt_AsLong(ret);
+        Py_DECREF(ret);
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+        } else if (fd >= 0 && !fstat(fd, &st)) {
+            if (S_ISREG(st.st_mode))
+                return wsgiSendRegularFile(c, filelike, fd, &st);
+            if (S_ISFIFO(st.st_mode))
+                return httpSendPipe(c, fd);
+        }
+    }
+
+    if ((ret = callMethod(filelike, "getvalue")) != NULL) {
+        if (!PyObject_CheckReadBuffer(ret)) {
+            Py_DECREF(ret);
+            return 1;
+        }
+        if ((tell = callMethod(filelike, "tell")) != NULL) {
+            pos = PyInt_AsSsize_t(tell);
+            Py_DECREF(tell);
+            if (PyErr_Occurred()) {
+                PyErr_Clear();
+                pos = 0;
+            }
+        }
+        sent = wsgiSendBuffer(c, ret, pos);
+        Py_DECREF(ret);
+        return sent;
+    }
+    return 1;
 }
 
-/* Send the application's response */
-int wsgiSendResponse(struct conn *c, PyObject *result)
+static int wsgiWriteResponse(struct conn *c, PyObject *result)
 {
     PyObject *iter, *item;
     int ret = 0;
@@ -753,9 +1507,8 @@ int wsgiSendResponse(struct conn *c, PyObject *result)
                 break;
             }
         }
-        Py_INCREF(item);
-        arrayPush(wsgi_data->body_items, item);
-        Py_DECREF(item);
+        // Sent data refers to item until response is sent
+        arrayPush(wsgi_data->body_items, &item);
     }
     Py_DECREF(iter);
 
@@ -764,3 +1517,17 @@ int wsgiSendResponse(struct conn *c, PyObject *result)
 
     return ret;
 }
+
+/* Send the application's response. Headers and body items are referenced
+   by send queue instead of copied and written together by writev(2) when
+   `SendBufferSize` bytes are queued or the iterable ends. */
+static int wsgiSendResponse(struct conn *c, PyObject *result)
+{
+    int ret;
+
+    corkConn(c, SendBufferSize);
+    ret = wsgiWriteResponse(c, result);
+    if (uncorkConn(c) == WHEAT_WRONG)
+        ret = -1;
+    return ret;
+}
@@ -45,12 +45,39 @@ PyTypeObject responseType;
 PyTypeObject FileWrapper_Type;
 PyTypeObject InputStream_Type;
 
+// Max deallocated Request and InputStream objects kept for reuse
+#define WHEAT_WSGI_POOL_SIZE     16
+// Max header names and values whose environ objects are kept
+#define WHEAT_WSGI_ENV_CACHE     256
+// Default bytes of response queued before written(app-send-buffer-size)
+#define WHEAT_WSGI_SEND_BUFFER   65536
+// Profiler default of app-profile-interval, folded stack longer than
+// WHEAT_PROFILE_STACK_LEN is cut
+#define WHEAT_PROFILE_INTERVAL   1000
+#define WHEAT_PROFILE_STACK_LEN  2048
+
+// Python objects created and reused for requests, stats of wsgi app
+extern long long *WsgiObjectCreated;
+extern long long *WsgiObjectReused;
+
 #ifndef PyMODINIT_FUNC
 #define PyMODINIT_FUNC void
 #endif
 PyMODINIT_FUNC
 init_wsgisup(void);
 PyObject *createEnviron(struct conn *c);
+// Return wsgi.input of `c`, reused object is preferred
+PyObject *newInputStream(struct conn *c);
+void clearInputStreamPool();
 void wsgiCallClose(PyObject *result);
 
+// Sampling profiler, table is created by master(see wsgiprofile.c)
+struct masterClient;
+int wsgiProfileCreate(size_t nslot);
+int wsgiProfileInit(long interval, unsigned sample);
+void wsgiProfileDealloc();
+int wsgiProfileBegin();
+void wsgiProfileEnd(int profiled);
+void profileCommand(struct masterClient *c);
+
 #endif
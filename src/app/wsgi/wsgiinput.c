@@ -6,6 +6,25 @@
 #include "../../slice.h"
 #include "app_wsgi.h"
 
+// Deallocated streams are kept and reused by next requests
+static InputStream *Pool[WHEAT_WSGI_POOL_SIZE];
+static int PoolCount = 0;
+// Body isn't fetched until app reads it, streamed body may not be received
+// yet when app is called
+static const struct slice NotRead = {NULL, 0};
+
+// Streamed body is received from client by httpGetBodyNext, other threads
+// can run meanwhile
+static const struct slice *nextBody(struct conn *c)
+{
+    const struct slice *s;
+
+    Py_BEGIN_ALLOW_THREADS
+    s = httpGetBodyNext(c);
+    Py_END_ALLOW_THREADS
+    return s;
+}
+
 /* Find occurrence of a character within our buffers */
 static int InputStream_findChar(InputStream *self, struct slice *s, int c)
 {
@@ -31,8 +50,10 @@ static PyObject *InputStream_consume(InputStream *self, int size)
     data = PyString_AS_STRING(result);
     do {
         if (self->pos >= self->curr->len) {
-            self->curr = httpGetBodyNext(self->c);
+            self->curr = nextBody(self->c);
             self->pos = 0;
+            if (!self->curr)
+                break;
         }
         size_t remaining = self->curr->len - self->pos;
         size_t copyed = size > remaining ? remaining : size;
@@ -41,15 +62,49 @@ static PyObject *InputStream_consume(InputStream *self, int size)
         total += copyed;
         self->pos += copyed;
     } while(size > 0);
+    if (size > 0)
+        _PyString_Resize(&result, total);
     self->readed += total;
     return result;
 }
 
 static void InputStream_dealloc(InputStream *self)
 {
+    if (PoolCount < WHEAT_WSGI_POOL_SIZE) {
+        Pool[PoolCount++] = self;
+        return ;
+    }
     self->ob_type->tp_free((PyObject *)self);
 }
 
+PyObject *newInputStream(struct conn *c)
+{
+    InputStream *self;
+
+    if (PoolCount) {
+        self = Pool[--PoolCount];
+        Py_TYPE(self) = &InputStream_Type;
+        _Py_NewReference((PyObject *)self);
+        (*WsgiObjectReused)++;
+    } else {
+        self = PyObject_New(InputStream, &InputStream_Type);
+        if (self == NULL)
+            return NULL;
+        (*WsgiObjectCreated)++;
+    }
+    self->c = c;
+    self->pos = 0;
+    self->readed = 0;
+    self->curr = &NotRead;
+    return (PyObject *)self;
+}
+
+void clearInputStreamPool()
+{
+    while (PoolCount)
+        PyObject_Del(Pool[--PoolCount]);
+}
+
 static PyObject *InputStream_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     InputStream *self;
@@ -74,7 +129,7 @@ static int InputStream_init(InputStream *self, PyObject *args, PyObject *kwds)
         return -1;
 
     self->c = PyCObject_AsVoidPtr(c);
-    self->curr = httpGetBodyNext(self->c);
+    self->curr = &NotRead;
     return 0;
 }
 
@@ -87,11 +142,13 @@ static PyObject *InputStream_read(InputStream *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "|i:read", &size))
         return NULL;
 
-    if (size <= 0 || !self->curr)
+    if (size == 0 || !self->curr)
         return PyString_FromString("");
 
+    // Chunked request has no CONTENT_LENGTH, so app usually reads all of
+    // body by read() without size
     remaining = httpBodyGetSize(self->c) - self->readed;
-    size = remaining > size ? size : remaining;
+    size = (size < 0 || remaining < size) ? remaining : size;
 
     return InputStream_consume(self, size);
 }
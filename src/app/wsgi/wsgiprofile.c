@@ -0,0 +1,282 @@
+// Sampling profiler of wsgi apps
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <Python.h>
+#include <frameobject.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
+
+#include "../application.h"
+#include "app_wsgi.h"
+
+// Python stack of profiled request is sampled by SIGPROF every
+// `app-profile-interval` microseconds of cpu time. Handler walks frame
+// chain of the interrupted thread and counts the stack in a table shared by
+// workers and master, so "profile" command of master outputs stacks of all
+// workers in folded format("frame;frame;... count"), which flame graph
+// tools read directly.
+//
+// Table is found by open addressing like rate limiter, slot is claimed by
+// compare-and-swap of its hash, then stack is written. Stack not finding a
+// slot in a few probes is counted as dropped.
+
+#define PROFILE_PROBES 16
+#define PROFILE_DEPTH  64
+
+struct profileSlot {
+    volatile uint64_t hash;     // 0 means unused
+    volatile uint64_t count;
+    volatile int ready;         // `stack` is written
+    char stack[WHEAT_PROFILE_STACK_LEN];
+};
+
+// Placed at the start of shared mapping, followed by slots
+struct profileSegment {
+    size_t size;
+    size_t nslot;
+    volatile int on_demand;     // set by "profile start"
+    volatile uint64_t samples;
+    volatile uint64_t dropped;
+    struct profileSlot slots[];
+};
+
+static struct profileSegment *Profile = NULL;
+static unsigned SampleEvery = 0;
+static unsigned long Requests = 0;
+static long Interval = 0;
+static int Running = 0;
+// Thread state of profiled request run by this thread, only its stack is
+// sampled and only when it holds GIL, so frames aren't changed meanwhile
+static __thread PyThreadState *Profiled = NULL;
+
+int wsgiProfileCreate(size_t nslot)
+{
+    size_t size;
+    void *p;
+
+    if (Profile)
+        return 0;
+    size = sizeof(struct profileSegment) + nslot*sizeof(struct profileSlot);
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    Profile = p;
+    Profile->size = size;
+    Profile->nslot = nslot;
+    return 0;
+}
+
+static uint64_t stackHash(const char *stack, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)stack[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static void recordStack(const char *stack, size_t len)
+{
+    struct profileSlot *slot;
+    uint64_t hash = stackHash(stack, len);
+    size_t i;
+
+    __sync_fetch_and_add(&Profile->samples, 1);
+    for (i = 0; i < PROFILE_PROBES; i++) {
+        slot = &Profile->slots[(hash + i) % Profile->nslot];
+        if (!slot->hash && __sync_bool_compare_and_swap(&slot->hash, 0, hash)) {
+            memcpy(slot->stack, stack, len);
+            slot->stack[len] = '\0';
+            __sync_synchronize();
+            slot->ready = 1;
+        }
+        if (slot->hash == hash) {
+            __sync_fetch_and_add(&slot->count, 1);
+            return ;
+        }
+    }
+    __sync_fetch_and_add(&Profile->dropped, 1);
+}
+
+// snprintf isn't async-signal-safe
+static size_t appendStr(char *buf, size_t pos, size_t size, const char *s)
+{
+    while (*s && pos < size)
+        buf[pos++] = *s++;
+    return pos;
+}
+
+static size_t appendInt(char *buf, size_t pos, size_t size, int n)
+{
+    char digits[16];
+    int i = sizeof(digits) - 1;
+
+    digits[i] = '\0';
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0 && i > 0);
+    return appendStr(buf, pos, size, digits + i);
+}
+
+// Frame is formatted as "function (file:line)" where line is the one
+// running, outermost frame first
+static void sampleStack(int sig)
+{
+    PyThreadState *tstate = Profiled;
+    PyFrameObject *frames[PROFILE_DEPTH], *f;
+    PyCodeObject *code;
+    char stack[WHEAT_PROFILE_STACK_LEN];
+    const char *file, *p;
+    size_t len = 0, size = sizeof(stack) - 1;
+    int n = 0, saved_errno = errno;
+
+    if (!tstate || tstate != _PyThreadState_Current || !Profile)
+        return ;
+    for (f = tstate->frame; f && n < PROFILE_DEPTH; f = f->f_back)
+        frames[n++] = f;
+    while (n-- > 0) {
+        code = frames[n]->f_code;
+        file = PyString_AS_STRING(code->co_filename);
+        if ((p = strrchr(file, '/')) != NULL)
+            file = p + 1;
+        if (len)
+            len = appendStr(stack, len, size, ";");
+        len = appendStr(stack, len, size, PyString_AS_STRING(code->co_name));
+        len = appendStr(stack, len, size, " (");
+        len = appendStr(stack, len, size, file);
+        len = appendStr(stack, len, size, ":");
+        len = appendInt(stack, len, size, PyFrame_GetLineNumber(frames[n]));
+        len = appendStr(stack, len, size, ")");
+    }
+    if (len)
+        recordStack(stack, len);
+    errno = saved_errno;
+}
+
+static void setProfileTimer(long usec)
+{
+    struct itimerval timer;
+
+    timer.it_interval.tv_sec = usec / 1000000;
+    timer.it_interval.tv_usec = usec % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int wsgiProfileInit(long interval, unsigned sample)
+{
+    struct sigaction act;
+
+    if (!Profile || interval <= 0)
+        return WHEAT_OK;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sampleStack;
+    act.sa_flags = SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    if (sigaction(SIGPROF, &act, NULL) == -1) {
+        wheatLog(WHEAT_WARNING, "sigaction SIGPROF failed: %s", strerror(errno));
+        return WHEAT_WRONG;
+    }
+    Interval = interval;
+    SampleEvery = sample;
+    return WHEAT_OK;
+}
+
+void wsgiProfileDealloc()
+{
+    if (!Interval)
+        return ;
+    setProfileTimer(0);
+    signal(SIGPROF, SIG_DFL);
+    Interval = 0;
+    Running = 0;
+    Requests = 0;
+}
+
+// Called with GIL, return 1 if this request is profiled. Timer runs while
+// any profiled request runs.
+int wsgiProfileBegin()
+{
+    if (!Interval)
+        return 0;
+    Requests++;
+    if (!Profile->on_demand && (!SampleEvery || Requests % SampleEvery))
+        return 0;
+    Profiled = PyThreadState_GET();
+    if (!Running++)
+        setProfileTimer(Interval);
+    return 1;
+}
+
+void wsgiProfileEnd(int profiled)
+{
+    if (!profiled)
+        return ;
+    Profiled = NULL;
+    if (!--Running)
+        setProfileTimer(0);
+}
+
+void profileCommand(struct masterClient *c)
+{
+    static const char disabled[] = "wsgi profiler is disabled\n";
+    char buf[64];
+    struct profileSlot *slot;
+    const char *reply;
+    size_t i;
+    int len, found = 0;
+
+    if (!Profile) {
+        replyMasterClient(c, disabled, sizeof(disabled)-1);
+        return ;
+    }
+    if (c->argc == 1) {
+        for (i = 0; i < Profile->nslot; i++) {
+            slot = &Profile->slots[i];
+            if (!slot->ready || !slot->count)
+                continue;
+            replyMasterClient(c, slot->stack, strlen(slot->stack));
+            len = snprintf(buf, sizeof(buf), " %llu\n",
+                    (unsigned long long)slot->count);
+            replyMasterClient(c, buf, len);
+            found = 1;
+        }
+        if (!found) {
+            static const char empty[] = "no samples\n";
+            replyMasterClient(c, empty, sizeof(empty)-1);
+        }
+        return ;
+    }
+    if (!strcasecmp(c->argv[1], "start")) {
+        Profile->on_demand = 1;
+        reply = "profile started\n";
+    } else if (!strcasecmp(c->argv[1], "stop")) {
+        Profile->on_demand = 0;
+        len = snprintf(buf, sizeof(buf), "profile stopped, %llu samples %llu dropped\n",
+                (unsigned long long)Profile->samples,
+                (unsigned long long)Profile->dropped);
+        replyMasterClient(c, buf, len);
+        return ;
+    } else if (!strcasecmp(c->argv[1], "reset")) {
+        // Samples taken meanwhile may be lost
+        for (i = 0; i < Profile->nslot; i++) {
+            slot = &Profile->slots[i];
+            slot->ready = 0;
+            slot->count = 0;
+            slot->hash = 0;
+        }
+        Profile->samples = Profile->dropped = 0;
+        reply = "profile reset\n";
+    } else {
+        reply = "profile [start|stop|reset]\n";
+    }
+    replyMasterClient(c, reply, strlen(reply));
+}
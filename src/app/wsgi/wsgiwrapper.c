@@ -55,8 +55,8 @@ FileWrapper_iter(FileWrapper *self)
 
 /* next() implementation for iteration protocol support. Calls read()
    on the file-like and emits strings according to the blocksize.
-   This is only used for compatibility (the normal path uses
-   wsgiSendFile()). */
+   This is only used for file-likes wsgiSendFileWrapper() can't send
+   directly. */
 static PyObject *
 FileWrapper_iternext(FileWrapper *self)
 {
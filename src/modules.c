@@ -2,7 +2,10 @@
 extern struct moduleAttr AppWsgiAttr;
 extern struct moduleAttr AppStaticAttr;
 extern struct moduleAttr AppRedisAttr;
+extern struct moduleAttr AppProxyAttr;
 extern struct moduleAttr ProtocolHttpAttr;
+extern struct moduleAttr ProtocolHttp2Attr;
+extern struct moduleAttr ProtocolWebSocketAttr;
 extern struct moduleAttr ProtocolRedisAttr;
 extern struct moduleAttr SyncWorkerAttr;
 extern struct moduleAttr AsyncWorkerAttr;
@@ -10,7 +13,10 @@ struct moduleAttr *ModuleTable[] = {
 &AppWsgiAttr,
 &AppStaticAttr,
 &AppRedisAttr,
+&AppProxyAttr,
 &ProtocolHttpAttr,
+&ProtocolHttp2Attr,
+&ProtocolWebSocketAttr,
 &ProtocolRedisAttr,
 &SyncWorkerAttr,
 &AsyncWorkerAttr,
@@ -7,6 +7,8 @@
 #ifndef WHEATSERVER_NETWORKING_H
 #define WHEATSERVER_NETWORKING_H
 
+#include <sys/uio.h>
+
 #include "wheatserver.h"
 
 #define WHEAT_IOBUF_LEN 1024 * 4
@@ -14,6 +16,8 @@
 // wrapper for read(2) write(2), you should keep buffer slice referenced alive.
 int readBulkFrom(int fd, struct slice *slice);
 int writeBulkTo(int fd, struct slice *clientbuf);
+// wrapper for writev(2), gather `iovcnt` buffers in `iov` into one syscall
+int writevBulkTo(int fd, struct iovec *iov, int iovcnt);
 
 // Used by master process for send and receive messages from clients or workers.
 struct masterClient;
@@ -2,6 +2,13 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#ifdef __linux
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // preadv2(2)
+#endif
+#include <sys/uio.h>
+#endif
+
 #include "wheatserver.h"
 
 #ifdef __APPLE__
@@ -33,6 +40,63 @@ ssize_t portable_sendfile(int out_fd, int in_fd, off_t off, off_t len) {
 
 #endif
 
+#if defined(__linux) && defined(RWF_NOWAIT)
+// Read one byte of the first and last page without waiting, kernel returns
+// EAGAIN if page isn't in page cache
+int portable_file_cached(int fd, off_t off, size_t len)
+{
+    struct iovec iov;
+    char c;
+    off_t last;
+
+    if (!len)
+        return 1;
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    last = off + len - 1;
+    if (preadv2(fd, &iov, 1, off, RWF_NOWAIT) == -1 && errno == EAGAIN)
+        return 0;
+    if (last / 4096 != off / 4096 &&
+            preadv2(fd, &iov, 1, last, RWF_NOWAIT) == -1 && errno == EAGAIN)
+        return 0;
+    return 1;
+}
+#else
+int portable_file_cached(int fd, off_t off, size_t len)
+{
+    return 1;
+}
+#endif
+
+#if defined(__linux) || defined(__FreeBSD__)
+#include <fcntl.h>
+
+void portable_file_sequential(int fd, off_t off, off_t len)
+{
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+}
+
+void portable_file_willneed(int fd, off_t off, off_t len)
+{
+    posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+}
+#else
+void portable_file_sequential(int fd, off_t off, off_t len)
+{
+}
+
+void portable_file_willneed(int fd, off_t off, off_t len)
+{
+}
+#endif
+
+#ifdef HAVE_SPLICE
+ssize_t portable_splice(int out_fd, int in_fd, size_t len)
+{
+    return splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE|SPLICE_F_MORE);
+}
+#endif
+
 void setProctitle(const char *title)
 {
     setproctitle("wheatserver: %s %s:%d", title,
@@ -12,6 +12,23 @@
 // outer_fd is non-blocking means EAGAIN errno.
 ssize_t portable_sendfile(int out_fd, int in_fd, off_t, off_t len);
 
+// Return 0 if range of file is known not in page cache, reading it may
+// block on disk. Return 1 if it's cached or unknown on the platform.
+int portable_file_cached(int fd, off_t off, size_t len);
+
+// Hint kernel that file will be read sequentially from `off`, or that range
+// will be read soon so it's read ahead asynchronously. No-op if unsupported.
+void portable_file_sequential(int fd, off_t off, off_t len);
+void portable_file_willneed(int fd, off_t off, off_t len);
+
+// Move data from pipe `in_fd` to `out_fd` by splice(2) without copying to
+// user space, only on Linux. Return the length moved, 0 at end of pipe or
+// -1 with errno.
+#ifdef __linux
+#define HAVE_SPLICE
+ssize_t portable_splice(int out_fd, int in_fd, size_t len);
+#endif
+
 /* Check if we can use setproctitle().
  * BSD systems have support for it, we provide an implementation for
  * Linux and osx. */
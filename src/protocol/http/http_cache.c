@@ -0,0 +1,357 @@
+// Response cache shared by worker processes
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "http_cache.h"
+
+#define CACHE_NONE (-1)
+// Spins between checks whether lock owner is alive
+#define CACHE_LOCK_SPINS 1024
+
+// `next`: next slot in bucket chain, or in free list if not used
+// `fill_until`: the expired entry is being regenerated by a worker
+struct cacheSlot {
+    int32_t next;
+    uint32_t hash;
+    time_t created;
+    time_t expire;
+    time_t fill_until;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint8_t used;
+    uint8_t referenced;
+    // key and value follow
+};
+
+// Placed at the start of shared mapping, followed by buckets and slots.
+// Every operation holds `lock` shortly, it's a spin lock because workers
+// never sleep or allocate while holding it. `lock` is pid of the owner, so
+// lock held by a worker which is killed meanwhile can be taken over.
+struct cacheSegment {
+    volatile pid_t lock;
+    size_t size;
+    size_t slot_size;
+    uint32_t nslot;
+    uint32_t hand;
+    int32_t free;
+    int32_t buckets[];
+};
+
+static struct cacheSegment *Cache = NULL;
+static char *Slots = NULL;
+
+#define slotAt(i)       ((struct cacheSlot *)(Slots + (size_t)(i)*Cache->slot_size))
+#define slotKey(s)      ((char *)((s)+1))
+#define slotValue(s)    (slotKey(s) + (s)->key_len)
+
+static uint32_t cacheHash(const char *key, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void cacheLock()
+{
+    pid_t self = getpid(), owner;
+    unsigned spins = 0;
+
+    while (!__sync_bool_compare_and_swap(&Cache->lock, 0, self)) {
+        if (++spins % CACHE_LOCK_SPINS == 0) {
+            owner = Cache->lock;
+            if (owner && owner != self && kill(owner, 0) == -1 &&
+                    errno == ESRCH &&
+                    __sync_bool_compare_and_swap(&Cache->lock, owner, self))
+                return ;
+        }
+        sched_yield();
+    }
+}
+
+static void cacheUnlock()
+{
+    __sync_lock_release(&Cache->lock);
+}
+
+int httpCacheCreate(size_t size, size_t item_size)
+{
+    size_t slot_size, header, n, i;
+    void *p;
+
+    slot_size = (sizeof(struct cacheSlot) + item_size + 7) & ~(size_t)7;
+    if (size <= sizeof(struct cacheSegment) + 8)
+        return -1;
+    // Each slot has one bucket
+    n = (size - sizeof(struct cacheSegment) - 8) / (slot_size + sizeof(int32_t));
+    if (!n || n > INT32_MAX)
+        return -1;
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    Cache = p;
+    Cache->lock = 0;
+    Cache->size = size;
+    Cache->slot_size = slot_size;
+    Cache->nslot = n;
+    Cache->hand = 0;
+    header = (sizeof(struct cacheSegment) + n*sizeof(int32_t) + 7) & ~(size_t)7;
+    Slots = (char *)p + header;
+    for (i = 0; i < n; i++) {
+        Cache->buckets[i] = CACHE_NONE;
+        slotAt(i)->used = 0;
+        slotAt(i)->next = i + 1 < n ? (int32_t)i + 1 : CACHE_NONE;
+    }
+    Cache->free = 0;
+    return 0;
+}
+
+void httpCacheDestroy()
+{
+    if (Cache)
+        munmap(Cache, Cache->size);
+    Cache = NULL;
+    Slots = NULL;
+}
+
+int httpCacheEnabled()
+{
+    return Cache != NULL;
+}
+
+// `*link` is set to the index referring to found slot
+static struct cacheSlot *cacheFind(uint32_t hash, const char *key,
+        size_t len, int32_t **link)
+{
+    int32_t *curr = &Cache->buckets[hash % Cache->nslot];
+    struct cacheSlot *s;
+
+    while (*curr != CACHE_NONE) {
+        s = slotAt(*curr);
+        if (s->hash == hash && s->key_len == len &&
+                !memcmp(slotKey(s), key, len)) {
+            *link = curr;
+            return s;
+        }
+        curr = &s->next;
+    }
+    return NULL;
+}
+
+static void cacheRemove(int32_t *link)
+{
+    int32_t idx = *link;
+    struct cacheSlot *s = slotAt(idx);
+
+    *link = s->next;
+    s->used = 0;
+    s->next = Cache->free;
+    Cache->free = idx;
+}
+
+// Entries are referenced by hits, the hand clears reference bit and
+// evicts the first entry not referenced since last pass
+static void cacheEvict(time_t now)
+{
+    struct cacheSlot *s;
+    int32_t *link, idx;
+
+    while (1) {
+        idx = Cache->hand;
+        s = slotAt(idx);
+        Cache->hand = (Cache->hand + 1) % Cache->nslot;
+        if (!s->used)
+            continue;
+        if (s->referenced && s->expire > now) {
+            s->referenced = 0;
+            continue;
+        }
+        // Used slot is always chained, unless a worker died while
+        // changing it, then it's just put back to free list
+        if (cacheFind(s->hash, slotKey(s), s->key_len, &link)) {
+            cacheRemove(link);
+        } else {
+            s->used = 0;
+            s->next = Cache->free;
+            Cache->free = idx;
+        }
+        return ;
+    }
+}
+
+int httpCacheGet(const char *key, size_t key_len, time_t now,
+        wstr *value, time_t *age)
+{
+    uint32_t hash = cacheHash(key, key_len);
+    struct cacheSlot *s;
+    int32_t *link;
+    size_t len = wstrlen(*value), value_len = 0;
+    int ret;
+
+    // Room is made before locking, value is only copied while locked
+    *value = wstrMakeRoom(*value, Cache->slot_size);
+    cacheLock();
+    s = cacheFind(hash, key, key_len, &link);
+    if (!s) {
+        ret = HTTP_CACHE_MISS;
+    } else if (s->expire > now) {
+        ret = HTTP_CACHE_HIT;
+    } else if (s->fill_until > now) {
+        ret = HTTP_CACHE_STALE;
+    } else {
+        // Caller is the one regenerating it
+        s->fill_until = now + HTTP_CACHE_LOCK_TIME;
+        ret = HTTP_CACHE_MISS;
+    }
+    if (ret != HTTP_CACHE_MISS) {
+        s->referenced = 1;
+        value_len = s->value_len;
+        memcpy(*value + len, slotValue(s), value_len);
+        *age = now - s->created;
+    }
+    cacheUnlock();
+    wstrupdatelen(*value, len + value_len);
+    return ret;
+}
+
+int httpCacheSet(const char *key, size_t key_len, const char *value,
+        size_t value_len, time_t now, time_t ttl)
+{
+    uint32_t hash = cacheHash(key, key_len);
+    struct cacheSlot *s;
+    int32_t *link, idx;
+
+    if (key_len + value_len > Cache->slot_size - sizeof(struct cacheSlot))
+        return -1;
+    cacheLock();
+    if (cacheFind(hash, key, key_len, &link))
+        cacheRemove(link);
+    if (Cache->free == CACHE_NONE)
+        cacheEvict(now);
+    idx = Cache->free;
+    s = slotAt(idx);
+    Cache->free = s->next;
+
+    s->hash = hash;
+    s->created = now;
+    s->expire = now + ttl;
+    s->fill_until = 0;
+    s->key_len = key_len;
+    s->value_len = value_len;
+    s->used = 1;
+    s->referenced = 0;
+    memcpy(slotKey(s), key, key_len);
+    memcpy(slotValue(s), value, value_len);
+    link = &Cache->buckets[hash % Cache->nslot];
+    s->next = *link;
+    *link = idx;
+    cacheUnlock();
+    return 0;
+}
+
+void httpCacheDelete(const char *key, size_t key_len)
+{
+    int32_t *link;
+
+    cacheLock();
+    if (cacheFind(cacheHash(key, key_len), key, key_len, &link))
+        cacheRemove(link);
+    cacheUnlock();
+}
+
+#ifdef HTTP_CACHE_TEST_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "../../test_help.h"
+
+// Size holding exactly `n` items of `item_size`
+static size_t cacheSizeFor(size_t n, size_t item_size)
+{
+    size_t slot_size = (sizeof(struct cacheSlot) + item_size + 7) & ~(size_t)7;
+    return sizeof(struct cacheSegment) + 8 + n*(slot_size + sizeof(int32_t));
+}
+
+int main(int argc, const char *argv[])
+{
+    wstr value = wstrEmpty();
+    time_t age;
+    pid_t pid;
+    int ret;
+
+    test_cond("httpCacheCreate too small", httpCacheCreate(16, 64) == -1);
+    test_cond("httpCacheCreate", httpCacheCreate(cacheSizeFor(2, 64), 64) == 0);
+    test_cond("httpCacheCreate slots", Cache->nslot == 2);
+
+    test_cond("httpCacheGet miss",
+            httpCacheGet("a", 1, 100, &value, &age) == HTTP_CACHE_MISS);
+    httpCacheSet("a", 1, "AAAA", 4, 100, 10);
+    ret = httpCacheGet("a", 1, 105, &value, &age);
+    test_cond("httpCacheGet hit", ret == HTTP_CACHE_HIT &&
+            !strcmp(value, "AAAA") && age == 5);
+    test_cond("httpCacheSet too large",
+            httpCacheSet("b", 1, "0123456789012345678901234567890123456789"
+                "012345678901234567890123456789", 70, 100, 10) == -1);
+
+    wstrClear(value);
+    test_cond("httpCacheGet expired regenerates",
+            httpCacheGet("a", 1, 110, &value, &age) == HTTP_CACHE_MISS);
+    ret = httpCacheGet("a", 1, 111, &value, &age);
+    test_cond("httpCacheGet expired stale while regenerating",
+            ret == HTTP_CACHE_STALE && !strcmp(value, "AAAA"));
+    wstrClear(value);
+    test_cond("httpCacheGet regenerating timeout",
+            httpCacheGet("a", 1, 110 + HTTP_CACHE_LOCK_TIME, &value, &age) == HTTP_CACHE_MISS);
+    httpCacheSet("a", 1, "aaaa", 4, 112, 10);
+    ret = httpCacheGet("a", 1, 113, &value, &age);
+    test_cond("httpCacheSet replace", ret == HTTP_CACHE_HIT && !strcmp(value, "aaaa"));
+
+    // "a" is referenced, so "b" is evicted when "c" comes
+    httpCacheSet("b", 1, "BBBB", 4, 113, 10);
+    httpCacheSet("c", 1, "CCCC", 4, 113, 10);
+    wstrClear(value);
+    test_cond("httpCacheSet evict unreferenced",
+            httpCacheGet("b", 1, 114, &value, &age) == HTTP_CACHE_MISS);
+    test_cond("httpCacheSet keep referenced",
+            httpCacheGet("a", 1, 114, &value, &age) == HTTP_CACHE_HIT);
+    httpCacheDelete("a", 1);
+    test_cond("httpCacheDelete",
+            httpCacheGet("a", 1, 114, &value, &age) == HTTP_CACHE_MISS);
+    wstrClear(value);
+    test_cond("httpCacheGet after delete",
+            httpCacheGet("c", 1, 114, &value, &age) == HTTP_CACHE_HIT &&
+            !strcmp(value, "CCCC"));
+
+    // Lock left by a dead worker is taken over
+    pid = fork();
+    if (pid == 0)
+        _exit(0);
+    waitpid(pid, NULL, 0);
+    Cache->lock = pid;
+    wstrClear(value);
+    test_cond("httpCacheGet dead lock owner",
+            httpCacheGet("c", 1, 114, &value, &age) == HTTP_CACHE_HIT &&
+            !Cache->lock);
+
+    wstrFree(value);
+    httpCacheDestroy();
+    test_report();
+    return 0;
+}
+
+#endif
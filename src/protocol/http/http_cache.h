@@ -0,0 +1,40 @@
+// Response cache shared by worker processes
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_PROTOCOL_HTTP_CACHE_H
+#define WHEATSERVER_PROTOCOL_HTTP_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include "../../wstr.h"
+
+// Cache lives in an anonymous shared mapping created by master before
+// workers are forked, so all workers see the same entries. It's split into
+// fixed-size slots, each holds one key and value and slots are reused in
+// CLOCK order when full.
+//
+// Only one worker regenerates an expired entry: the first one getting
+// HTTP_CACHE_MISS for it holds the entry for `HTTP_CACHE_LOCK_TIME` seconds
+// and others get HTTP_CACHE_STALE with the old value meanwhile.
+#define HTTP_CACHE_MISS     0
+#define HTTP_CACHE_HIT      1
+#define HTTP_CACHE_STALE    2
+
+#define HTTP_CACHE_LOCK_TIME 5
+
+// Return -1 if mapping failed or `size` can't hold one item
+int httpCacheCreate(size_t size, size_t item_size);
+void httpCacheDestroy();
+int httpCacheEnabled();
+// Value is appended to `*value` and `*age` is set if hit or stale
+int httpCacheGet(const char *key, size_t key_len, time_t now,
+        wstr *value, time_t *age);
+// Return -1 if key and value are larger than item size
+int httpCacheSet(const char *key, size_t key_len, const char *value,
+        size_t value_len, time_t now, time_t ttl);
+void httpCacheDelete(const char *key, size_t key_len);
+
+#endif
@@ -0,0 +1,187 @@
+// Rate limiter shared by worker processes
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <sys/mman.h>
+
+#include "http_ratelimit.h"
+
+#define RATE_PROBES 8
+
+// `key` is hash of rule and client key, 0 means unused
+struct rateBucket {
+    volatile uint64_t key;
+    volatile int64_t tat;
+};
+
+// Placed at the start of shared mapping, followed by buckets
+struct rateSegment {
+    size_t size;
+    size_t nbucket;
+    size_t nrule;
+    struct rateBucket *buckets;
+    volatile uint64_t rejects[];
+};
+
+static struct rateSegment *Limiter = NULL;
+
+static uint64_t rateHash(int rule, const char *key, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    hash = (hash ^ (unsigned)rule) * 1099511628211ULL;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+int rateLimitCreate(size_t nbucket, size_t nrule)
+{
+    size_t header, size;
+    void *p;
+
+    if (!nbucket)
+        return -1;
+    header = (sizeof(struct rateSegment) + nrule*sizeof(uint64_t) + 15) & ~(size_t)15;
+    size = header + nbucket*sizeof(struct rateBucket);
+    // Anonymous mapping is zero filled, all buckets are unused
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    Limiter = p;
+    Limiter->size = size;
+    Limiter->nbucket = nbucket;
+    Limiter->nrule = nrule;
+    Limiter->buckets = (struct rateBucket *)((char *)p + header);
+    return 0;
+}
+
+void rateLimitDestroy()
+{
+    if (Limiter)
+        munmap(Limiter, Limiter->size);
+    Limiter = NULL;
+}
+
+int rateLimitEnabled()
+{
+    return Limiter != NULL;
+}
+
+static struct rateBucket *rateBucketGet(uint64_t hash, int64_t now)
+{
+    struct rateBucket *bucket;
+    uint64_t key;
+    size_t i;
+
+    for (i = 0; i < RATE_PROBES; i++) {
+        bucket = &Limiter->buckets[(hash + i) % Limiter->nbucket];
+        key = bucket->key;
+        if (key == hash)
+            return bucket;
+        // Unused or refilled bucket is taken over
+        if ((!key || bucket->tat <= now) &&
+                __sync_bool_compare_and_swap(&bucket->key, key, hash))
+            return bucket;
+        if (bucket->key == hash)
+            return bucket;
+    }
+    return NULL;
+}
+
+int64_t rateLimitTake(int rule, const char *key, size_t len, int64_t now,
+        int64_t interval, int64_t burst)
+{
+    struct rateBucket *bucket;
+    int64_t old, tat, tolerance;
+
+    bucket = rateBucketGet(rateHash(rule, key, len), now);
+    if (!bucket)
+        return 0;
+    tolerance = interval * (burst - 1);
+    do {
+        old = bucket->tat;
+        tat = old < now ? now : old;
+        if (tat - now > tolerance) {
+            __sync_fetch_and_add(&Limiter->rejects[rule], 1);
+            return tat - now - tolerance;
+        }
+    } while (!__sync_bool_compare_and_swap(&bucket->tat, old, tat + interval));
+    return 0;
+}
+
+void rateLimitGive(int rule, const char *key, size_t len, int64_t interval)
+{
+    uint64_t hash = rateHash(rule, key, len);
+    struct rateBucket *bucket;
+    size_t i;
+
+    // Bucket taken over by other key meanwhile is left alone
+    for (i = 0; i < RATE_PROBES; i++) {
+        bucket = &Limiter->buckets[(hash + i) % Limiter->nbucket];
+        if (bucket->key == hash) {
+            __sync_fetch_and_sub(&bucket->tat, interval);
+            return ;
+        }
+    }
+}
+
+uint64_t rateLimitRejects(int rule)
+{
+    return Limiter->rejects[rule];
+}
+
+#ifdef HTTP_RATELIMIT_TEST_MAIN
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../test_help.h"
+
+int main(int argc, const char *argv[])
+{
+    int64_t wait;
+    int i, allowed;
+
+    test_cond("rateLimitCreate", rateLimitCreate(4, 2) == 0);
+    // 1 token every 100ms, 3 tokens at most
+    for (i = allowed = 0; i < 5; i++)
+        allowed += rateLimitTake(0, "a", 1, 1000000, 100000, 3) == 0;
+    test_cond("rateLimitTake burst", allowed == 3);
+    wait = rateLimitTake(0, "a", 1, 1000000, 100000, 3);
+    test_cond("rateLimitTake wait", wait == 100000);
+    test_cond("rateLimitTake refill",
+            rateLimitTake(0, "a", 1, 1100000, 100000, 3) == 0);
+    test_cond("rateLimitTake refill one",
+            rateLimitTake(0, "a", 1, 1100000, 100000, 3) > 0);
+    test_cond("rateLimitTake other key",
+            rateLimitTake(0, "b", 1, 1100000, 100000, 3) == 0);
+    test_cond("rateLimitTake other rule",
+            rateLimitTake(1, "a", 1, 1100000, 100000, 3) == 0);
+    test_cond("rateLimitRejects", rateLimitRejects(0) == 4 &&
+            rateLimitRejects(1) == 0);
+    rateLimitGive(0, "a", 1, 100000);
+    test_cond("rateLimitGive",
+            rateLimitTake(0, "a", 1, 1100000, 100000, 3) == 0 &&
+            rateLimitTake(0, "a", 1, 1100000, 100000, 3) > 0);
+
+    // Table is full of buckets not refilled, new key is allowed
+    for (i = 0; i < 4; i++) {
+        char key = 'c' + i;
+        rateLimitTake(1, &key, 1, 2000000, 1000000, 1);
+    }
+    test_cond("rateLimitTake full table",
+            rateLimitTake(1, "x", 1, 2000000, 1000000, 1) == 0);
+    test_cond("rateLimitTake refilled bucket reused",
+            rateLimitTake(1, "x", 1, 4000000, 1000000, 1) == 0 &&
+            rateLimitTake(1, "x", 1, 4000000, 1000000, 1) > 0);
+    rateLimitDestroy();
+    test_report();
+    return 0;
+}
+
+#endif
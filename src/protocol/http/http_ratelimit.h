@@ -0,0 +1,37 @@
+// Rate limiter shared by worker processes
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_PROTOCOL_HTTP_RATELIMIT_H
+#define WHEATSERVER_PROTOCOL_HTTP_RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Token buckets live in an anonymous shared mapping created by master
+// before workers are forked, so a limit is enforced across all workers.
+// Each bucket is kept as its "theoretical arrival time"(GCRA), a single
+// word updated by compare-and-swap, so no lock is needed. A bucket is
+// refilled by one token every `interval` microseconds and holds `burst`
+// tokens at most.
+//
+// Buckets are found by open addressing in a fixed table. Bucket refilled
+// completely is the same as a new one, so it can be taken by other keys.
+// If no bucket is found in a few probes, request is allowed.
+
+// Return -1 if mapping failed
+int rateLimitCreate(size_t nbucket, size_t nrule);
+void rateLimitDestroy();
+int rateLimitEnabled();
+// Take one token of bucket of `key` in `rule`. Return 0 if allowed,
+// otherwise microseconds to wait for next token.
+int64_t rateLimitTake(int rule, const char *key, size_t len, int64_t now,
+        int64_t interval, int64_t burst);
+// Give back token taken by rateLimitTake, used when request allowed by
+// `rule` is rejected by another one
+void rateLimitGive(int rule, const char *key, size_t len, int64_t interval);
+uint64_t rateLimitRejects(int rule);
+
+#endif
@@ -4,11 +4,31 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <limits.h>
+#include <ctype.h>
+
 #include "proto_http.h"
+#include "../../radix.h"
+#include "http_cache.h"
+#include "http_ratelimit.h"
+#include "../http2/proto_http2.h"
+#include "../websocket/proto_websocket.h"
 
 static FILE *AccessFp = NULL;
 static struct http_parser_settings HttpPaserSettings;
 #define WHEAT_BODY_LEN 10
+#define WHEAT_CHUNK_HEAD_LEN 20
+#define WHEAT_BODY_BUFFER_SIZE (1024*1024)
+#define WHEAT_BODY_TEMP_PATH "/tmp"
+#define WHEAT_ACCESS_BUFFER_SIZE (64*1024)
+#define WHEAT_ACCESS_LINE_LEN 1024
+#define WHEAT_HOST_LEN 256
+#define WHEAT_CACHE_ITEM_SIZE (64*1024)
+#define WHEAT_CACHE_TTL 1
+#define WHEAT_RATE_BUCKETS 65536
+#define WHEAT_HEADER_TIMEOUT 10
+#define WHEAT_BODY_TIMEOUT 60
+#define WHEAT_KEEPALIVE_TIMEOUT 15
 
 int httpSpot(struct conn*);
 int parseHttp(struct conn *, struct slice *, size_t *);
@@ -16,6 +36,12 @@ void *initHttpData();
 void freeHttpData(void *data);
 int initHttp();
 void deallocHttp();
+void httpCron();
+void httpClientIdle(struct client *c);
+int initHttpMaster();
+static void rateLimitCommand(struct masterClient *c);
+struct httpData;
+static struct httpRoute *matchRoute(struct httpData *data);
 
 // Http
 static struct configuration HttpConf[] = {
@@ -23,23 +49,78 @@ static struct configuration HttpConf[] = {
         NULL,                   STRING_FORMAT},
     {"document-root",     2, stringValidator,      {.ptr=NULL},
         NULL,                   STRING_FORMAT},
+    {"client-body-buffer-size", 2, unsignedIntValidator, {.val=WHEAT_BODY_BUFFER_SIZE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"client-body-temp-path", 2, stringValidator, {.ptr=WHEAT_BODY_TEMP_PATH},
+        (void *)WHEAT_NOTFREE,  STRING_FORMAT},
+    {"http-stream-request-body", 2, boolValidator, {.val=0},
+        NULL,                   BOOL_FORMAT},
+    {"access-log-buffer-size", 2, unsignedIntValidator, {.val=WHEAT_ACCESS_BUFFER_SIZE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"access-log-flush-interval", 2, unsignedIntValidator, {.val=1},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"access-log-sample", 2, unsignedIntValidator, {.val=1},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"access-log-format", 2, stringValidator, {.ptr="text"},
+        (void *)WHEAT_NOTFREE,  STRING_FORMAT},
+    {"http-route",        WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
+        NULL,                   LIST_FORMAT},
+    {"http-cache-size",   2, unsignedIntValidator, {.val=0},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"http-cache-item-size", 2, unsignedIntValidator, {.val=WHEAT_CACHE_ITEM_SIZE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"http-cache-ttl",    2, unsignedIntValidator, {.val=WHEAT_CACHE_TTL},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"http-rate-limit",   WHEAT_ARGS_NO_LIMIT,listValidator, {.ptr=NULL},
+        NULL,                   LIST_FORMAT},
+    {"http-rate-limit-buckets", 2, unsignedIntValidator, {.val=WHEAT_RATE_BUCKETS},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"http-header-timeout", 2, unsignedIntValidator, {.val=WHEAT_HEADER_TIMEOUT},
+        (void *)300,            INT_FORMAT},
+    {"http-body-timeout", 2, unsignedIntValidator, {.val=WHEAT_BODY_TIMEOUT},
+        (void *)3600,           INT_FORMAT},
+    {"http-keepalive-timeout", 2, unsignedIntValidator, {.val=WHEAT_KEEPALIVE_TIMEOUT},
+        (void *)300,            INT_FORMAT},
+};
+
+static struct statItem HttpStats[] = {
+    {"Total spilled request body", SUM_STAT, RAW, 0, 0},
+    {"Total streamed request body", SUM_STAT, RAW, 0, 0},
+    {"Total http cache hit", SUM_STAT, RAW, 0, 0},
+    {"Total http cache miss", SUM_STAT, RAW, 0, 0},
+    {"Total rate limited request", SUM_STAT, RAW, 0, 0},
+    {"Total header timeout client", SUM_STAT, RAW, 0, 0},
+    {"Total body timeout client", SUM_STAT, RAW, 0, 0},
+    {"Total keepalive timeout client", SUM_STAT, RAW, 0, 0},
+};
+
+static struct command HttpCommands[] = {
+    {"ratelimit", 1, rateLimitCommand,
+        "ratelimit\nOutput rejected requests of each http-rate-limit rule"},
 };
 
 struct protocol ProtocolHttp = {
     httpSpot, parseHttp, initHttpData, freeHttpData,
-        initHttp, deallocHttp
+        initHttp, deallocHttp, httpCron, httpClientIdle
 };
 
 struct moduleAttr ProtocolHttpAttr = {
-    "Http", PROTOCOL, {.protocol=&ProtocolHttp}, NULL, 0,
+    "Http", PROTOCOL, {.protocol=&ProtocolHttp},
+    HttpStats, sizeof(HttpStats)/sizeof(struct statItem),
     HttpConf, sizeof(HttpConf)/sizeof(struct configuration),
-    NULL, 0
+    HttpCommands, sizeof(HttpCommands)/sizeof(struct command),
+    initHttpMaster
 };
 
-struct staticHandler {
-    wstr abs_path;
+// Routes are compiled into `Routes` radix tree at startup. Key is path
+// prefix, or lowercase host followed by path prefix for routes bound to a
+// host. Each request goes to the route with the longest matched key.
+struct httpRoute {
+    struct app *app;
+    // static-file: real path of directory which request path is relative to
     wstr root;
-    wstr static_dir;
+    // Passed to app as is
+    wstr arg;
 };
 
 struct httpBody {
@@ -48,6 +129,23 @@ struct httpBody {
     struct slice *end_body;
     int body_len;
     int slice_len;
+
+    // Body larger than client-body-buffer-size is written to an unlinked
+    // temp file instead of pinning mbufs, and read back in spill_buf
+    int spill_fd;
+    off_t spill_off;
+    uint8_t *spill_buf;
+    struct slice spill_slice;
+
+    // Body of streamed request is parsed as app reads it(see
+    // http-stream-request-body), `stream_len` is its Content-Length and
+    // whole body must arrive before `stream_deadline`(microseconds, 0 means
+    // no limit)
+    size_t stream_len;
+    long long stream_deadline;
+
+    // Body copied by httpAppendRequestBody
+    wstr copied;
 };
 
 struct httpData {
@@ -57,10 +155,16 @@ struct httpData {
     unsigned last_was_value:1;
     unsigned complete:1;
     unsigned is_chunked_in_header:1;
+    unsigned has_length:1;
+    unsigned chunked:1;
     unsigned upgrade:1;
     unsigned keep_live:1;
     unsigned headers_sent:1;
     unsigned can_compress:1;
+    unsigned parsing:1;
+    unsigned deferred:1;
+    unsigned headers_parsed:1;
+    unsigned streaming:1;
     unsigned send;
 
     wstr query_string;
@@ -76,9 +180,77 @@ struct httpData {
     int response_length;
     struct dict *res_headers;
     wstr send_header;
+
+    // Set if request is built by other protocol(see httpFramer)
+    struct httpFramer *framer;
+    void *framer_data;
+
+    // Response being captured for http cache
+    wstr cache_key;
+    wstr cache_value;
+    time_t cache_ttl;
+};
+
+// Access log records are buffered per worker and written when buffer is
+// full or every `access-log-flush-interval` seconds by httpCron.
+struct accessLogger {
+    int binary;
+    unsigned sample;
+    unsigned long count;
+    char *buf;
+    size_t size;
+    size_t len;
+    time_t flush_interval;
+    time_t last_flush;
+    wstr remote_addr_key;
+    wstr referer_key;
+    wstr user_agent_key;
+};
+
+// Binary access log record, fields follow it in the order of remote
+// address, method, path, protocol version, referer and user agent without
+// NUL terminator. Integers are in host byte order.
+struct accessRecord {
+    uint16_t len;
+    uint16_t status;
+    uint32_t time;
+    uint32_t response_length;
+    uint16_t field_len[6];
 };
 
-static struct staticHandler StaticPathHandler;
+static struct accessLogger AccessLogger;
+static struct radix *Routes = NULL;
+static int HostRoutes = 0;
+static size_t BodyBufferSize = WHEAT_BODY_BUFFER_SIZE;
+static int Http2Enabled = 0;
+static int WebSocketEnabled = 0;
+static char *BodyTempPath = WHEAT_BODY_TEMP_PATH;
+// Responses of CacheApp are cached if http cache is enabled
+static struct app *CacheApp = NULL;
+// Large request body routed to StreamApp is read by app from client
+static struct app *StreamApp = NULL;
+static size_t CacheItemSize = WHEAT_CACHE_ITEM_SIZE;
+static time_t CacheTTL = WHEAT_CACHE_TTL;
+// Deadlines in milliseconds of each phase, request headers and body must be
+// received completely in time from their first byte, and next request must
+// start in time after the last response is sent
+static long HeaderTimeout = WHEAT_HEADER_TIMEOUT * 1000;
+static long BodyTimeout = WHEAT_BODY_TIMEOUT * 1000;
+static long KeepaliveTimeout = WHEAT_KEEPALIVE_TIMEOUT * 1000;
+static struct statItem *StatHeaderTimeout = NULL;
+static struct statItem *StatBodyTimeout = NULL;
+static struct statItem *StatKeepaliveTimeout = NULL;
+
+// `http-rate-limit` rules parsed by master, index of rule is the rule id
+// of rate limiter. `header` is NULL if client is identified by ip.
+struct rateRule {
+    wstr name;
+    wstr header;
+    int64_t interval;
+    int64_t burst;
+};
+static struct rateRule *RateRules = NULL;
+static size_t NRateRules = 0;
 
 const char *URL_SCHEME[] = {
     "http",
@@ -87,7 +259,8 @@ const char *URL_SCHEME[] = {
 
 const char *PROTOCOL_VERSION[] = {
     "HTTP/1.0",
-    "HTTP/1.1"
+    "HTTP/1.1",
+    "HTTP/2.0"
 };
 
 int convertHttpDate(time_t date, char *buf, size_t len)
@@ -144,12 +317,91 @@ const wstr httpGetPath(struct conn *c)
     return ((struct httpData*)c->protocol_data)->path;
 }
 
+static const struct slice *nextSpilledBody(struct httpBody *body)
+{
+    ssize_t nread;
+
+    if (body->spill_buf == NULL) {
+        body->spill_buf = wmalloc(Server.mbuf_size);
+        if (body->spill_buf == NULL)
+            return NULL;
+    }
+    nread = pread(body->spill_fd, body->spill_buf, Server.mbuf_size,
+            body->spill_off);
+    if (nread <= 0) {
+        if (nread == -1)
+            wheatLog(WHEAT_WARNING, "read spilled body failed: %s",
+                    strerror(errno));
+        return NULL;
+    }
+    body->spill_off += nread;
+    sliceTo(&body->spill_slice, body->spill_buf, nread);
+    return &body->spill_slice;
+}
+
+// Waits for streamed body share one deadline, so clients trickling bytes
+// can't hold app thread forever
+static long streamWaitTime(struct httpBody *body)
+{
+    struct timeval now;
+    long long left;
+
+    if (!body->stream_deadline)
+        return -1;
+    gettimeofday(&now, NULL);
+    left = body->stream_deadline - getMicroseconds(now);
+    return left > 0 ? (long)(left / 1000) : 0;
+}
+
+// Streamed body is parsed from request buffer when previous slices are
+// consumed, mbufs they referred to are released then. Client is waited for
+// if buffer is empty, so reading blocks app until data arrives.
+static const struct slice *nextStreamedBody(struct conn *c)
+{
+    struct httpData *data = c->protocol_data;
+    struct httpBody *body = &data->body;
+    struct client *client = c->client;
+    struct slice slice;
+    size_t nparsed;
+
+    while (body->curr_body == body->end_body) {
+        if (data->complete || !isClientValid(client))
+            return NULL;
+        body->curr_body = body->end_body = body->body;
+        releaseClientBuffer(client);
+        while (!msgCanRead(client->req_buf)) {
+            if (recvClientWait(client, streamWaitTime(body)) == WHEAT_WRONG) {
+                wheatLog(WHEAT_VERBOSE, "Closing client %s streaming body",
+                        client->name);
+                return NULL;
+            }
+        }
+        msgRead(client->req_buf, &slice);
+        http_parser_pause(data->parser, 0);
+        nparsed = http_parser_execute(data->parser, &HttpPaserSettings,
+                (const char *)slice.data, slice.len);
+        msgSetReaded(client->req_buf, nparsed);
+        if (HTTP_PARSER_ERRNO(data->parser) != HPE_OK &&
+                HTTP_PARSER_ERRNO(data->parser) != HPE_PAUSED) {
+            wheatLog(WHEAT_WARNING, "http_parser error name: %s",
+                    http_errno_name(HTTP_PARSER_ERRNO(data->parser)));
+            setClientUnvalid(client);
+            return NULL;
+        }
+    }
+    return body->curr_body++;
+}
+
 const struct slice *httpGetBodyNext(struct conn *c)
 {
     struct httpData *data;
     struct slice *s;
 
     data = c->protocol_data;
+    if (data->body.spill_fd != -1)
+        return nextSpilledBody(&data->body);
+    if (data->streaming)
+        return nextStreamedBody(c);
     s = data->body.curr_body;
     if (s == data->body.end_body)
         return NULL;
@@ -157,9 +409,34 @@ const struct slice *httpGetBodyNext(struct conn *c)
     return s;
 }
 
+// Return fd of temp file if body is spilled(see client-body-buffer-size),
+// otherwise -1 and body is iterated by httpGetBodyNext
+int httpGetBodyFile(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->body.spill_fd;
+}
+
 int httpBodyGetSize(struct conn *c)
 {
-    return ((struct httpData*)c->protocol_data)->body.body_len;
+    struct httpData *data = c->protocol_data;
+
+    if (data->streaming)
+        return data->body.stream_len;
+    return data->body.body_len;
+}
+
+// Body of streamed request not read by app is received and dropped, so
+// next request on the connection can be parsed
+void httpDiscardBody(struct conn *c)
+{
+    struct httpData *data = c->protocol_data;
+
+    if (!data->streaming)
+        return ;
+    while (httpGetBodyNext(c) != NULL)
+        continue;
+    if (!data->complete)
+        setClientUnvalid(c->client);
 }
 
 struct dict *httpGetReqHeaders(struct conn *c)
@@ -177,12 +454,24 @@ int httpGetResStatus(struct conn *c)
     return ((struct httpData*)c->protocol_data)->res_status;
 }
 
+void *httpGetFramerData(struct conn *c)
+{
+    return ((struct httpData*)c->protocol_data)->framer_data;
+}
+
 static int isChunked(struct httpData *http_data)
 {
-    return http_data->is_chunked_in_header &&
-        http_data->response_length == 0 &&
-        http_data->protocol_version == PROTOCOL_VERSION[1] &&
-        http_data->res_status == 200;
+    return http_data->chunked;
+}
+
+// Responses to HEAD and 1xx, 204, 304 responses never carry a body, so
+// client needn't Content-Length or chunk framing to find the end of them.
+static int isBodilessResponse(struct httpData *http_data)
+{
+    int status = http_data->res_status;
+
+    return (status >= 100 && status < 200) || status == 204 ||
+        status == 304 || !strcasecmp(http_data->method, "HEAD");
 }
 
 static int enlargeHttpBody(struct httpBody *body)
@@ -200,6 +489,60 @@ static int enlargeHttpBody(struct httpBody *body)
     return 0;
 }
 
+static int writeSpillFile(int fd, const uint8_t *data, size_t len)
+{
+    ssize_t nwritten;
+
+    while (len > 0) {
+        nwritten = write(fd, data, len);
+        if (nwritten == -1) {
+            if (errno == EINTR)
+                continue;
+            wheatLog(WHEAT_WARNING, "write spilled body failed: %s",
+                    strerror(errno));
+            return -1;
+        }
+        data += nwritten;
+        len -= nwritten;
+    }
+    return 0;
+}
+
+// Move body received so far to an unlinked temp file, later body will be
+// appended to it directly.
+static int spillHttpBody(struct httpBody *body)
+{
+    char path[WHEATSERVER_PATH_LEN];
+    struct slice *s;
+    int fd, ret;
+
+    ret = snprintf(path, sizeof(path), "%s/wheatserver-body.XXXXXX",
+            BodyTempPath);
+    if (ret < 0 || ret >= sizeof(path))
+        return -1;
+    fd = mkstemp(path);
+    if (fd == -1) {
+        wheatLog(WHEAT_WARNING, "create body temp file %s failed: %s",
+                path, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+
+    for (s = body->body; s != body->end_body; s++) {
+        if (writeSpillFile(fd, s->data, s->len) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    body->curr_body = body->end_body = body->body;
+    wstrFree(body->copied);
+    body->copied = NULL;
+    body->spill_fd = fd;
+    body->spill_off = 0;
+    getStatItemByName("Total spilled request body")->val++;
+    return 0;
+}
+
 static const char *connectionField(struct conn *c)
 {
     char *connection = NULL;
@@ -362,17 +705,22 @@ int on_header_value(http_parser *parser, const char *at, size_t len)
     return 0;
 }
 
-int on_body(http_parser *parser, const char *at, size_t len)
+static int appendHttpBody(struct httpBody *body, const char *at, size_t len)
 {
-    struct httpData *data;
-    struct httpBody *body;
-
-    data = parser->data;
-    body = &data->body;
+    if (!body->stream_len && body->spill_fd == -1 &&
+            body->body_len + len > BodyBufferSize) {
+        if (spillHttpBody(body) == -1)
+            return 1;
+    }
+    if (body->spill_fd != -1) {
+        if (writeSpillFile(body->spill_fd, (const uint8_t *)at, len) == -1)
+            return 1;
+        body->body_len += len;
+        return 0;
+    }
     if (body->end_body == body->body + body->slice_len) {
-        if (enlargeHttpBody(&data->body) == -1)
+        if (enlargeHttpBody(body) == -1)
             return 1;
-        body = &data->body;
     }
     sliceTo(body->end_body, (uint8_t *)at, len);
     body->end_body++;
@@ -380,13 +728,319 @@ int on_body(http_parser *parser, const char *at, size_t len)
     return 0;
 }
 
+int on_body(http_parser *parser, const char *at, size_t len)
+{
+    struct httpData *data = parser->data;
+    return appendHttpBody(&data->body, at, len);
+}
+
+static wstr fetchReqHeader(struct httpData *data, const char *field)
+{
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+    wstr value = NULL;
+
+    iter = dictGetIterator(data->req_headers);
+    while ((entry = dictNext(iter)) != NULL) {
+        if (!strcasecmp(dictGetKey(entry), field)) {
+            value = dictGetVal(entry);
+            break;
+        }
+    }
+    dictReleaseIterator(iter);
+    return value;
+}
+
+static int hasToken(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+
+    while (*value) {
+        while (*value == ' ' || *value == ',')
+            value++;
+        if (!strncasecmp(value, token, len) &&
+                (value[len] == '\0' || value[len] == ',' || value[len] == ' '))
+            return 1;
+        while (*value && *value != ',')
+            value++;
+    }
+    return 0;
+}
+
+// ========== Http cache ==========
+// Responses are stored as status line and headers followed by body. Only
+// GET requests without credentials are cached, key is "method host
+// path?query".
+static wstr cacheKey(struct httpData *data)
+{
+    wstr key, host;
+
+    if (strcmp(data->method, "GET") || fetchReqHeader(data, "Authorization") ||
+            fetchReqHeader(data, "Cookie"))
+        return NULL;
+    host = fetchReqHeader(data, "Host");
+    key = wstrNew(data->method);
+    key = wstrCatLen(key, " ", 1);
+    if (host)
+        key = wstrCat(key, host);
+    key = wstrCatLen(key, " ", 1);
+    key = wstrCat(key, data->path);
+    if (data->query_string) {
+        key = wstrCatLen(key, "?", 1);
+        key = wstrCat(key, data->query_string);
+    }
+    return key;
+}
+
+// Return seconds of Cache-Control directive like "max-age=60", -1 if not
+// found
+static int directiveSeconds(const char *value, const char *name)
+{
+    size_t len = strlen(name);
+
+    while (*value) {
+        while (*value == ' ' || *value == ',')
+            value++;
+        if (!strncasecmp(value, name, len) && value[len] == '=')
+            return atoi(value + len + 1);
+        while (*value && *value != ',')
+            value++;
+    }
+    return -1;
+}
+
+// Return seconds response can be cached, 0 means not cacheable
+static time_t responseCacheTTL(struct httpData *data)
+{
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+    const char *field, *value;
+    time_t ttl = CacheTTL;
+    int seconds, shared = 0;
+
+    if (data->res_status != 200)
+        return 0;
+    iter = dictGetIterator(data->res_headers);
+    while ((entry = dictNext(iter)) != NULL) {
+        field = dictGetKey(entry);
+        value = dictGetVal(entry);
+        if (!strcasecmp(field, "Set-Cookie") || !strcasecmp(field, "Vary")) {
+            ttl = 0;
+            break;
+        }
+        if (strcasecmp(field, "Cache-Control"))
+            continue;
+        if (hasToken(value, "no-store") || hasToken(value, "no-cache") ||
+                hasToken(value, "private")) {
+            ttl = 0;
+            break;
+        }
+        // s-maxage is for shared caches and overrides max-age
+        if ((seconds = directiveSeconds(value, "s-maxage")) >= 0) {
+            ttl = seconds;
+            shared = 1;
+        } else if (!shared && (seconds = directiveSeconds(value, "max-age")) >= 0) {
+            ttl = seconds;
+        }
+    }
+    dictReleaseIterator(iter);
+    return ttl;
+}
+
+// Old response mustn't be served any more if the new one isn't cached
+static void dropCacheCapture(struct httpData *data)
+{
+    httpCacheDelete(data->cache_key, wstrlen(data->cache_key));
+    wstrFree(data->cache_key);
+    wstrFree(data->cache_value);
+    data->cache_key = data->cache_value = NULL;
+}
+
+static void captureCacheHeaders(struct httpData *data)
+{
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+    char buf[32];
+    wstr value;
+    int ret;
+
+    data->cache_ttl = responseCacheTTL(data);
+    if (!data->cache_ttl) {
+        dropCacheCapture(data);
+        return ;
+    }
+    ret = snprintf(buf, sizeof(buf), "%d ", data->res_status);
+    value = wstrNewLen(buf, ret);
+    value = wstrCat(value, data->res_status_msg);
+    value = wstrCatLen(value, "\r\n", 2);
+    iter = dictGetIterator(data->res_headers);
+    while ((entry = dictNext(iter)) != NULL) {
+        if (!strcasecmp(dictGetKey(entry), CONNECTION) ||
+                !strcasecmp(dictGetKey(entry), TRANSFER_ENCODING))
+            continue;
+        value = wstrCat(value, dictGetKey(entry));
+        value = wstrCatLen(value, ": ", 2);
+        value = wstrCat(value, dictGetVal(entry));
+        value = wstrCatLen(value, "\r\n", 2);
+    }
+    dictReleaseIterator(iter);
+    data->cache_value = wstrCatLen(value, "\r\n", 2);
+}
+
+static void captureCacheBody(struct httpData *data, const char *body, size_t len)
+{
+    if (wstrlen(data->cache_key) + wstrlen(data->cache_value) + len > CacheItemSize) {
+        dropCacheCapture(data);
+        return ;
+    }
+    data->cache_value = wstrCatLen(data->cache_value, body, len);
+}
+
+static void storeCacheResponse(struct httpData *data)
+{
+    if (data->cache_value && (!data->has_length ||
+                data->send == data->response_length)) {
+        if (httpCacheSet(data->cache_key, wstrlen(data->cache_key),
+                    data->cache_value, wstrlen(data->cache_value),
+                    Server.cron_time.tv_sec, data->cache_ttl) == -1)
+            httpCacheDelete(data->cache_key, wstrlen(data->cache_key));
+    }
+    wstrFree(data->cache_key);
+    wstrFree(data->cache_value);
+    data->cache_key = data->cache_value = NULL;
+}
+
+// Body is sent from `value` without copying, it's freed with `c`
+static void sendCachedResponse(struct conn *c, wstr value, time_t age)
+{
+    char *p = value, *end = value + wstrlen(value), *eol, *sep, *msg;
+    char buf[32];
+    int has_length = 0;
+
+    registerConnFree(c, (void (*)(void *))wstrFree, value);
+    eol = strstr(p, "\r\n");
+    if (!eol) {
+        sendResponse500(c);
+        return ;
+    }
+    *eol = '\0';
+    msg = strchr(p, ' ');
+    fillResInfo(c, atoi(p), msg ? msg + 1 : "OK");
+    p = eol + 2;
+    while ((eol = strstr(p, "\r\n")) != NULL && eol != p) {
+        *eol = '\0';
+        if ((sep = strstr(p, ": ")) != NULL) {
+            *sep = '\0';
+            if (!strcasecmp(p, CONTENT_LENGTH))
+                has_length = 1;
+            appendToResHeaders(c, p, sep + 2);
+        }
+        p = eol + 2;
+    }
+    p += 2;
+    if (!has_length) {
+        snprintf(buf, sizeof(buf), "%ld", (long)(end - p));
+        appendToResHeaders(c, CONTENT_LENGTH, buf);
+    }
+    snprintf(buf, sizeof(buf), "%ld", (long)age);
+    appendToResHeaders(c, "Age", buf);
+    if (httpSendHeaders(c) == -1)
+        return ;
+    httpSendBody(c, p, end - p);
+}
+
+// Return 1 if request is answered by cache, otherwise response of app is
+// captured
+static int spotCachedResponse(struct conn *c)
+{
+    struct httpData *data = c->protocol_data;
+    wstr key, value;
+    time_t age;
+
+    key = cacheKey(data);
+    if (!key)
+        return 0;
+    value = wstrEmpty();
+    if (httpCacheGet(key, wstrlen(key), Server.cron_time.tv_sec,
+                &value, &age) != HTTP_CACHE_MISS) {
+        getStatItemByName("Total http cache hit")->val++;
+        wstrFree(key);
+        sendCachedResponse(c, value, age);
+        return 1;
+    }
+    getStatItemByName("Total http cache miss")->val++;
+    wstrFree(value);
+    data->cache_key = key;
+    return 0;
+}
+
+// HTTP/1.1 request without body can be upgraded to h2c(RFC 7540 3.2)
+static int isH2cUpgrade(http_parser *parser, struct httpData *data)
+{
+    wstr upgrade;
+
+    if (!Http2Enabled || parser->http_major != 1 || parser->http_minor != 1)
+        return 0;
+    if ((parser->flags & F_CHUNKED) ||
+            (parser->content_length != 0 && parser->content_length != ULLONG_MAX))
+        return 0;
+    upgrade = fetchReqHeader(data, "Upgrade");
+    return upgrade && hasToken(upgrade, "h2c") &&
+        fetchReqHeader(data, HTTP2_SETTINGS) != NULL;
+}
+
+// WebSocket opening handshake(RFC 6455 4.2.1)
+static int isWebSocketUpgrade(http_parser *parser, struct httpData *data)
+{
+    wstr upgrade, key, version;
+
+    if (!WebSocketEnabled || parser->method != HTTP_GET ||
+            parser->http_major != 1 || parser->http_minor != 1)
+        return 0;
+    upgrade = fetchReqHeader(data, "Upgrade");
+    key = fetchReqHeader(data, SEC_WEBSOCKET_KEY);
+    version = fetchReqHeader(data, "Sec-WebSocket-Version");
+    return upgrade && hasToken(upgrade, "websocket") && key &&
+        wstrlen(key) == 24 && version && !strcmp(version, "13");
+}
+
+// Only body with Content-Length not fitting in client-body-buffer-size is
+// streamed, smaller or chunked body is received before app is called
+static int isStreamedBody(http_parser *parser, struct httpData *data)
+{
+    struct httpRoute *route;
+
+    if (!StreamApp || parser->upgrade || (parser->flags & F_CHUNKED) ||
+            parser->content_length == ULLONG_MAX ||
+            parser->content_length <= BodyBufferSize)
+        return 0;
+    route = matchRoute(data);
+    return route && route->app == StreamApp;
+}
+
 int on_header_complete(http_parser *parser)
 {
     struct httpData *data = parser->data;
+    data->headers_parsed = 1;
     if (http_should_keep_alive(parser) == 0)
         data->keep_live = 0;
     else
         data->keep_live = 1;
+    // Server is free to ignore Upgrade(RFC 7230 6.7), then request and its
+    // body is served as usual
+    if (parser->upgrade && !isH2cUpgrade(parser, data) &&
+            !isWebSocketUpgrade(parser, data))
+        parser->upgrade = 0;
+    // Parser stops here and app is called, body is parsed by
+    // httpGetBodyNext later
+    if (isStreamedBody(parser, data)) {
+        data->streaming = 1;
+        data->body.stream_len = parser->content_length;
+        data->body.stream_deadline = BodyTimeout ?
+            getMicroseconds(Server.cron_time) + BodyTimeout*1000LL : 0;
+        getStatItemByName("Total streamed request body")->val++;
+        http_parser_pause(parser, 1);
+    }
     return 0;
 }
 
@@ -394,13 +1048,15 @@ int on_message_complete(http_parser *parser)
 {
     struct httpData *data = parser->data;
     data->complete = 1;
+    // Next request is left in request buffer
+    if (data->streaming)
+        http_parser_pause(parser, 1);
     return 0;
 }
 
-int on_url(http_parser *parser, const char *at, size_t len)
+static int setUrl(struct httpData *data, const char *at, size_t len)
 {
     struct http_parser_url parser_url;
-    struct httpData *data = parser->data;
 
     memset(&parser_url, 0, sizeof(struct http_parser_url));
     if (http_parser_parse_url(at, len, 0, &parser_url))
@@ -410,14 +1066,34 @@ int on_url(http_parser *parser, const char *at, size_t len)
     return 0;
 }
 
+int on_url(http_parser *parser, const char *at, size_t len)
+{
+    return setUrl(parser->data, at, len);
+}
+
 int parseHttp(struct conn *c, struct slice *slice, size_t *out)
 {
     size_t nparsed;
     struct httpData *http_data = c->protocol_data;
+    int was_parsing = http_data->parsing;
+    int had_headers = http_data->headers_parsed;
+
+    // Client speaks h2c with prior knowledge(RFC 7540 3.4)
+    if (Http2Enabled && !http_data->parsing && slice->len >= 3 &&
+            isHttp2Preface(slice)) {
+        clearClientDeadline(c->client);
+        if (http2Handoff(c) == WHEAT_WRONG)
+            return WHEAT_WRONG;
+        return c->client->protocol->parser(c, slice, out);
+    }
+    http_data->parsing = 1;
 
     nparsed = http_parser_execute(http_data->parser, &HttpPaserSettings, (const char *)slice->data, slice->len);
 
-    if (nparsed != slice->len) {
+    // Data following upgrade request belongs to the new protocol, body of
+    // streamed request is left to httpGetBodyNext
+    if (nparsed != slice->len && !http_data->parser->upgrade &&
+            !http_data->streaming) {
         /* Handle error. Usually just close the connection. */
         wheatLog(WHEAT_WARNING, "parseHttp() nparsed %d != recved %d", nparsed, slice->len);
         return WHEAT_WRONG;
@@ -425,22 +1101,29 @@ int parseHttp(struct conn *c, struct slice *slice, size_t *out)
 
     slice->len = nparsed;
 
-    if (http_data->parser->upgrade) {
-        /* handle new protocol */
-        wheatLog(WHEAT_WARNING, "parseHttp() handle new protocol");
-        if (http_data->parser->http_minor == 0)
-            http_data->upgrade = 1;
-        else
-            return WHEAT_WRONG;
-    }
+    // Spilled body doesn't refer to request buffer, so long uploads can
+    // be received without keeping all of it in memory
+    if (http_data->body.spill_fd != -1)
+        releaseClientBuffer(c->client);
 
     if (out) *out = nparsed;
-    if (http_data->complete) {
+    if (http_data->complete || http_data->streaming) {
+        clearClientDeadline(c->client);
         http_data->method = http_method_str(http_data->parser->method);
         if (http_data->parser->http_minor == 0)
             http_data->protocol_version = PROTOCOL_VERSION[0];
         else
             http_data->protocol_version = PROTOCOL_VERSION[1];
+        // Only h2c and websocket upgrade are left by on_header_complete.
+        // WebSocket handshake is answered directly, h2c upgrade request is
+        // answered as stream 1 of new Http2 connection
+        if (http_data->parser->upgrade) {
+            http_data->upgrade = 1;
+            if (isWebSocketUpgrade(http_data->parser, http_data))
+                return webSocketUpgrade(c, fetchReqHeader(http_data, SEC_WEBSOCKET_KEY));
+            if (http2Upgrade(c, fetchReqHeader(http_data, HTTP2_SETTINGS)) == WHEAT_WRONG)
+                return WHEAT_WRONG;
+        }
         return WHEAT_OK;
     }
     if (http_data->parser->http_errno) {
@@ -452,9 +1135,20 @@ int parseHttp(struct conn *c, struct slice *slice, size_t *out)
                 );
         return WHEAT_WRONG;
     }
+    // Deadline isn't extended by following data, so clients trickling
+    // bytes can't hold buffer forever
+    if (!was_parsing && !http_data->headers_parsed)
+        setClientDeadline(c->client, HeaderTimeout, StatHeaderTimeout);
+    else if (!had_headers && http_data->headers_parsed)
+        setClientDeadline(c->client, BodyTimeout, StatBodyTimeout);
     return 1;
 }
 
+void httpClientIdle(struct client *c)
+{
+    setClientDeadline(c, KeepaliveTimeout, StatKeepaliveTimeout);
+}
+
 void *initHttpData()
 {
     struct httpData *data = wmalloc(sizeof(struct httpData));
@@ -470,6 +1164,7 @@ void *initHttpData()
     http_parser_init(data->parser, HTTP_REQUEST);
     data->url_scheme = URL_SCHEME[0];
     memset(&data->body, 0, sizeof(data->body));
+    data->body.spill_fd = -1;
     int ret = enlargeHttpBody(&data->body);
     if (ret == -1) {
         wfree(data);
@@ -493,9 +1188,126 @@ void freeHttpData(void *data)
     wstrFree(d->path);
     wstrFree(d->send_header);
     wfree(d->body.body);
+    if (d->body.spill_fd != -1)
+        close(d->body.spill_fd);
+    wfree(d->body.spill_buf);
+    wstrFree(d->body.copied);
+    wstrFree(d->cache_key);
+    wstrFree(d->cache_value);
     wfree(d);
 }
 
+void httpSetFramer(struct httpData *data, struct httpFramer *framer,
+        void *framer_data)
+{
+    data->framer = framer;
+    data->framer_data = framer_data;
+}
+
+struct httpData *httpCreateRequest(struct httpFramer *framer, void *framer_data)
+{
+    struct httpData *data = initHttpData();
+    if (!data)
+        return NULL;
+    httpSetFramer(data, framer, framer_data);
+    data->protocol_version = PROTOCOL_VERSION[2];
+    data->keep_live = 1;
+    return data;
+}
+
+int httpSetRequestMethod(struct httpData *data, const char *method, size_t len)
+{
+    const char *name;
+    int i;
+
+    // Use the same static method string as http_parser does
+    for (i = 0; strcmp((name = http_method_str(i)), "<unknown>"); i++) {
+        if (strlen(name) == len && !memcmp(name, method, len)) {
+            data->method = name;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int httpSetRequestUrl(struct httpData *data, const char *url, size_t len)
+{
+    return setUrl(data, url, len) ? -1 : 0;
+}
+
+void httpSetRequestScheme(struct httpData *data, const char *scheme, size_t len)
+{
+    if (len == 5 && !memcmp(scheme, "https", 5))
+        data->url_scheme = URL_SCHEME[1];
+    else
+        data->url_scheme = URL_SCHEME[0];
+}
+
+// Field name is converted to the form HTTP/1.x clients usually send, like
+// "Content-Type", apps look up headers in this form. Repeated fields are
+// combined into one.
+int httpAddRequestHeader(struct httpData *data, const char *field,
+        size_t field_len, const char *value, size_t value_len)
+{
+    struct dictEntry *entry;
+    wstr key, val;
+    size_t i;
+
+    key = wstrNewLen(field, (int)field_len);
+    if (!key)
+        return -1;
+    for (i = 0; i < field_len; i++)
+        key[i] = (i == 0 || key[i-1] == '-') ? toupper(key[i]) : tolower(key[i]);
+
+    entry = dictFind(data->req_headers, key);
+    if (entry) {
+        wstrFree(key);
+        val = dictGetVal(entry);
+        if (!strcasecmp(dictGetKey(entry), "Cookie"))
+            val = wstrCatLen(val, "; ", 2);
+        else
+            val = wstrCatLen(val, ", ", 2);
+        if (val)
+            val = wstrCatLen(val, value, value_len);
+        if (!val)
+            return -1;
+        dictSetVal(data->req_headers, entry, val);
+        return 0;
+    }
+    val = wstrNewLen(value, (int)value_len);
+    if (!val || dictAdd(data->req_headers, key, val) == DICT_WRONG) {
+        wstrFree(key);
+        wstrFree(val);
+        return -1;
+    }
+    return 0;
+}
+
+// Unlike http_parser body, data passed in is copied because caller's buffer
+// may be freed before request done.
+int httpAppendRequestBody(struct httpData *data, const char *at, size_t len)
+{
+    struct httpBody *body = &data->body;
+
+    if (body->spill_fd != -1 || body->body_len + len > BodyBufferSize)
+        return appendHttpBody(body, at, len) ? -1 : 0;
+    if (body->copied)
+        body->copied = wstrCatLen(body->copied, at, len);
+    else
+        body->copied = wstrNewLen(at, (int)len);
+    if (!body->copied)
+        return -1;
+    sliceTo(body->body, (uint8_t *)body->copied, wstrlen(body->copied));
+    body->end_body = body->body + 1;
+    body->body_len += len;
+    return 0;
+}
+
+void httpFinishRequest(struct httpData *data)
+{
+    data->complete = 1;
+}
+
 static FILE *openAccessLog()
 {
     struct configuration *conf;
@@ -518,32 +1330,271 @@ static FILE *openAccessLog()
     return fp;
 }
 
-int initHttp()
+static int initAccessLogger()
 {
-    struct configuration *conf1, *conf2;
-
-    AccessFp = openAccessLog();
-    memset(&StaticPathHandler, 0 , sizeof(struct staticHandler));
-    conf1 = getConfiguration("document-root");
-    conf2 = getConfiguration("static-file-dir");
-    if (conf1->target.ptr && conf2->target.ptr) {
-        char path[1024];
-        char *real_path = realpath(conf1->target.ptr, path);
-        if (!real_path) {
-            wheatLog(WHEAT_WARNING, "document-root %s is unvalid",
-                    conf1->target.ptr);
+    char *format;
+
+    memset(&AccessLogger, 0, sizeof(AccessLogger));
+    format = getConfiguration("access-log-format")->target.ptr;
+    if (!strcasecmp(format, "binary")) {
+        AccessLogger.binary = 1;
+    } else if (strcasecmp(format, "text")) {
+        wheatLog(WHEAT_WARNING, "access-log-format %s is unvalid", format);
+        return WHEAT_WRONG;
+    }
+    AccessLogger.sample = getConfiguration("access-log-sample")->target.val;
+    AccessLogger.size = getConfiguration("access-log-buffer-size")->target.val;
+    AccessLogger.flush_interval = getConfiguration("access-log-flush-interval")->target.val;
+    AccessLogger.last_flush = Server.cron_time.tv_sec;
+    if (AccessLogger.size && !(AccessLogger.buf = wmalloc(AccessLogger.size)))
+        return WHEAT_WRONG;
+    AccessLogger.remote_addr_key = wstrNew("Remote_Addr");
+    AccessLogger.referer_key = wstrNew("Referer");
+    AccessLogger.user_agent_key = wstrNew("User-Agent");
+    if (!AccessLogger.remote_addr_key || !AccessLogger.referer_key ||
+            !AccessLogger.user_agent_key)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+static void writeAccessLog(const char *data, size_t len)
+{
+    ssize_t nwritten;
+
+    while (len) {
+        nwritten = write(fileno(AccessFp), data, len);
+        if (nwritten == -1) {
+            if (errno == EINTR)
+                continue;
+            wheatLog(WHEAT_WARNING, "log access failed: %s", strerror(errno));
+            fclose(AccessFp);
+            AccessFp = openAccessLog();
+            if (!AccessFp) {
+                wheatLog(WHEAT_WARNING, "open access log failed");
+                halt(1);
+            }
+            return ;
+        }
+        data += nwritten;
+        len -= nwritten;
+    }
+}
+
+static void flushAccessLog()
+{
+    if (AccessLogger.len)
+        writeAccessLog(AccessLogger.buf, AccessLogger.len);
+    AccessLogger.len = 0;
+    AccessLogger.last_flush = Server.cron_time.tv_sec;
+}
+
+static void appendAccessLog(const char *record, size_t len)
+{
+    if (AccessLogger.len + len > AccessLogger.size)
+        flushAccessLog();
+    if (len > AccessLogger.size) {
+        writeAccessLog(record, len);
+        return ;
+    }
+    memcpy(AccessLogger.buf + AccessLogger.len, record, len);
+    AccessLogger.len += len;
+}
+
+void httpCron()
+{
+    if (AccessFp && AccessLogger.len && Server.cron_time.tv_sec -
+            AccessLogger.last_flush >= AccessLogger.flush_interval)
+        flushAccessLog();
+    if (WebSocketEnabled)
+        spotProtocol("WebSocket")->protocolCron();
+}
+
+static void freeRoute(void *data)
+{
+    struct httpRoute *route = data;
+    wstrFree(route->root);
+    wstrFree(route->arg);
+    wfree(route);
+}
+
+// `key` is "[HOST]/PREFIX". `arg` of static-file route is the directory
+// which request path is relative to, `document-root` if not specified.
+static int addRoute(const char *key, const char *app_name, const char *arg)
+{
+    struct moduleAttr *module;
+    struct httpRoute *route;
+    const char *slash;
+    char path[PATH_MAX];
+    wstr lower_key;
+    int i;
+
+    slash = strchr(key, '/');
+    if (!slash) {
+        wheatLog(WHEAT_WARNING, "http-route %s has no path prefix", key);
+        return WHEAT_WRONG;
+    }
+    module = getModule(APP, app_name);
+    if (!module || strcasecmp(getApp(module)->proto_belong, "Http")) {
+        wheatLog(WHEAT_WARNING, "http-route %s: %s isn't Http app", key, app_name);
+        return WHEAT_WRONG;
+    }
+    route = wmalloc(sizeof(*route));
+    memset(route, 0, sizeof(*route));
+    route->app = getApp(module);
+    if (route->app == spotApp("static-file")) {
+        if (!arg)
+            arg = getConfiguration("document-root")->target.ptr;
+        if (!arg || !realpath(arg, path)) {
+            wheatLog(WHEAT_WARNING, "http-route %s: root %s is unvalid",
+                    key, arg ? arg : "NULL");
+            wfree(route);
             return WHEAT_WRONG;
         }
-        StaticPathHandler.abs_path = wstrNew(real_path);
-        StaticPathHandler.root = wstrDup(StaticPathHandler.abs_path);
-        StaticPathHandler.static_dir = wstrNew(conf2->target.ptr);
-        StaticPathHandler.abs_path = wstrCat(StaticPathHandler.abs_path,
-                StaticPathHandler.static_dir);
-        real_path = realpath(StaticPathHandler.abs_path, path);
-        if (!real_path) {
+        route->root = wstrNew(path);
+    } else if (arg) {
+        route->arg = wstrNew(arg);
+    }
+
+    lower_key = wstrNew(key);
+    for (i = 0; i < slash - key; i++)
+        lower_key[i] = tolower(lower_key[i]);
+    if (slash != key)
+        HostRoutes = 1;
+    route = radixInsert(Routes, lower_key, wstrlen(lower_key), route);
+    wstrFree(lower_key);
+    if (route) {
+        wheatLog(WHEAT_WARNING, "http-route %s is duplicated", key);
+        freeRoute(route);
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+// Without `http-route`, requests under `static-file-dir` go to static-file
+// and others go to wsgi
+static int addDefaultRoutes()
+{
+    struct configuration *conf1, *conf2;
+    char path[PATH_MAX];
+    wstr static_path;
+
+    conf1 = getConfiguration("document-root");
+    conf2 = getConfiguration("static-file-dir");
+    if (conf1->target.ptr && conf2->target.ptr) {
+        static_path = wstrNew(conf1->target.ptr);
+        static_path = wstrCat(static_path, conf2->target.ptr);
+        if (!realpath(static_path, path)) {
             wheatLog(WHEAT_WARNING, "static-file-dir is unvalid");
+            wstrFree(static_path);
             return WHEAT_WRONG;
         }
+        wstrFree(static_path);
+        if (addRoute(conf2->target.ptr, "static-file", conf1->target.ptr) == WHEAT_WRONG)
+            return WHEAT_WRONG;
+    }
+    return addRoute("/", "wsgi", NULL);
+}
+
+static int compileRoutes()
+{
+    struct configuration *conf;
+    struct listIterator *iter;
+    struct listNode *node;
+    wstr *frags, args[3];
+    int count, i, nargs, ret = WHEAT_OK;
+
+    Routes = radixCreate();
+    HostRoutes = 0;
+    conf = getConfiguration("http-route");
+    if (!conf->target.ptr)
+        return addDefaultRoutes();
+
+    iter = listGetIterator(conf->target.ptr, START_HEAD);
+    while (ret == WHEAT_OK && (node = listNext(iter)) != NULL) {
+        frags = wstrNewSplit(listNodeValue(node), " ", 1, &count);
+        if (!frags) {
+            ret = WHEAT_WRONG;
+            break;
+        }
+        nargs = 0;
+        for (i = 0; i < count; i++) {
+            if (!wstrlen(frags[i]))
+                continue;
+            if (nargs == 3) {
+                nargs++;
+                break;
+            }
+            args[nargs++] = frags[i];
+        }
+        if (nargs < 2 || nargs > 3) {
+            wheatLog(WHEAT_WARNING, "http-route %s is unvalid",
+                    (char *)listNodeValue(node));
+            ret = WHEAT_WRONG;
+        } else {
+            ret = addRoute(args[0], args[1], nargs == 3 ? args[2] : NULL);
+        }
+        wstrFreeSplit(frags, count);
+    }
+    freeListIterator(iter);
+    return ret;
+}
+
+// Route bound to request host is preferred, it doesn't allocate anything
+static struct httpRoute *matchRoute(struct httpData *data)
+{
+    struct radixWalker walker;
+    char host[WHEAT_HOST_LEN];
+    wstr value;
+    size_t i;
+
+    if (HostRoutes && (value = fetchReqHeader(data, "Host")) != NULL) {
+        for (i = 0; i < wstrlen(value) && value[i] != ':' && i < sizeof(host); i++)
+            host[i] = tolower(value[i]);
+        radixWalkInit(Routes, &walker);
+        if (radixWalk(&walker, host, i))
+            radixWalk(&walker, data->path, wstrlen(data->path));
+        if (walker.value)
+            return walker.value;
+    }
+    return radixLongestPrefix(Routes, data->path, wstrlen(data->path));
+}
+
+int initHttp()
+{
+    AccessFp = openAccessLog();
+    if (AccessFp && initAccessLogger() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    BodyBufferSize = getConfiguration("client-body-buffer-size")->target.val;
+    BodyTempPath = getConfiguration("client-body-temp-path")->target.ptr;
+    if (BodyTempPath == NULL)
+        BodyTempPath = WHEAT_BODY_TEMP_PATH;
+    Http2Enabled = getConfiguration("http2")->target.val;
+    if (Http2Enabled && spotProtocol("Http2")->initProtocol() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    WebSocketEnabled = getConfiguration("websocket")->target.val;
+    if (WebSocketEnabled && spotProtocol("WebSocket")->initProtocol() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    if (compileRoutes() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    HeaderTimeout = getConfiguration("http-header-timeout")->target.val * 1000L;
+    BodyTimeout = getConfiguration("http-body-timeout")->target.val * 1000L;
+    KeepaliveTimeout = getConfiguration("http-keepalive-timeout")->target.val * 1000L;
+    StatHeaderTimeout = getStatItemByName("Total header timeout client");
+    StatBodyTimeout = getStatItemByName("Total body timeout client");
+    StatKeepaliveTimeout = getStatItemByName("Total keepalive timeout client");
+    // Reading streamed body blocks until data arrives, only app threads can
+    // wait for it without stalling other clients of worker
+    if (getConfiguration("http-stream-request-body")->target.val) {
+        if (getConfiguration("app-threads")->target.val &&
+                !strcmp(Server.worker_type, "AsyncWorker"))
+            StreamApp = spotApp("wsgi");
+        else
+            wheatLog(WHEAT_NOTICE, "http-stream-request-body needs app-threads, body is buffered");
+    }
+    if (httpCacheEnabled()) {
+        CacheApp = spotApp("wsgi");
+        CacheItemSize = getConfiguration("http-cache-item-size")->target.val;
+        CacheTTL = getConfiguration("http-cache-ttl")->target.val;
     }
 
     memset(&HttpPaserSettings, 0 , sizeof(HttpPaserSettings));
@@ -558,72 +1609,427 @@ int initHttp()
 
 void deallocHttp()
 {
-    if (AccessFp)
+    if (Http2Enabled)
+        spotProtocol("Http2")->deallocProtocol();
+    if (WebSocketEnabled)
+        spotProtocol("WebSocket")->deallocProtocol();
+    if (AccessFp) {
+        flushAccessLog();
         fclose(AccessFp);
-    wstrFree(StaticPathHandler.abs_path);
-    memset(&StaticPathHandler, 0, sizeof(struct staticHandler));
+        AccessFp = NULL;
+    }
+    wfree(AccessLogger.buf);
+    wstrFree(AccessLogger.remote_addr_key);
+    wstrFree(AccessLogger.referer_key);
+    wstrFree(AccessLogger.user_agent_key);
+    memset(&AccessLogger, 0, sizeof(AccessLogger));
+    if (Routes) {
+        radixFree(Routes, freeRoute);
+        Routes = NULL;
+    }
+    CacheApp = NULL;
+    StreamApp = NULL;
+}
+
+static int initHttpCache()
+{
+    size_t size, item_size;
+
+    size = getConfiguration("http-cache-size")->target.val;
+    item_size = getConfiguration("http-cache-item-size")->target.val;
+    if (!size)
+        return WHEAT_OK;
+    if (httpCacheCreate(size, item_size) == -1) {
+        wheatLog(WHEAT_WARNING, "create http cache failed, http-cache-size %zu "
+                "is too small or %s", size, strerror(errno));
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+// Rule format: NAME ip|header:FIELD RATE/s|RATE/m [BURST]
+static int parseRateRule(struct rateRule *rule, wstr line)
+{
+    wstr *frags, args[4];
+    int count, i, n, rate;
+    char *unit;
+
+    frags = wstrNewSplit(line, " ", 1, &count);
+    if (!frags)
+        return WHEAT_WRONG;
+    for (i = n = 0; i < count && n < 4; i++) {
+        if (wstrlen(frags[i]))
+            args[n++] = frags[i];
+    }
+    if (n < 3)
+        goto err;
+    rate = atoi(args[2]);
+    unit = strchr(args[2], '/');
+    if (rate <= 0 || !unit || (strcmp(unit, "/s") && strcmp(unit, "/m")))
+        goto err;
+    if (!strcmp(args[1], "ip")) {
+        rule->header = NULL;
+    } else if (!strncasecmp(args[1], "header:", 7) && args[1][7]) {
+        rule->header = wstrNew(args[1] + 7);
+    } else {
+        goto err;
+    }
+    rule->name = wstrDup(args[0]);
+    rule->interval = (unit[1] == 's' ? 1000000LL : 60000000LL) / rate;
+    rule->burst = n == 4 ? atoi(args[3]) : 1;
+    if (rule->burst <= 0)
+        rule->burst = 1;
+    wstrFreeSplit(frags, count);
+    return WHEAT_OK;
+
+err:
+    wheatLog(WHEAT_WARNING, "http-rate-limit %s is unvalid", line);
+    wstrFreeSplit(frags, count);
+    return WHEAT_WRONG;
+}
+
+static int initRateLimit()
+{
+    struct list *rules = getConfiguration("http-rate-limit")->target.ptr;
+    size_t nbucket = getConfiguration("http-rate-limit-buckets")->target.val;
+    struct listIterator *iter;
+    struct listNode *node;
+
+    if (!rules || !listLength(rules))
+        return WHEAT_OK;
+    RateRules = wmalloc(sizeof(struct rateRule) * listLength(rules));
+    NRateRules = 0;
+    iter = listGetIterator(rules, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        if (parseRateRule(&RateRules[NRateRules], listNodeValue(node)) == WHEAT_WRONG) {
+            freeListIterator(iter);
+            return WHEAT_WRONG;
+        }
+        NRateRules++;
+    }
+    freeListIterator(iter);
+    if (rateLimitCreate(nbucket, NRateRules) == -1) {
+        wheatLog(WHEAT_WARNING, "create rate limiter failed: %s", strerror(errno));
+        return WHEAT_WRONG;
+    }
+    return WHEAT_OK;
+}
+
+// Cache and rate limiter are shared by workers, so they're created before
+// workers are forked. Changing them needs restart.
+int initHttpMaster()
+{
+    if (strcasecmp(getConfiguration("protocol")->target.ptr, "Http"))
+        return WHEAT_OK;
+    if (initHttpCache() == WHEAT_WRONG || initRateLimit() == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+static void rateLimitCommand(struct masterClient *c)
+{
+    char buf[256];
+    size_t i;
+    int len;
+
+    if (!rateLimitEnabled()) {
+        static const char disabled[] = "http-rate-limit is disabled\n";
+        replyMasterClient(c, disabled, sizeof(disabled)-1);
+        return ;
+    }
+    for (i = 0; i < NRateRules; i++) {
+        len = snprintf(buf, sizeof(buf), "%s: %llu\n", RateRules[i].name,
+                (unsigned long long)rateLimitRejects(i));
+        replyMasterClient(c, buf, len);
+    }
 }
 
 static const char *apacheDateFormat()
 {
     static char buf[255];
-    time_t now = time(0);
-    struct tm tm = *gmtime(&now);
-    strftime(buf, sizeof buf, "%d/%m/%Y:%H:%M:%S %z", &tm);
+    static time_t now = 0;
+    struct tm tm;
+
+    if (now != Server.cron_time.tv_sec || now == 0) {
+        now = Server.cron_time.tv_sec;
+        tm = *gmtime(&now);
+        strftime(buf, sizeof buf, "%d/%m/%Y:%H:%M:%S %z", &tm);
+    }
     return buf;
 }
 
+static size_t formatAccessRecord(char *buf, size_t size, const char *fields[6],
+        int status, int response_length)
+{
+    struct accessRecord record;
+    size_t len = sizeof(record), field_len;
+    int i;
+
+    record.status = status;
+    record.time = Server.cron_time.tv_sec;
+    record.response_length = response_length;
+    for (i = 0; i < 6; i++) {
+        field_len = strlen(fields[i]);
+        if (len + field_len > size)
+            field_len = size - len;
+        memcpy(buf + len, fields[i], field_len);
+        record.field_len[i] = field_len;
+        len += field_len;
+    }
+    record.len = len;
+    memcpy(buf, &record, sizeof(record));
+    return len;
+}
+
 void logAccess(struct conn *c)
 {
+    const char *fields[6];
+    char buf[WHEAT_ACCESS_LINE_LEN];
+    int ret, i;
+    struct httpData *http_data = c->protocol_data;
+
     if (!AccessFp)
         return ;
-    const char *remote_addr, *hyphen, *user, *datetime, *request;
-    const char *refer, *user_agent;
-    char status_str[100], resp_length[32];
-    char buf[255];
-    wstr temp;
+    if (AccessLogger.sample > 1 && AccessLogger.count++ % AccessLogger.sample)
+        return ;
+
+    fields[0] = dictFetchValue(http_data->req_headers, AccessLogger.remote_addr_key);
+    if (!fields[0])
+        fields[0] = getConnIP(c);
+    fields[1] = http_data->method;
+    fields[2] = http_data->path;
+    fields[3] = http_data->protocol_version;
+    fields[4] = dictFetchValue(http_data->req_headers, AccessLogger.referer_key);
+    fields[5] = dictFetchValue(http_data->req_headers, AccessLogger.user_agent_key);
+    for (i = 0; i < 6; i++) {
+        if (!fields[i])
+            fields[i] = "-";
+    }
+
+    if (AccessLogger.binary) {
+        ret = formatAccessRecord(buf, sizeof(buf), fields,
+                http_data->res_status, http_data->response_length);
+    } else {
+        ret = snprintf(buf, sizeof(buf), "%s - - [%s] %s %s %s %d \"%d\" %s %s\n",
+                fields[0], apacheDateFormat(), fields[1], fields[2], fields[3],
+                http_data->res_status, http_data->response_length, fields[4],
+                fields[5]);
+        if (ret < 0)
+            return ;
+        // Keep line ending if it's truncated
+        if (ret >= sizeof(buf)) {
+            ret = sizeof(buf) - 1;
+            buf[ret-1] = '\n';
+        }
+    }
+    appendAccessLog(buf, ret);
+}
+
+// Frame `data` as one chunk. Chunk header and trailing CRLF are queued as
+// separate slices around `data`, so body isn't copied and worker sends the
+// three slices in one writev(2).
+static int httpSendChunk(struct conn *c, const char *data, size_t len)
+{
+    struct slice slices[3];
+    struct httpData *http_data;
+    char *head;
     int ret;
+
+    http_data = c->protocol_data;
+    head = wmalloc(WHEAT_CHUNK_HEAD_LEN);
+    if (!head)
+        return -1;
+    registerConnFree(c, wfree, head);
+    ret = snprintf(head, WHEAT_CHUNK_HEAD_LEN, "%lx\r\n", (unsigned long)len);
+    if (ret < 0 || ret > WHEAT_CHUNK_HEAD_LEN)
+        return -1;
+
+    sliceTo(&slices[0], (uint8_t *)head, ret);
+    sliceTo(&slices[1], (uint8_t *)data, len);
+    sliceTo(&slices[2], (uint8_t *)"\r\n", 2);
+    http_data->send += len;
+    if (sendClientSlices(c, slices, 3) == WHEAT_WRONG)
+        return -1;
+    return 0;
+}
+
+// Send file as a chunk, the same as httpSendChunk but body is in `fd`
+static int httpSendFileChunk(struct conn *c, int fd, off_t off, off_t len)
+{
+    struct slice slice;
+    char *head;
+    int head_len;
+
+    head = wmalloc(WHEAT_CHUNK_HEAD_LEN);
+    if (!head)
+        return WHEAT_WRONG;
+    registerConnFree(c, wfree, head);
+    head_len = snprintf(head, WHEAT_CHUNK_HEAD_LEN, "%lx\r\n", (long)len);
+    sliceTo(&slice, (uint8_t *)head, head_len);
+    if (sendClientData(c, &slice) == WHEAT_WRONG ||
+            sendClientFileRange(c, fd, off, len) == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    sliceTo(&slice, (uint8_t *)"\r\n", 2);
+    return sendClientData(c, &slice);
+}
+
+// Apps send file as response body by it, so file content can be framed by
+// chunked encoding or other protocol as well.
+int httpSendFile(struct conn *c, int fd, off_t len)
+{
+    return httpSendFileRange(c, fd, 0, len);
+}
+
+// Send `len` bytes of file starting from `off`, file offset of `fd` isn't
+// changed so the same fd can be sent several times(multiple ranges)
+int httpSendFileRange(struct conn *c, int fd, off_t off, off_t len)
+{
     struct httpData *http_data = c->protocol_data;
 
-    temp = wstrNew("Remote_Addr");
-    remote_addr = dictFetchValue(http_data->req_headers, temp);
-    if (!remote_addr)
-        remote_addr = getConnIP(c);
-    wstrFree(temp);
-
-    hyphen = user = "-";
-    datetime = apacheDateFormat();
-    snprintf(buf, 255, "%s %s %s", http_data->method, http_data->path, http_data->protocol_version);
-    request = buf;
-    gcvt(http_data->res_status, 0, status_str);
-    gcvt(http_data->response_length, 0, resp_length);
-
-    temp = wstrNew("Referer");
-    refer = dictFetchValue(http_data->req_headers, temp);
-    if (!refer)
-        refer = "-";
-    wstrFree(temp);
-
-    temp = wstrNew("User-Agent");
-    user_agent = dictFetchValue(http_data->req_headers, temp);
-    if (!user_agent)
-        user_agent = "-";
-    wstrFree(temp);
-
-    ret = fprintf(AccessFp, "%s %s %s [%s] %s %s \"%s\" %s %s\n",
-            remote_addr, hyphen, user, datetime, request, status_str,
-            resp_length, refer, user_agent);
-    if (ret == -1) {
-        wheatLog(WHEAT_WARNING, "log access failed: %s", strerror(errno));
-        fclose(AccessFp);
-        AccessFp = openAccessLog();
-        if (!AccessFp) {
-            wheatLog(WHEAT_WARNING, "open access log failed");
-            halt(1);
+    if (!len || !strcasecmp(http_data->method, "HEAD"))
+        return WHEAT_OK;
+    if (http_data->cache_key)
+        dropCacheCapture(http_data);
+    // Like httpSendBody, nothing beyond Content-Length is sent
+    if (http_data->has_length) {
+        if (http_data->send >= http_data->response_length)
+            return WHEAT_OK;
+        if (len > http_data->response_length - http_data->send)
+            len = http_data->response_length - http_data->send;
+    }
+    http_data->send += len;
+    if (http_data->framer)
+        return http_data->framer->sendFile(c, fd, off, len) ? WHEAT_WRONG : WHEAT_OK;
+    if (isChunked(http_data))
+        return httpSendFileChunk(c, fd, off, len);
+    return sendClientFileRange(c, fd, off, len);
+}
+
+// Queue body from pipe `fd` to be sent by splice(2) until Content-Length is
+// reached, client is closed if pipe ends before. Headers must be sent already.
+// Return value:
+// 0: body is queued
+// 1: splice can't be used, caller should read pipe instead
+// -1: client failed
+int httpSendPipe(struct conn *c, int fd)
+{
+#ifdef HAVE_SPLICE
+    struct httpData *http_data = c->protocol_data;
+    size_t len;
+
+    // Only plain body without framing or copy can skip user space
+    if (!http_data->has_length || http_data->framer || isChunked(http_data) ||
+            !strcasecmp(http_data->method, "HEAD"))
+        return 1;
+    if (http_data->send >= http_data->response_length)
+        return 0;
+    if (http_data->cache_key)
+        dropCacheCapture(http_data);
+    len = http_data->response_length - http_data->send;
+    http_data->send += len;
+    return sendClientPipe(c, fd, len) == WHEAT_OK ? 0 : -1;
+#else
+    return 1;
+#endif
+}
+
+// Parse one "first-last", "first-" or "-suffix" byte range spec
+// Return value:
+// 1: satisfiable range stored in `range`
+// 0: unsatisfiable range
+// -1: syntax error
+static int parseByteRange(const char *p, const char *end, off_t size,
+        struct httpRange *range)
+{
+    off_t first = -1, last = -1;
+
+    while (p < end && isspace(*p)) p++;
+    while (end > p && isspace(end[-1])) end--;
+    if (p < end && isdigit(*p)) {
+        first = 0;
+        while (p < end && isdigit(*p)) {
+            if (first > (LLONG_MAX - 9) / 10)
+                return -1;
+            first = first * 10 + (*p++ - '0');
         }
     }
-    else
-        fflush(AccessFp);
+    if (p == end || *p++ != '-')
+        return -1;
+    if (p < end) {
+        last = 0;
+        while (p < end && isdigit(*p)) {
+            if (last > (LLONG_MAX - 9) / 10)
+                return -1;
+            last = last * 10 + (*p++ - '0');
+        }
+        if (p != end)
+            return -1;
+    }
+
+    if (first == -1) {
+        // suffix range: the last `last` bytes
+        if (last == -1)
+            return -1;
+        if (last == 0 || size == 0)
+            return 0;
+        range->start = last > size ? 0 : size - last;
+        range->len = size - range->start;
+        return 1;
+    }
+    if (last != -1 && last < first)
+        return -1;
+    if (first >= size)
+        return 0;
+    if (last == -1 || last >= size)
+        last = size - 1;
+    range->start = first;
+    range->len = last - first + 1;
+    return 1;
+}
+
+// Parse value of "Range" header against entity of `size` bytes, at most
+// `max` satisfiable ranges are stored in `ranges`.
+// Return value:
+// >0: the number of satisfiable ranges
+// 0: Range is malformed or has too many ranges, whole entity should be sent
+// -1: none of ranges is satisfiable(416)
+int httpParseRange(const char *value, off_t size, struct httpRange *ranges,
+        int max)
+{
+    const char *p, *end;
+    int ret, count = 0;
+
+    if (strncasecmp(value, "bytes=", 6))
+        return 0;
+    p = value + 6;
+    while (*p) {
+        end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+        if (count == max)
+            return 0;
+        ret = parseByteRange(p, end, size, &ranges[count]);
+        if (ret == -1)
+            return 0;
+        count += ret;
+        p = *end ? end + 1 : end;
+    }
+    return count ? count : -1;
+}
+
+// Send the last-chunk marker if response body is chunked
+static int httpSendLastChunk(struct conn *c)
+{
+    static const char last_chunk[] = "0\r\n\r\n";
+    struct slice slice;
+    struct httpData *http_data = c->protocol_data;
+
+    if (!http_data->headers_sent || !isChunked(http_data))
+        return 0;
+    sliceTo(&slice, (uint8_t *)last_chunk, sizeof(last_chunk)-1);
+    if (sendClientData(c, &slice) == WHEAT_WRONG)
+        return -1;
+    return 0;
 }
 
 /* Send a chunk of data */
@@ -638,15 +2044,19 @@ int httpSendBody(struct conn *c, const char *data, size_t len)
     http_data = c->protocol_data;
     if (!len || !strcasecmp(http_data->method, "HEAD"))
         return 0;
-    if (http_data->response_length != 0) {
+    if (http_data->cache_value)
+        captureCacheBody(http_data, data, len);
+    if (http_data->has_length) {
         if (http_data->send > http_data->response_length)
             return 0;
         restsend = http_data->response_length - http_data->send;
         tosend = restsend > tosend ? tosend: restsend;
     } else if (isChunked(http_data))
-        return 0;
+        return httpSendChunk(c, data, len);
 
     http_data->send += tosend;
+    if (http_data->framer)
+        return http_data->framer->sendBody(c, data, tosend);
     sliceTo(&slice, (uint8_t *)data, tosend);
     ret = sendClientData(c, &slice);
     if (ret == WHEAT_WRONG)
@@ -654,21 +2064,51 @@ int httpSendBody(struct conn *c, const char *data, size_t len)
     return 0;
 }
 
-int httpSendHeaders(struct conn *c)
+static int httpFinishResponse(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+
+    if (http_data->framer)
+        return http_data->framer->finish(c);
+    return httpSendLastChunk(c);
+}
+
+// Headers are handed to framer as they are, but body is still limited by
+// Content-Length in httpSendBody
+static int httpFramerSendHeaders(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+
+    iter = dictGetIterator(http_data->res_headers);
+    while ((entry = dictNext(iter)) != NULL) {
+        if (!strcasecmp(dictGetKey(entry), CONTENT_LENGTH)) {
+            http_data->response_length = atoi(dictGetVal(entry));
+            http_data->has_length = 1;
+        }
+    }
+    dictReleaseIterator(iter);
+    if (http_data->framer->sendHeaders(c, http_data->res_status,
+                http_data->res_headers) == -1)
+        return -1;
+    http_data->headers_sent = 1;
+    return 0;
+}
+
+// Build status line and headers into `send_header` of http data, return
+// NULL if failed
+static wstr buildResHeaders(struct conn *c)
 {
     struct httpData *http_data = c->protocol_data;
-    int ok, len, ret, is_connection;
+    int ok, ret, is_connection, is_transfer_encoding;
     struct dictIterator *iter;
     struct dictEntry *entry;
     const char *connection;
     char buf[256];
     wstr field, value, headers;
-    struct slice slice;
 
-    if (http_data->headers_sent)
-        return 0;
-
-    is_connection = 0;
+    is_connection = is_transfer_encoding = 0;
     ok = 0;
     iter = dictGetIterator(http_data->res_headers);
     headers = defaultResHeader(c, http_data->send_header);
@@ -678,10 +2118,12 @@ int httpSendHeaders(struct conn *c)
         ASSERT(field && value);
         if (!strncasecmp(field, TRANSFER_ENCODING,
                     sizeof(TRANSFER_ENCODING))) {
+            is_transfer_encoding = 1;
             if (!strncasecmp(value, CHUNKED, sizeof(CHUNKED)))
                 http_data->is_chunked_in_header = 1;
         } else if (!strncasecmp(field, CONTENT_LENGTH, sizeof(CONTENT_LENGTH))) {
             http_data->response_length = atoi(value);
+            http_data->has_length = 1;
         } else if (!strncasecmp(field, CONNECTION, sizeof(CONNECTION))) {
             is_connection = 1;
         }
@@ -690,8 +2132,23 @@ int httpSendHeaders(struct conn *c)
             goto cleanup;
         headers = wstrCatLen(headers, buf, ret);
     }
-    if (!http_data->response_length && http_data->res_status != 302)
-        http_data->keep_live = 0;
+    // Without Content-Length, HTTP/1.1 client can still find the end of body
+    // by chunk framing and keep connection alive. Otherwise closing
+    // connection is the only way to delimit body.
+    if (!http_data->has_length && !isBodilessResponse(http_data)) {
+        if (http_data->protocol_version == PROTOCOL_VERSION[1] &&
+                (!is_transfer_encoding || http_data->is_chunked_in_header)) {
+            http_data->chunked = 1;
+            if (!is_transfer_encoding) {
+                ret = snprintf(buf, sizeof(buf), "%s: chunked\r\n",
+                        TRANSFER_ENCODING);
+                if ((headers = wstrCatLen(headers, buf, ret)) == NULL)
+                    goto cleanup;
+            }
+        } else if (http_data->res_status != 302) {
+            http_data->keep_live = 0;
+        }
+    }
     if (!is_connection) {
         connection = connectionField(c);
         ret = snprintf(buf, sizeof(buf), "Connection: %s\r\n", connection);
@@ -702,18 +2159,68 @@ int httpSendHeaders(struct conn *c)
     }
 
     headers = wstrCatLen(headers, "\r\n", 2);
-    sliceTo(&slice, (uint8_t *)headers, wstrlen(headers));
-
-    len = sendClientData(c, &slice);
-    if (len < 0) {
-        goto cleanup;
-    }
-    http_data->headers_sent = 1;
     ok = 1;
 
 cleanup:
     dictReleaseIterator(iter);
-    return ok? 0 : -1;
+    return ok ? headers : NULL;
+}
+
+int httpSendHeaders(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+    struct slice slice;
+    wstr headers;
+
+    if (http_data->headers_sent)
+        return 0;
+    if (http_data->cache_key)
+        captureCacheHeaders(http_data);
+    if (http_data->framer)
+        return httpFramerSendHeaders(c);
+
+    headers = buildResHeaders(c);
+    if (!headers)
+        return -1;
+    sliceTo(&slice, (uint8_t *)headers, wstrlen(headers));
+    if (sendClientData(c, &slice) < 0)
+        return -1;
+    http_data->headers_sent = 1;
+    return 0;
+}
+
+// Send headers and the whole body in memory together, so small response
+// is written by one writev(2). Body isn't copied and must live until conn
+// is freed.
+int httpSendResponse(struct conn *c, const char *body, size_t len)
+{
+    struct httpData *http_data = c->protocol_data;
+    struct slice slices[2];
+    wstr headers;
+
+    if (http_data->headers_sent || http_data->cache_key ||
+            http_data->framer || !len ||
+            !strcasecmp(http_data->method, "HEAD")) {
+        if (httpSendHeaders(c) == -1)
+            return -1;
+        return httpSendBody(c, body, len);
+    }
+
+    headers = buildResHeaders(c);
+    if (!headers)
+        return -1;
+    if (!http_data->has_length || http_data->response_length != len) {
+        sliceTo(&slices[0], (uint8_t *)headers, wstrlen(headers));
+        if (sendClientData(c, &slices[0]) < 0)
+            return -1;
+        http_data->headers_sent = 1;
+        return httpSendBody(c, body, len);
+    }
+    http_data->headers_sent = 1;
+    http_data->send += len;
+    sliceTo(&slices[0], (uint8_t *)headers, wstrlen(headers));
+    sliceTo(&slices[1], (uint8_t *)body, len);
+    return sendClientSlices(c, slices, 2) == WHEAT_WRONG ? -1 : 0;
 }
 
 
@@ -733,6 +2240,58 @@ void sendResponse404(struct conn *c)
         httpSendBody(c, body, strlen(body));
 }
 
+static void sendResponse429(struct conn *c, int64_t wait)
+{
+    static const char body[] =
+        "<html><head><title>429 Too Many Requests</title></head>\n"
+        "<body><h1>Too Many Requests</h1></body></html>\n";
+    char buf[32];
+
+    fillResInfo(c, 429, "Too Many Requests");
+    snprintf(buf, sizeof(buf), "%lld", (long long)(wait + 999999) / 1000000);
+    appendToResHeaders(c, "Retry-After", buf);
+    if (!httpSendHeaders(c))
+        httpSendBody(c, body, sizeof(body)-1);
+}
+
+static const char *rateRuleKey(struct conn *c, size_t rule)
+{
+    if (RateRules[rule].header)
+        return fetchReqHeader(c->protocol_data, RateRules[rule].header);
+    return getConnIP(c);
+}
+
+// Requests over any rule are answered with 429 before routed to app.
+// Tokens taken by rules checked before the rejecting one are given back,
+// so rejected requests don't use up quota of looser rules.
+static int rateLimited(struct conn *c)
+{
+    struct timeval tv;
+    const char *key;
+    int64_t now, wait;
+    size_t i;
+
+    gettimeofday(&tv, NULL);
+    now = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    for (i = 0; i < NRateRules; i++) {
+        if (!(key = rateRuleKey(c, i)))
+            continue;
+        wait = rateLimitTake(i, key, strlen(key), now, RateRules[i].interval,
+                RateRules[i].burst);
+        if (wait)
+            break;
+    }
+    if (i == NRateRules)
+        return 0;
+    while (i-- > 0) {
+        if ((key = rateRuleKey(c, i)) != NULL)
+            rateLimitGive(i, key, strlen(key), RateRules[i].interval);
+    }
+    getStatItemByName("Total rate limited request")->val++;
+    sendResponse429(c, wait);
+    return 1;
+}
+
 void sendResponse500(struct conn *c)
 {
     static const char body[] =
@@ -755,13 +2314,30 @@ int httpSpot(struct conn *c)
     struct app *app;
     int ret;
     struct httpData *http_data = c->protocol_data;
+    struct httpRoute *route;
     wstr path = NULL;
-    if (StaticPathHandler.abs_path && fromSameParentDir(StaticPathHandler.static_dir, http_data->path)) {
-        path = wstrNew(StaticPathHandler.root);
+    void *arg;
+
+    if (NRateRules && rateLimited(c)) {
+        ret = WHEAT_OK;
+        goto finish;
+    }
+    route = matchRoute(http_data);
+    if (!route) {
+        sendResponse404(c);
+        ret = WHEAT_OK;
+        goto finish;
+    }
+    app = route->app;
+    arg = route->arg;
+    if (app == CacheApp && spotCachedResponse(c)) {
+        ret = WHEAT_OK;
+        goto finish;
+    }
+    if (route->root) {
+        path = wstrNew(route->root);
         path = wstrCat(path, http_data->path);
-        app = spotApp("static-file");
-    } else {
-        app = spotApp("wsgi");
+        arg = path;
     }
     if (app->is_init) {
         ret = app->initApp(c->client->protocol);
@@ -778,14 +2354,38 @@ int httpSpot(struct conn *c)
         wheatLog(WHEAT_WARNING, "init app data failed");
         return WHEAT_WRONG;
     }
-    ret = app->appCall(c, path);
+    ret = app->appCall(c, arg);
     if (ret == WHEAT_WRONG) {
         wheatLog(WHEAT_WARNING, "app failed, exited");
         app->deallocApp();
         app->is_init = 0;
     }
-    logAccess(c);
     wstrFree(path);
-    finishConn(c);
+    if (http_data->deferred)
+        return ret;
+finish:
+    httpDiscardBody(c);
+    httpCompleteResponse(c);
     return ret;
 }
+
+// App answering later(e.g. waiting for backend server) calls it in
+// `appCall`, then response is completed by httpCompleteResponse instead of
+// returning from `appCall`.
+void httpDeferResponse(struct conn *c)
+{
+    ((struct httpData*)c->protocol_data)->deferred = 1;
+}
+
+// `c` may be freed after return
+void httpCompleteResponse(struct conn *c)
+{
+    struct httpData *http_data = c->protocol_data;
+
+    if (http_data->cache_key)
+        storeCacheResponse(http_data);
+    if (httpFinishResponse(c) == -1)
+        setClientClose(c);
+    logAccess(c);
+    finishConn(c);
+}
@@ -18,12 +18,44 @@
 #define IF_MODIFIED_SINCE    "If-Modified-Since"
 #define CHUNKED              "Chunked"
 #define HTTP_CONTINUE        "HTTP/1.1 100 Continue\r\n\r\n"
+#define HTTP2_SETTINGS       "HTTP2-Settings"
+#define SEC_WEBSOCKET_KEY    "Sec-WebSocket-Key"
+#define RANGE                "Range"
+#define IF_RANGE             "If-Range"
+#define ACCEPT_RANGES        "Accept-Ranges"
+#define CONTENT_RANGE        "Content-Range"
+#define ACCEPT_ENCODING      "Accept-Encoding"
+#define CONTENT_ENCODING     "Content-Encoding"
+#define VARY                 "Vary"
+#define ETAG                 "ETag"
+#define IF_NONE_MATCH        "If-None-Match"
+#define CACHE_CONTROL        "Cache-Control"
+
+struct httpData;
+
+struct httpRange {
+    off_t start;
+    off_t len;
+};
+
+// Protocols carrying http semantics on their own framing(e.g. Http2) build
+// requests by the request building API below, apps still see them via the
+// API above. Response of these requests is handed to `httpFramer` instead
+// of being written as HTTP/1.1 text.
+struct httpFramer {
+    int (*sendHeaders)(struct conn *c, int status, struct dict *headers);
+    int (*sendBody)(struct conn *c, const char *data, size_t len);
+    int (*sendFile)(struct conn *c, int fd, off_t off, size_t len);
+    int (*finish)(struct conn *c);
+};
 
 // Http protocol API
 const wstr httpGetPath(struct conn *c);
 const wstr httpGetQueryString(struct conn *c);
 const struct slice *httpGetBodyNext(struct conn *c);
+int httpGetBodyFile(struct conn *c);
 int httpBodyGetSize(struct conn *c);
+void httpDiscardBody(struct conn *c);
 const char *httpGetUrlScheme(struct conn *c);
 const char *httpGetMethod(struct conn *c);
 const char *httpGetProtocolVersion(struct conn *c);
@@ -36,10 +68,35 @@ time_t fromHttpDate(char *buf);
 int httpSendBody(struct conn *c, const char *data, size_t len);
 void fillResInfo(struct conn *c, int status, const char *msg);
 int httpSendHeaders(struct conn *c);
+int httpSendResponse(struct conn *c, const char *body, size_t len);
 void sendResponse500(struct conn *c);
 void sendResponse404(struct conn *c);
 int appendToResHeaders(struct conn *c, const char *field,
         const char *value);
+int httpSendFile(struct conn *c, int fd, off_t len);
+int httpSendFileRange(struct conn *c, int fd, off_t off, off_t len);
+int httpSendPipe(struct conn *c, int fd);
+int httpParseRange(const char *value, off_t size, struct httpRange *ranges,
+        int max);
+void httpDeferResponse(struct conn *c);
+void httpCompleteResponse(struct conn *c);
+
+// Http request building API
+void *initHttpData();
+void freeHttpData(void *data);
+struct httpData *httpCreateRequest(struct httpFramer *framer, void *framer_data);
+int httpSetRequestMethod(struct httpData *data, const char *method, size_t len);
+int httpSetRequestUrl(struct httpData *data, const char *url, size_t len);
+void httpSetRequestScheme(struct httpData *data, const char *scheme, size_t len);
+int httpAddRequestHeader(struct httpData *data, const char *field,
+        size_t field_len, const char *value, size_t value_len);
+int httpAppendRequestBody(struct httpData *data, const char *at, size_t len);
+void httpFinishRequest(struct httpData *data);
+void httpSetFramer(struct httpData *data, struct httpFramer *framer,
+        void *framer_data);
+void *httpGetFramerData(struct conn *c);
+int httpSpot(struct conn *c);
+char *httpDate();
 
 void logAccess(struct conn *c);
 
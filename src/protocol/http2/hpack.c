@@ -0,0 +1,648 @@
+// HPACK header compression for Http2(RFC 7541)
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "hpack.h"
+#include "../../memalloc.h"
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STATIC_LEN     61
+
+struct hpackField {
+    const char *name;
+    const char *value;
+};
+
+// Appendix A
+static const struct hpackField StaticTable[HPACK_STATIC_LEN] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""},
+    {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""},
+    {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+    {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+    {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""}
+};
+
+struct huffmanCode {
+    uint32_t code;
+    int bits;
+};
+
+// Appendix B, symbol 256 is EOS
+static const struct huffmanCode HuffmanCodes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6},
+    {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5},
+    {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6},
+    {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12},
+    {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7},
+    {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7},
+    {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7},
+    {0x6c, 7}, {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7},
+    {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19},
+    {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15}, {0x3, 5}, {0x23, 6},
+    {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5},
+    {0x74, 7}, {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7},
+    {0x78, 7}, {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11},
+    {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20},
+    {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22},
+    {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22},
+    {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23},
+    {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24},
+    {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24},
+    {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23},
+    {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22},
+    {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22},
+    {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23},
+    {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21},
+    {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21},
+    {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23},
+    {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20},
+    {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23},
+    {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22},
+    {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26},
+    {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27},
+    {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19},
+    {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27},
+    {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21},
+    {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28},
+    {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20},
+    {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22},
+    {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22},
+    {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24},
+    {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26},
+    {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27},
+    {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27},
+    {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27}, {0x7ffffee, 27},
+    {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+};
+
+// Decoding tree built from HuffmanCodes, child 0 means no such node because
+// root is never a child
+struct huffmanNode {
+    int16_t child[2];
+    int16_t sym;
+};
+
+static struct huffmanNode HuffmanTree[513];
+static int HuffmanTreeLen = 0;
+
+struct hpackEntry {
+    wstr name;
+    wstr value;
+};
+
+// Dynamic table is a ring of entries, the newest one is at `first`
+struct hpackTable {
+    struct hpackEntry *entries;
+    size_t slots;
+    size_t first;
+    size_t len;
+    size_t size;
+    size_t max_size;
+    size_t limit;
+};
+
+static void buildHuffmanTree()
+{
+    int sym, i, bit, node;
+
+    memset(HuffmanTree, 0, sizeof(HuffmanTree));
+    HuffmanTree[0].sym = -1;
+    HuffmanTreeLen = 1;
+    for (sym = 0; sym < 257; sym++) {
+        node = 0;
+        for (i = HuffmanCodes[sym].bits - 1; i >= 0; i--) {
+            bit = (HuffmanCodes[sym].code >> i) & 1;
+            if (HuffmanTree[node].child[bit] == 0) {
+                HuffmanTree[HuffmanTreeLen].sym = -1;
+                HuffmanTree[node].child[bit] = HuffmanTreeLen++;
+            }
+            node = HuffmanTree[node].child[bit];
+        }
+        HuffmanTree[node].sym = sym;
+    }
+}
+
+static int huffmanDecode(const uint8_t *p, size_t len, wstr *out)
+{
+    int node, i, bit, depth, all_ones;
+    char sym;
+    const uint8_t *end = p + len;
+
+    if (!HuffmanTreeLen)
+        buildHuffmanTree();
+    node = depth = 0;
+    all_ones = 1;
+    for (; p < end; p++) {
+        for (i = 7; i >= 0; i--) {
+            bit = (*p >> i) & 1;
+            node = HuffmanTree[node].child[bit];
+            if (node == 0)
+                return -1;
+            depth++;
+            all_ones &= bit;
+            if (HuffmanTree[node].sym == -1)
+                continue;
+            if (HuffmanTree[node].sym == 256)
+                return -1;
+            sym = (char)HuffmanTree[node].sym;
+            if ((*out = wstrCatLen(*out, &sym, 1)) == NULL)
+                return -1;
+            node = depth = 0;
+            all_ones = 1;
+        }
+    }
+    // Padding is the most-significant bits of EOS and shorter than a byte
+    if (depth > 7 || !all_ones)
+        return -1;
+    return 0;
+}
+
+static size_t huffmanEncodedLen(const char *s, size_t len)
+{
+    size_t bits = 0;
+    while (len--)
+        bits += HuffmanCodes[(uint8_t)*s++].bits;
+    return (bits + 7) / 8;
+}
+
+static wstr huffmanEncode(wstr out, const char *s, size_t len)
+{
+    uint64_t acc = 0;
+    int nbits = 0;
+    char byte;
+    const struct huffmanCode *code;
+
+    while (len--) {
+        code = &HuffmanCodes[(uint8_t)*s++];
+        acc = (acc << code->bits) | code->code;
+        nbits += code->bits;
+        while (nbits >= 8) {
+            nbits -= 8;
+            byte = (char)(acc >> nbits);
+            if ((out = wstrCatLen(out, &byte, 1)) == NULL)
+                return NULL;
+        }
+    }
+    if (nbits) {
+        byte = (char)((acc << (8 - nbits)) | (0xff >> nbits));
+        out = wstrCatLen(out, &byte, 1);
+    }
+    return out;
+}
+
+// 5.1 Integer Representation
+static int decodeInteger(const uint8_t **p, const uint8_t *end, int prefix,
+        size_t *value)
+{
+    size_t mask = (1 << prefix) - 1;
+    int shift = 0;
+    size_t v;
+
+    v = **p & mask;
+    (*p)++;
+    if (v < mask) {
+        *value = v;
+        return 0;
+    }
+    while (*p < end) {
+        if (shift > 28)
+            return -1;
+        v += (size_t)(**p & 0x7f) << shift;
+        shift += 7;
+        if (!(*(*p)++ & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static wstr encodeInteger(wstr out, uint8_t first, int prefix, size_t value)
+{
+    size_t mask = (1 << prefix) - 1;
+    char byte;
+
+    if (value < mask) {
+        byte = (char)(first | value);
+        return wstrCatLen(out, &byte, 1);
+    }
+    byte = (char)(first | mask);
+    out = wstrCatLen(out, &byte, 1);
+    value -= mask;
+    while (out && value >= 0x80) {
+        byte = (char)((value & 0x7f) | 0x80);
+        out = wstrCatLen(out, &byte, 1);
+        value >>= 7;
+    }
+    if (out) {
+        byte = (char)value;
+        out = wstrCatLen(out, &byte, 1);
+    }
+    return out;
+}
+
+// 5.2 String Literal Representation, the result is returned in new wstr
+static wstr decodeString(const uint8_t **p, const uint8_t *end)
+{
+    int huffman;
+    size_t len;
+    wstr s;
+
+    if (*p >= end)
+        return NULL;
+    huffman = **p & 0x80;
+    if (decodeInteger(p, end, 7, &len) == -1 || len > (size_t)(end - *p))
+        return NULL;
+    if (huffman) {
+        s = wstrNewLen(NULL, (int)(len * 8 / 5));
+        if (s && huffmanDecode(*p, len, &s) == -1) {
+            wstrFree(s);
+            s = NULL;
+        }
+    } else {
+        s = wstrNewLen(*p, (int)len);
+    }
+    *p += len;
+    return s;
+}
+
+static wstr encodeString(wstr out, const char *s, size_t len, int lower)
+{
+    size_t huffman_len, i;
+    char buf[256], *lowered = NULL;
+
+    if (lower) {
+        lowered = len <= sizeof(buf) ? buf : wmalloc(len);
+        if (!lowered)
+            return NULL;
+        for (i = 0; i < len; i++)
+            lowered[i] = tolower(s[i]);
+        s = lowered;
+    }
+    huffman_len = huffmanEncodedLen(s, len);
+    if (huffman_len < len) {
+        out = encodeInteger(out, 0x80, 7, huffman_len);
+        if (out)
+            out = huffmanEncode(out, s, len);
+    } else {
+        out = encodeInteger(out, 0, 7, len);
+        if (out)
+            out = wstrCatLen(out, s, len);
+    }
+    if (lowered && lowered != buf)
+        wfree(lowered);
+    return out;
+}
+
+struct hpackTable *hpackTableCreate(size_t max_size)
+{
+    struct hpackTable *t = wmalloc(sizeof(*t));
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->max_size = t->limit = max_size;
+    return t;
+}
+
+static struct hpackEntry *tableEntry(struct hpackTable *t, size_t i)
+{
+    return &t->entries[(t->first + i) % t->slots];
+}
+
+static void evictEntries(struct hpackTable *t, size_t max_size)
+{
+    struct hpackEntry *e;
+
+    while (t->len && t->size > max_size) {
+        e = tableEntry(t, t->len - 1);
+        t->size -= wstrlen(e->name) + wstrlen(e->value) + HPACK_ENTRY_OVERHEAD;
+        wstrFree(e->name);
+        wstrFree(e->value);
+        t->len--;
+    }
+}
+
+void hpackTableFree(struct hpackTable *t)
+{
+    evictEntries(t, 0);
+    wfree(t->entries);
+    wfree(t);
+}
+
+// 4.4 Entry Eviction When Adding New Entries, table takes `name` and `value`
+static int addEntry(struct hpackTable *t, wstr name, wstr value)
+{
+    size_t size, i, slots;
+    struct hpackEntry *entries;
+
+    size = wstrlen(name) + wstrlen(value) + HPACK_ENTRY_OVERHEAD;
+    if (size > t->max_size) {
+        evictEntries(t, 0);
+        wstrFree(name);
+        wstrFree(value);
+        return 0;
+    }
+    evictEntries(t, t->max_size - size);
+    if (t->len == t->slots) {
+        slots = t->slots ? t->slots * 2 : 16;
+        entries = wmalloc(sizeof(*entries) * slots);
+        if (!entries)
+            return -1;
+        for (i = 0; i < t->len; i++)
+            entries[i] = *tableEntry(t, i);
+        wfree(t->entries);
+        t->entries = entries;
+        t->slots = slots;
+        t->first = 0;
+    }
+    t->first = (t->first + t->slots - 1) % t->slots;
+    t->entries[t->first].name = name;
+    t->entries[t->first].value = value;
+    t->len++;
+    t->size += size;
+    return 0;
+}
+
+// Index space is static table followed by dynamic table(2.3.3)
+static int lookupIndex(struct hpackTable *t, size_t index,
+        const char **name, size_t *name_len,
+        const char **value, size_t *value_len)
+{
+    struct hpackEntry *e;
+
+    if (index == 0)
+        return -1;
+    if (index <= HPACK_STATIC_LEN) {
+        *name = StaticTable[index-1].name;
+        *name_len = strlen(*name);
+        *value = StaticTable[index-1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_LEN + 1;
+    if (index >= t->len)
+        return -1;
+    e = tableEntry(t, index);
+    *name = e->name;
+    *name_len = wstrlen(e->name);
+    *value = e->value;
+    *value_len = wstrlen(e->value);
+    return 0;
+}
+
+// 6.2 Literal Header Field Representation, `prefix` is the length of index
+static int decodeLiteral(struct hpackTable *t, const uint8_t **p,
+        const uint8_t *end, int prefix, int indexing,
+        hpackEmit emit, void *data)
+{
+    size_t index, name_len, value_len;
+    const char *name, *value;
+    wstr name_str, value_str;
+    int ret;
+
+    if (decodeInteger(p, end, prefix, &index) == -1)
+        return -1;
+    if (index) {
+        if (lookupIndex(t, index, &name, &name_len, &value, &value_len) == -1)
+            return -1;
+        name_str = wstrNewLen(name, (int)name_len);
+    } else {
+        name_str = decodeString(p, end);
+    }
+    if (!name_str)
+        return -1;
+    value_str = decodeString(p, end);
+    if (!value_str) {
+        wstrFree(name_str);
+        return -1;
+    }
+    ret = emit(data, name_str, wstrlen(name_str), value_str,
+            wstrlen(value_str));
+    if (ret == 0 && indexing)
+        return addEntry(t, name_str, value_str);
+    wstrFree(name_str);
+    wstrFree(value_str);
+    return ret;
+}
+
+int hpackDecode(struct hpackTable *t, const uint8_t *block, size_t len,
+        hpackEmit emit, void *data)
+{
+    const uint8_t *p = block, *end = block + len;
+    size_t index, name_len, value_len;
+    const char *name, *value;
+
+    while (p < end) {
+        if (*p & 0x80) {
+            // 6.1 Indexed Header Field Representation
+            if (decodeInteger(&p, end, 7, &index) == -1 ||
+                    lookupIndex(t, index, &name, &name_len, &value, &value_len) == -1)
+                return -1;
+            if (emit(data, name, name_len, value, value_len) == -1)
+                return -1;
+        } else if (*p & 0x40) {
+            if (decodeLiteral(t, &p, end, 6, 1, emit, data) == -1)
+                return -1;
+        } else if (*p & 0x20) {
+            // 6.3 Dynamic Table Size Update
+            if (decodeInteger(&p, end, 5, &index) == -1 || index > t->limit)
+                return -1;
+            t->max_size = index;
+            evictEntries(t, index);
+        } else {
+            // Without indexing(0000) and never indexed(0001)
+            if (decodeLiteral(t, &p, end, 4, 0, emit, data) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+wstr hpackEncodeStatus(wstr out, int status)
+{
+    char buf[8];
+    int i;
+
+    for (i = 0; i < HPACK_STATIC_LEN; i++) {
+        if (StaticTable[i].name[1] == 's' &&
+                !strcmp(StaticTable[i].name, ":status") &&
+                atoi(StaticTable[i].value) == status)
+            return encodeInteger(out, 0x80, 7, i+1);
+    }
+    snprintf(buf, sizeof(buf), "%03d", status % 1000);
+    // Literal without indexing, name is `:status` in static table
+    if ((out = encodeInteger(out, 0, 4, 8)) == NULL)
+        return NULL;
+    return encodeString(out, buf, 3, 0);
+}
+
+wstr hpackEncodeHeader(wstr out, const char *name, size_t name_len,
+        const char *value, size_t value_len)
+{
+    int i;
+
+    for (i = 0; i < HPACK_STATIC_LEN; i++) {
+        if (strlen(StaticTable[i].name) == name_len &&
+                !strncasecmp(StaticTable[i].name, name, name_len))
+            break;
+    }
+    if (i < HPACK_STATIC_LEN) {
+        out = encodeInteger(out, 0, 4, i+1);
+    } else {
+        out = encodeInteger(out, 0, 4, 0);
+        if (out)
+            out = encodeString(out, name, name_len, 1);
+    }
+    if (out)
+        out = encodeString(out, value, value_len, 0);
+    return out;
+}
+
+#ifdef HPACK_TEST_MAIN
+#include "../../test_help.h"
+
+static int appendHeader(void *data, const char *name, size_t name_len,
+        const char *value, size_t value_len)
+{
+    wstr *out = data;
+    *out = wstrCatLen(*out, name, name_len);
+    *out = wstrCatLen(*out, ": ", 2);
+    *out = wstrCatLen(*out, value, value_len);
+    *out = wstrCatLen(*out, "\n", 1);
+    return 0;
+}
+
+static int decodeHex(struct hpackTable *t, const char *hex, wstr *out)
+{
+    uint8_t block[512];
+    size_t len = strlen(hex) / 2, i;
+    unsigned int byte;
+
+    for (i = 0; i < len; i++) {
+        sscanf(hex + i*2, "%2x", &byte);
+        block[i] = (uint8_t)byte;
+    }
+    wstrClear(*out);
+    return hpackDecode(t, block, len, appendHeader, out);
+}
+
+int main(int argc, const char *argv[])
+{
+    struct hpackTable *t;
+    wstr out = wstrEmpty(), block;
+    int ret;
+
+    {
+        // C.3 Request Examples without Huffman Coding
+        t = hpackTableCreate(HPACK_DEFAULT_TABLE_SIZE);
+        ret = decodeHex(t, "828684410f7777772e6578616d706c652e636f6d", &out);
+        test_cond("decode first request", ret == 0 && !strcmp(out,
+                    ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\n") && t->size == 57);
+        ret = decodeHex(t, "828684be58086e6f2d6361636865", &out);
+        test_cond("decode second request", ret == 0 && !strcmp(out,
+                    ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\ncache-control: no-cache\n") &&
+                t->size == 110);
+        ret = decodeHex(t, "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565", &out);
+        test_cond("decode third request", ret == 0 && !strcmp(out,
+                    ":method: GET\n:scheme: https\n:path: /index.html\n"
+                    ":authority: www.example.com\ncustom-key: custom-value\n") &&
+                t->size == 164 && t->len == 3);
+        hpackTableFree(t);
+    }
+    {
+        // C.4 Request Examples with Huffman Coding
+        t = hpackTableCreate(HPACK_DEFAULT_TABLE_SIZE);
+        ret = decodeHex(t, "828684418cf1e3c2e5f23a6ba0ab90f4ff", &out);
+        test_cond("huffman decode first request", ret == 0 && !strcmp(out,
+                    ":method: GET\n:scheme: http\n:path: /\n"
+                    ":authority: www.example.com\n"));
+        ret = decodeHex(t, "828684be5886a8eb10649cbf", &out);
+        test_cond("huffman decode second request", ret == 0 &&
+                strstr(out, "cache-control: no-cache\n") != NULL);
+        ret = decodeHex(t, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", &out);
+        test_cond("huffman decode third request", ret == 0 &&
+                strstr(out, "custom-key: custom-value\n") != NULL &&
+                t->size == 164);
+        ret = decodeHex(t, "418cf1e3c2e5f23a6ba0ab90f4fe", &out);
+        test_cond("huffman decode bad padding", ret == -1);
+        ret = decodeHex(t, "c4", &out);
+        test_cond("decode unknown index", ret == -1);
+        hpackTableFree(t);
+    }
+    {
+        // C.5 Response Examples without Huffman Coding, eviction happens
+        t = hpackTableCreate(256);
+        ret = decodeHex(t, "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d546e1768747470733a2f2f7777772e6578616d706c652e636f6d", &out);
+        test_cond("decode first response", ret == 0 && t->size == 222);
+        ret = decodeHex(t, "4803333037c1c0bf", &out);
+        test_cond("decode second response", ret == 0 && !strcmp(out,
+                    ":status: 307\ncache-control: private\n"
+                    "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                    "location: https://www.example.com\n") && t->size == 222);
+        ret = decodeHex(t, "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a69707738666f6f3d4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b2076657273696f6e3d31", &out);
+        test_cond("decode third response", ret == 0 &&
+                strstr(out, "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; "
+                    "max-age=3600; version=1\n") != NULL &&
+                t->size == 215 && t->len == 3);
+        ret = decodeHex(t, "3fe201", &out);
+        test_cond("table size update over limit", ret == -1);
+        hpackTableFree(t);
+    }
+    {
+        t = hpackTableCreate(HPACK_DEFAULT_TABLE_SIZE);
+        block = wstrEmpty();
+        block = hpackEncodeStatus(block, 200);
+        block = hpackEncodeStatus(block, 302);
+        block = hpackEncodeHeader(block, "Content-Type", 12, "text/html", 9);
+        block = hpackEncodeHeader(block, "X-Powered-By", 12, "wheatserver", 11);
+        ret = hpackDecode(t, (uint8_t *)block, wstrlen(block), appendHeader, &out);
+        test_cond("encode and decode", ret == 0 && !strcmp(out,
+                    ":status: 200\n:status: 302\ncontent-type: text/html\n"
+                    "x-powered-by: wheatserver\n") && t->len == 0);
+        wstrFree(block);
+        hpackTableFree(t);
+    }
+    wstrFree(out);
+    test_report();
+    return 0;
+}
+#endif
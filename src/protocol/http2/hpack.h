@@ -0,0 +1,34 @@
+// HPACK header compression for Http2(RFC 7541)
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_PROTOCOL_HTTP2_HPACK_H
+#define WHEATSERVER_PROTOCOL_HTTP2_HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "../../wstr.h"
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+
+// Decoding context keeps the dynamic table of one direction of a connection
+struct hpackTable;
+
+// Called for each decoded header field, return -1 to stop decoding
+typedef int (*hpackEmit)(void *data, const char *name, size_t name_len,
+        const char *value, size_t value_len);
+
+struct hpackTable *hpackTableCreate(size_t max_size);
+void hpackTableFree(struct hpackTable *t);
+int hpackDecode(struct hpackTable *t, const uint8_t *block, size_t len,
+        hpackEmit emit, void *data);
+
+// Encoder never inserts into dynamic table, so it needs no context. Header
+// name is lowercased as Http2 requires.
+wstr hpackEncodeStatus(wstr out, int status);
+wstr hpackEncodeHeader(wstr out, const char *name, size_t name_len,
+        const char *value, size_t value_len);
+
+#endif
@@ -0,0 +1,1272 @@
+// Http2 protocol module implemetation
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "../http/proto_http.h"
+#include "proto_http2.h"
+#include "hpack.h"
+
+#define HTTP2_PREFACE           "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN       24
+#define HTTP2_SWITCHING         "HTTP/1.1 101 Switching Protocols\r\n" \
+                                "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+#define HTTP2_FRAME_HEAD_LEN    9
+#define HTTP2_FRAME_SIZE        16384
+#define HTTP2_MAX_FRAME_SIZE    16777215
+#define HTTP2_DEFAULT_WINDOW    65535
+#define HTTP2_MAX_WINDOW        0x7fffffff
+#define WHEAT_HTTP2_STREAMS     100
+
+// Frame types
+#define HTTP2_FRAME_DATA            0x0
+#define HTTP2_FRAME_HEADERS         0x1
+#define HTTP2_FRAME_PRIORITY        0x2
+#define HTTP2_FRAME_RST_STREAM      0x3
+#define HTTP2_FRAME_SETTINGS        0x4
+#define HTTP2_FRAME_PUSH_PROMISE    0x5
+#define HTTP2_FRAME_PING            0x6
+#define HTTP2_FRAME_GOAWAY          0x7
+#define HTTP2_FRAME_WINDOW_UPDATE   0x8
+#define HTTP2_FRAME_CONTINUATION    0x9
+
+// Frame flags
+#define HTTP2_END_STREAM        0x1
+#define HTTP2_ACK               0x1
+#define HTTP2_END_HEADERS       0x4
+#define HTTP2_PADDED            0x8
+#define HTTP2_PRIORITY_FLAG     0x20
+
+// Error codes
+#define HTTP2_NO_ERROR          0x0
+#define HTTP2_PROTOCOL_ERROR    0x1
+#define HTTP2_INTERNAL_ERROR    0x2
+#define HTTP2_FLOW_CONTROL_ERROR 0x3
+#define HTTP2_STREAM_CLOSED     0x5
+#define HTTP2_FRAME_SIZE_ERROR  0x6
+#define HTTP2_REFUSED_STREAM    0x7
+#define HTTP2_COMPRESSION_ERROR 0x9
+
+// Settings
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE        0x1
+#define HTTP2_SETTINGS_ENABLE_PUSH              0x2
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS   0x3
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE      0x4
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE           0x5
+
+int parseHttp2(struct conn *, struct slice *, size_t *);
+int initHttp2();
+void deallocHttp2();
+
+static int http2SendHeaders(struct conn *c, int status, struct dict *headers);
+static int http2SendBody(struct conn *c, const char *data, size_t len);
+static int http2SendFile(struct conn *c, int fd, off_t off, size_t len);
+static int http2Finish(struct conn *c);
+
+// Http2
+static struct configuration Http2Conf[] = {
+    {"http2",             2, boolValidator,        {.val=0},
+        NULL,                   BOOL_FORMAT},
+    {"http2-max-concurrent-streams", 2, unsignedIntValidator, {.val=WHEAT_HTTP2_STREAMS},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"http2-initial-window-size", 2, unsignedIntValidator, {.val=HTTP2_DEFAULT_WINDOW},
+        (void *)HTTP2_MAX_WINDOW, INT_FORMAT},
+};
+
+static struct statItem Http2Stats[] = {
+    {"Total http2 connection", SUM_STAT, RAW, 0, 0},
+    {"Total http2 stream", SUM_STAT, RAW, 0, 0},
+    {"Total http2 reset stream", SUM_STAT, RAW, 0, 0},
+    {"Total http2 blocked write", SUM_STAT, RAW, 0, 0},
+};
+
+static struct protocol ProtocolHttp2 = {
+    httpSpot, parseHttp2, initHttpData, freeHttpData,
+        initHttp2, deallocHttp2, NULL
+};
+
+struct moduleAttr ProtocolHttp2Attr = {
+    "Http2", PROTOCOL, {.protocol=&ProtocolHttp2},
+    Http2Stats, sizeof(Http2Stats)/sizeof(struct statItem),
+    Http2Conf, sizeof(Http2Conf)/sizeof(struct configuration),
+    NULL, 0
+};
+
+static struct httpFramer Http2Framer = {
+    http2SendHeaders, http2SendBody, http2SendFile, http2Finish
+};
+
+static size_t Http2MaxStreams = WHEAT_HTTP2_STREAMS;
+static size_t Http2WindowSize = HTTP2_DEFAULT_WINDOW;
+
+// Response data can't be sent because of flow control. `fd` is -1 if data
+// is copied to `buf`, otherwise it's duplicated from app's file.
+struct http2Pending {
+    int fd;
+    off_t off;
+    size_t len;
+    char buf[];
+};
+
+// `request` is owned by stream until it's dispatched to app, then conn
+// owns it. Stream is kept after response finished if some data is pending.
+struct http2Stream {
+    uint32_t id;
+    struct http2Session *session;
+    struct httpData *request;
+    long send_window;
+    size_t recv_consumed;
+    struct list *pending;
+    wstr authority;
+
+    unsigned end_stream:1;     // peer sent END_STREAM
+    unsigned headers_done:1;
+    unsigned dispatched:1;
+    unsigned finished:1;       // app finished, waiting for pending data
+    unsigned malformed:1;
+    unsigned has_method:1;
+    unsigned has_scheme:1;
+    unsigned has_path:1;
+    unsigned has_host:1;
+    unsigned regular_seen:1;
+};
+
+enum http2BlockKind {
+    BLOCK_REQUEST,
+    BLOCK_TRAILERS,
+    BLOCK_DISCARD,
+};
+
+// Session is attached to client as `client_data`.
+// `conn`: conn parsing frames now, control frames are queued to it
+// `frame_buf`: frame crossing request buffer slices is assembled here
+// `header_block`: header block fragments waiting for CONTINUATION
+struct http2Session {
+    struct client *client;
+    struct conn *conn;
+    struct hpackTable *decoder;
+    wstr frame_buf;
+    size_t preface_left;
+    uint32_t last_stream_id;
+    struct list *streams;
+
+    wstr header_block;
+    uint32_t header_id;        // non-zero if CONTINUATION is expected
+    struct http2Stream *header_stream;
+    enum http2BlockKind header_kind;
+    int header_end_stream;
+
+    long send_window;
+    size_t recv_consumed;
+    long peer_initial_window;
+    size_t peer_max_frame;
+
+    unsigned goaway:1;
+};
+
+#define nameIs(n, l, lit)   ((l) == sizeof(lit)-1 && !memcmp((n), (lit), (l)))
+
+static uint32_t readUint32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void writeUint32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static size_t frameLength(const uint8_t *head)
+{
+    return ((size_t)head[0] << 16) | ((size_t)head[1] << 8) | head[2];
+}
+
+static wstr appendFrameHead(wstr buf, size_t len, int type, int flags,
+        uint32_t id)
+{
+    uint8_t head[HTTP2_FRAME_HEAD_LEN];
+
+    head[0] = len >> 16;
+    head[1] = len >> 8;
+    head[2] = len;
+    head[3] = type;
+    head[4] = flags;
+    writeUint32(head+5, id & HTTP2_MAX_WINDOW);
+    return wstrCatLen(buf, (char *)head, sizeof(head));
+}
+
+static size_t recvWindow()
+{
+    return Http2WindowSize > HTTP2_DEFAULT_WINDOW ? Http2WindowSize : HTTP2_DEFAULT_WINDOW;
+}
+
+// `frames` is queued to `c` and freed with it
+static int sendFrames(struct conn *c, wstr frames)
+{
+    struct slice slice;
+
+    if (!frames)
+        return -1;
+    registerConnFree(c, (void (*)(void*))wstrFree, frames);
+    sliceTo(&slice, (uint8_t *)frames, wstrlen(frames));
+    return sendClientData(c, &slice) == WHEAT_WRONG ? -1 : 0;
+}
+
+static int sendControl(struct conn *c, int type, int flags, uint32_t id,
+        const uint8_t *payload, size_t len)
+{
+    wstr frame = wstrNewLen(NULL, HTTP2_FRAME_HEAD_LEN + len);
+
+    if (frame)
+        frame = appendFrameHead(frame, len, type, flags, id);
+    if (frame && len)
+        frame = wstrCatLen(frame, (const char *)payload, len);
+    return sendFrames(c, frame);
+}
+
+static int sendWindowUpdate(struct conn *c, uint32_t id, size_t inc)
+{
+    uint8_t payload[4];
+
+    writeUint32(payload, inc);
+    return sendControl(c, HTTP2_FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static int resetStream(struct conn *c, uint32_t id, uint32_t code)
+{
+    uint8_t payload[4];
+
+    writeUint32(payload, code);
+    getStatItemByName("Total http2 reset stream")->val++;
+    return sendControl(c, HTTP2_FRAME_RST_STREAM, 0, id, payload, 4);
+}
+
+// Connection error(RFC 7540 5.4.1): tell peer by GOAWAY and close client
+// after it's sent, frames received later are discarded.
+static int connectionError(struct http2Session *session, uint32_t code)
+{
+    uint8_t payload[8];
+
+    wheatLog(WHEAT_VERBOSE, "http2 connection error %u from %s",
+            code, session->client->name);
+    writeUint32(payload, session->last_stream_id);
+    writeUint32(payload+4, code);
+    session->goaway = 1;
+    setClientClose(session->conn);
+    return sendControl(session->conn, HTTP2_FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+static int sendServerSettings(struct conn *c)
+{
+    uint8_t payload[12];
+
+    payload[0] = 0;
+    payload[1] = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    writeUint32(payload+2, Http2MaxStreams);
+    payload[6] = 0;
+    payload[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+    writeUint32(payload+8, Http2WindowSize);
+    if (sendControl(c, HTTP2_FRAME_SETTINGS, 0, 0, payload, 12) == -1)
+        return -1;
+    // Connection window can only be changed by WINDOW_UPDATE
+    if (Http2WindowSize > HTTP2_DEFAULT_WINDOW)
+        return sendWindowUpdate(c, 0, Http2WindowSize - HTTP2_DEFAULT_WINDOW);
+    return 0;
+}
+
+// ==================================================================
+// ========================= Stream Management ======================
+// ==================================================================
+
+static void freePending(void *data)
+{
+    struct http2Pending *p = data;
+
+    if (p->fd != -1)
+        close(p->fd);
+    wfree(p);
+}
+
+// Part of pending data may still be queued in conns before `c`, so it's
+// released with `c`
+static void releasePending(struct conn *c, struct http2Pending *p)
+{
+    if (c)
+        registerConnFree(c, freePending, p);
+    else
+        freePending(p);
+}
+
+static struct http2Stream *findStream(struct http2Session *session, uint32_t id)
+{
+    struct listNode *node;
+    struct http2Stream *stream;
+
+    for (node = listFirst(session->streams); node; node = node->next) {
+        stream = listNodeValue(node);
+        if (stream->id == id)
+            return stream;
+    }
+    return NULL;
+}
+
+static struct http2Stream *createStream(struct http2Session *session, uint32_t id)
+{
+    struct http2Stream *stream = wmalloc(sizeof(*stream));
+
+    if (!stream)
+        return NULL;
+    memset(stream, 0, sizeof(*stream));
+    stream->id = id;
+    stream->session = session;
+    stream->send_window = session->peer_initial_window;
+    stream->pending = createList();
+    if (!stream->pending || !appendToListTail(session->streams, stream)) {
+        freeList(stream->pending);
+        wfree(stream);
+        return NULL;
+    }
+    getStatItemByName("Total http2 stream")->val++;
+    return stream;
+}
+
+static void freeStream(struct http2Stream *stream, struct conn *c)
+{
+    struct http2Session *session = stream->session;
+    struct listNode *node;
+
+    node = searchListKey(session->streams, stream);
+    if (node)
+        removeListNode(session->streams, node);
+    while ((node = listFirst(stream->pending)) != NULL) {
+        releasePending(c, listNodeValue(node));
+        removeListNode(stream->pending, node);
+    }
+    freeList(stream->pending);
+    if (stream->request)
+        freeHttpData(stream->request);
+    if (session->header_stream == stream)
+        session->header_stream = NULL;
+    wstrFree(stream->authority);
+    wfree(stream);
+}
+
+static void http2ClientClosed(struct client *client)
+{
+    struct http2Session *session = client->client_data;
+    struct listNode *node;
+
+    while ((node = listFirst(session->streams)) != NULL)
+        freeStream(listNodeValue(node), NULL);
+    freeList(session->streams);
+    hpackTableFree(session->decoder);
+    wstrFree(session->frame_buf);
+    wstrFree(session->header_block);
+    wfree(session);
+    client->client_data = NULL;
+}
+
+static struct http2Session *createSession(struct client *client)
+{
+    struct http2Session *session = wmalloc(sizeof(*session));
+
+    if (!session)
+        return NULL;
+    memset(session, 0, sizeof(*session));
+    session->client = client;
+    session->decoder = hpackTableCreate(HPACK_DEFAULT_TABLE_SIZE);
+    session->frame_buf = wstrEmpty();
+    session->header_block = wstrEmpty();
+    session->streams = createList();
+    if (!session->decoder || !session->frame_buf || !session->header_block ||
+            !session->streams) {
+        if (session->decoder)
+            hpackTableFree(session->decoder);
+        if (session->streams)
+            freeList(session->streams);
+        wstrFree(session->frame_buf);
+        wstrFree(session->header_block);
+        wfree(session);
+        return NULL;
+    }
+    session->preface_left = HTTP2_PREFACE_LEN;
+    session->send_window = HTTP2_DEFAULT_WINDOW;
+    session->peer_initial_window = HTTP2_DEFAULT_WINDOW;
+    session->peer_max_frame = HTTP2_FRAME_SIZE;
+    client->client_data = session;
+    setClientFreeNotify(client, http2ClientClosed);
+    getStatItemByName("Total http2 connection")->val++;
+    return session;
+}
+
+// ==================================================================
+// ========================== Response Framing ======================
+// ==================================================================
+
+static size_t sendableSize(struct http2Stream *stream)
+{
+    long size = stream->send_window;
+
+    if (stream->session->send_window < size)
+        size = stream->session->send_window;
+    return size > 0 ? size : 0;
+}
+
+// Queue DATA frames for `len` bytes of `data` or file `fd` from `off`,
+// caller makes sure flow control windows allow it.
+static int writeData(struct conn *c, struct http2Stream *stream, int fd,
+        const char *data, off_t off, size_t len, int end_stream)
+{
+    struct http2Session *session = stream->session;
+    size_t frames, i, n, max = session->peer_max_frame;
+    struct slice *slices;
+    wstr heads;
+    int flags, ret = WHEAT_OK;
+
+    frames = (len + max - 1) / max;
+    heads = wstrNewLen(NULL, frames * HTTP2_FRAME_HEAD_LEN);
+    slices = wmalloc(sizeof(struct slice) * frames * 2);
+    if (!heads || !slices) {
+        wstrFree(heads);
+        wfree(slices);
+        return -1;
+    }
+    registerConnFree(c, (void (*)(void*))wstrFree, heads);
+    for (i = 0; i < frames; i++) {
+        n = len - i * max < max ? len - i * max : max;
+        flags = (end_stream && i == frames - 1) ? HTTP2_END_STREAM : 0;
+        heads = appendFrameHead(heads, n, HTTP2_FRAME_DATA, flags, stream->id);
+        sliceTo(&slices[i*2], (uint8_t *)heads + i * HTTP2_FRAME_HEAD_LEN,
+                HTTP2_FRAME_HEAD_LEN);
+        if (fd == -1)
+            sliceTo(&slices[i*2+1], (uint8_t *)data + i * max, n);
+    }
+    if (fd == -1) {
+        ret = sendClientSlices(c, slices, frames * 2);
+    } else {
+        for (i = 0; i < frames && ret == WHEAT_OK; i++) {
+            n = len - i * max < max ? len - i * max : max;
+            ret = sendClientData(c, &slices[i*2]);
+            if (ret == WHEAT_OK)
+                ret = sendClientFileRange(c, fd, off + i * max, n);
+        }
+    }
+    wfree(slices);
+    stream->send_window -= len;
+    session->send_window -= len;
+    return ret == WHEAT_WRONG ? -1 : 0;
+}
+
+static int addPending(struct http2Stream *stream, int fd, const char *data,
+        off_t off, size_t len)
+{
+    struct http2Pending *p;
+
+    p = wmalloc(sizeof(*p) + (fd == -1 ? len : 0));
+    if (!p)
+        return -1;
+    p->fd = -1;
+    p->off = 0;
+    p->len = len;
+    if (fd == -1) {
+        if (data)
+            memcpy(p->buf, data, len);
+    } else if ((p->fd = dup(fd)) == -1) {
+        wfree(p);
+        return -1;
+    } else {
+        p->off = off;
+    }
+    if (!appendToListTail(stream->pending, p)) {
+        freePending(p);
+        return -1;
+    }
+    getStatItemByName("Total http2 blocked write")->val++;
+    return 0;
+}
+
+// Send pending data as windows allowed, stream is freed if app finished it
+// and nothing is left.
+static int flushStream(struct http2Stream *stream, struct conn *c)
+{
+    struct listNode *node;
+    struct http2Pending *p;
+    size_t n;
+    int last;
+
+    while ((node = listFirst(stream->pending)) != NULL) {
+        p = listNodeValue(node);
+        n = sendableSize(stream);
+        if (n == 0)
+            return 0;
+        if (n > p->len)
+            n = p->len;
+        last = stream->finished && n == p->len && listLength(stream->pending) == 1;
+        if (writeData(c, stream, p->fd, p->fd == -1 ? p->buf + p->off : NULL,
+                    p->off, n, last) == -1)
+            return -1;
+        p->off += n;
+        p->len -= n;
+        if (p->len)
+            return 0;
+        releasePending(c, p);
+        removeListNode(stream->pending, node);
+        if (last) {
+            freeStream(stream, c);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int flushStreams(struct http2Session *session, struct conn *c)
+{
+    struct listNode *node, *next;
+    struct http2Stream *stream;
+
+    for (node = listFirst(session->streams); node; node = next) {
+        next = node->next;
+        stream = listNodeValue(node);
+        if (session->send_window <= 0)
+            break;
+        if (listLength(stream->pending) && flushStream(stream, c) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int http2SendHeaders(struct conn *c, int status, struct dict *headers)
+{
+    struct http2Stream *stream = httpGetFramerData(c);
+    struct http2Session *session = stream->session;
+    struct dictIterator *iter;
+    struct dictEntry *entry;
+    wstr block, frames, field, value;
+    size_t len, off, n, max = session->peer_max_frame;
+    const char *date = httpDate();
+    int type, flags;
+
+    block = hpackEncodeStatus(wstrEmpty(), status);
+    if (block)
+        block = hpackEncodeHeader(block, "server", 6, Server.master_name,
+                strlen(Server.master_name));
+    if (block)
+        block = hpackEncodeHeader(block, "date", 4, date, strlen(date));
+    iter = dictGetIterator(headers);
+    while (block && (entry = dictNext(iter)) != NULL) {
+        field = dictGetKey(entry);
+        value = dictGetVal(entry);
+        // Connection-specific fields are prohibited(RFC 7540 8.1.2.2)
+        if (!strcasecmp(field, CONNECTION) || !strcasecmp(field, "Keep-Alive") ||
+                !strcasecmp(field, "Proxy-Connection") ||
+                !strcasecmp(field, TRANSFER_ENCODING) ||
+                !strcasecmp(field, "Upgrade"))
+            continue;
+        block = hpackEncodeHeader(block, field, wstrlen(field), value,
+                wstrlen(value));
+    }
+    dictReleaseIterator(iter);
+    if (!block)
+        return -1;
+
+    len = wstrlen(block);
+    frames = wstrNewLen(NULL, len + (len / max + 1) * HTTP2_FRAME_HEAD_LEN);
+    off = 0;
+    type = HTTP2_FRAME_HEADERS;
+    do {
+        n = len - off < max ? len - off : max;
+        flags = off + n == len ? HTTP2_END_HEADERS : 0;
+        if (frames)
+            frames = appendFrameHead(frames, n, type, flags, stream->id);
+        if (frames)
+            frames = wstrCatLen(frames, block + off, n);
+        type = HTTP2_FRAME_CONTINUATION;
+        off += n;
+    } while (off < len);
+    wstrFree(block);
+    return sendFrames(c, frames);
+}
+
+static int http2SendBody(struct conn *c, const char *data, size_t len)
+{
+    struct http2Stream *stream = httpGetFramerData(c);
+    size_t n = 0;
+
+    if (!len)
+        return 0;
+    if (!listLength(stream->pending)) {
+        n = sendableSize(stream);
+        if (n > len)
+            n = len;
+        if (n && writeData(c, stream, -1, data, 0, n, 0) == -1)
+            return -1;
+    }
+    if (n < len)
+        return addPending(stream, -1, data + n, 0, len - n);
+    return 0;
+}
+
+static int http2SendFile(struct conn *c, int fd, off_t off, size_t len)
+{
+    struct http2Stream *stream = httpGetFramerData(c);
+    size_t n = 0;
+
+    if (!len)
+        return 0;
+    if (!listLength(stream->pending)) {
+        n = sendableSize(stream);
+        if (n > len)
+            n = len;
+        if (n && writeData(c, stream, fd, NULL, off, n, 0) == -1)
+            return -1;
+    }
+    if (n < len)
+        return addPending(stream, fd, NULL, off + n, len - n);
+    return 0;
+}
+
+static int http2Finish(struct conn *c)
+{
+    struct http2Stream *stream = httpGetFramerData(c);
+    int ret = 0;
+
+    if (!ishttpHeaderSended(c)) {
+        ret = resetStream(c, stream->id, HTTP2_INTERNAL_ERROR);
+        freeStream(stream, c);
+        return ret;
+    }
+    stream->finished = 1;
+    if (listLength(stream->pending))
+        return 0;
+    ret = sendControl(c, HTTP2_FRAME_DATA, HTTP2_END_STREAM, stream->id, NULL, 0);
+    freeStream(stream, c);
+    return ret;
+}
+
+// ==================================================================
+// ============================ Frame Parsing =======================
+// ==================================================================
+
+static int addStreamHeader(void *data, const char *name, size_t name_len,
+        const char *value, size_t value_len)
+{
+    struct http2Stream *stream = data;
+    struct httpData *request = stream->request;
+    size_t i;
+
+    if (stream->malformed)
+        return 0;
+    if (name_len && name[0] == ':') {
+        if (stream->regular_seen)
+            goto malformed;
+        if (nameIs(name, name_len, ":method") && !stream->has_method) {
+            stream->has_method = 1;
+            if (httpSetRequestMethod(request, value, value_len) == -1)
+                goto malformed;
+        } else if (nameIs(name, name_len, ":scheme") && !stream->has_scheme) {
+            stream->has_scheme = 1;
+            httpSetRequestScheme(request, value, value_len);
+        } else if (nameIs(name, name_len, ":path") && !stream->has_path) {
+            stream->has_path = 1;
+            if (!value_len || httpSetRequestUrl(request, value, value_len) == -1)
+                goto malformed;
+        } else if (nameIs(name, name_len, ":authority") && !stream->authority) {
+            stream->authority = wstrNewLen(value, (int)value_len);
+        } else {
+            goto malformed;
+        }
+        return 0;
+    }
+
+    stream->regular_seen = 1;
+    for (i = 0; i < name_len; i++) {
+        if (isupper((unsigned char)name[i]))
+            goto malformed;
+    }
+    if (nameIs(name, name_len, "connection") ||
+            nameIs(name, name_len, "keep-alive") ||
+            nameIs(name, name_len, "proxy-connection") ||
+            nameIs(name, name_len, "transfer-encoding") ||
+            nameIs(name, name_len, "upgrade") ||
+            (nameIs(name, name_len, "te") && !nameIs(value, value_len, "trailers")))
+        goto malformed;
+    // Http2 has no interim 100 response written by apps
+    if (nameIs(name, name_len, "expect"))
+        return 0;
+    if (nameIs(name, name_len, "host"))
+        stream->has_host = 1;
+    if (httpAddRequestHeader(request, name, name_len, value, value_len) == -1)
+        goto malformed;
+    return 0;
+
+malformed:
+    stream->malformed = 1;
+    return 0;
+}
+
+static int discardHeader(void *data, const char *name, size_t name_len,
+        const char *value, size_t value_len)
+{
+    return 0;
+}
+
+static void streamEnded(struct http2Stream *stream, struct http2Stream **ready)
+{
+    stream->end_stream = 1;
+    httpFinishRequest(stream->request);
+    *ready = stream;
+}
+
+// Header block must be decoded even if stream is refused or reset, or
+// decoder's dynamic table will be out of sync with peer's.
+static int finishHeaderBlock(struct http2Session *session,
+        struct http2Stream **ready)
+{
+    struct http2Stream *stream = session->header_stream;
+    int ret;
+
+    ret = hpackDecode(session->decoder, (uint8_t *)session->header_block,
+            wstrlen(session->header_block),
+            session->header_kind == BLOCK_REQUEST ? addStreamHeader : discardHeader,
+            stream);
+    wstrClear(session->header_block);
+    session->header_id = 0;
+    session->header_stream = NULL;
+    if (ret == -1)
+        return connectionError(session, HTTP2_COMPRESSION_ERROR);
+    if (session->header_kind == BLOCK_DISCARD || !stream)
+        return 0;
+
+    if (session->header_kind == BLOCK_REQUEST) {
+        if (stream->malformed || !stream->has_method || !stream->has_scheme ||
+                !stream->has_path) {
+            ret = resetStream(session->conn, stream->id, HTTP2_PROTOCOL_ERROR);
+            freeStream(stream, session->conn);
+            return ret;
+        }
+        // Apps look up Host to build url, it's :authority in Http2
+        if (stream->authority && !stream->has_host &&
+                httpAddRequestHeader(stream->request, "host", 4,
+                    stream->authority, wstrlen(stream->authority)) == -1)
+            return -1;
+        stream->headers_done = 1;
+    }
+    if (session->header_end_stream)
+        streamEnded(stream, ready);
+    return 0;
+}
+
+static int onHeaders(struct http2Session *session, uint32_t id, int flags,
+        const uint8_t *p, size_t len, struct http2Stream **ready)
+{
+    struct http2Stream *stream;
+    size_t pad = 0;
+
+    if (id == 0 || !(id & 1))
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    if (flags & HTTP2_PADDED) {
+        if (len < 1)
+            return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+        pad = p[0];
+        p++;
+        len--;
+    }
+    if (flags & HTTP2_PRIORITY_FLAG) {
+        if (len < 5)
+            return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+        p += 5;
+        len -= 5;
+    }
+    if (pad > len)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    len -= pad;
+
+    session->header_stream = NULL;
+    session->header_end_stream = flags & HTTP2_END_STREAM;
+    stream = findStream(session, id);
+    if (stream) {
+        // Trailers are accepted but not passed to apps
+        if (stream->end_stream || !stream->headers_done)
+            return connectionError(session, HTTP2_STREAM_CLOSED);
+        if (!(flags & HTTP2_END_STREAM))
+            return connectionError(session, HTTP2_PROTOCOL_ERROR);
+        session->header_kind = BLOCK_TRAILERS;
+        session->header_stream = stream;
+    } else if (id <= session->last_stream_id) {
+        return connectionError(session, HTTP2_STREAM_CLOSED);
+    } else {
+        session->last_stream_id = id;
+        session->header_kind = BLOCK_DISCARD;
+        if (listLength(session->streams) >= Http2MaxStreams) {
+            if (resetStream(session->conn, id, HTTP2_REFUSED_STREAM) == -1)
+                return -1;
+        } else {
+            stream = createStream(session, id);
+            if (!stream)
+                return -1;
+            stream->request = httpCreateRequest(&Http2Framer, stream);
+            if (!stream->request) {
+                freeStream(stream, NULL);
+                return -1;
+            }
+            session->header_kind = BLOCK_REQUEST;
+            session->header_stream = stream;
+        }
+    }
+
+    session->header_block = wstrCatLen(session->header_block, (const char *)p, len);
+    if (!session->header_block)
+        return -1;
+    if (flags & HTTP2_END_HEADERS)
+        return finishHeaderBlock(session, ready);
+    session->header_id = id;
+    return 0;
+}
+
+static int onContinuation(struct http2Session *session, uint32_t id, int flags,
+        const uint8_t *p, size_t len, struct http2Stream **ready)
+{
+    if (id != session->header_id)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    session->header_block = wstrCatLen(session->header_block, (const char *)p, len);
+    if (!session->header_block)
+        return -1;
+    // Limit memory a header block can take as http_parser does
+    if (wstrlen(session->header_block) > Server.max_buffer_size)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    if (flags & HTTP2_END_HEADERS)
+        return finishHeaderBlock(session, ready);
+    return 0;
+}
+
+static int onData(struct http2Session *session, uint32_t id, int flags,
+        const uint8_t *p, size_t len, struct http2Stream **ready)
+{
+    struct http2Stream *stream;
+    size_t frame_len = len, pad = 0;
+
+    if (id == 0)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    if (flags & HTTP2_PADDED) {
+        if (len < 1)
+            return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+        pad = p[0];
+        p++;
+        len--;
+    }
+    if (pad > len)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    len -= pad;
+    if (session->recv_consumed + frame_len > recvWindow())
+        return connectionError(session, HTTP2_FLOW_CONTROL_ERROR);
+    session->recv_consumed += frame_len;
+
+    stream = findStream(session, id);
+    if (!stream || stream->end_stream) {
+        if (id > session->last_stream_id)
+            return connectionError(session, HTTP2_PROTOCOL_ERROR);
+        if (stream)
+            freeStream(stream, session->conn);
+        if (resetStream(session->conn, id, HTTP2_STREAM_CLOSED) == -1)
+            return -1;
+    } else if (stream->recv_consumed + frame_len > recvWindow()) {
+        return connectionError(session, HTTP2_FLOW_CONTROL_ERROR);
+    } else {
+        stream->recv_consumed += frame_len;
+        if (len && httpAppendRequestBody(stream->request, (const char *)p, len) == -1) {
+            freeStream(stream, session->conn);
+            if (resetStream(session->conn, id, HTTP2_INTERNAL_ERROR) == -1)
+                return -1;
+        } else if (flags & HTTP2_END_STREAM) {
+            streamEnded(stream, ready);
+        } else if (stream->recv_consumed >= recvWindow() / 2) {
+            if (sendWindowUpdate(session->conn, id, stream->recv_consumed) == -1)
+                return -1;
+            stream->recv_consumed = 0;
+        }
+    }
+
+    if (session->recv_consumed >= recvWindow() / 2) {
+        if (sendWindowUpdate(session->conn, 0, session->recv_consumed) == -1)
+            return -1;
+        session->recv_consumed = 0;
+    }
+    return 0;
+}
+
+// Peer settings are applied without ACK when they come from HTTP2-Settings
+static int applySettings(struct http2Session *session, const uint8_t *p,
+        size_t len)
+{
+    struct listNode *node;
+    struct http2Stream *stream;
+    uint32_t value;
+    long delta;
+    int id;
+
+    for (; len >= 6; p += 6, len -= 6) {
+        id = (p[0] << 8) | p[1];
+        value = readUint32(p+2);
+        switch (id) {
+            case HTTP2_SETTINGS_ENABLE_PUSH:
+                if (value > 1)
+                    return HTTP2_PROTOCOL_ERROR;
+                break;
+            case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > HTTP2_MAX_WINDOW)
+                    return HTTP2_FLOW_CONTROL_ERROR;
+                delta = (long)value - session->peer_initial_window;
+                session->peer_initial_window = value;
+                for (node = listFirst(session->streams); node; node = node->next) {
+                    stream = listNodeValue(node);
+                    stream->send_window += delta;
+                    if (stream->send_window > HTTP2_MAX_WINDOW)
+                        return HTTP2_FLOW_CONTROL_ERROR;
+                }
+                break;
+            case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < HTTP2_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE)
+                    return HTTP2_PROTOCOL_ERROR;
+                session->peer_max_frame = value;
+                break;
+            default:
+                // Encoder doesn't use dynamic table and server never
+                // pushes, others are ignored
+                break;
+        }
+    }
+    return HTTP2_NO_ERROR;
+}
+
+static int onSettings(struct http2Session *session, uint32_t id, int flags,
+        const uint8_t *p, size_t len)
+{
+    uint32_t code;
+
+    if (id != 0)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    if (flags & HTTP2_ACK)
+        return len ? connectionError(session, HTTP2_FRAME_SIZE_ERROR) : 0;
+    if (len % 6)
+        return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+    code = applySettings(session, p, len);
+    if (code != HTTP2_NO_ERROR)
+        return connectionError(session, code);
+    if (sendControl(session->conn, HTTP2_FRAME_SETTINGS, HTTP2_ACK, 0, NULL, 0) == -1)
+        return -1;
+    return flushStreams(session, session->conn);
+}
+
+static int onWindowUpdate(struct http2Session *session, uint32_t id,
+        const uint8_t *p, size_t len)
+{
+    struct http2Stream *stream;
+    uint32_t inc;
+
+    if (len != 4)
+        return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+    inc = readUint32(p) & HTTP2_MAX_WINDOW;
+    if (id == 0) {
+        if (!inc)
+            return connectionError(session, HTTP2_PROTOCOL_ERROR);
+        if (session->send_window + inc > HTTP2_MAX_WINDOW)
+            return connectionError(session, HTTP2_FLOW_CONTROL_ERROR);
+        session->send_window += inc;
+    } else {
+        stream = findStream(session, id);
+        if (!stream)
+            return id > session->last_stream_id ?
+                connectionError(session, HTTP2_PROTOCOL_ERROR) : 0;
+        if (!inc || stream->send_window + inc > HTTP2_MAX_WINDOW) {
+            freeStream(stream, session->conn);
+            return resetStream(session->conn, id, inc ? HTTP2_FLOW_CONTROL_ERROR :
+                    HTTP2_PROTOCOL_ERROR);
+        }
+        stream->send_window += inc;
+    }
+    return flushStreams(session, session->conn);
+}
+
+static int onRstStream(struct http2Session *session, uint32_t id,
+        const uint8_t *p, size_t len)
+{
+    struct http2Stream *stream;
+
+    if (len != 4)
+        return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+    if (id == 0 || id > session->last_stream_id)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    stream = findStream(session, id);
+    if (stream) {
+        getStatItemByName("Total http2 reset stream")->val++;
+        freeStream(stream, session->conn);
+    }
+    return 0;
+}
+
+static int onPing(struct http2Session *session, uint32_t id, int flags,
+        const uint8_t *p, size_t len)
+{
+    if (len != 8)
+        return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+    if (id != 0)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+    if (flags & HTTP2_ACK)
+        return 0;
+    return sendControl(session->conn, HTTP2_FRAME_PING, HTTP2_ACK, 0, p, 8);
+}
+
+// Return -1 only if resources run out, protocol errors are reported to peer
+// by GOAWAY or RST_STREAM.
+static int processFrame(struct http2Session *session, const uint8_t *frame,
+        struct http2Stream **ready)
+{
+    size_t len = frameLength(frame);
+    int type = frame[3], flags = frame[4];
+    uint32_t id = readUint32(frame+5) & HTTP2_MAX_WINDOW;
+    const uint8_t *p = frame + HTTP2_FRAME_HEAD_LEN;
+
+    // Header block must be contiguous(RFC 7540 6.10)
+    if (session->header_id && type != HTTP2_FRAME_CONTINUATION)
+        return connectionError(session, HTTP2_PROTOCOL_ERROR);
+
+    switch (type) {
+        case HTTP2_FRAME_DATA:
+            return onData(session, id, flags, p, len, ready);
+        case HTTP2_FRAME_HEADERS:
+            return onHeaders(session, id, flags, p, len, ready);
+        case HTTP2_FRAME_CONTINUATION:
+            return onContinuation(session, id, flags, p, len, ready);
+        case HTTP2_FRAME_PRIORITY:
+            if (len != 5)
+                return connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+            return id ? 0 : connectionError(session, HTTP2_PROTOCOL_ERROR);
+        case HTTP2_FRAME_RST_STREAM:
+            return onRstStream(session, id, p, len);
+        case HTTP2_FRAME_SETTINGS:
+            return onSettings(session, id, flags, p, len);
+        case HTTP2_FRAME_PUSH_PROMISE:
+            return connectionError(session, HTTP2_PROTOCOL_ERROR);
+        case HTTP2_FRAME_PING:
+            return onPing(session, id, flags, p, len);
+        case HTTP2_FRAME_GOAWAY:
+            if (id != 0)
+                return connectionError(session, HTTP2_PROTOCOL_ERROR);
+            // Streams already received are still answered
+            setClientClose(session->conn);
+            return 0;
+        case HTTP2_FRAME_WINDOW_UPDATE:
+            return onWindowUpdate(session, id, p, len);
+        default:
+            // Unknown frame types must be ignored
+            return 0;
+    }
+}
+
+// Return the next complete frame, it's in `slice` if possible, otherwise
+// it's assembled in `frame_buf`. NULL if more data is needed.
+static uint8_t *nextFrame(struct http2Session *session, struct slice *slice,
+        size_t *pos)
+{
+    size_t remain = slice->len - *pos, buffered, need, len;
+    uint8_t *frame;
+
+    if (!wstrlen(session->frame_buf) && remain >= HTTP2_FRAME_HEAD_LEN) {
+        frame = slice->data + *pos;
+        len = frameLength(frame);
+        if (len > HTTP2_FRAME_SIZE) {
+            connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+            return NULL;
+        }
+        if (remain >= HTTP2_FRAME_HEAD_LEN + len) {
+            *pos += HTTP2_FRAME_HEAD_LEN + len;
+            return frame;
+        }
+    }
+
+    buffered = wstrlen(session->frame_buf);
+    if (buffered < HTTP2_FRAME_HEAD_LEN)
+        need = HTTP2_FRAME_HEAD_LEN - buffered;
+    else
+        need = HTTP2_FRAME_HEAD_LEN + frameLength((uint8_t *)session->frame_buf) - buffered;
+    if (need > remain)
+        need = remain;
+    session->frame_buf = wstrCatLen(session->frame_buf,
+            (const char *)slice->data + *pos, need);
+    *pos += need;
+    if (!session->frame_buf) {
+        setClientUnvalid(session->client);
+        session->goaway = 1;
+        return NULL;
+    }
+    frame = (uint8_t *)session->frame_buf;
+    buffered = wstrlen(session->frame_buf);
+    if (buffered < HTTP2_FRAME_HEAD_LEN)
+        return NULL;
+    len = frameLength(frame);
+    if (len > HTTP2_FRAME_SIZE) {
+        connectionError(session, HTTP2_FRAME_SIZE_ERROR);
+        return NULL;
+    }
+    return buffered == HTTP2_FRAME_HEAD_LEN + len ? frame : NULL;
+}
+
+// When a stream's request is complete, it's bound to `c` and passed to app
+// like a HTTP/1.x request. Data retained(body, partial frame) is copied, so
+// request buffer can be released.
+int parseHttp2(struct conn *c, struct slice *slice, size_t *out)
+{
+    struct http2Session *session = c->client->client_data;
+    struct http2Stream *ready = NULL;
+    size_t pos = 0;
+    uint8_t *frame;
+
+    session->conn = c;
+    releaseClientBuffer(c->client);
+    while (session->preface_left && pos < slice->len) {
+        if (slice->data[pos] != HTTP2_PREFACE[HTTP2_PREFACE_LEN-session->preface_left]) {
+            wheatLog(WHEAT_VERBOSE, "http2 invalid connection preface");
+            return WHEAT_WRONG;
+        }
+        pos++;
+        session->preface_left--;
+    }
+
+    while (pos < slice->len && !ready && !session->goaway) {
+        frame = nextFrame(session, slice, &pos);
+        if (!frame)
+            continue;
+        if (processFrame(session, frame, &ready) == -1)
+            return WHEAT_WRONG;
+        if (frame == (uint8_t *)session->frame_buf)
+            wstrClear(session->frame_buf);
+    }
+
+    if (out) *out = session->goaway ? slice->len : pos;
+    if (!ready)
+        return 1;
+    freeHttpData(c->protocol_data);
+    c->protocol_data = ready->request;
+    ready->request = NULL;
+    ready->dispatched = 1;
+    return WHEAT_OK;
+}
+
+// ==================================================================
+// ======================= Handoff From Http ========================
+// ==================================================================
+
+int isHttp2Preface(struct slice *s)
+{
+    size_t len = s->len < HTTP2_PREFACE_LEN ? s->len : HTTP2_PREFACE_LEN;
+    return !memcmp(s->data, HTTP2_PREFACE, len);
+}
+
+int http2Handoff(struct conn *c)
+{
+    if (!createSession(c->client))
+        return WHEAT_WRONG;
+    c->client->protocol = &ProtocolHttp2;
+    return sendServerSettings(c) == -1 ? WHEAT_WRONG : WHEAT_OK;
+}
+
+static int base64UrlValue(char ch)
+{
+    if (ch >= 'A' && ch <= 'Z') return ch - 'A';
+    if (ch >= 'a' && ch <= 'z') return ch - 'a' + 26;
+    if (ch >= '0' && ch <= '9') return ch - '0' + 52;
+    if (ch == '-' || ch == '+') return 62;
+    if (ch == '_' || ch == '/') return 63;
+    return -1;
+}
+
+// HTTP2-Settings is base64url encoded SETTINGS payload(RFC 7540 3.2.1)
+static wstr decodeSettings(wstr value)
+{
+    size_t i, len = wstrlen(value);
+    uint32_t bits = 0;
+    int nbits = 0, v;
+    uint8_t byte;
+    wstr payload = wstrNewLen(NULL, len * 3 / 4 + 1);
+
+    for (i = 0; payload && i < len && value[i] != '='; i++) {
+        v = base64UrlValue(value[i]);
+        if (v == -1) {
+            wstrFree(payload);
+            return NULL;
+        }
+        bits = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            byte = bits >> nbits;
+            payload = wstrCatLen(payload, (char *)&byte, 1);
+        }
+    }
+    return payload;
+}
+
+// Request upgrading is answered as stream 1, it's half-closed from client
+// already(RFC 7540 3.2).
+int http2Upgrade(struct conn *c, wstr settings)
+{
+    struct http2Session *session;
+    struct http2Stream *stream;
+    struct slice slice;
+    wstr payload;
+    int code;
+
+    payload = decodeSettings(settings);
+    if (!payload || wstrlen(payload) % 6) {
+        wstrFree(payload);
+        return WHEAT_WRONG;
+    }
+    session = createSession(c->client);
+    if (!session) {
+        wstrFree(payload);
+        return WHEAT_WRONG;
+    }
+    session->conn = c;
+    code = applySettings(session, (uint8_t *)payload, wstrlen(payload));
+    wstrFree(payload);
+    if (code != HTTP2_NO_ERROR)
+        return WHEAT_WRONG;
+    c->client->protocol = &ProtocolHttp2;
+
+    stream = createStream(session, 1);
+    if (!stream)
+        return WHEAT_WRONG;
+    session->last_stream_id = 1;
+    stream->headers_done = stream->end_stream = stream->dispatched = 1;
+    httpSetFramer(c->protocol_data, &Http2Framer, stream);
+
+    sliceTo(&slice, (uint8_t *)HTTP2_SWITCHING, sizeof(HTTP2_SWITCHING)-1);
+    if (sendClientData(c, &slice) == WHEAT_WRONG || sendServerSettings(c) == -1)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+int initHttp2()
+{
+    struct configuration *conf;
+
+    // Http2 needs Http to recognize preface or upgrade request
+    if (!strcasecmp(getConfiguration("protocol")->target.ptr, "Http2")) {
+        wheatLog(WHEAT_WARNING, "Http2 can't be used as protocol directly, use Http with `http2 on`");
+        return WHEAT_WRONG;
+    }
+    conf = getConfiguration("http2-max-concurrent-streams");
+    Http2MaxStreams = conf->target.val;
+    conf = getConfiguration("http2-initial-window-size");
+    Http2WindowSize = conf->target.val;
+    return WHEAT_OK;
+}
+
+void deallocHttp2()
+{
+}
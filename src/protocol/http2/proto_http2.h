@@ -0,0 +1,19 @@
+// Http2 protocol module implemetation
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_PROTO_HTTP2_H
+#define WHEATSERVER_PROTO_HTTP2_H
+
+#include "../protocol.h"
+
+// Http2 isn't selected by `protocol` directly. Http protocol hands client
+// over to it when client sends connection preface(h2c with prior knowledge)
+// or asks for h2c upgrade, both only if `http2` is on.
+int isHttp2Preface(struct slice *s);
+int http2Handoff(struct conn *c);
+int http2Upgrade(struct conn *c, wstr settings);
+
+#endif
@@ -21,7 +21,7 @@ void deallocRedis();
 
 static struct protocol ProtocolRedis = {
     redisSpot, parseRedis, initRedisData, freeRedisData,
-        initRedis, deallocRedis,
+        initRedis, deallocRedis, NULL
 };
 
 struct moduleAttr ProtocolRedisAttr = {
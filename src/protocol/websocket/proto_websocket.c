@@ -0,0 +1,729 @@
+// WebSocket protocol module implemetation
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "../http/proto_http.h"
+#include "../../app/application.h"
+#include "proto_websocket.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define WS_GUID                 "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_SWITCHING            "HTTP/1.1 101 Switching Protocols\r\n" \
+                                "Upgrade: websocket\r\nConnection: Upgrade\r\n" \
+                                "Sec-WebSocket-Accept: %s\r\n\r\n"
+#define WS_CONTROL_MAX          125
+#define WS_MAX_MESSAGE_SIZE     (1024*1024)
+#define WS_PING_INTERVAL        10
+
+// Dispatched by wsSpot after handshake, 101 response is queued on the conn
+#define WS_EVENT_OPEN           0x100
+
+int wsSpot(struct conn *c);
+int parseWebSocket(struct conn *, struct slice *, size_t *);
+void *initWsData();
+void freeWsData(void *data);
+int initWebSocket();
+void deallocWebSocket();
+void webSocketCron();
+
+// WebSocket
+static struct configuration WebSocketConf[] = {
+    {"websocket",         2, boolValidator,        {.val=0},
+        NULL,                   BOOL_FORMAT},
+    {"websocket-app",     2, stringValidator,      {.ptr="wsgi"},
+        (void *)WHEAT_NOTFREE,  STRING_FORMAT},
+    {"websocket-max-message-size", 2, unsignedIntValidator, {.val=WS_MAX_MESSAGE_SIZE},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+    {"websocket-ping-interval", 2, unsignedIntValidator, {.val=WS_PING_INTERVAL},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+};
+
+static struct statItem WebSocketStats[] = {
+    {"Total websocket connection", SUM_STAT, RAW, 0, 0},
+    {"Total websocket message", SUM_STAT, RAW, 0, 0},
+};
+
+static struct protocol ProtocolWebSocket = {
+    wsSpot, parseWebSocket, initWsData, freeWsData,
+        initWebSocket, deallocWebSocket, webSocketCron
+};
+
+struct moduleAttr ProtocolWebSocketAttr = {
+    "WebSocket", PROTOCOL, {.protocol=&ProtocolWebSocket},
+    WebSocketStats, sizeof(WebSocketStats)/sizeof(struct statItem),
+    WebSocketConf, sizeof(WebSocketConf)/sizeof(struct configuration),
+    NULL, 0
+};
+
+static struct app *WebSocketApp = NULL;
+static size_t MaxMessageSize = WS_MAX_MESSAGE_SIZE;
+static time_t PingInterval = WS_PING_INTERVAL;
+static struct list *Sessions = NULL;
+
+// Per client state. Frame spanning reads is assembled in `frame_buf` and
+// fragments of a message are joined in `message`.
+struct wsSession {
+    struct client *client;
+    wstr path;
+    wstr query_string;
+    wstr frame_buf;
+    wstr message;
+    int message_opcode;
+    time_t last_recv;
+    time_t last_ping;
+    unsigned closing:1;
+};
+
+// Protocol data of conn. `payload` refers to request buffer directly if
+// the whole frame is in it, otherwise to `copied`.
+struct wsMessage {
+    int opcode;
+    int close_code;
+    struct slice payload;
+    wstr copied;
+};
+
+struct wsFrame {
+    unsigned fin:1;
+    int opcode;
+    uint64_t len;
+    uint8_t *mask;
+    uint8_t *payload;
+};
+
+// ==================================================================
+// ============================ Handshake ===========================
+// ==================================================================
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1Block(uint32_t h[5], const uint8_t *p)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 |
+            (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+    for (; i < 80; i++)
+        w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = ROL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+// SHA-1 is only used to compute Sec-WebSocket-Accept
+static void sha1(const uint8_t *data, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint64_t bits = (uint64_t)len << 3;
+    uint8_t block[64];
+    int i;
+
+    for (; len >= 64; data += 64, len -= 64)
+        sha1Block(h, data);
+    memset(block, 0, sizeof(block));
+    memcpy(block, data, len);
+    block[len] = 0x80;
+    if (len >= 56) {
+        sha1Block(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    for (i = 0; i < 8; i++)
+        block[63-i] = bits >> (i * 8);
+    sha1Block(h, block);
+    for (i = 0; i < 20; i++)
+        digest[i] = h[i/4] >> (24 - (i % 4) * 8);
+}
+
+static void base64Encode(const uint8_t *in, size_t len, char *out)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    for (i = 0; i + 2 < len; i += 3) {
+        *out++ = table[in[i] >> 2];
+        *out++ = table[((in[i] & 0x3) << 4) | (in[i+1] >> 4)];
+        *out++ = table[((in[i+1] & 0xf) << 2) | (in[i+2] >> 6)];
+        *out++ = table[in[i+2] & 0x3f];
+    }
+    if (len - i == 1) {
+        *out++ = table[in[i] >> 2];
+        *out++ = table[(in[i] & 0x3) << 4];
+        *out++ = '=';
+        *out++ = '=';
+    } else if (len - i == 2) {
+        *out++ = table[in[i] >> 2];
+        *out++ = table[((in[i] & 0x3) << 4) | (in[i+1] >> 4)];
+        *out++ = table[(in[i+1] & 0xf) << 2];
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+static void wsClientClosed(struct client *client)
+{
+    struct wsSession *session = client->client_data;
+    struct listNode *node;
+
+    if (Sessions && (node = searchListKey(Sessions, session)) != NULL)
+        removeListNode(Sessions, node);
+    wstrFree(session->path);
+    wstrFree(session->query_string);
+    wstrFree(session->frame_buf);
+    wstrFree(session->message);
+    wfree(session);
+    client->client_data = NULL;
+}
+
+static struct wsSession *createSession(struct conn *c)
+{
+    struct wsSession *session = wmalloc(sizeof(*session));
+
+    if (!session)
+        return NULL;
+    memset(session, 0, sizeof(*session));
+    session->client = c->client;
+    session->path = wstrDup(httpGetPath(c));
+    session->query_string = wstrDup(httpGetQueryString(c));
+    session->frame_buf = wstrEmpty();
+    session->message = wstrEmpty();
+    if (!session->path || !session->query_string || !session->frame_buf ||
+            !session->message || !appendToListTail(Sessions, session)) {
+        wstrFree(session->path);
+        wstrFree(session->query_string);
+        wstrFree(session->frame_buf);
+        wstrFree(session->message);
+        wfree(session);
+        return NULL;
+    }
+    session->last_recv = session->last_ping = Server.cron_time.tv_sec;
+    c->client->client_data = session;
+    setClientFreeNotify(c->client, wsClientClosed);
+    getStatItemByName("Total websocket connection")->val++;
+    return session;
+}
+
+// Answer handshake on `c` and switch client to WebSocket, `c` carries
+// WS_EVENT_OPEN afterwards instead of http request
+int webSocketUpgrade(struct conn *c, wstr key)
+{
+    uint8_t digest[20];
+    char accept[32], *response;
+    struct wsMessage *msg;
+    struct slice slice;
+    wstr input;
+    int len;
+
+    input = wstrDup(key);
+    input = wstrCat(input, WS_GUID);
+    if (!input)
+        return WHEAT_WRONG;
+    sha1((uint8_t *)input, wstrlen(input), digest);
+    wstrFree(input);
+    base64Encode(digest, sizeof(digest), accept);
+
+    response = wmalloc(sizeof(WS_SWITCHING) + sizeof(accept));
+    if (!response)
+        return WHEAT_WRONG;
+    registerConnFree(c, wfree, response);
+    len = sprintf(response, WS_SWITCHING, accept);
+
+    msg = initWsData();
+    if (!msg || !createSession(c)) {
+        if (msg)
+            freeWsData(msg);
+        return WHEAT_WRONG;
+    }
+    freeHttpData(c->protocol_data);
+    c->protocol_data = msg;
+    msg->opcode = WS_EVENT_OPEN;
+    c->client->protocol = &ProtocolWebSocket;
+
+    sliceTo(&slice, (uint8_t *)response, len);
+    return sendClientData(c, &slice);
+}
+
+// ==================================================================
+// ============================= Framing ============================
+// ==================================================================
+
+// XOR payload with masking key, 4-byte key is repeated to vector width so
+// each block is unmasked by one instruction
+static void unmask(uint8_t *data, uint64_t len, const uint8_t *mask)
+{
+    uint64_t i = 0, wide;
+    uint32_t key;
+
+    memcpy(&key, mask, sizeof(key));
+#if defined(__SSE2__)
+    __m128i vkey = _mm_set1_epi32((int)key);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, vkey));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t vkey = vreinterpretq_u8_u32(vdupq_n_u32(key));
+    for (; i + 16 <= len; i += 16)
+        vst1q_u8(data + i, veorq_u8(vld1q_u8(data + i), vkey));
+#endif
+    wide = (uint64_t)key << 32 | key;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, sizeof(v));
+        v ^= wide;
+        memcpy(data + i, &v, sizeof(v));
+    }
+    for (; i < len; i++)
+        data[i] ^= mask[i & 3];
+}
+
+static int checkFrame(struct wsSession *session, struct wsFrame *frame)
+{
+    if (frame->opcode & 0x8) {
+        if (frame->opcode > WS_OPCODE_PONG || !frame->fin ||
+                frame->len > WS_CONTROL_MAX)
+            return WS_CLOSE_PROTOCOL_ERROR;
+        return 0;
+    }
+    if (frame->opcode > WS_OPCODE_BINARY)
+        return WS_CLOSE_PROTOCOL_ERROR;
+    // Continuation only follows unfinished message and vice versa
+    if ((frame->opcode == WS_OPCODE_CONTINUATION) != (session->message_opcode != 0))
+        return WS_CLOSE_PROTOCOL_ERROR;
+    if (frame->len > MaxMessageSize - wstrlen(session->message))
+        return WS_CLOSE_TOO_BIG;
+    return 0;
+}
+
+// Parse frame in `len` bytes of `p`
+// Return value:
+// 0: frame is complete
+// >0: the number of bytes still needed
+// -1: frame is illegal, `*error` is set to close code
+static long frameNeed(struct wsSession *session, uint8_t *p, size_t len,
+        struct wsFrame *frame, int *error)
+{
+    uint64_t payload_len;
+    size_t head = 6;
+    int i;
+
+    if (len < 2)
+        return 2 - len;
+    // No extension is negotiated and client frames must be masked
+    if ((p[0] & 0x70) || !(p[1] & 0x80)) {
+        *error = WS_CLOSE_PROTOCOL_ERROR;
+        return -1;
+    }
+    payload_len = p[1] & 0x7f;
+    if (payload_len == 126)
+        head += 2;
+    else if (payload_len == 127)
+        head += 8;
+    if (len < head)
+        return head - len;
+    if (payload_len == 126) {
+        payload_len = (uint64_t)p[2] << 8 | p[3];
+    } else if (payload_len == 127) {
+        payload_len = 0;
+        for (i = 2; i < 10; i++)
+            payload_len = payload_len << 8 | p[i];
+    }
+    frame->fin = p[0] >> 7;
+    frame->opcode = p[0] & 0x0f;
+    frame->len = payload_len;
+    frame->mask = p + head - 4;
+    frame->payload = p + head;
+    if ((*error = checkFrame(session, frame)) != 0)
+        return -1;
+    if (len - head < payload_len)
+        return head + payload_len - len;
+    return 0;
+}
+
+// Return the next complete frame, it's in `slice` if possible, otherwise
+// it's assembled in `frame_buf`. NULL if more data is needed or error.
+static uint8_t *nextFrame(struct wsSession *session, struct slice *slice,
+        size_t *pos, struct wsFrame *frame, int *error)
+{
+    uint8_t *start = slice->data + *pos;
+    long need;
+
+    if (!wstrlen(session->frame_buf)) {
+        need = frameNeed(session, start, slice->len - *pos, frame, error);
+        if (need == -1)
+            return NULL;
+        if (need == 0) {
+            *pos += frame->payload - start + frame->len;
+            return start;
+        }
+    }
+
+    while (1) {
+        need = frameNeed(session, (uint8_t *)session->frame_buf,
+                wstrlen(session->frame_buf), frame, error);
+        if (need <= 0)
+            return need ? NULL : (uint8_t *)session->frame_buf;
+        if (*pos == slice->len)
+            return NULL;
+        if ((size_t)need > slice->len - *pos)
+            need = slice->len - *pos;
+        session->frame_buf = wstrCatLen(session->frame_buf,
+                (const char *)slice->data + *pos, need);
+        *pos += need;
+        if (!session->frame_buf) {
+            setClientUnvalid(session->client);
+            return NULL;
+        }
+    }
+}
+
+// Return 1 if a message or control frame is ready in `msg`, 0 if message
+// is unfinished, -1 if error
+static int handleFrame(struct wsSession *session, struct wsMessage *msg,
+        struct wsFrame *frame)
+{
+    if (!(frame->opcode & 0x8) &&
+            (!frame->fin || frame->opcode == WS_OPCODE_CONTINUATION)) {
+        if (frame->opcode != WS_OPCODE_CONTINUATION)
+            session->message_opcode = frame->opcode;
+        session->message = wstrCatLen(session->message,
+                (const char *)frame->payload, frame->len);
+        if (!session->message)
+            return -1;
+        if (!frame->fin)
+            return 0;
+        msg->opcode = session->message_opcode;
+        msg->copied = session->message;
+        sliceTo(&msg->payload, (uint8_t *)msg->copied, wstrlen(msg->copied));
+        session->message = wstrEmpty();
+        session->message_opcode = 0;
+        return session->message ? 1 : -1;
+    }
+    msg->opcode = frame->opcode;
+    sliceTo(&msg->payload, frame->payload, frame->len);
+    return 1;
+}
+
+// One complete message or control frame is handed to wsSpot each time.
+// Payload of frame in request buffer is unmasked in place and isn't copied.
+int parseWebSocket(struct conn *c, struct slice *slice, size_t *out)
+{
+    struct wsSession *session = c->client->client_data;
+    struct wsMessage *msg = c->protocol_data;
+    struct wsFrame frame;
+    size_t pos = 0;
+    uint8_t *p;
+    int error = 0, ret;
+
+    releaseClientBuffer(c->client);
+    session->last_recv = Server.cron_time.tv_sec;
+    // Data after close frame is discarded
+    if (session->closing) {
+        if (out) *out = slice->len;
+        return 1;
+    }
+    while (pos < slice->len) {
+        p = nextFrame(session, slice, &pos, &frame, &error);
+        if (!isClientValid(c->client))
+            return WHEAT_WRONG;
+        if (error) {
+            msg->opcode = WS_OPCODE_CLOSE;
+            msg->close_code = error;
+            break;
+        }
+        if (!p)
+            continue;
+        unmask(frame.payload, frame.len, frame.mask);
+        ret = handleFrame(session, msg, &frame);
+        if (ret == -1)
+            return WHEAT_WRONG;
+        if (p == (uint8_t *)session->frame_buf) {
+            if (ret == 1 && !msg->copied) {
+                msg->copied = session->frame_buf;
+                session->frame_buf = wstrEmpty();
+                if (!session->frame_buf)
+                    return WHEAT_WRONG;
+            } else {
+                wstrClear(session->frame_buf);
+            }
+        }
+        if (ret == 1)
+            break;
+    }
+
+    if (out) *out = pos;
+    return msg->opcode == -1 ? 1 : WHEAT_OK;
+}
+
+static int sendFrame(struct conn *c, int opcode, const char *data, size_t len)
+{
+    struct slice slice;
+    uint8_t *frame;
+    size_t head = 2;
+    int i;
+
+    if (len > 65535)
+        head += 8;
+    else if (len > 125)
+        head += 2;
+    frame = wmalloc(head + len);
+    if (!frame)
+        return WHEAT_WRONG;
+    registerConnFree(c, wfree, frame);
+    frame[0] = 0x80 | opcode;
+    if (len > 65535) {
+        frame[1] = 127;
+        for (i = 0; i < 8; i++)
+            frame[9-i] = (uint64_t)len >> (i * 8);
+    } else if (len > 125) {
+        frame[1] = 126;
+        frame[2] = len >> 8;
+        frame[3] = len;
+    } else {
+        frame[1] = len;
+    }
+    if (len)
+        memcpy(frame + head, data, len);
+    sliceTo(&slice, frame, head + len);
+    return sendClientData(c, &slice);
+}
+
+static int callWebSocketApp(struct conn *c)
+{
+    int ret;
+
+    if (initApp(WebSocketApp) == WHEAT_WRONG)
+        return WHEAT_WRONG;
+    c->app = WebSocketApp;
+    if (initAppData(c) == WHEAT_WRONG) {
+        wheatLog(WHEAT_WARNING, "init app data failed");
+        return WHEAT_WRONG;
+    }
+    ret = WebSocketApp->appCall(c, NULL);
+    if (ret == WHEAT_WRONG) {
+        wheatLog(WHEAT_WARNING, "app failed, exited");
+        WebSocketApp->deallocApp();
+        WebSocketApp->is_init = 0;
+    }
+    return ret;
+}
+
+int wsSpot(struct conn *c)
+{
+    struct wsMessage *msg = c->protocol_data;
+    int ret = WHEAT_OK, code;
+
+    switch (msg->opcode) {
+        case WS_EVENT_OPEN:
+        case WS_OPCODE_PONG:
+            break;
+        case WS_OPCODE_PING:
+            ret = sendFrame(c, WS_OPCODE_PONG, (const char *)msg->payload.data,
+                    msg->payload.len);
+            break;
+        case WS_OPCODE_CLOSE:
+            // Echo status code of peer's close frame
+            code = msg->close_code;
+            if (!code && msg->payload.len >= 2)
+                code = msg->payload.data[0] << 8 | msg->payload.data[1];
+            else if (!code)
+                code = WS_CLOSE_NORMAL;
+            wsClose(c, code, NULL);
+            break;
+        default:
+            getStatItemByName("Total websocket message")->val++;
+            ret = callWebSocketApp(c);
+            if (ret == WHEAT_WRONG)
+                wsClose(c, WS_CLOSE_UNEXPECTED, NULL);
+            break;
+    }
+    finishConn(c);
+    return ret;
+}
+
+void *initWsData()
+{
+    struct wsMessage *msg = wmalloc(sizeof(*msg));
+
+    if (!msg)
+        return NULL;
+    memset(msg, 0, sizeof(*msg));
+    msg->opcode = -1;
+    return msg;
+}
+
+void freeWsData(void *data)
+{
+    struct wsMessage *msg = data;
+
+    wstrFree(msg->copied);
+    wfree(msg);
+}
+
+// ==================================================================
+// ======================== WebSocket API ===========================
+// ==================================================================
+
+int isWebSocket(struct conn *c)
+{
+    return c->client->protocol == &ProtocolWebSocket;
+}
+
+int wsGetOpcode(struct conn *c)
+{
+    struct wsMessage *msg = c->protocol_data;
+    return msg->opcode;
+}
+
+const struct slice *wsGetMessage(struct conn *c)
+{
+    struct wsMessage *msg = c->protocol_data;
+    return &msg->payload;
+}
+
+const wstr wsGetPath(struct conn *c)
+{
+    struct wsSession *session = c->client->client_data;
+    return session->path;
+}
+
+const wstr wsGetQueryString(struct conn *c)
+{
+    struct wsSession *session = c->client->client_data;
+    return session->query_string;
+}
+
+int wsSendMessage(struct conn *c, int opcode, const char *data, size_t len)
+{
+    struct wsSession *session = c->client->client_data;
+
+    if (session->closing)
+        return WHEAT_WRONG;
+    return sendFrame(c, opcode, data, len);
+}
+
+// Send close frame and close client after it's sent, no more message can
+// be sent then
+int wsClose(struct conn *c, int code, const char *reason)
+{
+    struct wsSession *session = c->client->client_data;
+    char payload[WS_CONTROL_MAX];
+    size_t len = 2;
+
+    setClientClose(c);
+    if (session->closing)
+        return WHEAT_OK;
+    session->closing = 1;
+    payload[0] = code >> 8;
+    payload[1] = code;
+    if (reason) {
+        len += strlen(reason);
+        if (len > sizeof(payload))
+            len = sizeof(payload);
+        memcpy(payload + 2, reason, len - 2);
+    }
+    return sendFrame(c, WS_OPCODE_CLOSE, payload, len);
+}
+
+// Ping clients which sent nothing for `websocket-ping-interval` seconds,
+// client doesn't answer in another interval is dead and closed. Sending
+// refreshes client, so live clients aren't closed as timeout client.
+void webSocketCron()
+{
+    static time_t last = 0;
+    time_t now = Server.cron_time.tv_sec;
+    struct listIterator *iter;
+    struct listNode *node;
+    struct wsSession *session;
+    struct conn *c;
+
+    if (!PingInterval || now == last)
+        return;
+    last = now;
+    iter = listGetIterator(Sessions, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        session = listNodeValue(node);
+        if (session->closing || session->client->pending ||
+                now - session->last_recv < PingInterval)
+            continue;
+        if (now - session->last_recv >= PingInterval * 2) {
+            wheatLog(WHEAT_VERBOSE, "Closing dead websocket client %s",
+                    session->client->name);
+            freeClient(session->client);
+            continue;
+        }
+        if (now - session->last_ping < PingInterval)
+            continue;
+        session->last_ping = now;
+        c = connGet(session->client);
+        if (sendFrame(c, WS_OPCODE_PING, NULL, 0) == WHEAT_WRONG)
+            setClientClose(c);
+        finishConn(c);
+    }
+    freeListIterator(iter);
+}
+
+int initWebSocket()
+{
+    struct moduleAttr *app_module;
+    char *app_name;
+
+    // WebSocket needs Http to answer handshake
+    if (!strcasecmp(getConfiguration("protocol")->target.ptr, "WebSocket")) {
+        wheatLog(WHEAT_WARNING, "WebSocket can't be used as protocol directly, use Http with `websocket on`");
+        return WHEAT_WRONG;
+    }
+    // Long-lived connections would block SyncWorker
+    if (!strcasecmp(Server.worker_type, "SyncWorker")) {
+        wheatLog(WHEAT_WARNING, "WebSocket needs AsyncWorker");
+        return WHEAT_WRONG;
+    }
+    app_name = getConfiguration("websocket-app")->target.ptr;
+    app_module = getModule(APP, app_name);
+    if (!app_module) {
+        wheatLog(WHEAT_WARNING, "websocket-app %s not found", app_name);
+        return WHEAT_WRONG;
+    }
+    WebSocketApp = app_module->module.app;
+    MaxMessageSize = getConfiguration("websocket-max-message-size")->target.val;
+    PingInterval = getConfiguration("websocket-ping-interval")->target.val;
+    if (PingInterval >= Server.worker_timeout)
+        wheatLog(WHEAT_NOTICE, "websocket-ping-interval should be less than timeout-seconds, otherwise idle websocket clients are closed");
+    Sessions = createList();
+    if (!Sessions)
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
+void deallocWebSocket()
+{
+    if (Sessions) {
+        freeList(Sessions);
+        Sessions = NULL;
+    }
+}
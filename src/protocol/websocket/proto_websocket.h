@@ -0,0 +1,43 @@
+// WebSocket protocol module implemetation
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_PROTO_WEBSOCKET_H
+#define WHEATSERVER_PROTO_WEBSOCKET_H
+
+#include "../protocol.h"
+
+#define WS_OPCODE_CONTINUATION  0x0
+#define WS_OPCODE_TEXT          0x1
+#define WS_OPCODE_BINARY        0x2
+#define WS_OPCODE_CLOSE         0x8
+#define WS_OPCODE_PING          0x9
+#define WS_OPCODE_PONG          0xA
+
+#define WS_CLOSE_NORMAL         1000
+#define WS_CLOSE_GOING_AWAY     1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_INVALID_DATA   1007
+#define WS_CLOSE_TOO_BIG        1009
+#define WS_CLOSE_UNEXPECTED     1011
+
+// WebSocket isn't selected by `protocol` directly. Http protocol hands client
+// over to it after receiving "Upgrade: websocket" handshake if `websocket`
+// is on.
+int webSocketUpgrade(struct conn *c, wstr key);
+
+// WebSocket message API
+// App configured by `websocket-app` is called once per complete text or
+// binary message, nothing is parked between messages. Message payload is
+// only valid during the call.
+int isWebSocket(struct conn *c);
+int wsGetOpcode(struct conn *c);
+const struct slice *wsGetMessage(struct conn *c);
+const wstr wsGetPath(struct conn *c);
+const wstr wsGetQueryString(struct conn *c);
+int wsSendMessage(struct conn *c, int opcode, const char *data, size_t len);
+int wsClose(struct conn *c, int code, const char *reason);
+
+#endif
@@ -0,0 +1,259 @@
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <stddef.h>
+#include <string.h>
+
+#include "radix.h"
+#include "memalloc.h"
+
+// Each node owns the bytes between its parent and itself. Children are
+// sorted by their first byte, so a child is found by binary search.
+struct radixNode {
+    char *label;
+    size_t len;
+    void *value;
+    struct radixNode **children;
+    size_t nchild;
+};
+
+struct radix {
+    struct radixNode root;
+    size_t size;
+};
+
+static struct radixNode *radixNodeCreate(const char *label, size_t len, void *value)
+{
+    struct radixNode *node = wmalloc(sizeof(*node));
+    node->label = wmalloc(len);
+    memcpy(node->label, label, len);
+    node->len = len;
+    node->value = value;
+    node->children = NULL;
+    node->nchild = 0;
+    return node;
+}
+
+static void radixNodeFree(struct radixNode *node, void (*free_value)(void *))
+{
+    size_t i;
+    for (i = 0; i < node->nchild; ++i) {
+        radixNodeFree(node->children[i], free_value);
+        wfree(node->children[i]);
+    }
+    if (node->value && free_value)
+        free_value(node->value);
+    wfree(node->children);
+    wfree(node->label);
+}
+
+// Return the index of child starting with `ch` or where it should be
+// inserted if not found
+static size_t radixChildPos(struct radixNode *node, unsigned char ch, int *found)
+{
+    size_t low = 0, high = node->nchild, mid;
+    unsigned char first;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        first = (unsigned char)node->children[mid]->label[0];
+        if (first == ch) {
+            *found = 1;
+            return mid;
+        }
+        if (first < ch)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *found = 0;
+    return low;
+}
+
+static void radixAddChild(struct radixNode *node, size_t pos,
+        struct radixNode *child)
+{
+    node->children = wrealloc(node->children,
+            sizeof(struct radixNode *) * (node->nchild + 1));
+    memmove(&node->children[pos+1], &node->children[pos],
+            sizeof(struct radixNode *) * (node->nchild - pos));
+    node->children[pos] = child;
+    node->nchild++;
+}
+
+// Split `node` at `at`, the tail part becomes the only child of `node`
+static void radixSplit(struct radixNode *node, size_t at)
+{
+    struct radixNode *tail = radixNodeCreate(node->label+at,
+            node->len-at, node->value);
+    tail->children = node->children;
+    tail->nchild = node->nchild;
+    node->children = wmalloc(sizeof(struct radixNode *));
+    node->children[0] = tail;
+    node->nchild = 1;
+    node->value = NULL;
+    node->len = at;
+}
+
+struct radix *radixCreate()
+{
+    struct radix *r = wmalloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    return r;
+}
+
+void radixFree(struct radix *r, void (*free_value)(void *))
+{
+    radixNodeFree(&r->root, free_value);
+    wfree(r);
+}
+
+size_t radixSize(struct radix *r)
+{
+    return r->size;
+}
+
+void *radixInsert(struct radix *r, const char *key, size_t len, void *value)
+{
+    struct radixNode *node = &r->root, *child;
+    size_t pos, i;
+    int found;
+    void *old;
+
+    while (len) {
+        pos = radixChildPos(node, (unsigned char)key[0], &found);
+        if (!found) {
+            radixAddChild(node, pos, radixNodeCreate(key, len, value));
+            r->size++;
+            return NULL;
+        }
+        child = node->children[pos];
+        for (i = 1; i < child->len && i < len; ++i) {
+            if (child->label[i] != key[i])
+                break;
+        }
+        if (i < child->len)
+            radixSplit(child, i);
+        node = child;
+        key += i;
+        len -= i;
+    }
+    old = node->value;
+    node->value = value;
+    if (!old)
+        r->size++;
+    return old;
+}
+
+void radixWalkInit(struct radix *r, struct radixWalker *w)
+{
+    w->node = &r->root;
+    w->pos = 0;
+    w->value = r->root.value;
+}
+
+int radixWalk(struct radixWalker *w, const char *s, size_t len)
+{
+    struct radixNode *node = w->node;
+    size_t pos = w->pos, n;
+    int found;
+
+    while (len) {
+        if (pos == node->len) {
+            n = radixChildPos(node, (unsigned char)s[0], &found);
+            if (!found)
+                goto miss;
+            node = node->children[n];
+            pos = 0;
+        }
+        n = node->len - pos;
+        if (n > len)
+            n = len;
+        if (memcmp(node->label+pos, s, n))
+            goto miss;
+        pos += n;
+        s += n;
+        len -= n;
+        if (pos == node->len && node->value)
+            w->value = node->value;
+    }
+    w->node = node;
+    w->pos = pos;
+    return 1;
+
+miss:
+    w->node = NULL;
+    return 0;
+}
+
+void *radixFind(struct radix *r, const char *key, size_t len)
+{
+    struct radixWalker w;
+
+    radixWalkInit(r, &w);
+    if (!radixWalk(&w, key, len) || w.pos != w.node->len)
+        return NULL;
+    return w.node->value;
+}
+
+void *radixLongestPrefix(struct radix *r, const char *key, size_t len)
+{
+    struct radixWalker w;
+
+    radixWalkInit(r, &w);
+    radixWalk(&w, key, len);
+    return w.value;
+}
+
+#ifdef RADIX_TEST_MAIN
+#include "test_help.h"
+#include "stdlib.h"
+#include "stdio.h"
+
+int main(int argc, const char *argv[])
+{
+    {
+        struct radix *r = radixCreate();
+        struct radixWalker w;
+        int a = 1, b = 2, c = 3, d = 4, e = 5;
+
+        test_cond("radixInsert new key", radixInsert(r, "/static/", 8, &a) == NULL);
+        radixInsert(r, "/", 1, &b);
+        radixInsert(r, "/api/v1/", 8, &c);
+        radixInsert(r, "/api/", 5, &d);
+        radixInsert(r, "/stat", 5, &e);
+        test_cond("radixSize", radixSize(r) == 5);
+        test_cond("radixInsert replace", radixInsert(r, "/api/", 5, &d) == &d);
+        test_cond("radixSize after replace", radixSize(r) == 5);
+
+        test_cond("radixFind exact", radixFind(r, "/static/", 8) == &a);
+        test_cond("radixFind split node", radixFind(r, "/stat", 5) == &e);
+        test_cond("radixFind inner node", radixFind(r, "/sta", 4) == NULL);
+        test_cond("radixFind miss", radixFind(r, "/static/x", 9) == NULL);
+
+        test_cond("radixLongestPrefix longest",
+                radixLongestPrefix(r, "/static/a.png", 13) == &a);
+        test_cond("radixLongestPrefix shorter key",
+                radixLongestPrefix(r, "/statistic", 10) == &e);
+        test_cond("radixLongestPrefix nested",
+                radixLongestPrefix(r, "/api/v1/users", 13) == &c);
+        test_cond("radixLongestPrefix parent",
+                radixLongestPrefix(r, "/api/v2/users", 13) == &d);
+        test_cond("radixLongestPrefix fallback",
+                radixLongestPrefix(r, "/index.html", 11) == &b);
+        test_cond("radixLongestPrefix none",
+                radixLongestPrefix(r, "index.html", 10) == NULL);
+
+        radixWalkInit(r, &w);
+        test_cond("radixWalk part", radixWalk(&w, "/ap", 3) == 1);
+        test_cond("radixWalk part value", w.value == &b);
+        test_cond("radixWalk rest", radixWalk(&w, "i/v1/x", 6) == 0);
+        test_cond("radixWalk rest value", w.value == &c);
+        radixFree(r, NULL);
+    }
+    test_report();
+    return 0;
+}
+
+#endif
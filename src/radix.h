@@ -0,0 +1,49 @@
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_RADIX_H
+#define WHEATSERVER_RADIX_H
+
+#include <stddef.h>
+
+struct radix;
+struct radixNode;
+
+// `radix` is a compressed prefix tree mapping byte strings to non-NULL values.
+// It is built once and mainly used to find the longest inserted key which is
+// prefix of the searched string:
+//
+//     struct radix *r = radixCreate();
+//     radixInsert(r, "/static/", 8, static_route);
+//     radixInsert(r, "/", 1, default_route);
+//     route = radixLongestPrefix(r, path, wstrlen(path));
+//
+// Searching costs O(len) and allocates nothing. If the searched string is
+// split into several parts, walk them one by one with `radixWalker`:
+//
+//     struct radixWalker w;
+//     radixWalkInit(r, &w);
+//     if (radixWalk(&w, host, host_len))
+//         radixWalk(&w, path, path_len);
+//     route = w.value;
+struct radixWalker {
+    struct radixNode *node;
+    size_t pos;
+    void *value;
+};
+
+struct radix *radixCreate();
+void radixFree(struct radix *r, void (*free_value)(void *));
+// Return old value if `key` exists and replace it with `value`
+void *radixInsert(struct radix *r, const char *key, size_t len, void *value);
+void *radixFind(struct radix *r, const char *key, size_t len);
+void *radixLongestPrefix(struct radix *r, const char *key, size_t len);
+size_t radixSize(struct radix *r);
+
+void radixWalkInit(struct radix *r, struct radixWalker *w);
+// Return 0 if no key starts with all the walked bytes. `w->value` is the
+// value of the longest key walked through.
+int radixWalk(struct radixWalker *w, const char *s, size_t len);
+
+#endif
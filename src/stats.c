@@ -18,6 +18,7 @@ static struct statItem StatItems[] = {
     {"Total request", SUM_STAT, RAW, 0, 0},
     {"Total timeout client", SUM_STAT, RAW, 0, 0},
     {"Total failed request", SUM_STAT, RAW, 0, 0},
+    {"Total sendfile offload", SUM_STAT, RAW, 0, 0},
     {"Max buffer size", MAX_STAT, RAW, 0, 0},
     {"Worker run time", SUM_STAT, MICORSECONDS_TIME, 0, 0},
     {"Max worker cron interval", ASSIGN_STAT, RAW, 0, 0},
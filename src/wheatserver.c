@@ -624,6 +624,24 @@ void reload()
     adjustWorkerNumber();
 }
 
+static void initModulesMaster()
+{
+    struct listNode *node;
+    struct listIterator *iter;
+    struct moduleAttr *module_attr;
+
+    iter = listGetIterator(Server.modules, START_HEAD);
+    while ((node = listNext(iter)) != NULL) {
+        module_attr = listNodeValue(node);
+        if (module_attr->initMaster &&
+                module_attr->initMaster() == WHEAT_WRONG) {
+            wheatLog(WHEAT_WARNING, "init module %s failed", module_attr->name);
+            halt(1);
+        }
+    }
+    freeListIterator(iter);
+}
+
 void initServer()
 {
     Server.master_center = eventcenterInit(Server.worker_number*2+32);
@@ -642,6 +660,7 @@ void initServer()
     initStatListen();
     initMainListen();
     logRedirect();
+    initModulesMaster();
 }
 
 void version() {
@@ -70,6 +70,7 @@
 #define WHEAT_PREALLOC_CLIENT  100
 #define WHEAT_MAX_BUFFER_SIZE  (4*1024*1024)
 #define WHEAT_MAX_FILE_LIMIT   (16*1024*1024)
+#define WHEAT_SENDFILE_MAX_CHUNK (1024*1024)
 #define WHEAT_STR_NULL         "NULL"
 
 // Command Format
@@ -220,6 +221,9 @@ struct moduleAttr {
     size_t conf_size;
     struct command *commands;
     size_t command_size;
+    // Optional, called by master after configuration is loaded and before
+    // workers are forked, so resources shared by workers can be created.
+    int (*initMaster)();
 };
 
 struct workerProcess;
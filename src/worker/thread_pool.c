@@ -0,0 +1,220 @@
+// Thread pool running blocking jobs outside event loop
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "thread_pool.h"
+#include "../memalloc.h"
+
+struct job {
+    void (*work)(void *);
+    void (*done)(void *);
+    void *arg;
+    struct job *next;
+};
+
+// Jobs queued in `todo` are taken by threads and moved to `finished`, one
+// byte is written to `notify[1]` for each finished job
+struct threadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *todo, *todo_tail;
+    struct job *finished;
+    int notify[2];
+    int stop;
+    int nthreads;
+    pthread_t threads[];
+};
+
+static void *threadMain(void *data)
+{
+    struct threadPool *pool = data;
+    struct job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->todo && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->stop)
+            break;
+        job = pool->todo;
+        pool->todo = job->next;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->work(job->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->finished;
+        pool->finished = job;
+        // Pipe full means it's readable already
+        if (write(pool->notify[1], "", 1)) {}
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct threadPool *threadPoolCreate(int nthreads)
+{
+    struct threadPool *pool;
+    int i;
+
+    pool = wmalloc(sizeof(*pool) + nthreads*sizeof(pthread_t));
+    if (!pool)
+        return NULL;
+    pool->todo = pool->todo_tail = pool->finished = NULL;
+    pool->stop = 0;
+    pool->nthreads = 0;
+    if (pipe(pool->notify) == -1) {
+        wfree(pool);
+        return NULL;
+    }
+    fcntl(pool->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool->notify[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, threadMain, pool)) {
+            threadPoolDestroy(pool);
+            return NULL;
+        }
+        pool->nthreads++;
+    }
+    return pool;
+}
+
+static void freeJobs(struct job *job)
+{
+    struct job *next;
+
+    while (job) {
+        next = job->next;
+        wfree(job);
+        job = next;
+    }
+}
+
+void threadPoolDestroy(struct threadPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    freeJobs(pool->todo);
+    freeJobs(pool->finished);
+    close(pool->notify[0]);
+    close(pool->notify[1]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    wfree(pool);
+}
+
+int threadPoolSubmit(struct threadPool *pool, void (*work)(void *),
+        void (*done)(void *), void *arg)
+{
+    struct job *job = wmalloc(sizeof(*job));
+
+    if (!job)
+        return -1;
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->todo)
+        pool->todo_tail->next = job;
+    else
+        pool->todo = job;
+    pool->todo_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int threadPoolFd(struct threadPool *pool)
+{
+    return pool->notify[0];
+}
+
+int threadPoolComplete(struct threadPool *pool)
+{
+    struct job *job, *next;
+    char buf[64];
+    int count = 0;
+
+    while (read(pool->notify[0], buf, sizeof(buf)) > 0)
+        continue;
+    pthread_mutex_lock(&pool->lock);
+    job = pool->finished;
+    pool->finished = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    while (job) {
+        next = job->next;
+        job->done(job->arg);
+        wfree(job);
+        job = next;
+        count++;
+    }
+    return count;
+}
+
+#ifdef THREAD_POOL_TEST_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include "../test_help.h"
+
+struct counter {
+    int worked;
+    int done;
+};
+
+static void work(void *arg)
+{
+    struct counter *counter = arg;
+    usleep(100);
+    __sync_fetch_and_add(&counter->worked, 1);
+}
+
+static void done(void *arg)
+{
+    struct counter *counter = arg;
+    counter->done++;
+}
+
+int main(int argc, const char *argv[])
+{
+    struct threadPool *pool;
+    struct counter counter = {0, 0};
+    struct pollfd pfd;
+    int i, completed = 0;
+
+    pool = threadPoolCreate(4);
+    test_cond("threadPoolCreate", pool != NULL);
+    for (i = 0; i < 100; i++)
+        threadPoolSubmit(pool, work, done, &counter);
+    pfd.fd = threadPoolFd(pool);
+    pfd.events = POLLIN;
+    while (completed < 100 && poll(&pfd, 1, 1000) == 1)
+        completed += threadPoolComplete(pool);
+    test_cond("threadPoolComplete all jobs", completed == 100 &&
+            counter.worked == 100 && counter.done == 100);
+    test_cond("threadPoolComplete nothing", threadPoolComplete(pool) == 0);
+
+    for (i = 0; i < 100; i++)
+        threadPoolSubmit(pool, work, done, &counter);
+    threadPoolDestroy(pool);
+    test_cond("threadPoolDestroy", counter.done == 100);
+    test_report();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,34 @@
+// Thread pool running blocking jobs outside event loop
+//
+// Copyright (c) 2013 The Wheatserver Author. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef WHEATSERVER_WORKER_THREAD_POOL_H
+#define WHEATSERVER_WORKER_THREAD_POOL_H
+
+struct threadPool;
+
+// Worker process is single threaded, so only `work` of job runs in pool
+// thread and it mustn't touch anything shared with worker. `done` is called
+// by the thread calling `threadPoolComplete`, which is expected when
+// `threadPoolFd` becomes readable.
+//
+// Use cases:
+//     pool = threadPoolCreate(4);
+//     createEvent(center, threadPoolFd(pool), EVENT_READABLE, handler, pool);
+//     threadPoolSubmit(pool, work, done, arg);
+//     ...
+//     // handler
+//     threadPoolComplete(pool);
+
+struct threadPool *threadPoolCreate(int nthreads);
+// Wait running jobs and drop queued ones, `done` isn't called for both
+void threadPoolDestroy(struct threadPool *pool);
+int threadPoolSubmit(struct threadPool *pool, void (*work)(void *),
+        void (*done)(void *), void *arg);
+int threadPoolFd(struct threadPool *pool);
+// Call `done` of finished jobs and return the number of them
+int threadPoolComplete(struct threadPool *pool);
+
+#endif
@@ -4,12 +4,18 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
+#include <poll.h>
+
 #include "../wheatserver.h"
 #include "worker.h"
+#include "thread_pool.h"
 
 struct workerProcess *WorkerProcess = NULL;
 
 #define WHEAT_CLIENT_MAX      1000
+#define WHEAT_IOV_MAX         64
+#define WHEAT_OFFLOAD_CHUNK   (256*1024)
+#define WHEAT_READAHEAD       (2*1024*1024)
 
 // ========= Statistic Cache ===============
 // Cache below stat field avoid too much query on StatItems
@@ -17,16 +23,28 @@ static struct statItem *StatBufferSize = NULL;
 static struct statItem *StatTotalRequest = NULL;
 static struct statItem *StatFailedRequest = NULL;
 static struct statItem *StatRunTime = NULL;
+static struct statItem *StatFileOffload = NULL;
 
 enum packetType {
     SLICE = 1,
     FILE_DESCRIPTION = 2,
+    PIPE = 3,
 };
 
+// `warm`: end of range known in page cache, used by file offload
+// `advised`: end of range kernel is told to read ahead
 struct fileWrapper {
     int fd;
     off_t off;
     size_t len;
+    off_t warm;
+    off_t advised;
+};
+
+// `fd` is dup of pipe passed by app, closed with packet
+struct pipeWrapper {
+    int fd;
+    size_t len;
 };
 
 struct sendPacket {
@@ -34,6 +52,7 @@ struct sendPacket {
     union {
         struct slice slice;
         struct fileWrapper file;
+        struct pipeWrapper pipe;
     } target;
 };
 
@@ -42,10 +61,31 @@ struct callback {
     void *data;
 };
 
+// Range of file not in page cache is read by pool thread first, so
+// sendfile(2) won't block other clients on disk. Client waiting for it
+// isn't sent anything until the job is done.
+struct fileOffload {
+    struct client *client;  // NULL means client is freed
+    struct fileWrapper *file;
+    int fd;                 // dup of `file->fd`, closed when done
+    off_t off;
+    size_t len;
+};
+
+static struct threadPool *FileOffload = NULL;
+// Max file bytes sent to a client each time it's writable, 0 means no limit
+static size_t SendfileMaxChunk = 0;
+
 static struct list *FreeClients = NULL;
 static struct list *Clients = NULL;
 static struct statItem *StatTotalClient = NULL;
 
+// Clients with deadline are kept in a binary min-heap, so expired ones are
+// found every cron without scanning all clients
+static struct client **Deadlines = NULL;
+static int DeadlineCount = 0;
+static int DeadlineSize = 0;
+
 // Static fucntion declaretion
 static void handleRequest(struct evcenter *center, int fd, void *data, int mask);
 static void connDealloc(struct conn *c);
@@ -56,6 +96,96 @@ static void callbackCall(void *data);
 // ======================= Client Implemation =======================
 // ==================================================================
 
+static void deadlineSet(int idx, struct client *c)
+{
+    Deadlines[idx] = c;
+    c->deadline_idx = idx;
+}
+
+static void deadlineUp(int idx)
+{
+    struct client *c = Deadlines[idx];
+    int parent;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (Deadlines[parent]->deadline <= c->deadline)
+            break;
+        deadlineSet(idx, Deadlines[parent]);
+        idx = parent;
+    }
+    deadlineSet(idx, c);
+}
+
+static void deadlineDown(int idx)
+{
+    struct client *c = Deadlines[idx];
+    int child;
+
+    while ((child = idx*2 + 1) < DeadlineCount) {
+        if (child + 1 < DeadlineCount &&
+                Deadlines[child+1]->deadline < Deadlines[child]->deadline)
+            child++;
+        if (c->deadline <= Deadlines[child]->deadline)
+            break;
+        deadlineSet(idx, Deadlines[child]);
+        idx = child;
+    }
+    deadlineSet(idx, c);
+}
+
+void clearClientDeadline(struct client *c)
+{
+    int idx = c->deadline_idx;
+
+    if (idx == -1)
+        return ;
+    c->deadline_idx = -1;
+    if (idx == --DeadlineCount)
+        return ;
+    deadlineSet(idx, Deadlines[DeadlineCount]);
+    deadlineUp(idx);
+    deadlineDown(Deadlines[idx]->deadline_idx);
+}
+
+void setClientDeadline(struct client *c, long milliseconds, struct statItem *stat)
+{
+    struct client **deadlines;
+
+    if (milliseconds <= 0) {
+        clearClientDeadline(c);
+        return ;
+    }
+    if (c->deadline_idx == -1) {
+        if (DeadlineCount == DeadlineSize) {
+            deadlines = wrealloc(Deadlines, sizeof(*Deadlines)*(DeadlineSize*2+16));
+            if (!deadlines)
+                return ;
+            Deadlines = deadlines;
+            DeadlineSize = DeadlineSize*2 + 16;
+        }
+        deadlineSet(DeadlineCount++, c);
+    }
+    c->deadline = getMicroseconds(Server.cron_time) + milliseconds*1000LL;
+    c->deadline_stat = stat;
+    deadlineUp(c->deadline_idx);
+    deadlineDown(c->deadline_idx);
+}
+
+static void deadlinesCron()
+{
+    long long now = getMicroseconds(Server.cron_time);
+    struct client *c;
+
+    while (DeadlineCount && Deadlines[0]->deadline <= now) {
+        c = Deadlines[0];
+        wheatLog(WHEAT_VERBOSE, "Closing client %s reached deadline: %s", c->name,
+                c->deadline_stat->name);
+        c->deadline_stat->val++;
+        freeClient(c);
+    }
+}
+
 static void clientsCron()
 {
     long idletime;
@@ -64,6 +194,7 @@ static void clientsCron()
     struct client *c;
     struct listNode *node;
 
+    deadlinesCron();
     numclients = listLength(Clients);
     iteration = numclients < 50 ? numclients : numclients / 10;
     while (listLength(Clients) && iteration--) {
@@ -86,6 +217,35 @@ static void clientsCron()
     }
 }
 
+// Protocol calls it when no conn refers to consumed request data any more,
+// so mbufs already parsed can be released before the request completes.
+void releaseClientBuffer(struct client *c)
+{
+    msgClean(c->req_buf);
+}
+
+int recvClientWait(struct client *c, long milliseconds)
+{
+    struct pollfd pfd;
+    int ret;
+
+    if (!isClientValid(c))
+        return WHEAT_WRONG;
+    pfd.fd = c->clifd;
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, milliseconds);
+    if (ret == -1 && errno == EINTR)
+        return WHEAT_OK;
+    if (ret != 1) {
+        setClientUnvalid(c);
+        return WHEAT_WRONG;
+    }
+    WorkerProcess->worker->recvData(c);
+    if (!isClientValid(c))
+        return WHEAT_WRONG;
+    return WHEAT_OK;
+}
+
 struct client *createClient(int fd, char *ip, int port, struct protocol *p)
 {
     struct client *c;
@@ -114,12 +274,17 @@ struct client *createClient(int fd, char *ip, int port, struct protocol *p)
     c->pending = NULL;
     c->client_data = NULL;
     c->notify = NULL;
+    c->offload = NULL;
+    c->hold = 0;
     c->last_io = Server.cron_time;
+    c->deadline_idx = -1;
     c->name = wstrEmpty();
 
     createEvent(WorkerProcess->center, c->clifd, EVENT_READABLE,
             handleRequest, c);
     getStatVal(StatTotalClient)++;
+    if (p->clientIdle)
+        p->clientIdle(c);
     return c;
 }
 
@@ -127,8 +292,19 @@ void freeClient(struct client *c)
 {
     struct listNode *node;
 
+    if (c->hold) {
+        setClientUnvalid(c);
+        clearClientDeadline(c);
+        deleteEvent(WorkerProcess->center, c->clifd, EVENT_READABLE|EVENT_WRITABLE);
+        return ;
+    }
     if (c->notify)
         c->notify(c);
+    clearClientDeadline(c);
+    if (c->offload) {
+        ((struct fileOffload *)c->offload)->client = NULL;
+        c->offload = NULL;
+    }
     wstrFree(c->ip);
     wstrFree(c->name);
     msgFree(c->req_buf);
@@ -148,6 +324,8 @@ void freeClient(struct client *c)
 
 void tryFreeClient(struct client *c)
 {
+    if (c->hold)
+        return;
     if (isClientValid(c) && (isClientNeedSend(c) || !c->should_close))
         return;
     freeClient(c);
@@ -195,6 +373,7 @@ struct conn *connGet(struct client *client)
     c->app = c->app_private_data = NULL;
     appendToListTail(client->conns, c);
     c->ready_send = 0;
+    c->cork_limit = c->corked = 0;
     c->send_queue = createList();
     listSetFree(c->send_queue, (void(*)(void*))freeSendPacket);
     c->cleanup = arrayCreate(sizeof(struct callback), 2);
@@ -233,6 +412,8 @@ void registerConnFree(struct conn *conn, void (*clean)(void*), void *data)
 
 static void freeSendPacket(struct sendPacket *p)
 {
+    if (p->type == PIPE)
+        close(p->target.pipe.fd);
     wfree(p);
 }
 
@@ -252,6 +433,10 @@ static void appendFileToSendQueue(struct conn *conn, int fd, off_t off,
     packet->target.file.fd = fd;
     packet->target.file.off = off;
     packet->target.file.len = len;
+    packet->target.file.warm = off;
+    packet->target.file.advised = off;
+    if (len > WHEAT_READAHEAD)
+        portable_file_sequential(fd, off, len);
 
     appendToListTail(conn->send_queue, packet);
 }
@@ -266,50 +451,232 @@ static void appendSliceToSendQueue(struct conn *conn, struct slice *s)
     appendToListTail(conn->send_queue, packet);
 }
 
+// Gather continuous SLICE packets at the head of `send_queue` and write
+// them with one writev(2), packets sent completely are removed from
+// `send_queue`.
+// Return value:
+// 0: send packets completely
+// 1: send packets incompletely
+// -1: send packets error client need closed
+static int sendSlicePackets(struct client *c, struct list *send_queue)
+{
+    struct iovec iov[WHEAT_IOV_MAX];
+    struct listNode *node;
+    struct sendPacket *packet;
+    struct slice *data;
+    ssize_t nwritten;
+    int niov;
+
+    niov = 0;
+    node = listFirst(send_queue);
+    while (node && niov < WHEAT_IOV_MAX) {
+        packet = listNodeValue(node);
+        if (packet->type != SLICE)
+            break;
+        iov[niov].iov_base = packet->target.slice.data;
+        iov[niov].iov_len = packet->target.slice.len;
+        niov++;
+        node = node->next;
+    }
+
+    nwritten = writevBulkTo(c->clifd, iov, niov);
+    if (nwritten == -1)
+        return -1;
+
+    while (niov--) {
+        node = listFirst(send_queue);
+        packet = listNodeValue(node);
+        data = &packet->target.slice;
+        if (nwritten < data->len) {
+            data->data += nwritten;
+            data->len -= nwritten;
+            return 1;
+        }
+        nwritten -= data->len;
+        removeListNode(send_queue, node);
+    }
+    return 0;
+}
+
+static void readFileRange(void *data)
+{
+    struct fileOffload *job = data;
+    char buf[65536];
+    off_t off = job->off, end = job->off + job->len;
+    ssize_t nread;
+
+    while (off < end) {
+        nread = pread(job->fd, buf,
+                end - off < sizeof(buf) ? end - off : sizeof(buf), off);
+        if (nread <= 0)
+            break;
+        off += nread;
+    }
+}
+
+static void fileRangeRead(void *data)
+{
+    struct fileOffload *job = data;
+    struct client *c = job->client;
+    struct conn *send_conn;
+
+    close(job->fd);
+    if (c) {
+        c->offload = NULL;
+        job->file->warm = job->off + job->len;
+        if (isClientNeedSend(c)) {
+            send_conn = listNodeValue(listFirst(c->conns));
+            WorkerProcess->worker->sendData(send_conn);
+        }
+        tryFreeClient(c);
+    }
+    wfree(job);
+}
+
+// Return 1 if next chunk of file is being read by pool thread
+static int offloadFile(struct client *c, struct fileWrapper *file)
+{
+    struct fileOffload *job;
+    size_t len;
+    int fd;
+
+    len = file->len < WHEAT_OFFLOAD_CHUNK ? file->len : WHEAT_OFFLOAD_CHUNK;
+    file->warm = file->off + len;
+    if (portable_file_cached(file->fd, file->off, len))
+        return 0;
+    job = wmalloc(sizeof(*job));
+    if (!job)
+        return 0;
+    fd = dup(file->fd);
+    if (fd == -1) {
+        wfree(job);
+        return 0;
+    }
+    job->client = c;
+    job->file = file;
+    job->fd = fd;
+    job->off = file->off;
+    job->len = len;
+    if (threadPoolSubmit(FileOffload, readFileRange, fileRangeRead, job) == -1) {
+        close(fd);
+        wfree(job);
+        return 0;
+    }
+    c->offload = job;
+    getStatVal(StatFileOffload)++;
+    return 1;
+}
+
+static void completeFileOffload(struct evcenter *center, int fd, void *data,
+        int mask)
+{
+    threadPoolComplete(data);
+}
+
+int enableFileOffload(int nthreads)
+{
+    FileOffload = threadPoolCreate(nthreads);
+    if (!FileOffload)
+        return WHEAT_WRONG;
+    if (createEvent(WorkerProcess->center, threadPoolFd(FileOffload),
+                EVENT_READABLE, completeFileOffload, FileOffload) == WHEAT_WRONG) {
+        threadPoolDestroy(FileOffload);
+        FileOffload = NULL;
+        return WHEAT_WRONG;
+    }
+    StatFileOffload = getStatItemByName("Total sendfile offload");
+    return WHEAT_OK;
+}
+
+void setSendfileMaxChunk(size_t len)
+{
+    SendfileMaxChunk = len;
+}
+
+// Keep next window of large file being read ahead while it's sent, so
+// sendfile(2) rarely waits for disk
+static void adviseFile(struct fileWrapper *file)
+{
+    off_t end = file->off + file->len;
+
+    if (file->advised < file->off)
+        file->advised = file->off;
+    if (file->advised >= end ||
+            file->advised - file->off > WHEAT_READAHEAD / 2)
+        return ;
+    portable_file_willneed(file->fd, file->advised, WHEAT_READAHEAD);
+    file->advised += WHEAT_READAHEAD;
+}
+
+// `budget` is file bytes can be sent before giving way to other clients,
+// it's decreased by bytes sent
+//
 // Return value:
 // 0: send packet completely
 // 1: send packet incompletely
 // -1: send packet error client need closed
-static int sendPacket(struct client *c, struct sendPacket *packet)
+static int sendFilePacket(struct client *c, struct sendPacket *packet,
+        size_t *budget)
 {
-    struct slice *data;
     ssize_t nwritten = 0;
     struct fileWrapper *file_wrapper;
-    switch (packet->type) {
-        case SLICE:
-            data = &packet->target.slice;
-            while (data->len != 0) {
-                nwritten = writeBulkTo(c->clifd, data);
-                if (nwritten <= 0)
-                    break;
-                data->len -= nwritten;
-                data->data += nwritten;
-            }
+    size_t len;
 
-            if (nwritten == -1) {
-                return -1;
-            }
+    file_wrapper = &packet->target.file;
+    while (file_wrapper->len > 0) {
+        if (!*budget)
+            return 1;
+        if (FileOffload && file_wrapper->off >= file_wrapper->warm &&
+                offloadFile(c, file_wrapper))
+            return 1;
+        if (file_wrapper->len > WHEAT_READAHEAD)
+            adviseFile(file_wrapper);
+        len = file_wrapper->len < *budget ? file_wrapper->len : *budget;
+        nwritten = portable_sendfile(c->clifd, file_wrapper->fd,
+                file_wrapper->off, len);
+        if (nwritten == -1)
+            return -1;
+        else if (nwritten == 0) {
+            return 1;
+        }
+        file_wrapper->off += nwritten;
+        file_wrapper->len -= nwritten;
+        *budget -= nwritten;
+    }
+    return 0;
+}
 
-            if (nwritten == 0) {
-                return 1;
-            }
-            break;
-        case FILE_DESCRIPTION:
-            file_wrapper = &packet->target.file;
-            while (file_wrapper->len > 0) {
-                nwritten = portable_sendfile(c->clifd, file_wrapper->fd,
-                        file_wrapper->off, file_wrapper->len);
-                if (nwritten == -1)
-                    return -1;
-                else if (nwritten == 0) {
-                    return 1;
-                }
-                file_wrapper->off += nwritten;
-                file_wrapper->len -= nwritten;
-            }
+#ifdef HAVE_SPLICE
+// Pipe is moved to client by splice(2), reading pipe may block worker like
+// app reading it, but client not writable leaves it to writable event.
+// Return value is the same as sendFilePacket, pipe ending before `len`
+// bytes is an error because response can't be completed.
+static int sendPipePacket(struct client *c, struct sendPacket *packet,
+        size_t *budget)
+{
+    struct pipeWrapper *pipe_wrapper = &packet->target.pipe;
+    ssize_t n;
+    size_t len;
+
+    while (pipe_wrapper->len > 0) {
+        if (!*budget)
+            return 1;
+        len = pipe_wrapper->len < *budget ? pipe_wrapper->len : *budget;
+        n = portable_splice(c->clifd, pipe_wrapper->fd, len);
+        if (n > 0) {
+            pipe_wrapper->len -= n;
+            *budget -= n;
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN) {
+            return 1;
+        } else if (errno != EINTR) {
+            return -1;
+        }
     }
     return 0;
 }
+#endif
 
 void clientSendPacketList(struct client *c)
 {
@@ -317,7 +684,11 @@ void clientSendPacketList(struct client *c)
     struct conn *send_conn;
     struct listNode *node, *node2;
     ssize_t ret;
+    size_t budget;
 
+    if (c->offload)
+        return ;
+    budget = SendfileMaxChunk ? SendfileMaxChunk : (size_t)-1;
     while (isClientNeedSend(c)) {
         node = listFirst(c->conns);
         send_conn = listNodeValue(node);
@@ -325,7 +696,18 @@ void clientSendPacketList(struct client *c)
         while (listLength(send_conn->send_queue)) {
             node2 = listFirst(send_conn->send_queue);
             packet = listNodeValue(node2);
-            ret = sendPacket(c, packet);
+            if (packet->type == SLICE) {
+                ret = sendSlicePackets(c, send_conn->send_queue);
+            } else {
+#ifdef HAVE_SPLICE
+                if (packet->type == PIPE)
+                    ret = sendPipePacket(c, packet, &budget);
+                else
+#endif
+                ret = sendFilePacket(c, packet, &budget);
+                if (ret == 0)
+                    removeListNode(send_conn->send_queue, node2);
+            }
             if (ret == -1) {
                 setClientUnvalid(c);
                 return ;
@@ -333,28 +715,108 @@ void clientSendPacketList(struct client *c)
                 return ;
             }
             ASSERT(ret == 0);
-            removeListNode(send_conn->send_queue, node2);
         }
         if (send_conn->ready_send)
             removeListNode(c->conns, node);
     }
+    if (!listLength(c->conns) && c->protocol->clientIdle)
+        c->protocol->clientIdle(c);
 }
 
 int sendClientFile(struct conn *c, int fd, off_t len)
 {
-    int send = 0;
-    appendFileToSendQueue(c, fd, send, len-send);
+    return sendClientFileRange(c, fd, 0, len);
+}
+
+int sendClientFileRange(struct conn *c, int fd, off_t off, size_t len)
+{
+    appendFileToSendQueue(c, fd, off, len);
     return WorkerProcess->worker->sendData(c);
 }
 
+// Return whether queued data of corked `c` should be held
+static int holdCorked(struct conn *c, size_t len)
+{
+    if (!c->cork_limit)
+        return 0;
+    c->corked += len;
+    if (c->corked < c->cork_limit)
+        return 1;
+    c->corked = 0;
+    return 0;
+}
+
 int sendClientData(struct conn *c, struct slice *s)
 {
     if (!s->len)
         return WHEAT_OK;
     appendSliceToSendQueue(c, s);
+    if (holdCorked(c, s->len))
+        return WHEAT_OK;
+    return WorkerProcess->worker->sendData(c);
+}
+
+// Queue `count` slices together and send them once, worker will gather them
+// into one writev(2) instead of a syscall per slice
+int sendClientSlices(struct conn *c, struct slice *slices, size_t count)
+{
+    size_t i, len = 0;
+
+    for (i = 0; i < count; i++) {
+        if (slices[i].len)
+            appendSliceToSendQueue(c, &slices[i]);
+        len += slices[i].len;
+    }
+    if (holdCorked(c, len))
+        return WHEAT_OK;
     return WorkerProcess->worker->sendData(c);
 }
 
+void corkConn(struct conn *c, size_t limit)
+{
+    c->cork_limit = limit;
+    c->corked = 0;
+}
+
+int uncorkConn(struct conn *c)
+{
+    size_t corked = c->corked;
+
+    c->cork_limit = c->corked = 0;
+    if (!corked)
+        return WHEAT_OK;
+    return WorkerProcess->worker->sendData(c);
+}
+
+#ifdef HAVE_SPLICE
+// `len` bytes of pipe `fd` are queued after data of `c` and sent as client
+// is writable, pipe is dup'ed so app may close it meanwhile
+int sendClientPipe(struct conn *c, int fd, size_t len)
+{
+    struct sendPacket *packet;
+    int pipe_fd;
+
+    if (!len)
+        return WHEAT_OK;
+    pipe_fd = dup(fd);
+    if (pipe_fd == -1) {
+        setClientUnvalid(c->client);
+        return WHEAT_WRONG;
+    }
+    packet = wmalloc(sizeof(*packet));
+    if (!packet) {
+        close(pipe_fd);
+        setClientUnvalid(c->client);
+        return WHEAT_WRONG;
+    }
+    packet->type = PIPE;
+    packet->target.pipe.fd = pipe_fd;
+    packet->target.pipe.len = len;
+    appendToListTail(c->send_queue, packet);
+    return WorkerProcess->worker->sendData(c);
+}
+#endif
+
 // ==================================================================
 // ============= Worker Process Connection Functions ================
 // ==================================================================
@@ -364,7 +826,7 @@ struct client *buildConn(char *ip, int port, struct protocol *p)
     struct client *c = NULL;
     int fd = wheatTcpConnect(Server.neterr, ip, port);
     if (fd == NET_WRONG) {
-        wheatLog(WHEAT_WARNING, "Unable to connect to redis %s:%d: %s %s",
+        wheatLog(WHEAT_WARNING, "Unable to connect to %s:%d: %s %s",
                 ip, port, strerror(errno), Server.neterr);
         return NULL;
     }
@@ -381,32 +843,16 @@ struct client *buildConn(char *ip, int port, struct protocol *p)
     return c;
 }
 
-static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
+// Parse and call app for requests in buffer until client is held by app
+static void parseRequests(struct client *client)
 {
-    struct client *client;
     struct conn *conn;
-    ssize_t nread, ret;
-    struct timeval start, end;
-    long time_use;
+    ssize_t ret;
     struct slice slice;
-    size_t parsed;
-
-    parsed = 0;
-    ret = 0;
-    client = data;
+    size_t parsed = 0;
 
-    gettimeofday(&start, NULL);
-    nread = WorkerProcess->worker->recvData(client);
-    if (!isClientValid(client)) {
-        freeClient(client);
-        return ;
-    }
-
-    if (msgGetSize(client->req_buf) > getStatVal(StatBufferSize)) {
-        getStatVal(StatBufferSize) = msgGetSize(client->req_buf);
-    }
-
-    while (msgCanRead(client->req_buf)) {
+    while (!client->hold && isClientValid(client) &&
+            msgCanRead(client->req_buf)) {
         conn = connGet(client);
 
         msgRead(client->req_buf, &slice);
@@ -435,11 +881,56 @@ static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
         }
     }
     tryFreeClient(client);
+}
+
+static void handleRequest(struct evcenter *center, int fd, void *data, int mask)
+{
+    struct client *client;
+    ssize_t nread;
+    struct timeval start, end;
+    long time_use;
+
+    client = data;
+
+    gettimeofday(&start, NULL);
+    nread = WorkerProcess->worker->recvData(client);
+    if (!isClientValid(client)) {
+        freeClient(client);
+        return ;
+    }
+    if (nread > 0)
+        refreshClient(client);
+
+    if (msgGetSize(client->req_buf) > getStatVal(StatBufferSize)) {
+        getStatVal(StatBufferSize) = msgGetSize(client->req_buf);
+    }
+
+    parseRequests(client);
     gettimeofday(&end, NULL);
     time_use = 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
     getStatVal(StatRunTime) += time_use;
 }
 
+void holdClient(struct client *c)
+{
+    if (!c->hold++)
+        deleteEvent(WorkerProcess->center, c->clifd, EVENT_READABLE);
+}
+
+// Requests pipelined behind the held one are parsed now
+void unholdClient(struct client *c)
+{
+    if (--c->hold)
+        return ;
+    if (!isClientValid(c)) {
+        freeClient(c);
+        return ;
+    }
+    createEvent(WorkerProcess->center, c->clifd, EVENT_READABLE,
+            handleRequest, c);
+    parseRequests(c);
+}
+
 static void acceptClient(struct evcenter *center, int fd, void *data, int mask)
 {
     char ip[46];
@@ -454,6 +945,9 @@ static void acceptClient(struct evcenter *center, int fd, void *data, int mask)
     }
     wheatNonBlock(Server.neterr, cfd);
     wheatCloseOnExec(Server.neterr, cfd);
+    // Small writes like Http2 frame heads aren't held by Nagle waiting for
+    // delayed ACK, responses to coalesce are corked instead
+    wheatTcpNoDelay(Server.neterr, cfd);
 
     c = createClient(cfd, ip, cport, WorkerProcess->protocol);
 }
@@ -571,11 +1065,15 @@ void workerProcessCron(void (*fake_func)(void *data), void *data)
     long long interval;
     int refresh_seconds;
     void (*worker_cron)();
+    void (*protocol_cron)();
 
     refresh_seconds = Server.stat_refresh_seconds;
     worker_cron = WorkerProcess->worker->cron;
+    protocol_cron = WorkerProcess->protocol->protocolCron;
     while (WorkerProcess->alive) {
         arrayEach(WorkerProcess->apps, appCronRun);
+        if (protocol_cron)
+            protocol_cron();
 
         if (worker_cron)
             worker_cron();
@@ -610,4 +1108,5 @@ void workerProcessCron(void (*fake_func)(void *data), void *data)
         processEvents(WorkerProcess->center, WHEATSERVER_CRON_MILLLISECONDS);
         gettimeofday(&Server.cron_time, NULL);
     }
+    WorkerProcess->protocol->deallocProtocol();
 }
@@ -71,6 +71,7 @@ struct workerProcess {
 };
 
 struct client;
+struct statItem;
 struct conn;
 
 // Protocol Interface
@@ -86,6 +87,12 @@ struct conn;
 // `initProtocolData`: implement protocol data attached to each request,
 // parsed data useful can store to it.
 // `initProtocol`: used to setup protocol module
+// `deallocProtocol`: called when protocol module unloaded or worker exits
+// `protocolCron`: protocol cron function and will be called each heart
+// interval, it can be NULL
+// `clientIdle`: called when client is accepted or all responses are sent and
+// no request is in progress, protocol can set deadline for next request. It
+// can be NULL
 struct protocol {
     int (*spotAppAndCall)(struct conn *);
     int (*parser)(struct conn *conn, struct slice *s, size_t *nparsed);
@@ -93,6 +100,8 @@ struct protocol {
     void (*freeProtocolData)(void *ptcol_data);
     int (*initProtocol)();
     void (*deallocProtocol)();
+    void (*protocolCron)();
+    void (*clientIdle)(struct client *);
 };
 
 // Worker Interface
@@ -172,6 +181,8 @@ struct app {
 // `cleanup`: in order to reach no-copy goal, application may save buffer wait
 // to be sent. Application module can make buffer rely on special conn, it may
 // like garbage collection mechanism.
+// `cork_limit`: data is only queued until `corked` bytes reach it, 0 means
+// sending immediately(see corkConn)
 // `next`: the next conn below to `client`
 struct conn {
     struct client *client;
@@ -180,6 +191,8 @@ struct conn {
     void *app_private_data;
     struct list *send_queue;
     int ready_send;
+    size_t cork_limit;
+    size_t corked;
     struct array *cleanup;
     struct conn *next;
 };
@@ -193,6 +206,9 @@ struct conn {
 // `conns` fields and send packets in ordering.
 //
 // `last_io`: the last send or receive time
+// `deadline`: client is closed when cron time passes it, `deadline_stat` is
+// increased then. It's set by protocol with `setClientDeadline` and
+// `deadline_idx` is the position in worker's deadline heap, -1 if not set
 // `name`: the client name, it always used by application to debug or show
 // information attach client
 // `protocol`: the protocol attached
@@ -217,6 +233,9 @@ struct client {
     wstr ip;
     int port;
     struct timeval last_io;
+    long long deadline;
+    struct statItem *deadline_stat;
+    int deadline_idx;
     wstr name;
     struct protocol *protocol;
     struct conn *pending;
@@ -225,6 +244,8 @@ struct client {
     void *client_data;
     void (*notify)(struct client*);
     void *notify_data;
+    void *offload;           // file offload job waited by client
+    int hold;                // jobs of other threads using client
 
     unsigned is_outer:1;
     unsigned should_close:1; // Used to indicate whether closing client
@@ -248,10 +269,38 @@ struct client *createClient(int fd, char *ip, int port, struct protocol *p);
 void freeClient(struct client *);
 void tryFreeClient(struct client *c);
 int sendClientFile(struct conn *c, int fd, off_t len);
+int sendClientFileRange(struct conn *c, int fd, off_t off, size_t len);
 int sendClientData(struct conn *c, struct slice *s);
+int sendClientSlices(struct conn *c, struct slice *slices, size_t count);
+// Data sent by `c` is queued until `limit` bytes are queued or uncorkConn is
+// called, then queued slices are sent by one writev(2). Data must live until
+// `c` is freed as usual.
+void corkConn(struct conn *c, size_t limit);
+int uncorkConn(struct conn *c);
+#ifdef HAVE_SPLICE
+int sendClientPipe(struct conn *c, int fd, size_t len);
+#endif
 int isClientNeedSend(struct client *);
+// Client used by job of other thread isn't read, parsed or freed until
+// each hold is released, it's freed then if closed meanwhile
+void holdClient(struct client *c);
+void unholdClient(struct client *c);
+void releaseClientBuffer(struct client *c);
+// Block until data of `c` is received or `milliseconds` passes(-1 means
+// forever), used to read request on behalf of app(e.g. streamed body).
+// Return WHEAT_OK without data if interrupted by signal, caller waits again
+// with what's left of its time
+int recvClientWait(struct client *c, long milliseconds);
+// `milliseconds` is relative to cron time, 0 clears deadline
+void setClientDeadline(struct client *c, long milliseconds, struct statItem *stat);
+void clearClientDeadline(struct client *c);
 // Used by worker module only
 void clientSendPacketList(struct client *c);
+// Read file ranges not in page cache by `nthreads` threads before sending
+int enableFileOffload(int nthreads);
+// Send at most `len` file bytes to client each time, others clients are
+// served before the remaining is sent. 0 means no limit.
+void setSendfileMaxChunk(size_t len);
 
 #define isClientValid(c)                   ((c)->valid)
 #define isClientNeedParse(c)               (msgCanRead(c)->req_buf))
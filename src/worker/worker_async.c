@@ -6,18 +6,36 @@
 
 #include "../wheatserver.h"
 
+void setupAsync();
 int asyncSendData(struct conn *c); // pass `data` ownership to
 int asyncRecvData(struct client *c);
 
+static struct configuration AsyncConf[] = {
+    {"sendfile-threads",  2, unsignedIntValidator, {.val=0},
+        (void *)64,             INT_FORMAT},
+    {"sendfile-max-chunk", 2, unsignedIntValidator, {.val=WHEAT_SENDFILE_MAX_CHUNK},
+        (void *)WHEAT_BUFLIMIT, INT_FORMAT},
+};
+
 static struct worker AsyncWorker = {
-    NULL, NULL, asyncSendData,
+    setupAsync, NULL, asyncSendData,
     asyncRecvData
 };
 
 struct moduleAttr AsyncWorkerAttr = {
-    "AsyncWorker", WORKER, {.worker=&AsyncWorker}, NULL, 0, NULL, 0
+    "AsyncWorker", WORKER, {.worker=&AsyncWorker}, NULL, 0,
+    AsyncConf, sizeof(AsyncConf)/sizeof(struct configuration)
 };
 
+void setupAsync()
+{
+    int nthreads = getConfiguration("sendfile-threads")->target.val;
+
+    if (nthreads && enableFileOffload(nthreads) == WHEAT_WRONG)
+        wheatLog(WHEAT_WARNING, "enable sendfile offload failed, send inline");
+    setSendfileMaxChunk(getConfiguration("sendfile-max-chunk")->target.val);
+}
+
 static void sendReplyToClient(struct evcenter *center, int fd, void *data, int mask)
 {
     struct client *c = data;
@@ -27,7 +45,8 @@ static void sendReplyToClient(struct evcenter *center, int fd, void *data, int m
     refreshClient(c);
 
     clientSendPacketList(c);
-    if (!isClientValid(c) || !isClientNeedSend(c)) {
+    // Client waiting for file offload is resumed by it
+    if (!isClientValid(c) || !isClientNeedSend(c) || c->offload) {
         wheatLog(WHEAT_DEBUG, "delete write event on sendReplyToClient");
         deleteEvent(WorkerProcess->center, c->clifd, EVENT_WRITABLE);
         tryFreeClient(c);
@@ -47,7 +66,7 @@ int asyncSendData(struct conn *c)
         // to caller to deal with error.
         return WHEAT_WRONG;
     }
-    if (isClientNeedSend(client)) {
+    if (isClientNeedSend(client) && !client->offload) {
         wheatLog(WHEAT_DEBUG, "create write event on asyncSendData");
         createEvent(WorkerProcess->center, client->clifd, EVENT_WRITABLE,
                 sendReplyToClient, client);
@@ -64,7 +83,8 @@ int asyncRecvData(struct client *c)
     size_t total = 0;
     struct slice slice;
     // Because os IO notify only once if you don't read all data within this
-    // buffer
+    // buffer. But leave remaining data to next readable event once buffer is
+    // full, so protocol has chance to consume it(e.g. spill request body)
     do {
         n = msgPut(c->req_buf, &slice);
         if (n != 0) {
@@ -77,7 +97,8 @@ int asyncRecvData(struct client *c)
         }
         total += n;
         msgSetWritted(c->req_buf, n);
-    } while (n == slice.len);
+    } while (msgGetSize(c->req_buf) < Server.max_buffer_size &&
+            n == slice.len);
     if (msgGetSize(c->req_buf) > Server.max_buffer_size) {
         wheatLog(WHEAT_VERBOSE, "Client buffer size larger than limit %d>%d",
                 msgGetSize(c->req_buf), Server.max_buffer_size);
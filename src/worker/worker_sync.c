@@ -43,6 +43,8 @@ int syncRecvData(struct client *c)
     }
     struct slice slice;
     ssize_t n, total = 0;
+    // Leave remaining data to next readable event once buffer is full, so
+    // protocol has chance to consume it(e.g. spill request body)
     do {
         n = msgPut(c->req_buf, &slice);
         if (n != 0) {
@@ -55,7 +57,8 @@ int syncRecvData(struct client *c)
         }
         total += n;
         msgSetWritted(c->req_buf, n);
-    } while (n == slice.len || n == 0);
+    } while (msgGetSize(c->req_buf) < Server.max_buffer_size &&
+            (n == slice.len || n == 0));
     if (msgGetSize(c->req_buf) > Server.max_buffer_size) {
         wheatLog(WHEAT_VERBOSE, "Client buffer size larger than limit %d>%d",
                 msgGetSize(c->req_buf), Server.max_buffer_size);
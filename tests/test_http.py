@@ -1,6 +1,12 @@
-from wheatserver_test import WheatServer, PROJECT_PATH, server_socket
+from wheatserver_test import WheatServer, PROJECT_PATH, server_socket, construct_command
 import os
 import time
+import socket
+import tempfile
+import shutil
+import gzip
+import hashlib
+import httplib
 import requests
 
 POST_DATA = b"""POST /asdf HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nContent-Length: 200\r\nContent-Type: multipart/form-data; boundary=25510934abe14960a7309cc7a2c790d8\r\nAccept-Encoding: gzip, deflate, compress\r\nAccept: */*\r\nUser-Agent: python-requests/1.1.0 CPython/2.7.2 Darwin/12.2.0\r\n\r\n--25510934abe14960a7309cc7a2c790d8\r\nContent-Disposition: form-data; name=\"file\"; filename=\"/Users/wanghaomai/Downloads/1.txt\"\r\nContent-Type: text/plain\r\n\r\n1234\n\r\n--25510934abe14960a7309cc7a2c790d8--\r\n"""
@@ -50,3 +56,672 @@ def test_document_root_and_static_file_dir():
     time.sleep(0.1)
     r = requests.get("http://127.0.0.1:10828/static/example.jpg",timeout=1)
     assert 200 == r.status_code
+
+def test_chunked_response_keep_alive():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--protocol Http")
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    conn.request("GET", "/file")
+    r = conn.getresponse()
+    assert r.getheader("transfer-encoding") == "chunked"
+    assert len(r.read()) == os.path.getsize(os.path.join(PROJECT_PATH, "example/static/example.jpg"))
+    conn.request("GET", "/")
+    r = conn.getresponse()
+    assert 200 == r.status
+
+def test_chunked_body_spill_to_file():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--client-body-buffer-size 16",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("POST / HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nTransfer-Encoding: chunked\r\n\r\n")
+    s.send("10\r\n0123456789abcdef\r\n")
+    time.sleep(0.1)
+    s.send("a\r\nghijklmnop\r\n0\r\n\r\n")
+    a = s.recv(1000)
+    while not a.endswith("\r\n\r\n0123456789abcdefghijklmnop"):
+        a += s.recv(1000)
+    assert "200" in a
+
+def test_http2_prior_knowledge():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--http2 on",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n")
+    s.send("\x00\x00\x00\x04\x00\x00\x00\x00\x00")
+    # HEADERS: GET / http, END_STREAM | END_HEADERS
+    s.send("\x00\x00\x03\x01\x05\x00\x00\x00\x01\x82\x86\x84")
+    frames = []
+    a = ""
+    while not any(t == 0 and f & 1 for t, f, i in frames):
+        a += s.recv(1000)
+        while len(a) >= 9 and len(a) >= 9 + (ord(a[0]) << 16 | ord(a[1]) << 8 | ord(a[2])):
+            l = ord(a[0]) << 16 | ord(a[1]) << 8 | ord(a[2])
+            frames.append((ord(a[3]), ord(a[4]), ord(a[8])))
+            a = a[9+l:]
+    assert frames[0] == (4, 0, 0)
+    assert (1, 4, 1) in frames
+
+def test_static_file_range():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % PROJECT_PATH + "/example/",
+                               "--static-file-dir %s" % "/static",
+                               "--protocol Http")
+    time.sleep(0.1)
+    content = open(os.path.join(PROJECT_PATH, "example/static/example.jpg")).read()
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    conn.request("GET", "/static/example.jpg", headers={"Range": "bytes=10-19"})
+    r = conn.getresponse()
+    assert 206 == r.status
+    assert r.getheader("content-range") == "bytes 10-19/%d" % len(content)
+    assert r.read() == content[10:20]
+    conn.request("GET", "/static/example.jpg", headers={"Range": "bytes=0-1,-2"})
+    r = conn.getresponse()
+    assert 206 == r.status
+    assert r.getheader("content-type").startswith("multipart/byteranges")
+    body = r.read()
+    assert content[:2] in body and content[-2:] in body
+    conn.request("GET", "/static/example.jpg", headers={"Range": "bytes=%d-" % len(content)})
+    r = conn.getresponse()
+    r.read()
+    assert 416 == r.status
+    conn.request("GET", "/static/example.jpg", headers={"Range": "bytes=0-9",
+                                                        "If-Range": "Mon, 01 Jan 2001 00:00:00 GMT"})
+    r = conn.getresponse()
+    assert 200 == r.status
+    assert r.getheader("accept-ranges") == "bytes"
+    assert len(r.read()) == len(content)
+
+def test_websocket_echo():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--websocket on",
+                               "--app-websocket-name websocket",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = server_socket(10828)
+    s.settimeout(1)
+    s.send("GET /chat HTTP/1.1\r\nHost: 127.0.0.1:10828\r\nUpgrade: websocket\r\n"
+           "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+           "Sec-WebSocket-Version: 13\r\n\r\n")
+    a = ""
+    while "\r\n\r\n" not in a:
+        a += s.recv(1000)
+    assert "101" in a and "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" in a
+    # masked text frame "hello" split across two sends
+    mask = "\x01\x02\x03\x04"
+    payload = "".join(chr(ord(c) ^ ord(mask[i % 4])) for i, c in enumerate("hello"))
+    s.send("\x81\x85" + mask[:2])
+    time.sleep(0.1)
+    s.send(mask[2:] + payload)
+    a = a.split("\r\n\r\n", 1)[1]
+    while len(a) < 7:
+        a += s.recv(1000)
+    assert a[:7] == "\x81\x05hello"
+
+def test_http_route():
+    async = WheatServer(os.path.join(PROJECT_PATH, "tests", "route.conf"),
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"))
+    time.sleep(0.1)
+    r = requests.get("http://127.0.0.1:10828/static/example.jpg", timeout=1)
+    assert 200 == r.status_code
+    r = requests.get("http://127.0.0.1:10828/echo/abc", timeout=1)
+    assert "/echo/abc" == r.content
+    r = requests.get("http://127.0.0.1:10828/", timeout=1)
+    assert "Hello world!\n" == r.content
+    r = requests.get("http://127.0.0.1:10828/",
+                     headers={"Host": "LocalHost:10828"}, timeout=1)
+    assert "/" == r.content
+
+def test_http_proxy():
+    backend = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--port 10830", "--stat-port 10831",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--protocol Http")
+    proxy = WheatServer(os.path.join(PROJECT_PATH, "tests", "proxy.conf"),
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"))
+    time.sleep(0.2)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    for i in range(3):
+        conn.request("GET", "/complex")
+        r = conn.getresponse()
+        assert 200 == r.status
+        assert "Hello world!\n" * 20000 == r.read()
+    conn.request("POST", "/", "proxied body")
+    r = conn.getresponse()
+    assert "proxied body" == r.read()
+    conn.request("GET", "/file")
+    r = conn.getresponse()
+    assert r.read() == open(os.path.join(PROJECT_PATH, "example/static/example.jpg")).read()
+    r = requests.get("http://127.0.0.1:10828/static/example.jpg", timeout=1)
+    assert 200 == r.status_code
+    del backend
+    time.sleep(0.2)
+    r = requests.get("http://127.0.0.1:10828/", timeout=1)
+    assert 502 == r.status_code
+
+def test_http_cache():
+    async = WheatServer(os.path.join(PROJECT_PATH, "tests", "cache.conf"),
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"))
+    time.sleep(0.1)
+    first = requests.get("http://127.0.0.1:10828/count/", timeout=1)
+    for i in range(4):
+        r = requests.get("http://127.0.0.1:10828/count/", timeout=1)
+        assert first.content == r.content
+        assert "age" in r.headers
+    for i in range(2):
+        r = requests.get("http://127.0.0.1:10828/count/?nostore", timeout=1)
+        assert "age" not in r.headers
+    r = requests.get("http://127.0.0.1:10828/count/",
+                     headers={"Cookie": "a=b"}, timeout=1)
+    assert "age" not in r.headers
+
+def test_http_rate_limit():
+    async = WheatServer(os.path.join(PROJECT_PATH, "tests", "ratelimit.conf"),
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"))
+    time.sleep(0.1)
+    r = requests.get("http://127.0.0.1:10828/", headers={"X-Api-Key": "a"}, timeout=1)
+    assert 200 == r.status_code
+    r = requests.get("http://127.0.0.1:10828/", headers={"X-Api-Key": "a"}, timeout=1)
+    assert 429 == r.status_code and "retry-after" in r.headers
+    # Per-ip token taken by request rejected by api-key is given back, so
+    # two of three per-ip tokens are left
+    for i in range(2):
+        r = requests.get("http://127.0.0.1:10828/", timeout=1)
+        assert 200 == r.status_code
+    r = requests.get("http://127.0.0.1:10828/", timeout=1)
+    assert 429 == r.status_code
+    s = server_socket(10829)
+    s.send(construct_command("ratelimit"))
+    assert "per-ip: 1\napi-key: 1\n" == s.recv(100)
+
+def test_http_phase_timeout():
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"),
+                               "--http-header-timeout 1",
+                               "--http-keepalive-timeout 1")
+    time.sleep(0.1)
+    # headers trickled byte by byte are not completed in time
+    s = server_socket(10828)
+    s.settimeout(3)
+    s.send("GET / HTTP/1.1\r\n")
+    closed = False
+    for c in "Host: 127.0.0.1\r\n":
+        time.sleep(0.2)
+        try:
+            s.send(c)
+        except socket.error:
+            closed = True
+            break
+    assert closed or s.recv(100) == ""
+
+    s = server_socket(10828)
+    s.settimeout(3)
+    s.send("GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+    assert "200 OK" in s.recv(100)
+    # idle keep-alive connection is closed before socket timeout
+    while s.recv(1000):
+        pass
+
+def test_static_file_precompressed():
+    root = tempfile.mkdtemp()
+    os.mkdir(os.path.join(root, "static"))
+    open(os.path.join(root, "static/app.js"), "w").write("var a = 1;\n" * 100)
+    f = gzip.open(os.path.join(root, "static/app.js.gz"), "w")
+    f.write("var a = 1;\n" * 100)
+    f.close()
+    async = WheatServer("", "--worker-type %s" % "AsyncWorker",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s/" % root,
+                               "--static-file-dir %s" % "/static",
+                               "--static-file-precompressed on",
+                               "--protocol Http")
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    conn.request("GET", "/static/app.js", headers={"Accept-Encoding": "br;q=0, gzip"})
+    r = conn.getresponse()
+    body = r.read()
+    assert r.getheader("content-encoding") == "gzip"
+    assert r.getheader("vary") == "Accept-Encoding"
+    assert r.getheader("content-type") == "application/x-javascript"
+    assert body == open(os.path.join(root, "static/app.js.gz")).read()
+    conn.request("GET", "/static/app.js")
+    r = conn.getresponse()
+    assert r.getheader("content-encoding") is None
+    assert r.read() == "var a = 1;\n" * 100
+    shutil.rmtree(root)
+
+def test_static_file_etag():
+    async = WheatServer(os.path.join(PROJECT_PATH, "tests", "static.conf"),
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % os.path.join(PROJECT_PATH, "example/"))
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    conn.request("GET", "/static/example.jpg")
+    r = conn.getresponse()
+    r.read()
+    etag = r.getheader("etag")
+    assert 200 == r.status and etag.startswith('"')
+    assert r.getheader("cache-control") == "max-age=86400"
+    conn.request("GET", "/static/example.jpg", headers={"If-None-Match": '"x", W/%s' % etag})
+    r = conn.getresponse()
+    assert 304 == r.status and r.getheader("etag") == etag and r.read() == ""
+    # If-Modified-Since is ignored with If-None-Match
+    conn.request("GET", "/static/example.jpg", headers={"If-None-Match": '"x"',
+        "If-Modified-Since": r.getheader("date")})
+    r = conn.getresponse()
+    assert 200 == r.status
+    r.read()
+    conn.request("GET", "/static/example.jpg", headers={"Range": "bytes=0-9",
+        "If-Range": etag})
+    r = conn.getresponse()
+    assert 206 == r.status and len(r.read()) == 10
+
+def test_static_file_offload():
+    import ctypes
+    root = tempfile.mkdtemp()
+    os.mkdir(os.path.join(root, "static"))
+    content = os.urandom(4 * 1024 * 1024)
+    path = os.path.join(root, "static/big.bin")
+    with open(path, "w") as f:
+        f.write(content)
+        f.flush()
+        os.fsync(f.fileno())
+        # Drop pages of file so worker finds it cold(POSIX_FADV_DONTNEED)
+        ctypes.CDLL(None).posix_fadvise(f.fileno(), ctypes.c_long(0),
+                                        ctypes.c_long(0), 4)
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--worker-number 1",
+                               "--sendfile-threads 2",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % root,
+                               "--static-file-dir /static/",
+                               "--protocol Http")
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=2)
+    for i in range(2):
+        conn.request("GET", "/static/big.bin")
+        r = conn.getresponse()
+        assert 200 == r.status and r.read() == content
+    conn.request("GET", "/static/big.bin", headers={"Range": "bytes=1000000-1000009"})
+    r = conn.getresponse()
+    assert 206 == r.status and r.read() == content[1000000:1000010]
+    shutil.rmtree(root)
+
+def test_static_file_fair_send():
+    root = tempfile.mkdtemp()
+    os.mkdir(os.path.join(root, "static"))
+    content = os.urandom(6 * 1024 * 1024)
+    with open(os.path.join(root, "static/big.bin"), "w") as f:
+        f.write(content)
+    with open(os.path.join(root, "static/small.txt"), "w") as f:
+        f.write("small")
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--worker-number 1",
+                               "--sendfile-max-chunk 65536",
+                               "--app-project-path %s" % os.path.join(PROJECT_PATH, "example"),
+                               "--document-root %s" % root,
+                               "--static-file-dir /static/",
+                               "--protocol Http")
+    time.sleep(0.1)
+    big = server_socket(10828)
+    big.send("GET /static/big.bin HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n")
+    # Large download is still going on while small file is served
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    conn.request("GET", "/static/small.txt")
+    r = conn.getresponse()
+    assert 200 == r.status and r.read() == "small"
+    data = ""
+    big.settimeout(2)
+    while len(data) < len(content):
+        chunk = big.recv(1024 * 1024)
+        if not chunk:
+            break
+        data += chunk
+    assert data.endswith(content)
+    shutil.rmtree(root)
+
+def test_wsgi_environ():
+    root = tempfile.mkdtemp()
+    with open(os.path.join(root, "envdump.py"), "w") as f:
+        f.write("def application(environ, start_response):\n"
+                "    start_response('200 OK', [('Content-Type', 'text/plain')])\n"
+                "    keys = [k for k in environ if k.isupper()]\n"
+                "    return ['%s=%s\\n' % (k, environ[k]) for k in sorted(keys)]\n")
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--app-project-path %s" % root,
+                               "--app-module-name envdump",
+                               "--app-name application",
+                               "--protocol Http")
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+    # Cached keys and values must not leak between requests
+    for i in range(3):
+        conn.request("GET", "/a%%20b?x=%d" % i, headers={"Host": "example.com:8080",
+            "X-Custom-%d" % i: "v", "Content-Type": "text/plain"})
+        r = conn.getresponse()
+        env = dict(line.split("=", 1) for line in r.read().splitlines())
+        assert env["SERVER_NAME"] == "example.com"
+        assert env["SERVER_PORT"] == "8080"
+        assert env["PATH_INFO"] == "/a b" and env["QUERY_STRING"] == "x=%d" % i
+        assert env["HTTP_X_CUSTOM_%d" % i] == "v"
+        assert len([k for k in env if k.startswith("HTTP_X_CUSTOM")]) == 1
+        assert env["CONTENT_TYPE"] == "text/plain" and env["SCRIPT_NAME"] == ""
+        assert env["REQUEST_METHOD"] == "GET"
+    shutil.rmtree(root)
+
+def test_wsgi_preload_app():
+    root = tempfile.mkdtemp()
+    with open(os.path.join(root, "preload.py"), "w") as f:
+        f.write("import os\n"
+                "IMPORTED = os.getpid()\n"
+                "def application(environ, start_response):\n"
+                "    start_response('200 OK', [('Content-Type', 'text/plain')])\n"
+                "    return ['%d %d' % (IMPORTED, os.getpid())]\n")
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--app-project-path %s" % root,
+                               "--app-module-name preload",
+                               "--app-name application",
+                               "--preload-app on",
+                               "--protocol Http")
+    time.sleep(0.1)
+    # App is imported by master, not the worker serving request
+    for i in range(3):
+        conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=1)
+        conn.request("GET", "/")
+        imported, served = conn.getresponse().read().split()
+        assert imported != served
+        conn.close()
+    shutil.rmtree(root)
+
+def test_wsgi_small_chunks():
+    root = tempfile.mkdtemp()
+    with open(os.path.join(root, "chunks.py"), "w") as f:
+        f.write("def application(environ, start_response):\n"
+                "    n = int(environ['QUERY_STRING'])\n"
+                "    headers = [('Content-Type', 'text/plain')]\n"
+                "    if environ['PATH_INFO'] == '/length':\n"
+                "        headers.append(('Content-Length', str(n * 6)))\n"
+                "    start_response('200 OK', headers)\n"
+                "    return ('%05d\\n' % i for i in range(n))\n")
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--app-project-path %s" % root,
+                               "--app-module-name chunks",
+                               "--app-name application",
+                               "--app-send-buffer-size 4096",
+                               "--protocol Http")
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=2)
+    # Below and over send buffer, with and without chunked encoding
+    for path in ("/length", "/chunked"):
+        for n in (10, 50000):
+            conn.request("GET", "%s?%d" % (path, n))
+            r = conn.getresponse()
+            assert r.read() == "".join("%05d\n" % i for i in range(n))
+    shutil.rmtree(root)
+
+def test_wsgi_app_threads():
+    root = tempfile.mkdtemp()
+    os.mkdir(os.path.join(root, "static"))
+    with open(os.path.join(root, "static/a.txt"), "w") as f:
+        f.write("static")
+    with open(os.path.join(root, "threaded.py"), "w") as f:
+        f.write("import time\n"
+                "def application(environ, start_response):\n"
+                "    path = environ['PATH_INFO']\n"
+                "    write = start_response('200 OK', [('Content-Type', 'text/plain')])\n"
+                "    if path == '/slow':\n"
+                "        time.sleep(1)\n"
+                "    elif path == '/post':\n"
+                "        return [environ['wsgi.input'].read()]\n"
+                "    elif path == '/multithread':\n"
+                "        return [str(environ['wsgi.multithread'])]\n"
+                "    write('write,')\n"
+                "    return [path, '!']\n")
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--worker-number 1",
+                               "--app-threads 2",
+                               "--app-project-path %s" % root,
+                               "--app-module-name threaded",
+                               "--app-name application",
+                               "--document-root %s" % root,
+                               "--static-file-dir /static/",
+                               "--protocol Http")
+    time.sleep(0.1)
+    slow = httplib.HTTPConnection("127.0.0.1", 10828, timeout=3)
+    slow.request("GET", "/slow")
+    time.sleep(0.1)
+    # Worker serves others while slow app runs in thread
+    start = time.time()
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=3)
+    conn.request("GET", "/static/a.txt")
+    assert conn.getresponse().read() == "static"
+    conn.request("GET", "/fast")
+    assert conn.getresponse().read() == "write,/fast!"
+    conn.request("POST", "/post", "x" * 100000)
+    assert conn.getresponse().read() == "x" * 100000
+    assert time.time() - start < 0.5
+    assert slow.getresponse().read() == "write,/slow!"
+    conn.request("GET", "/multithread")
+    assert conn.getresponse().read() == "True"
+
+    # Interim response goes before the response of app
+    s = socket.create_connection(("127.0.0.1", 10828))
+    s.send("POST /post HTTP/1.1\r\nHost: a\r\nExpect: 100-continue\r\n"
+           "Content-Length: 3\r\nConnection: close\r\n\r\nabc")
+    data = ""
+    while True:
+        buf = s.recv(4096)
+        if not buf:
+            break
+        data += buf
+    assert data.startswith("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200")
+    assert data.endswith("3\r\nabc\r\n0\r\n\r\n")
+
+    # Client closed before app returns
+    s = socket.create_connection(("127.0.0.1", 10828))
+    s.send("GET /slow HTTP/1.1\r\nHost: a\r\n\r\n")
+    s.close()
+    # Request sent while app runs waits for it
+    s = socket.create_connection(("127.0.0.1", 10828))
+    s.send("GET /slow HTTP/1.1\r\nHost: a\r\n\r\n")
+    time.sleep(0.2)
+    s.send("GET /next HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n")
+    data = ""
+    while True:
+        buf = s.recv(4096)
+        if not buf:
+            break
+        data += buf
+    assert data.index("\r\n/slow\r\n") < data.index("\r\n/next\r\n")
+    shutil.rmtree(root)
+
+def test_wsgi_file_wrapper():
+    root = tempfile.mkdtemp()
+    data = "".join(chr(i % 256) for i in range(300000))
+    with open(os.path.join(root, "data"), "wb") as f:
+        f.write(data)
+    with open(os.path.join(root, "wrapper.py"), "w") as f:
+        f.write("import os, StringIO\n"
+                "PATH = %r\n"
+                "def application(environ, start_response):\n"
+                "    path = environ['PATH_INFO']\n"
+                "    headers = [('Content-Type', 'text/plain')]\n"
+                "    if path == '/file':\n"
+                "        body = open(PATH, 'rb')\n"
+                "        body.seek(100)\n"
+                "    elif path == '/length':\n"
+                "        body = open(PATH, 'rb')\n"
+                "        headers.append(('Content-Length', '1000'))\n"
+                "    elif path == '/stringio':\n"
+                "        body = StringIO.StringIO(open(PATH, 'rb').read())\n"
+                "        body.seek(5)\n"
+                "    else:\n"
+                "        r, w = os.pipe()\n"
+                "        os.write(w, 'piped' * 100)\n"
+                "        os.close(w)\n"
+                "        body = os.fdopen(r, 'rb')\n"
+                "        headers.append(('Content-Length', '500'))\n"
+                "    start_response('200 OK', headers)\n"
+                "    return environ['wsgi.file_wrapper'](body, 4096)\n"
+                % os.path.join(root, "data"))
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--app-project-path %s" % root,
+                               "--app-module-name wrapper",
+                               "--app-name application",
+                               "--protocol Http")
+    time.sleep(0.1)
+    conn = httplib.HTTPConnection("127.0.0.1", 10828, timeout=2)
+    # File is sent after app closed it
+    for path, body in (("/file", data[100:]), ("/length", data[:1000]),
+                       ("/stringio", data[5:]), ("/pipe", "piped" * 100)):
+        conn.request("GET", path)
+        r = conn.getresponse()
+        assert r.status == 200 and r.read() == body
+    shutil.rmtree(root)
+
+def test_wsgi_stream_request_body():
+    root = tempfile.mkdtemp()
+    started = os.path.join(root, "started")
+    with open(os.path.join(root, "upload.py"), "w") as f:
+        f.write("import hashlib\n"
+                "STARTED = %r\n"
+                "def application(environ, start_response):\n"
+                "    start_response('200 OK', [('Content-Type', 'text/plain')])\n"
+                "    if environ['PATH_INFO'] != '/upload':\n"
+                "        return [environ['PATH_INFO']]\n"
+                "    open(STARTED, 'w').close()\n"
+                "    body, md5 = environ['wsgi.input'], hashlib.md5()\n"
+                "    total = 0\n"
+                "    while True:\n"
+                "        data = body.read(8192)\n"
+                "        if not data:\n"
+                "            break\n"
+                "        total += len(data)\n"
+                "        md5.update(data)\n"
+                "    return ['%%d %%s' %% (total, md5.hexdigest())]\n"
+                % started)
+    data = "".join(chr(i % 251) for i in range(3000000))
+    expected = "%d %s" % (len(data), hashlib.md5(data).hexdigest())
+    # Body is buffered unless app runs in thread
+    for streamed, options in ((False, ()), (True, ("--app-threads 2",))):
+        async = WheatServer("", "--worker-type AsyncWorker",
+                                   "--worker-number 1",
+                                   "--app-project-path %s" % root,
+                                   "--app-module-name upload",
+                                   "--app-name application",
+                                   "--client-body-buffer-size 65536",
+                                   "--http-stream-request-body on",
+                                   "--protocol Http", *options)
+        time.sleep(0.1)
+        # App is called before body is sent
+        s = socket.create_connection(("127.0.0.1", 10828))
+        s.settimeout(3)
+        s.send("POST /upload HTTP/1.1\r\nHost: a\r\nContent-Length: %d\r\n\r\n"
+               % len(data) + data[:1000])
+        time.sleep(0.3)
+        assert os.path.exists(started) == streamed
+        s.sendall(data[1000:])
+        # Unread body is dropped and connection is kept
+        s.sendall("POST /ignore HTTP/1.1\r\nHost: a\r\nContent-Length: %d\r\n\r\n"
+                  % len(data) + data)
+        time.sleep(0.2)
+        s.send("GET /next HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n")
+        resp = ""
+        while True:
+            buf = s.recv(4096)
+            if not buf:
+                break
+            resp += buf
+        assert expected in resp and "/ignore" in resp and "/next" in resp
+        os.remove(started)
+        del async
+        time.sleep(0.5)
+
+    # Trickled body is cut off at one deadline
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--worker-number 1",
+                               "--app-threads 2",
+                               "--app-project-path %s" % root,
+                               "--app-module-name upload",
+                               "--app-name application",
+                               "--client-body-buffer-size 65536",
+                               "--http-stream-request-body on",
+                               "--http-body-timeout 1",
+                               "--protocol Http")
+    time.sleep(0.1)
+    s = socket.create_connection(("127.0.0.1", 10828))
+    s.send("POST /upload HTTP/1.1\r\nHost: a\r\nContent-Length: %d\r\n\r\n"
+           % len(data))
+    start = time.time()
+    try:
+        while time.time() - start < 3:
+            s.send("x")
+            time.sleep(0.2)
+    except socket.error:
+        pass
+    assert time.time() - start < 2.5
+    shutil.rmtree(root)
+
+def test_wsgi_profile():
+    root = tempfile.mkdtemp()
+    with open(os.path.join(root, "profiled.py"), "w") as f:
+        f.write("import time\n"
+                "def spin():\n"
+                "    end = time.time() + 0.1\n"
+                "    while time.time() < end:\n"
+                "        pass\n"
+                "def application(environ, start_response):\n"
+                "    start_response('200 OK', [('Content-Type', 'text/plain')])\n"
+                "    spin()\n"
+                "    return ['spun']\n")
+    async = WheatServer("", "--worker-type AsyncWorker",
+                               "--worker-number 1",
+                               "--app-project-path %s" % root,
+                               "--app-module-name profiled",
+                               "--app-name application",
+                               "--app-profile-sample 2",
+                               "--app-profile-slots 1024",
+                               "--protocol Http")
+    time.sleep(0.1)
+
+    def command(*args):
+        s = server_socket(10829)
+        s.send(construct_command(*args))
+        time.sleep(0.1)
+        return s.recv(65536)
+
+    # Every second request is sampled
+    for i in range(2):
+        assert requests.get("http://127.0.0.1:10828/", timeout=2).content == "spun"
+    stacks = command("profile")
+    assert "application (profiled.py:8);spin (profiled.py:" in stacks
+    assert all(line.rsplit(" ", 1)[1].isdigit() for line in stacks.splitlines())
+    assert command("profile", "reset") == "profile reset\n"
+    assert command("profile") == "no samples\n"
+    # All requests are sampled on demand
+    assert command("profile", "start") == "profile started\n"
+    requests.get("http://127.0.0.1:10828/", timeout=2)
+    assert "spin (profiled.py:" in command("profile")
+    assert command("profile", "stop").startswith("profile stopped")
+    shutil.rmtree(root)